@@ -0,0 +1,44 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+//
+// Compiles a chat template offline (parsing it and detecting its capabilities), for
+// minja::chat_template::from_compiled_file() to load at startup:
+//
+//   compile-template template.jinja template.minja [bos_token] [eos_token]
+#include <minja/chat-template.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+int main(int argc, char ** argv) {
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <template.jinja> <output> [bos_token] [eos_token]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Can't open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::stringstream source;
+    source << in.rdbuf();
+
+    minja::chat_template tmpl(source.str(), argc > 3 ? argv[3] : "", argc > 4 ? argv[4] : "");
+    auto compiled = tmpl.compile();
+    if (compiled.empty()) {
+        return 1;
+    }
+    std::ofstream out(argv[2], std::ios::binary);
+    out.write(compiled.data(), (std::streamsize) compiled.size());
+    if (!out) {
+        std::cerr << "Can't write " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cout << argv[2] << ": " << compiled.size() << " bytes" << std::endl;
+}
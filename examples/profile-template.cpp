@@ -0,0 +1,99 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+//
+// Profiles the rendering of a chat template with a context file (same format as tests/contexts/*.json), printing
+// the time & heap bytes spent on each line of the template (slowest first), and optionally writing the call tree
+// in the folded stacks format flamegraph.pl, speedscope or inferno read:
+//
+//   profile-template template.jinja context.json [folded.txt]
+#include <minja/chat-template.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+// Attributes heap allocations to the line being rendered.
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC flags the malloc / free pairs below once the replaced operators get inlined into their callers.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void * operator new(size_t size) {
+    minja::Profiler::count_allocation(size);
+    if (void * p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+
+static bool read_file(const char * path, std::string & out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+    std::stringstream content;
+    content << in.rdbuf();
+    out = content.str();
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " <template.jinja> <context.json> [folded_output]" << std::endl;
+        return 1;
+    }
+    std::string source, context;
+    if (!read_file(argv[1], source) || !read_file(argv[2], context)) {
+        return 1;
+    }
+    rapidjson::Document ctx;
+    ctx.Parse(context.c_str());
+    if (ctx.HasParseError() || !ctx.IsObject()) {
+        std::cerr << "Invalid context file: " << argv[2] << std::endl;
+        return 1;
+    }
+    auto get_string = [&](const char * name) {
+        return ctx.HasMember(name) && ctx[name].IsString() ? std::string(ctx[name].GetString()) : std::string();
+    };
+    minja::chat_template tmpl(source, get_string("bos_token"), get_string("eos_token"));
+
+    minja::chat_template_inputs inputs;
+    for (auto & kv : ctx.GetObject()) {
+        std::string key = kv.name.GetString();
+        if (key == "messages") {
+            inputs.messages.CopyFrom(kv.value, inputs.messages.GetAllocator());
+        } else if (key == "tools") {
+            inputs.tools.CopyFrom(kv.value, inputs.tools.GetAllocator());
+        } else if (key == "add_generation_prompt") {
+            inputs.add_generation_prompt = kv.value.IsBool() && kv.value.GetBool();
+        } else if (key != "bos_token" && key != "eos_token") {
+            if (!inputs.extra_context.IsObject()) inputs.extra_context.SetObject();
+            auto & alloc = inputs.extra_context.GetAllocator();
+            inputs.extra_context.AddMember(rapidjson::Value(key.c_str(), alloc), rapidjson::Value(kv.value, alloc), alloc);
+        }
+    }
+
+    minja::Profiler profiler;
+    {
+        minja::Profiler::Scope scope(profiler);
+        tmpl.apply(inputs);
+    }
+    std::cout << profiler.report();
+
+    if (argc > 3) {
+        std::ofstream out(argv[3], std::ios::binary);
+        out << profiler.folded();
+        if (!out) {
+            std::cerr << "Can't write " << argv[3] << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
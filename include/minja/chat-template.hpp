@@ -10,16 +10,37 @@
 
 #include "minja.hpp"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <functional>
+#include <future>
 #include <iomanip>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Forward declaration for Value used in Minja
 namespace minja { class Value; }
@@ -73,17 +94,181 @@ struct chat_template_options {
     bool polyfill_system_role = true;
     bool polyfill_object_arguments = true;
     bool polyfill_typed_content = true;
+
+    // Caches the output of the template's blocks in the template's memo (see minja::RenderMemo and chat_template::memo()).
+    bool memoize = false;
+};
+
+// Runs a task somewhere, e.g. on a thread pool (see chat_template's constructor and load_async()). Tasks may run in
+// any order, on any thread, and late: a task that finds nothing left to do just returns.
+using chat_template_executor = std::function<void(std::function<void()>)>;
+
+// Process-wide cache of parsed chat templates: the chat_templates made from the same source, special tokens and
+// options share the trees, programs and capabilities of the first one instead of parsing the template (and detecting
+// its capabilities) again. The least recently used entries are dropped past max_bytes (the templates made from them
+// keep them alive), and a budget of 0 turns the cache off. Thread-safe.
+class chat_template_cache {
+public:
+    // Immutable once cached.
+    struct entry {
+        std::string source;
+        std::string bos_token;
+        std::string eos_token;
+        minja::Options options;
+        std::shared_ptr<minja::TemplateNode> root;
+        std::shared_ptr<minja::TemplateNode> specialized_roots[2];
+        std::shared_ptr<minja::TemplateProgram> programs[3];
+        bool has_caps = false;  // Whether caps & tool_call_example were detected or loaded (see chat_template's constructor)
+        chat_template_caps caps;
+        std::string tool_call_example;
+        size_t bytes = 0;  // Roughly what the entry keeps alive
+    };
+    struct stats_t {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    explicit chat_template_cache(size_t max_bytes = 64 * 1024 * 1024) : max_bytes_(max_bytes) {}
+    chat_template_cache(const chat_template_cache &) = delete;
+    chat_template_cache & operator=(const chat_template_cache &) = delete;
+
+    // The cache chat_template's constructor uses.
+    static chat_template_cache & global() {
+        static chat_template_cache cache;
+        return cache;
+    }
+
+    // 64-bit FNV-1a hash of the source and special tokens.
+    static uint64_t hash(const std::string & source, const std::string & bos_token, const std::string & eos_token) {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](const std::string & str) {
+            for (unsigned char c : str) {
+                hash = (hash ^ c) * 1099511628211ull;
+            }
+            hash = (hash ^ 0xff) * 1099511628211ull; // Separator, so that ("ab", "c") and ("a", "bc") differ.
+        };
+        mix(source);
+        mix(bos_token);
+        mix(eos_token);
+        return hash;
+    }
+
+    // The entry for that template, if cached (which makes it the most recently used).
+    std::shared_ptr<const entry> find(const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                                      const minja::Options & options) {
+        auto k = key(hash(source, bos_token, eos_token), options);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(k);
+        if (it == index_.end() || !matches(*it->second->second, source, bos_token, eos_token, options)) {
+            misses_++;
+            return nullptr;
+        }
+        hits_++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return entries_.front().second;
+    }
+
+    // Caches `e`, replacing the entry of the same template if any.
+    void insert(std::shared_ptr<const entry> e) {
+        auto k = key(hash(e->source, e->bos_token, e->eos_token), e->options);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(k);
+        if (it != index_.end()) {
+            bytes_ -= it->second->second->bytes;
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        if (e->bytes > max_bytes_) return;
+        bytes_ += e->bytes;
+        entries_.emplace_front(k, std::move(e));
+        index_[k] = entries_.begin();
+        evict();
+    }
+
+    void set_max_bytes(size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_bytes_ = max_bytes;
+        evict();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    stats_t stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_t stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.entries = entries_.size();
+        stats.bytes = bytes_;
+        return stats;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    size_t max_bytes_;
+    std::list<std::pair<uint64_t, std::shared_ptr<const entry>>> entries_;  // By key, most recently used first
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, std::shared_ptr<const entry>>>::iterator> index_;
+    size_t bytes_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+
+    static uint64_t key(uint64_t hash, const minja::Options & options) {
+        auto flags = (uint64_t) options.trim_blocks | (uint64_t) options.lstrip_blocks << 1
+            | (uint64_t) options.keep_trailing_newline << 2 | (uint64_t) options.optimize << 3;
+        return (hash ^ flags) * 1099511628211ull;
+    }
+    static bool matches(const entry & e, const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                        const minja::Options & options) {
+        return e.source == source && e.bos_token == bos_token && e.eos_token == eos_token
+            && e.options.trim_blocks == options.trim_blocks && e.options.lstrip_blocks == options.lstrip_blocks
+            && e.options.keep_trailing_newline == options.keep_trailing_newline && e.options.optimize == options.optimize;
+    }
+    void evict() {
+        while (bytes_ > max_bytes_ && !entries_.empty()) {
+            bytes_ -= entries_.back().second->bytes;
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
 };
 
 class chat_template {
     
 private:
+    // Bumped whenever the detection logic changes, so that caps saved by older versions get detected afresh.
+    static constexpr int kCapsVersion = 1;
+    // Bumped whenever the AST or the layout of compile()'s output changes.
+    static constexpr int kCompiledVersion = 2;
+    static constexpr char kCompiledMagic[8] = {'M', 'I', 'N', 'J', 'A', 'T', 'P', 'L'};
     chat_template_caps caps_;
     std::string source_;
     std::string bos_token_;
     std::string eos_token_;
     std::shared_ptr<minja::TemplateNode> template_root_;
+    // template_root_ specialized for the special tokens and each add_generation_prompt value (see program_for()).
+    std::shared_ptr<minja::TemplateNode> specialized_roots_[2];
+    // template_root_ then both specialized_roots_, compiled for apply() to render (see compile_programs()).
+    std::shared_ptr<minja::TemplateProgram> programs_[3];
     std::string tool_call_example_;
+
+    // Copies of the tools of the last few renders, borrowed instead of them when they're the same again (as they
+    // usually are, turn after turn) so that templates writing `tools | tojson` only serialize them once (see
+    // minja::SharedJson). Shared by the copies of the template, like its trees.
+    struct shared_tools_cache {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<const minja::SharedJson>> recent;  // most recently used first
+    };
+    static constexpr size_t kSharedToolsCapacity = 4;
+    std::shared_ptr<shared_tools_cache> shared_tools_ = std::make_shared<shared_tools_cache>();
+    // What the blocks rendered to, for the renders with options.memoize. Also shared by the copies.
+    std::shared_ptr<minja::RenderMemo> memo_ = std::make_shared<minja::RenderMemo>();
     
     // Helper to convert Value to string
     static std::string valueToString(const rapidjson::Value& val) {
@@ -92,6 +277,37 @@ private:
         val.Accept(writer);
         return buffer.GetString();
     }
+
+    // Copies src into dst with allocator. With borrow_strings, the copy's strings point into src (which must then
+    // outlive it) and only its arrays & objects are allocated; otherwise all strings are copied, including the ones
+    // src itself only references (which CopyFrom would keep referencing).
+    static void copy_value(rapidjson::Value & dst, const rapidjson::Value & src, rapidjson::Document::AllocatorType & allocator, bool borrow_strings) {
+        if (src.IsObject()) {
+            dst.SetObject();
+            for (const auto & member : src.GetObject()) {
+                rapidjson::Value name, value;
+                copy_value(name, member.name, allocator, borrow_strings);
+                copy_value(value, member.value, allocator, borrow_strings);
+                dst.AddMember(name, value, allocator);
+            }
+        } else if (src.IsArray()) {
+            dst.SetArray();
+            dst.Reserve(src.Size(), allocator);
+            for (const auto & item : src.GetArray()) {
+                rapidjson::Value value;
+                copy_value(value, item, allocator, borrow_strings);
+                dst.PushBack(value, allocator);
+            }
+        } else if (src.IsString()) {
+            if (borrow_strings) {
+                dst.SetString(rapidjson::StringRef(src.GetString(), src.GetStringLength()));
+            } else {
+                dst.SetString(src.GetString(), src.GetStringLength(), allocator);
+            }
+        } else {
+            dst.CopyFrom(src, allocator);
+        }
+    }
     
     std::string try_raw_render(
                                rapidjson::Value& messages, // Modifying to pass by ref as it might be changed by polyfills later
@@ -112,11 +328,16 @@ private:
         // This is tricky because the Value objects in chat_template_inputs need an allocator.
         // Let's try to pass the allocator to inputs.
         inputs.allocator_for_inputs = &allocator;
-        inputs.messages.CopyFrom(messages, allocator);
-        inputs.tools.CopyFrom(tools, allocator);
+        // The probes are only rendered once: they're moved into inputs and back rather than copied.
+        messages.Swap(inputs.messages);
+        if (&tools == &messages) {
+            inputs.tools.CopyFrom(inputs.messages, allocator);
+        } else {
+            tools.Swap(inputs.tools);
+        }
         inputs.add_generation_prompt = add_generation_prompt;
         if (!extra_context.IsNull()) {
-            inputs.extra_context.CopyFrom(extra_context, allocator);
+            extra_context.Swap(inputs.extra_context);
         } else {
             inputs.extra_context.SetObject(); // Initialize as empty object if default
         }
@@ -128,20 +349,48 @@ private:
         
         auto prompt = apply(inputs, opts);
         // fprintf(stderr, "try_raw_render: %s\n", prompt.c_str());
+        messages.Swap(inputs.messages);
+        if (&tools != &messages) tools.Swap(inputs.tools);
         return prompt;
     }
-    
-public:
-    
-    chat_template(const std::string & source, const std::string & bos_token, const std::string & eos_token)
-    : source_(source), bos_token_(bos_token), eos_token_(eos_token)
-    {
-        template_root_ = minja::Parser::parse(source_, {
-            /* .trim_blocks = */ true,
-            /* .lstrip_blocks = */ true,
-            /* .keep_trailing_newline = */ false,
-        });
+
+    // Runs the probes, concurrently if there's an executor: each is offered to it, and the calling thread runs those
+    // that haven't started yet before waiting for the others, so that it never waits on one the executor didn't get to.
+    static void run_probes(std::vector<std::function<void()>> probes, const chat_template_executor & executor) {
+        if (!executor || probes.size() < 2) {
+            for (const auto & probe : probes) probe();
+            return;
+        }
+        struct Batch {
+            std::vector<std::function<void()>> probes;
+            std::atomic<size_t> next {0};
+            std::mutex mutex;
+            std::condition_variable cv;
+            size_t done = 0;
+
+            void run() {
+                for (size_t i; (i = next++) < probes.size();) {
+                    probes[i]();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (++done == probes.size()) cv.notify_all();
+                }
+            }
+        };
+        auto batch = std::make_shared<Batch>();
+        batch->probes = std::move(probes);
+        for (size_t i = 1; i < batch->probes.size(); i++) {
+            executor([batch]() { batch->run(); });
+        }
+        batch->run();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->cv.wait(lock, [&]() { return batch->done == batch->probes.size(); });
+    }
+
 #ifdef MINJA_ADD_TEST
+    // Detects the capabilities of the template by rendering it with probe inputs (about a dozen full renders), in
+    // three rounds of independent probes run on `executor` if given. Probes that can't change the outcome are skipped.
+    // Returns whether it could (only in MINJA_ADD_TEST builds).
+    bool detect_caps(const chat_template_executor & executor) {
         auto contains = [](const std::string & haystack, const std::string & needle) {
             return haystack.find(needle) != std::string::npos;
         };
@@ -189,9 +438,17 @@ public:
         messages_typed_content_test2.PushBack(dummy_typed_user_msg_copy1, alloc);
         rapidjson::Value no_tools_copy2; no_tools_copy2.CopyFrom(no_tools, alloc);
         
-        caps_.requires_typed_content =
-        !contains(try_raw_render(messages_typed_content_test1, no_tools_copy1, false, alloc), user_needle) &&
-        contains(try_raw_render(messages_typed_content_test2, no_tools_copy2, false, alloc), user_needle);
+        // Every later probe depends on this one. The typed content probe only matters if string content isn't
+        // rendered: it's run speculatively alongside when there's an executor, after it otherwise.
+        std::string out_str_content, out_typed_content;
+        auto render_typed_content = [&]() { out_typed_content = try_raw_render(messages_typed_content_test2, no_tools_copy2, false, alloc); };
+        std::vector<std::function<void()>> probes {
+            [&]() { out_str_content = try_raw_render(messages_typed_content_test1, no_tools_copy1, false, alloc); },
+        };
+        if (executor) probes.push_back(render_typed_content);
+        run_probes(std::move(probes), executor);
+        if (!executor && !contains(out_str_content, user_needle)) render_typed_content();
+        caps_.requires_typed_content = !contains(out_str_content, user_needle) && contains(out_typed_content, user_needle);
         
         // const auto dummy_user_msg = caps_.requires_typed_content ? dummy_typed_user_msg : dummy_str_user_msg;
         rapidjson::Value dummy_user_msg(rapidjson::kObjectType);
@@ -225,7 +482,6 @@ public:
         messages_for_sys_role_test.PushBack(needle_system_msg_copy, alloc);
         messages_for_sys_role_test.PushBack(dummy_user_msg_copy2, alloc);
         rapidjson::Value no_tools_copy3; no_tools_copy3.CopyFrom(no_tools, alloc);
-        caps_.supports_system_role = contains(try_raw_render(messages_for_sys_role_test, no_tools_copy3, false, alloc), sys_needle);
         
         // auto out = try_raw_render(json::array({dummy_user_msg}), json::array({...}), false);
         rapidjson::Value messages_for_tools_test(rapidjson::kArrayType);
@@ -254,8 +510,6 @@ public:
         tool_def.AddMember("function", function_def, alloc);
         tools_for_test.PushBack(tool_def, alloc);
         
-        std::string out_tools_test = try_raw_render(tools_for_test, tools_for_test, false, alloc);
-        caps_.supports_tools = contains(out_tools_test, "some_tool");
         
         // auto make_tool_calls_msg = [&](const json & tool_calls) { ... }
         auto make_tool_calls_msg_rj = [&](rapidjson::Value& tool_calls_val, rapidjson::Document::AllocatorType& allocator_func) {
@@ -301,8 +555,6 @@ public:
         rapidjson::Value tool_calls_msg1 = make_tool_calls_msg_rj(tool_calls_array1, alloc);
         messages_for_tool_call_str_args_test.PushBack(tool_calls_msg1, alloc);
         rapidjson::Value no_tools_copy4; no_tools_copy4.CopyFrom(no_tools, alloc);
-        std::string out_tool_call_str_args = try_raw_render(messages_for_tool_call_str_args_test, no_tools_copy4, false, alloc);
-        bool tool_call_renders_str_arguments = contains(out_tool_call_str_args, "\"argument_needle\":") || contains(out_tool_call_str_args, "'argument_needle':");
         
         // out = try_raw_render(json::array({ dummy_user_msg, make_tool_calls_msg(json::array({make_tool_call("ipython", dummy_args_obj)})) }), {}, false);
         rapidjson::Value messages_for_tool_call_obj_args_test(rapidjson::kArrayType);
@@ -314,11 +566,6 @@ public:
         rapidjson::Value tool_calls_msg2 = make_tool_calls_msg_rj(tool_calls_array2, alloc);
         messages_for_tool_call_obj_args_test.PushBack(tool_calls_msg2, alloc);
         rapidjson::Value no_tools_copy5; no_tools_copy5.CopyFrom(no_tools, alloc);
-        std::string out_tool_call_obj_args = try_raw_render(messages_for_tool_call_obj_args_test, no_tools_copy5, false, alloc);
-        bool tool_call_renders_obj_arguments = contains(out_tool_call_obj_args, "\"argument_needle\":") || contains(out_tool_call_obj_args, "'argument_needle':");
-        
-        caps_.supports_tool_calls = tool_call_renders_str_arguments || tool_call_renders_obj_arguments;
-        caps_.requires_object_arguments = !tool_call_renders_str_arguments && tool_call_renders_obj_arguments;
         
         // auto out_empty = try_raw_render(json::array({dummy_user_msg, {{"role", "assistant"}, {"content", ""}}}), {}, false);
         rapidjson::Value messages_for_empty_content_test(rapidjson::kArrayType);
@@ -329,7 +576,6 @@ public:
         assistant_msg_empty_content.AddMember("content", "", alloc);
         messages_for_empty_content_test.PushBack(assistant_msg_empty_content, alloc);
         rapidjson::Value no_tools_copy6; no_tools_copy6.CopyFrom(no_tools, alloc);
-        std::string out_empty_content = try_raw_render(messages_for_empty_content_test, no_tools_copy6, false, alloc);
         
         // auto out_null = try_raw_render(json::array({dummy_user_msg, {{"role", "assistant"}, {"content", nullptr}}}), {}, false);
         rapidjson::Value messages_for_null_content_test(rapidjson::kArrayType);
@@ -340,10 +586,34 @@ public:
         assistant_msg_null_content.AddMember("content", rapidjson::Value(rapidjson::kNullType), alloc);
         messages_for_null_content_test.PushBack(assistant_msg_null_content, alloc);
         rapidjson::Value no_tools_copy7; no_tools_copy7.CopyFrom(no_tools, alloc);
-        std::string out_null_content = try_raw_render(messages_for_null_content_test, no_tools_copy7, false, alloc);
+
+        // The tools probe passes the same array as messages & tools, which try_raw_render copies: with its own
+        // allocator, as the others may render meanwhile.
+        Document tools_probe_doc;
+        std::string out_system_role, out_tools_test, out_tool_call_str_args, out_tool_call_obj_args, out_empty_content, out_null_content;
+        run_probes({
+            [&]() { out_system_role = try_raw_render(messages_for_sys_role_test, no_tools_copy3, false, alloc); },
+            [&]() { out_tools_test = try_raw_render(tools_for_test, tools_for_test, false, tools_probe_doc.GetAllocator()); },
+            [&]() { out_tool_call_str_args = try_raw_render(messages_for_tool_call_str_args_test, no_tools_copy4, false, alloc); },
+            [&]() { out_tool_call_obj_args = try_raw_render(messages_for_tool_call_obj_args_test, no_tools_copy5, false, alloc); },
+            [&]() { out_empty_content = try_raw_render(messages_for_empty_content_test, no_tools_copy6, false, alloc); },
+            [&]() { out_null_content = try_raw_render(messages_for_null_content_test, no_tools_copy7, false, alloc); },
+        }, executor);
+        caps_.supports_system_role = contains(out_system_role, sys_needle);
+        caps_.supports_tools = contains(out_tools_test, "some_tool");
+        bool tool_call_renders_str_arguments = contains(out_tool_call_str_args, "\"argument_needle\":") || contains(out_tool_call_str_args, "'argument_needle':");
+        bool tool_call_renders_obj_arguments = contains(out_tool_call_obj_args, "\"argument_needle\":") || contains(out_tool_call_obj_args, "'argument_needle':");
+        caps_.supports_tool_calls = tool_call_renders_str_arguments || tool_call_renders_obj_arguments;
+        caps_.requires_object_arguments = !tool_call_renders_str_arguments && tool_call_renders_obj_arguments;
         caps_.requires_non_null_content = contains(out_empty_content, user_needle) && !contains(out_null_content, user_needle);
-        
-        
+
+        // Last round: the parallel tool calls & tool response probes (pointless without tool calls), and the renders
+        // the tool call example is inferred from (only needed to polyfill tools).
+        probes.clear();
+        std::string out_parallel_calls, out_tool_response;
+        rapidjson::Value messages_for_parallel_calls_test(rapidjson::kArrayType);
+        rapidjson::Value messages_for_tool_response_test(rapidjson::kArrayType);
+        rapidjson::Value no_tools_copy8, no_tools_copy9;
         if (caps_.supports_tool_calls) {
             // auto dummy_args = caps_.requires_object_arguments ? dummy_args_obj : json(dummy_args_obj.dump());
             rapidjson::Value dummy_args_for_parallel_test;
@@ -362,7 +632,6 @@ public:
             rapidjson::Value tc2 = make_tool_call_rj("test_tool2", dummy_args_tc2, alloc);
             
             // auto out = try_raw_render(json::array({ dummy_user_msg, make_tool_calls_msg(json::array({tc1, tc2})) }), {}, false);
-            rapidjson::Value messages_for_parallel_calls_test(rapidjson::kArrayType);
             rapidjson::Value dummy_user_msg_copy8; dummy_user_msg_copy8.CopyFrom(dummy_user_msg, alloc);
             messages_for_parallel_calls_test.PushBack(dummy_user_msg_copy8, alloc);
             rapidjson::Value tool_calls_array_parallel(rapidjson::kArrayType);
@@ -370,16 +639,14 @@ public:
             tool_calls_array_parallel.PushBack(tc2, alloc);
             rapidjson::Value tool_calls_msg_parallel = make_tool_calls_msg_rj(tool_calls_array_parallel, alloc);
             messages_for_parallel_calls_test.PushBack(tool_calls_msg_parallel, alloc);
-            rapidjson::Value no_tools_copy8; no_tools_copy8.CopyFrom(no_tools, alloc);
-            std::string out_parallel_calls = try_raw_render(messages_for_parallel_calls_test, no_tools_copy8, false, alloc);
-            caps_.supports_parallel_tool_calls = contains(out_parallel_calls, "test_tool1") && contains(out_parallel_calls, "test_tool2");
+            no_tools_copy8.CopyFrom(no_tools, alloc);
+            probes.push_back([&]() { out_parallel_calls = try_raw_render(messages_for_parallel_calls_test, no_tools_copy8, false, alloc); });
             
             // Need to re-create tc1 as it was moved into tool_calls_array_parallel
             rapidjson::Value dummy_args_tc1_resp; dummy_args_tc1_resp.CopyFrom(dummy_args_for_parallel_test, alloc);
             rapidjson::Value tc1_resp = make_tool_call_rj("test_tool1", dummy_args_tc1_resp, alloc);
             
             // out = try_raw_render(json::array({ dummy_user_msg, make_tool_calls_msg(json::array({tc1})), { ...tool response... } }), {}, false);
-            rapidjson::Value messages_for_tool_response_test(rapidjson::kArrayType);
             rapidjson::Value dummy_user_msg_copy9; dummy_user_msg_copy9.CopyFrom(dummy_user_msg, alloc);
             messages_for_tool_response_test.PushBack(dummy_user_msg_copy9, alloc);
             rapidjson::Value tool_calls_array_resp(rapidjson::kArrayType);
@@ -392,12 +659,13 @@ public:
             tool_response_msg.AddMember("content", "Some response!", alloc);
             tool_response_msg.AddMember("tool_call_id", "call_911_", alloc);
             messages_for_tool_response_test.PushBack(tool_response_msg, alloc);
-            rapidjson::Value no_tools_copy9; no_tools_copy9.CopyFrom(no_tools, alloc);
-            std::string out_tool_response = try_raw_render(messages_for_tool_response_test, no_tools_copy9, false, alloc);
-            caps_.supports_tool_responses = contains(out_tool_response, "Some response!");
-            caps_.supports_tool_call_id = contains(out_tool_response, "call_911_");
+            no_tools_copy9.CopyFrom(no_tools, alloc);
+            probes.push_back([&]() { out_tool_response = try_raw_render(messages_for_tool_response_test, no_tools_copy9, false, alloc); });
         }
-        
+
+        std::string prefix_str, full_str;
+        chat_template_inputs inputs_prefix;
+        chat_template_inputs inputs_full;
         if (!caps_.supports_tools) {
             // const json user_msg { {"role", "user"}, {"content", "Hey"} };
             rapidjson::Value user_msg_infer(rapidjson::kObjectType);
@@ -439,19 +707,16 @@ public:
             tool_calls_array_infer.PushBack(tool_call_item_infer, alloc);
             tool_call_msg_infer.AddMember("tool_calls", tool_calls_array_infer, alloc);
             
-            std::string prefix_str, full_str;
             {
-                chat_template_inputs inputs_prefix;
                 inputs_prefix.allocator_for_inputs = &alloc;
                 inputs_prefix.messages.SetArray();
                 rapidjson::Value user_msg_infer_copy1; user_msg_infer_copy1.CopyFrom(user_msg_infer, alloc);
                 inputs_prefix.messages.PushBack(user_msg_infer_copy1, alloc);
                 inputs_prefix.add_generation_prompt = true;
                 // inputs.tools is already kNullType by default in chat_template_inputs constructor
-                prefix_str = apply(inputs_prefix);
+                probes.push_back([&]() { prefix_str = apply(inputs_prefix); });
             }
             {
-                chat_template_inputs inputs_full;
                 inputs_full.allocator_for_inputs = &alloc;
                 inputs_full.messages.SetArray();
                 rapidjson::Value user_msg_infer_copy2; user_msg_infer_copy2.CopyFrom(user_msg_infer, alloc);
@@ -460,8 +725,17 @@ public:
                 inputs_full.messages.PushBack(tool_call_msg_infer_copy, alloc);
                 inputs_full.add_generation_prompt = false;
                 // inputs.tools is already kNullType by default
-                full_str = apply(inputs_full);
+                probes.push_back([&]() { full_str = apply(inputs_full); });
             }
+        }
+
+        run_probes(std::move(probes), executor);
+        if (caps_.supports_tool_calls) {
+            caps_.supports_parallel_tool_calls = contains(out_parallel_calls, "test_tool1") && contains(out_parallel_calls, "test_tool2");
+            caps_.supports_tool_responses = contains(out_tool_response, "Some response!");
+            caps_.supports_tool_call_id = contains(out_tool_response, "call_911_");
+        }
+        if (!caps_.supports_tools) {
             // ... rest of the logic for tool_call_example_ using prefix_str and full_str
             // This part seems okay to remain as string manipulation
             auto eos_pos_last = full_str.rfind(eos_token_);
@@ -486,26 +760,422 @@ public:
                 tool_call_example_ = example;
             }
         }
-        // Ensure d_render_test is cleared if it were a member, but it's local.
+        return true;
+    }
+#else
+    bool detect_caps(const chat_template_executor &) { return false; }
 #endif
+
+    // The caps fields, in the order they're saved by save_caps().
+    static const std::vector<std::pair<const char *, bool chat_template_caps::*>> & caps_fields() {
+        static const std::vector<std::pair<const char *, bool chat_template_caps::*>> fields {
+            {"supports_tools",               &chat_template_caps::supports_tools},
+            {"supports_tool_calls",          &chat_template_caps::supports_tool_calls},
+            {"supports_tool_responses",      &chat_template_caps::supports_tool_responses},
+            {"supports_system_role",         &chat_template_caps::supports_system_role},
+            {"supports_parallel_tool_calls", &chat_template_caps::supports_parallel_tool_calls},
+            {"supports_tool_call_id",        &chat_template_caps::supports_tool_call_id},
+            {"requires_object_arguments",    &chat_template_caps::requires_object_arguments},
+            {"requires_non_null_content",    &chat_template_caps::requires_non_null_content},
+            {"requires_typed_content",       &chat_template_caps::requires_typed_content},
+        };
+        return fields;
+    }
+
+    // Only for from_compiled(), which fills everything in.
+    chat_template() = default;
+
+    void compile_programs() {
+        programs_[0] = std::make_shared<minja::TemplateProgram>(template_root_);
+        for (bool add_generation_prompt : {false, true}) {
+            programs_[1 + add_generation_prompt] = std::make_shared<minja::TemplateProgram>(specialized_roots_[add_generation_prompt]);
+        }
+    }
+    
+public:
+    
+    // If `saved_caps` holds the output of save_caps() for the same source & tokens, the capabilities are loaded
+    // from it instead of being detected (which only happens in MINJA_ADD_TEST builds). Given an `executor`, the
+    // detection renders run concurrently on it. A template already made from the same source & tokens (and still in
+    // chat_template_cache::global()) lends its trees and programs, and its capabilities unless `saved_caps` load.
+    chat_template(const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                  const std::string & saved_caps = std::string(), const chat_template_executor & executor = nullptr)
+    : source_(source), bos_token_(bos_token), eos_token_(eos_token)
+    {
+        minja::Options options {
+            /* .trim_blocks = */ true,
+            /* .lstrip_blocks = */ true,
+            /* .keep_trailing_newline = */ false,
+            /* .optimize = */ true,
+        };
+        auto & cache = chat_template_cache::global();
+        auto cached = cache.find(source_, bos_token_, eos_token_, options);
+        size_t bytes = 0;
+        if (cached) {
+            template_root_ = cached->root;
+            for (int i = 0; i < 2; i++) specialized_roots_[i] = cached->specialized_roots[i];
+            for (int i = 0; i < 3; i++) programs_[i] = cached->programs[i];
+            bytes = cached->bytes;
+        } else {
+            // Each template gets its own arena: the AST is laid out contiguously and freed in one go with the template.
+            auto arena = std::make_shared<minja::Arena>();
+            template_root_ = minja::Parser::parse(source_, options, arena);
+            for (bool add_generation_prompt : {false, true}) {
+                specialized_roots_[add_generation_prompt] = minja::Parser::parse(source_, options, arena, {
+                    {"bos_token", bos_token_},
+                    {"eos_token", eos_token_},
+                    {"add_generation_prompt", add_generation_prompt},
+                });
+            }
+            compile_programs();
+            bytes = sizeof(chat_template_cache::entry) + 2 * source_.size() + bos_token_.size() + eos_token_.size() + arena->bytes_reserved();
+            for (const auto & program : programs_) bytes += program->bytes();
+        }
+        bool has_caps = !saved_caps.empty() && load_caps(saved_caps);
+        if (!has_caps && cached && cached->has_caps) {
+            caps_ = cached->caps;
+            tool_call_example_ = cached->tool_call_example;
+            return;
+        }
+        if (!has_caps) has_caps = detect_caps(executor);
+        if (!cached || (has_caps && !cached->has_caps)) {
+            auto entry = std::make_shared<chat_template_cache::entry>();
+            entry->source = source_;
+            entry->bos_token = bos_token_;
+            entry->eos_token = eos_token_;
+            entry->options = options;
+            entry->root = template_root_;
+            for (int i = 0; i < 2; i++) entry->specialized_roots[i] = specialized_roots_[i];
+            for (int i = 0; i < 3; i++) entry->programs[i] = programs_[i];
+            entry->has_caps = has_caps;
+            entry->caps = caps_;
+            entry->tool_call_example = tool_call_example_;
+            entry->bytes = bytes + tool_call_example_.size();
+            cache.insert(std::move(entry));
+        }
+    }
+
+    // Parses the template and detects its capabilities (see the constructor) on `executor`, or on a new thread if
+    // there's none, e.g. while the model weights load.
+    static std::future<std::unique_ptr<chat_template>> load_async(const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                                                                  const chat_template_executor & executor = nullptr,
+                                                                  const std::string & saved_caps = std::string()) {
+        auto load = [=]() {
+            return std::unique_ptr<chat_template>(new chat_template(source, bos_token, eos_token, saved_caps, executor));
+        };
+        if (!executor) {
+            return std::async(std::launch::async, load);
+        }
+        auto promise = std::make_shared<std::promise<std::unique_ptr<chat_template>>>();
+        auto future = promise->get_future();
+        executor([promise, load]() { promise->set_value(load()); });
+        return future;
     }
     
     const std::string & source() const { return source_; }
     const std::string & bos_token() const { return bos_token_; }
     const std::string & eos_token() const { return eos_token_; }
     const chat_template_caps & original_caps() const { return caps_; }
+    /* The cache of the renders with options.memoize, e.g. for its stats. */
+    minja::RenderMemo & memo() const { return *memo_; }
+    const std::string & tool_call_example() const { return tool_call_example_; }
+
+    // 64-bit FNV-1a hash (as 16 hex digits) of the source and special tokens, which the detected capabilities depend on.
+    static std::string caps_key(const std::string & source, const std::string & bos_token, const std::string & eos_token) {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) chat_template_cache::hash(source, bos_token, eos_token));
+        return hex;
+    }
+
+    // Serializes the capabilities and tool call example (as JSON), to be given back to the constructor or
+    // load_caps() on later runs so they skip the detection renders.
+    std::string save_caps() const {
+        Document doc(rapidjson::kObjectType);
+        auto & alloc = doc.GetAllocator();
+        doc.AddMember("version", kCapsVersion, alloc);
+        auto key = caps_key(source_, bos_token_, eos_token_);
+        doc.AddMember("key", rapidjson::Value(key.c_str(), (rapidjson::SizeType) key.size(), alloc), alloc);
+        for (const auto & field : caps_fields()) {
+            doc.AddMember(rapidjson::StringRef(field.first), caps_.*field.second, alloc);
+        }
+        doc.AddMember("tool_call_example", rapidjson::Value(tool_call_example_.c_str(), (rapidjson::SizeType) tool_call_example_.size(), alloc), alloc);
+        return valueToString(doc);
+    }
+
+    // Loads capabilities saved by save_caps(); leaves them untouched and returns false if `saved` is malformed,
+    // was saved by another version or for another template / tokens.
+    bool load_caps(const std::string & saved) {
+        rapidjson::Document doc;
+        doc.Parse(saved.c_str(), saved.size());
+        if (doc.HasParseError() || !doc.IsObject()) {
+            _printlog("Invalid saved chat template caps");
+            return false;
+        }
+        auto version = doc.FindMember("version");
+        auto key = doc.FindMember("key");
+        if (version == doc.MemberEnd() || !version->value.IsInt() || version->value.GetInt() != kCapsVersion
+            || key == doc.MemberEnd() || !key->value.IsString() || key->value.GetString() != caps_key(source_, bos_token_, eos_token_)) {
+            _printlog("Saved chat template caps don't match this template");
+            return false;
+        }
+        chat_template_caps caps;
+        for (const auto & field : caps_fields()) {
+            auto it = doc.FindMember(field.first);
+            if (it == doc.MemberEnd() || !it->value.IsBool()) {
+                _printlog(std::string("Saved chat template caps lack ") + field.first);
+                return false;
+            }
+            caps.*field.second = it->value.GetBool();
+        }
+        auto example = doc.FindMember("tool_call_example");
+        if (example == doc.MemberEnd() || !example->value.IsString()) {
+            _printlog("Saved chat template caps lack tool_call_example");
+            return false;
+        }
+        caps_ = caps;
+        tool_call_example_.assign(example->value.GetString(), example->value.GetStringLength());
+        return true;
+    }
+
+    // Serializes the parsed trees, special tokens and capabilities into a binary form from_compiled() loads back
+    // without parsing the template nor detecting its capabilities (see examples/compile-template.cpp, which writes
+    // it to a file offline). Returns an empty string, after logging why, if the template can't be compiled.
+    std::string compile() const {
+        minja::TemplateWriter writer;
+        writer.write_varint(kCompiledVersion);
+        writer.write_varint(kCapsVersion);
+        writer.write_string(source_);
+        writer.write_string(bos_token_);
+        writer.write_string(eos_token_);
+        writer.write_string(tool_call_example_);
+        writer.write_varint(caps_fields().size());
+        for (const auto & field : caps_fields()) {
+            writer.write_varint(caps_.*field.second ? 1 : 0);
+        }
+        if (!writer.write_tree(template_root_)) return std::string();
+        for (const auto & root : specialized_roots_) {
+            if (!writer.write_tree(root)) return std::string();
+        }
+        return std::string(kCompiledMagic, sizeof(kCompiledMagic)) + writer.finish();
+    }
+
+    // Loads the output of compile(); `data` needn't outlive the call. Returns nullptr (after logging why) if it's
+    // corrupted or was compiled by another version.
+    static std::unique_ptr<chat_template> from_compiled(const char * data, size_t size) {
+        if (size < sizeof(kCompiledMagic) || std::memcmp(data, kCompiledMagic, sizeof(kCompiledMagic)) != 0) {
+            _printlog("Not a compiled chat template");
+            return nullptr;
+        }
+        uint64_t compiled_version = 0, caps_version = 0, n_caps = 0;
+        std::unique_ptr<chat_template> tmpl(new chat_template());
+        auto source = std::make_shared<std::string>();
+        minja::TemplateReader reader(data + sizeof(kCompiledMagic), size - sizeof(kCompiledMagic), source, std::make_shared<minja::Arena>());
+        if (!reader.read_varint(compiled_version) || !reader.read_varint(caps_version)) return nullptr;
+        if (compiled_version != kCompiledVersion || caps_version != kCapsVersion) {
+            _printlog("Chat template was compiled by another version");
+            return nullptr;
+        }
+        if (!reader.read_string(tmpl->source_) || !reader.read_string(tmpl->bos_token_) || !reader.read_string(tmpl->eos_token_)
+            || !reader.read_string(tmpl->tool_call_example_) || !reader.read_varint(n_caps)) return nullptr;
+        if (n_caps != caps_fields().size()) {
+            _printlog("Compiled chat template has unexpected caps");
+            return nullptr;
+        }
+        for (const auto & field : caps_fields()) {
+            uint64_t value;
+            if (!reader.read_varint(value)) return nullptr;
+            tmpl->caps_.*field.second = value != 0;
+        }
+        // The trees' locations point into the source, as if it had just been parsed.
+        *source = minja::normalize_newlines(tmpl->source_);
+        tmpl->template_root_ = reader.read_tree();
+        for (auto & root : tmpl->specialized_roots_) {
+            root = reader.read_tree();
+        }
+        if (!tmpl->template_root_ || !tmpl->specialized_roots_[0] || !tmpl->specialized_roots_[1]) return nullptr;
+        if (!reader.at_end()) {
+            _printlog("Compiled chat template has trailing data");
+            return nullptr;
+        }
+        tmpl->compile_programs();
+        return tmpl;
+    }
+
+    // Loads a file holding the output of compile(), memory-mapping it where supported instead of reading it in.
+    static std::unique_ptr<chat_template> from_compiled_file(const std::string & path) {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            _printlog("Can't open " + path);
+            return nullptr;
+        }
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        return from_compiled(data.data(), data.size());
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            _printlog("Can't open " + path);
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            _printlog("Can't read " + path);
+            return nullptr;
+        }
+        auto size = (size_t) st.st_size;
+        auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            _printlog("Can't map " + path);
+            return nullptr;
+        }
+        auto tmpl = from_compiled((const char *) data, size);
+        munmap(data, size);
+        return tmpl;
+#endif
+    }
     
     
     std::string apply(
                       chat_template_inputs & inputs,
                       const chat_template_options & opts = chat_template_options()) const
+    {
+        minja::StringSink out;
+        apply(inputs, out, opts);
+        return out.take();
+    }
+    
+    // Streams the prompt into `out` as it's rendered (e.g. a minja::CallbackSink feeding a tokenizer, or a
+    // minja::StringSink reused across requests), flushing it at the end.
+    void apply(
+               chat_template_inputs & inputs,
+               minja::RenderSink & out,
+               const chat_template_options & opts = chat_template_options()) const
     {
         // Create a working document for this apply call.
         // All new JSON Values created within this scope should use its allocator.
+        Document working_doc;
+        render_prompt(inputs, out, opts, working_doc.GetAllocator());
+    }
+
+    /*
+     * Same, also recording which bytes of the prompt each of inputs.messages rendered to (spans numbered by index in
+     * inputs.messages, even when polyfills reshaped them), and those of the {% generation %} blocks: see
+     * minja::SpanSink.
+     */
+    void apply(
+               chat_template_inputs & inputs,
+               minja::SpanSink & out,
+               const chat_template_options & opts = chat_template_options()) const
+    {
         Document working_doc;
         rapidjson::Document::AllocatorType& allocator = working_doc.GetAllocator();
         
-        rapidjson::Value actual_messages(rapidjson::kArrayType); // Uses working_doc's allocator by default if created here
+        rapidjson::Value polyfilled_messages;
+        std::vector<size_t> origins;
+        const auto & actual_messages = prepare_messages(inputs, opts, polyfilled_messages, allocator, &origins);
+        std::shared_ptr<const minja::SharedJson> tools;
+        auto context = make_context(inputs, opts, actual_messages, /* borrow_inputs= */ true, &tools);
+        if (&actual_messages == &inputs.messages) origins.clear();
+        out.set_messages(context->get("messages"), std::move(origins));
+        
+        program_for(inputs, opts).render(out, context);
+        out.flush();
+    }
+
+    /*
+     * Renders `count` conversations on `num_threads` threads (0: one per core), each taking the next conversation
+     * left whenever it's done with one, and returns the prompts in order: the same as apply() on each of them.
+     * The threads share the parsed template, and each reuses its output buffer & polyfill memory across conversations.
+     */
+    std::vector<std::string> apply_batch(
+                      const chat_template_inputs * inputs,
+                      size_t count,
+                      const chat_template_options & opts = chat_template_options(),
+                      size_t num_threads = 0) const
+    {
+        std::vector<std::string> prompts(count);
+        std::atomic<size_t> next {0};
+        auto work = [&]() {
+            minja::StringSink out;
+            std::vector<char> scratch;
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+                size_t capacity;
+                {
+                    // The allocator starts from the memory the previous ones needed; the buffer only grows once it's
+                    // gone, as it writes into it when destroyed.
+                    std::optional<rapidjson::Document::AllocatorType> allocator;
+                    if (scratch.empty()) {
+                        allocator.emplace();
+                    } else {
+                        allocator.emplace(scratch.data(), scratch.size());
+                    }
+                    out.clear();
+                    render_prompt(inputs[i], out, opts, *allocator);
+                    capacity = allocator->Capacity();
+                }
+                prompts[i].assign(out.str());
+                if (capacity > scratch.size()) scratch.resize(capacity);
+            }
+        };
+        if (!num_threads) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        num_threads = std::min(num_threads, count);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(work);
+        work();
+        for (auto & thread : threads) thread.join();
+        return prompts;
+    }
+    std::vector<std::string> apply_batch(
+                      const std::vector<chat_template_inputs> & inputs,
+                      const chat_template_options & opts = chat_template_options(),
+                      size_t num_threads = 0) const
+    {
+        return apply_batch(inputs.data(), inputs.size(), opts, num_threads);
+    }
+    
+private:
+    friend class chat_session;
+
+    void render_prompt(
+               const chat_template_inputs & inputs,
+               minja::RenderSink & out,
+               const chat_template_options & opts,
+               rapidjson::Document::AllocatorType & allocator) const
+    {
+        rapidjson::Value polyfilled_messages;
+        const auto & actual_messages = prepare_messages(inputs, opts, polyfilled_messages, allocator);
+        std::shared_ptr<const minja::SharedJson> tools;
+        auto context = make_context(inputs, opts, actual_messages, /* borrow_inputs= */ true, &tools);
+        
+        const auto & program = program_for(inputs, opts);
+        std::optional<minja::RenderMemo::Scope> memo_scope;
+        if (opts.memoize) memo_scope.emplace(*memo_, program.get_root());
+        program.render(out, context);
+        out.flush();
+    }
+
+    // The program of the specialized tree matching the values make_context() will set, unless extra_context overrides them.
+    const minja::TemplateProgram & program_for(const chat_template_inputs & inputs, const chat_template_options & opts) const {
+        if (!opts.use_bos_token || !opts.use_eos_token) return *programs_[0];
+        if (inputs.extra_context.IsObject()) {
+            for (auto name : {"bos_token", "eos_token", "add_generation_prompt"}) {
+                if (inputs.extra_context.HasMember(name)) return *programs_[0];
+            }
+        }
+        return *programs_[1 + inputs.add_generation_prompt];
+    }
+    
+    // Returns the messages the template will actually see: inputs.messages itself if no polyfill applies,
+    // otherwise the polyfilled messages, built into `storage` with `allocator`.
+    const rapidjson::Value & prepare_messages(
+                      const chat_template_inputs & inputs,
+                      const chat_template_options & opts,
+                      rapidjson::Value & storage,
+                      rapidjson::Document::AllocatorType & allocator,
+                      std::vector<size_t> * origins = nullptr) const
+    {
         
         auto has_tools = inputs.tools.IsArray() && !inputs.tools.Empty();
         auto has_tool_calls = false;
@@ -546,223 +1216,244 @@ public:
                                                         || polyfill_typed_content
                                                         );
         
-        if (needs_polyfills) {
-            // actual_messages is already an empty array, using allocator
-            
-            auto add_message = [&](const rapidjson::Value & msg_const) {
-                rapidjson::Value msg;
-                msg.CopyFrom(msg_const, allocator); // Ensure it uses the current doc's allocator
+        if (!needs_polyfills) {
+            return inputs.messages;
+        }
+        auto & actual_messages = storage.SetArray();
+        // With origins, which of inputs.messages each of actual_messages comes from (SpanSink::npos for the
+        // tools' system prompt when it's a message of its own).
+        if (origins) origins->clear();
+        
+        auto add_message = [&](rapidjson::Value & msg, size_t origin) { // moves msg into actual_messages
+            if (origins) origins->push_back(origin);
+            if (polyfill_typed_content && msg.IsObject() && msg.HasMember("content") && msg["content"].IsString()) {
+                rapidjson::Value new_msg(rapidjson::kObjectType);
+                new_msg.AddMember("role", msg["role"], allocator);
                 
-                if (polyfill_typed_content && msg.IsObject() && msg.HasMember("content") &&
-                    !msg["content"].IsNull() && msg["content"].IsString()) {
-                    
-                    rapidjson::Value new_msg(rapidjson::kObjectType);
-                    new_msg.AddMember("role", rapidjson::Value(msg["role"], allocator), allocator); // copy role
-                    
-                    rapidjson::Value content_array_typed(rapidjson::kArrayType);
-                    rapidjson::Value content_item_typed(rapidjson::kObjectType);
-                    content_item_typed.AddMember("type", "text", allocator);
-                    // Need to copy the string content for "text"
-                    rapidjson::Value text_val(msg["content"].GetString(), allocator);
-                    content_item_typed.AddMember("text", text_val, allocator);
-                    content_array_typed.PushBack(content_item_typed, allocator);
-                    new_msg.AddMember("content", content_array_typed, allocator);
-                    actual_messages.PushBack(new_msg, allocator);
-                } else {
-                    actual_messages.PushBack(msg, allocator); // msg already copied with allocator
-                }
-            };
+                rapidjson::Value content_array_typed(rapidjson::kArrayType);
+                rapidjson::Value content_item_typed(rapidjson::kObjectType);
+                content_item_typed.AddMember("type", "text", allocator);
+                content_item_typed.AddMember("text", msg["content"], allocator);
+                content_array_typed.PushBack(content_item_typed, allocator);
+                new_msg.AddMember("content", content_array_typed, allocator);
+                actual_messages.PushBack(new_msg, allocator);
+            } else {
+                actual_messages.PushBack(msg, allocator);
+            }
+        };
+        
+        std::string pending_system;
+        size_t pending_origin = minja::SpanSink::npos;
+        auto flush_sys = [&]() {
+            if (!pending_system.empty()) {
+                rapidjson::Value sys_as_user_msg(rapidjson::kObjectType);
+                sys_as_user_msg.AddMember("role", "user", allocator);
+                sys_as_user_msg.AddMember("content", rapidjson::Value(pending_system.c_str(), (rapidjson::SizeType) pending_system.size(), allocator), allocator);
+                add_message(sys_as_user_msg, pending_origin);
+                pending_system.clear();
+            }
+        };
+        
+        // The messages to polyfill, in order: inputs.messages, with the tools' system prompt merged into (or
+        // inserted before) the first one.
+        std::vector<const rapidjson::Value *> sources;
+        if (inputs.messages.IsArray()) {
+            sources.reserve(inputs.messages.Size() + 1);
+            for (const auto & message_val : inputs.messages.GetArray()) sources.push_back(&message_val);
+        }
+        rapidjson::Value tools_system_msg;
+        if (polyfill_tools) {
+            // Convert inputs.tools to string for the system prompt
+            rapidjson::StringBuffer tools_buffer;
+            rapidjson::PrettyWriter<rapidjson::StringBuffer> tools_writer(tools_buffer); // Pretty for readability
+            tools_writer.SetIndent(' ', 2);
+            inputs.tools.Accept(tools_writer);
+            std::string tools_str_prompt = tools_buffer.GetString();
             
-            std::string pending_system;
-            auto flush_sys = [&]() {
-                if (!pending_system.empty()) {
-                    rapidjson::Value sys_as_user_msg(rapidjson::kObjectType);
-                    sys_as_user_msg.AddMember("role", "user", allocator);
-                    sys_as_user_msg.AddMember("content", rapidjson::StringRef(pending_system.c_str()), allocator);
-                    add_message(sys_as_user_msg); // add_message will handle typed content if needed
-                    pending_system.clear();
-                }
-            };
+            std::string system_prompt_str =
+            "You can call any of the following tools to satisfy the user's requests: " + tools_str_prompt +
+            (!polyfill_tool_call_example || tool_call_example_.empty() ? "" : "\n\nExample tool call syntax:\n\n" + tool_call_example_ + "\n\n");
             
-            rapidjson::Value adjusted_messages_val(rapidjson::kArrayType);
-            if (polyfill_tools) {
-                // Convert inputs.tools to string for the system prompt
-                rapidjson::StringBuffer tools_buffer;
-                rapidjson::PrettyWriter<rapidjson::StringBuffer> tools_writer(tools_buffer); // Pretty for readability
-                tools_writer.SetIndent(' ', 2);
-                inputs.tools.Accept(tools_writer);
-                std::string tools_str_prompt = tools_buffer.GetString();
-                
-                std::string system_prompt_str =
-                "You can call any of the following tools to satisfy the user's requests: " + tools_str_prompt +
-                (!polyfill_tool_call_example || tool_call_example_.empty() ? "" : "\n\nExample tool call syntax:\n\n" + tool_call_example_ + "\n\n");
-                
-                // add_system returns a new Value, ensure it uses 'allocator'
-                rapidjson::Value messages_copy_for_add_system;
-                messages_copy_for_add_system.CopyFrom(inputs.messages, allocator);
-                adjusted_messages_val = add_system(messages_copy_for_add_system, system_prompt_str, allocator);
+            // Same as add_system(), without copying the other messages.
+            if (!sources.empty() && sources[0]->IsObject() && sources[0]->HasMember("role") && (*sources[0])["role"] == "system") {
+                copy_value(tools_system_msg, *sources[0], allocator, /* borrow_strings= */ true);
+                std::string existing_system_content_str;
+                if (tools_system_msg.HasMember("content") && tools_system_msg["content"].IsString()) {
+                    existing_system_content_str = tools_system_msg["content"].GetString();
+                }
+                std::string new_content_str = existing_system_content_str + "\n\n" + system_prompt_str;
+                rapidjson::Value new_content(new_content_str.c_str(), (rapidjson::SizeType) new_content_str.size(), allocator);
+                if (tools_system_msg.HasMember("content")) {
+                    tools_system_msg["content"].Swap(new_content);
+                } else {
+                    tools_system_msg.AddMember("content", new_content, allocator);
+                }
+                sources[0] = &tools_system_msg;
             } else {
-                adjusted_messages_val.CopyFrom(inputs.messages, allocator);
+                tools_system_msg.SetObject();
+                tools_system_msg.AddMember("role", "system", allocator);
+                tools_system_msg.AddMember("content", rapidjson::Value(system_prompt_str.c_str(), (rapidjson::SizeType) system_prompt_str.size(), allocator), allocator);
+                sources.insert(sources.begin(), &tools_system_msg);
             }
+        }
+        auto first_input = sources.size() - (inputs.messages.IsArray() ? inputs.messages.Size() : 0);
+        
+        for (size_t i = 0; i < sources.size(); ++i) {
+            const auto * source = sources[i];
+            auto origin = i < first_input ? minja::SpanSink::npos : i - first_input;
+            if (!source->IsObject() || !source->HasMember("role") || !source->HasMember("content")) {
+                // MNN_ERROR replacement:
+                fprintf(stderr, "message must have 'role' and 'content' fields: %s\n", valueToString(*source).c_str());
+                continue;
+            }
+            // A structural copy whose strings still point into inputs (or tools_system_msg): only the
+            // polyfilled fields below get strings of their own.
+            rapidjson::Value message;
+            copy_value(message, *source, allocator, /* borrow_strings= */ true);
+            const char* role_cstr = message["role"].GetString();
+            std::string role = role_cstr;
             
-            if (adjusted_messages_val.IsArray()){
-                for (auto & message_val_mut : adjusted_messages_val.GetArray()) { // Iterate by mutable ref
-                    // message_ is already using 'allocator' as it's part of adjusted_messages_val
-                    rapidjson::Value message; // Create a mutable copy for this iteration
-                    message.CopyFrom(message_val_mut, allocator);
-                    
-                    
-                    if (!message.IsObject() || !message.HasMember("role") || !message.HasMember("content")) {
-                        // MNN_ERROR replacement:
-                        fprintf(stderr, "message must have 'role' and 'content' fields: %s\n", valueToString(message).c_str());
-                        // Potentially skip this message or handle error
-                        continue;
-                    }
-                    const char* role_cstr = message["role"].GetString();
-                    std::string role = role_cstr;
-                    
-                    if (message.HasMember("tool_calls")) {
-                        if (polyfill_object_arguments || polyfill_tool_calls) {
-                            if (message["tool_calls"].IsArray()) {
-                                for (auto & tool_call_val : message["tool_calls"].GetArray()) {
-                                    if (tool_call_val.IsObject() && tool_call_val.HasMember("type") && tool_call_val["type"] == "function") {
-                                        if (tool_call_val.HasMember("function") && tool_call_val["function"].IsObject()) {
-                                            auto& function_val = tool_call_val["function"];
-                                            if (function_val.HasMember("arguments") && function_val["arguments"].IsString()) {
-                                                std::string args_str = function_val["arguments"].GetString();
-                                                Document args_doc;
-                                                if (!args_doc.Parse(args_str.c_str()).HasParseError()) {
-                                                    // Replace the string arguments with the parsed Value object
-                                                    // The new Value must use 'allocator'
-                                                    rapidjson::Value new_args_val;
-                                                    new_args_val.CopyFrom(args_doc, allocator);
-                                                    function_val["arguments"].Swap(new_args_val); // Swap to avoid copy if possible
-                                                }
-                                            }
+            if (message.HasMember("tool_calls")) {
+                if (polyfill_object_arguments || polyfill_tool_calls) {
+                    if (message["tool_calls"].IsArray()) {
+                        for (auto & tool_call_val : message["tool_calls"].GetArray()) {
+                            if (tool_call_val.IsObject() && tool_call_val.HasMember("type") && tool_call_val["type"] == "function") {
+                                if (tool_call_val.HasMember("function") && tool_call_val["function"].IsObject()) {
+                                    auto& function_val = tool_call_val["function"];
+                                    if (function_val.HasMember("arguments") && function_val["arguments"].IsString()) {
+                                        std::string args_str = function_val["arguments"].GetString();
+                                        Document args_doc;
+                                        if (!args_doc.Parse(args_str.c_str()).HasParseError()) {
+                                            // Replace the string arguments with the parsed Value object
+                                            // The new Value must use 'allocator'
+                                            rapidjson::Value new_args_val;
+                                            new_args_val.CopyFrom(args_doc, allocator);
+                                            function_val["arguments"].Swap(new_args_val); // Swap to avoid copy if possible
                                         }
                                     }
                                 }
                             }
                         }
-                        if (polyfill_tool_calls) {
-                            rapidjson::Value content_val; content_val.CopyFrom(message["content"], allocator); // Keep original content if any
-                            rapidjson::Value tool_calls_payload(rapidjson::kArrayType);
-                            if (message["tool_calls"].IsArray()) {
-                                for (const auto & tool_call_val_const : message["tool_calls"].GetArray()) {
-                                    if (tool_call_val_const.IsObject() && tool_call_val_const.HasMember("type") && tool_call_val_const["type"] == "function") {
-                                        const auto& function_val_const = tool_call_val_const["function"];
-                                        rapidjson::Value tc_item(rapidjson::kObjectType);
-                                        tc_item.AddMember("name", rapidjson::Value(function_val_const["name"], allocator), allocator);
-                                        // Arguments should already be objects if polyfill_object_arguments ran
-                                        tc_item.AddMember("arguments", rapidjson::Value(function_val_const["arguments"], allocator), allocator);
-                                        if (tool_call_val_const.HasMember("id")) {
-                                            tc_item.AddMember("id", rapidjson::Value(tool_call_val_const["id"], allocator), allocator);
-                                        }
-                                        tool_calls_payload.PushBack(tc_item, allocator);
-                                    }
+                    }
+                }
+                if (polyfill_tool_calls) {
+                    rapidjson::Value content_val;
+                    content_val.Swap(message["content"]); // Keep original content if any; replaced below
+                    rapidjson::Value tool_calls_payload(rapidjson::kArrayType);
+                    if (message["tool_calls"].IsArray()) {
+                        for (auto & tool_call_val : message["tool_calls"].GetArray()) {
+                            if (tool_call_val.IsObject() && tool_call_val.HasMember("type") && tool_call_val["type"] == "function") {
+                                auto& function_val = tool_call_val["function"];
+                                rapidjson::Value tc_item(rapidjson::kObjectType);
+                                tc_item.AddMember("name", function_val["name"], allocator);
+                                // Arguments should already be objects if polyfill_object_arguments ran
+                                tc_item.AddMember("arguments", function_val["arguments"], allocator);
+                                if (tool_call_val.HasMember("id")) {
+                                    tc_item.AddMember("id", tool_call_val["id"], allocator);
                                 }
+                                tool_calls_payload.PushBack(tc_item, allocator);
                             }
-                            rapidjson::Value obj_for_content(rapidjson::kObjectType);
-                            obj_for_content.AddMember("tool_calls", tool_calls_payload, allocator);
-                            if (!content_val.IsNull() && !(content_val.IsString() && strlen(content_val.GetString()) == 0)) {
-                                obj_for_content.AddMember("content", content_val, allocator);
-                            }
-                            
-                            // Serialize obj_for_content to string for message["content"]
-                            rapidjson::StringBuffer s_buffer;
-                            rapidjson::PrettyWriter<rapidjson::StringBuffer> writer_obj(s_buffer);
-                            writer_obj.SetIndent(' ', 2);
-                            obj_for_content.Accept(writer_obj);
-                            message["content"].SetString(s_buffer.GetString(), allocator);
-                            message.RemoveMember("tool_calls");
                         }
                     }
-                    if (polyfill_tool_responses && role == "tool") {
-                        message["role"].SetString("user", allocator); // Change role to user
-                        rapidjson::Value tool_response_obj(rapidjson::kObjectType);
-                        rapidjson::Value tool_response_inner_obj(rapidjson::kObjectType);
-                        
-                        if (message.HasMember("name")) {
-                            tool_response_inner_obj.AddMember("tool", rapidjson::Value(message["name"], allocator), allocator);
-                        }
-                        // message["content"] is guaranteed to exist by check above
-                        tool_response_inner_obj.AddMember("content", rapidjson::Value(message["content"], allocator), allocator);
-                        if (message.HasMember("tool_call_id")) {
-                            tool_response_inner_obj.AddMember("tool_call_id", rapidjson::Value(message["tool_call_id"], allocator), allocator);
-                        }
-                        tool_response_obj.AddMember("tool_response", tool_response_inner_obj, allocator);
-                        
-                        // Serialize tool_response_obj to string for message["content"]
-                        rapidjson::StringBuffer s_buffer_resp;
-                        rapidjson::PrettyWriter<rapidjson::StringBuffer> writer_resp(s_buffer_resp);
-                        writer_resp.SetIndent(' ',2);
-                        tool_response_obj.Accept(writer_resp);
-                        message["content"].SetString(s_buffer_resp.GetString(), allocator);
-                        
-                        if (message.HasMember("name")) message.RemoveMember("name");
-                        if (message.HasMember("tool_call_id")) message.RemoveMember("tool_call_id"); // if it was there
+                    rapidjson::Value obj_for_content(rapidjson::kObjectType);
+                    obj_for_content.AddMember("tool_calls", tool_calls_payload, allocator);
+                    if (!content_val.IsNull() && !(content_val.IsString() && content_val.GetStringLength() == 0)) {
+                        obj_for_content.AddMember("content", content_val, allocator);
                     }
                     
-                    if (!message["content"].IsNull() && polyfill_system_role) {
-                        // Assuming content is string after previous polyfills or by its nature
-                        std::string content_str;
-                        if (message["content"].IsString()){
-                            content_str = message["content"].GetString();
-                        } else {
-                            // If content is not string (e.g. array for typed content), it needs to be stringified for pending_system
-                            // This case should be handled by typed_content polyfill first if active
-                            // For simplicity, if it's not string here, we might skip or stringify it
-                            rapidjson::StringBuffer temp_s_buffer;
-                            rapidjson::Writer<rapidjson::StringBuffer> temp_writer(temp_s_buffer);
-                            message["content"].Accept(temp_writer);
-                            content_str = temp_s_buffer.GetString();
-                        }
-                        
-                        if (role == "system") {
-                            if (!pending_system.empty()) pending_system += "\n";
-                            pending_system += content_str;
-                            // This message is consumed, skip adding it directly
-                            // A continue here would skip the 'add_message(message)' below for system messages
-                            // which is the desired behavior.
-                            // However, the original code structure adds the modified message (if not system)
-                            // or flushes system messages.
-                            // Let's ensure this message isn't added by 'add_message' if it's system.
-                            // The flush_sys() and add_message(message) logic outside the loop handles it.
-                            // So, if role is system, we just update pending_system and the message itself is not added.
-                            continue;
-                        } else {
-                            if (role == "user") {
-                                if (!pending_system.empty()) {
-                                    std::string new_content = pending_system + (content_str.empty() ? "" : "\n" + content_str);
-                                    message["content"].SetString(new_content.c_str(), allocator);
-                                    pending_system.clear();
-                                }
-                            } else { // assistant, tool (already transformed to user)
-                                flush_sys();
-                            }
+                    // Serialize obj_for_content to string for message["content"]
+                    rapidjson::StringBuffer s_buffer;
+                    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer_obj(s_buffer);
+                    writer_obj.SetIndent(' ', 2);
+                    obj_for_content.Accept(writer_obj);
+                    message["content"].SetString(s_buffer.GetString(), allocator);
+                    message.RemoveMember("tool_calls");
+                }
+            }
+            if (polyfill_tool_responses && role == "tool") {
+                message["role"].SetString("user", allocator); // Change role to user
+                rapidjson::Value tool_response_obj(rapidjson::kObjectType);
+                rapidjson::Value tool_response_inner_obj(rapidjson::kObjectType);
+                
+                if (message.HasMember("name")) {
+                    tool_response_inner_obj.AddMember("tool", message["name"], allocator);
+                }
+                // message["content"] is guaranteed to exist by check above; it's replaced below
+                rapidjson::Value content_val;
+                content_val.Swap(message["content"]);
+                tool_response_inner_obj.AddMember("content", content_val, allocator);
+                if (message.HasMember("tool_call_id")) {
+                    tool_response_inner_obj.AddMember("tool_call_id", message["tool_call_id"], allocator);
+                }
+                tool_response_obj.AddMember("tool_response", tool_response_inner_obj, allocator);
+                
+                // Serialize tool_response_obj to string for message["content"]
+                rapidjson::StringBuffer s_buffer_resp;
+                rapidjson::PrettyWriter<rapidjson::StringBuffer> writer_resp(s_buffer_resp);
+                writer_resp.SetIndent(' ',2);
+                tool_response_obj.Accept(writer_resp);
+                message["content"].SetString(s_buffer_resp.GetString(), allocator);
+                
+                if (message.HasMember("name")) message.RemoveMember("name");
+                if (message.HasMember("tool_call_id")) message.RemoveMember("tool_call_id"); // if it was there
+            }
+            
+            if (!message["content"].IsNull() && polyfill_system_role) {
+                // The content as a string, only built when it's merged with the pending system messages.
+                auto content_str = [&]() -> std::string {
+                    if (message["content"].IsString()) {
+                        return std::string(message["content"].GetString(), message["content"].GetStringLength());
+                    }
+                    // If content is not string (e.g. array for typed content), it's stringified for pending_system
+                    rapidjson::StringBuffer temp_s_buffer;
+                    rapidjson::Writer<rapidjson::StringBuffer> temp_writer(temp_s_buffer);
+                    message["content"].Accept(temp_writer);
+                    return temp_s_buffer.GetString();
+                };
+                
+                if (role == "system") {
+                    // The message is consumed: its content goes to the next user message (or a user message
+                    // of its own, see flush_sys).
+                    if (pending_system.empty()) pending_origin = origin;
+                    if (!pending_system.empty()) pending_system += "\n";
+                    pending_system += content_str();
+                    continue;
+                } else {
+                    if (role == "user") {
+                        if (!pending_system.empty()) {
+                            auto content = content_str();
+                            std::string new_content = pending_system + (content.empty() ? "" : "\n" + content);
+                            message["content"].SetString(new_content.c_str(), (rapidjson::SizeType) new_content.size(), allocator);
+                            pending_system.clear();
                         }
+                    } else { // assistant, tool (already transformed to user)
+                        flush_sys();
                     }
-                    add_message(message); // add_message handles copying to actual_messages with allocator
                 }
             }
-            flush_sys();
-        } else { // no polyfills needed
-            actual_messages.CopyFrom(inputs.messages, allocator);
+            add_message(message, origin);
         }
-        
-        auto context = minja::Context::make(nullptr); // nlohmann::json() equivalent for context data
-        // The make function needs to be adapted for rapidjson::Value
-        // For now, creating an empty object for context data.
-        rapidjson::Value context_data_val(rapidjson::kObjectType);
-        context_data_val.AddMember("messages", actual_messages, allocator); // actual_messages already uses allocator
-        context_data_val.AddMember("add_generation_prompt", inputs.add_generation_prompt, allocator);
-        
-        // Convert context_data_val to nlohmann::json for minja::Context::make
-        // This is a temporary bridge. minja::Context itself needs to be updated for rapidjson.
-        // This is a critical dependency.
-
-        context = minja::Context::make(minja::Value(context_data_val));
-        
+        flush_sys();
+        return storage;
+    }
+    
+    // Builds the render context. With borrow_inputs, messages, tools & extra context are read in place
+    // (minja::Value::borrow), so actual_messages and inputs must outlive the context; otherwise they're copied.
+    // With shared_tools too, non-empty tools are read from their copy in shared_tools_ instead, which
+    // *shared_tools must keep alive as long as the context.
+    std::shared_ptr<minja::Context> make_context(
+                      const chat_template_inputs & inputs,
+                      const chat_template_options & opts,
+                      const rapidjson::Value & actual_messages,
+                      bool borrow_inputs,
+                      std::shared_ptr<const minja::SharedJson> * shared_tools = nullptr) const
+    {
+        auto convert = [&](const rapidjson::Value & v) {
+            return borrow_inputs ? minja::Value::borrow(v) : minja::Value(v);
+        };
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("messages", convert(actual_messages));
+        context->set("add_generation_prompt", inputs.add_generation_prompt);
         context->set("bos_token", opts.use_bos_token ? bos_token_ : "");
         context->set("eos_token", opts.use_eos_token ? eos_token_ : "");
         if (opts.define_strftime_now) {
@@ -772,37 +1463,94 @@ public:
                 auto format = args.args[0].get<std::string>();
                 
                 auto time_point = std::chrono::system_clock::to_time_t(time_now_capture);
-                auto local_time = *std::localtime(&time_point);
+                // std::localtime returns a shared static buffer, which concurrent renders would race on.
+                std::tm local_time {};
+#ifdef _WIN32
+                localtime_s(&local_time, &time_point);
+#else
+                localtime_r(&time_point, &local_time);
+#endif
                 std::ostringstream ss;
                 ss << std::put_time(&local_time, format.c_str());
                 return ss.str();
             }));
         }
         
-        if (!inputs.tools.IsNull()) {
-            // context->set("tools", minja::Value(inputs.tools));
-            // Again, minja::Value constructor needs to handle rapidjson::Value
-            // Temporary bridge: rapidjson::Value -> string -> nlohmann::json -> minja::Value
-            std::string tools_for_minja_value_str = valueToString(inputs.tools);
-            rapidjson::Document doc;
-            doc.Parse(tools_for_minja_value_str.c_str());
-            context->set("tools", minja::Value(doc));
+        if (borrow_inputs && shared_tools && inputs.tools.IsArray() && !inputs.tools.Empty()) {
+            *shared_tools = share_tools(inputs.tools);
+            context->set("tools", minja::Value::borrow(**shared_tools));
+        } else if (!inputs.tools.IsNull()) {
+            context->set("tools", convert(inputs.tools));
         }
         if (!inputs.extra_context.IsNull() && inputs.extra_context.IsObject()) {
-            for (auto & kv : inputs.extra_context.GetObject()) {
-                // context->set(kv.key(), minja::Value(kv.value()));
-                // Temporary bridge for kv.value()
-                std::string kv_value_str = valueToString(kv.value);
-                rapidjson::Document doc;
-                doc.Parse(kv_value_str.c_str());
-                context->set(kv.name.GetString(), minja::Value(doc));
+            for (const auto & kv : inputs.extra_context.GetObject()) {
+                context->set(kv.name.GetString(), convert(kv.value));
             }
         }
-        
-        auto ret = template_root_->render(context);
-        return ret;
+        return context;
+    }
+
+    // The copy of `tools` in shared_tools_, made now if none of the recent ones is the same.
+    std::shared_ptr<const minja::SharedJson> share_tools(const rapidjson::Value & tools) const {
+        auto & cache = *shared_tools_;
+        std::vector<std::shared_ptr<const minja::SharedJson>> recent;
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            recent = cache.recent;
+        }
+        // Compared (and copied) outside of the lock, so that concurrent renders don't wait on each other.
+        std::shared_ptr<const minja::SharedJson> shared;
+        for (const auto & entry : recent) {
+            if (same_json(entry->get(), tools)) {
+                shared = entry;
+                break;
+            }
+        }
+        if (!shared) shared = std::make_shared<const minja::SharedJson>(tools);
+
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto it = std::find(cache.recent.begin(), cache.recent.end(), shared);
+        if (it != cache.recent.end()) cache.recent.erase(it);
+        cache.recent.insert(cache.recent.begin(), shared);
+        if (cache.recent.size() > kSharedToolsCapacity) cache.recent.pop_back();
+        return shared;
+    }
+
+    // Whether a and b are the same down to the kind of their numbers and the order of their members, which render
+    // differently: unlike with operator==, 1 isn't the same as 1.0.
+    static bool same_json(const rapidjson::Value & a, const rapidjson::Value & b) {
+        if (a.GetType() != b.GetType()) return false;
+        switch (a.GetType()) {
+            case rapidjson::kStringType:
+                return a.GetStringLength() == b.GetStringLength()
+                    && std::memcmp(a.GetString(), b.GetString(), a.GetStringLength()) == 0;
+            case rapidjson::kNumberType:
+                if (a.IsDouble() || b.IsDouble()) {
+                    if (!a.IsDouble() || !b.IsDouble()) return false;
+                    auto x = a.GetDouble(), y = b.GetDouble();
+                    return std::memcmp(&x, &y, sizeof(x)) == 0;  // tells 0.0 from -0.0
+                }
+                if (a.IsInt64() != b.IsInt64()) return false;
+                return a.IsInt64() ? a.GetInt64() == b.GetInt64() : a.GetUint64() == b.GetUint64();
+            case rapidjson::kArrayType:
+                if (a.Size() != b.Size()) return false;
+                for (rapidjson::SizeType i = 0; i < a.Size(); ++i) {
+                    if (!same_json(a[i], b[i])) return false;
+                }
+                return true;
+            case rapidjson::kObjectType: {
+                if (a.MemberCount() != b.MemberCount()) return false;
+                for (auto i = a.MemberBegin(), j = b.MemberBegin(); i != a.MemberEnd(); ++i, ++j) {
+                    if (!same_json(i->name, j->name) || !same_json(i->value, j->value)) return false;
+                }
+                return true;
+            }
+            default:
+                return true;
+        }
     }
     
+public:
     // static nlohmann::ordered_json add_system(const nlohmann::ordered_json & messages, const std::string & system_prompt) {
     static rapidjson::Value add_system(
                                        const rapidjson::Value & messages_const, // input messages (const ref)
@@ -810,10 +1558,10 @@ public:
                                        rapidjson::Document::AllocatorType& allocator) // allocator for the returned Value
     {
         rapidjson::Value messages_with_system(rapidjson::kArrayType);
-        messages_with_system.CopyFrom(messages_const, allocator); // Deep copy to make it modifiable
         
-        if (!messages_with_system.Empty() && messages_with_system[0].IsObject() &&
-            messages_with_system[0].HasMember("role") && messages_with_system[0]["role"] == "system") {
+        if (!messages_const.Empty() && messages_const[0].IsObject() &&
+            messages_const[0].HasMember("role") && messages_const[0]["role"] == "system") {
+            messages_with_system.CopyFrom(messages_const, allocator); // Deep copy to make it modifiable
             
             std::string existing_system_content_str;
             if (messages_with_system[0].HasMember("content") && messages_with_system[0]["content"].IsString()) {
@@ -826,19 +1574,350 @@ public:
         } else {
             rapidjson::Value new_system_msg(rapidjson::kObjectType);
             new_system_msg.AddMember("role", "system", allocator);
-            new_system_msg.AddMember("content", rapidjson::StringRef(system_prompt.c_str()), allocator);
+            new_system_msg.AddMember("content", rapidjson::Value(system_prompt.c_str(), (rapidjson::SizeType) system_prompt.size(), allocator), allocator);
             
-            // Insert at the beginning
-            rapidjson::Value temp_array(rapidjson::kArrayType);
-            temp_array.PushBack(new_system_msg, allocator);
-            for (auto& el : messages_with_system.GetArray()) {
+            // Insert at the beginning, copying each message once
+            messages_with_system.Reserve(messages_const.Size() + 1, allocator);
+            messages_with_system.PushBack(new_system_msg, allocator);
+            for (const auto& el : messages_const.GetArray()) {
                 rapidjson::Value el_copy;
                 el_copy.CopyFrom(el, allocator);
-                temp_array.PushBack(el_copy, allocator);
+                messages_with_system.PushBack(el_copy, allocator);
             }
-            messages_with_system.Swap(temp_array);
         }
         return messages_with_system; // This Value is allocated with 'allocator'
     }
 };
+
+// Result of chat_session::update: the new prompt is the first `keep` bytes of the previous one followed by `append`.
+struct chat_delta {
+    size_t keep = 0;
+    std::string append;
+};
+
+/*
+ * Renders a conversation that grows by appending messages, returning only what changed since the previous call.
+ *
+ * When the template has the usual shape `prefix {% for message in messages %}body{% endfor %} tail`, where the prefix
+ * only reads messages[<constant>], the body (and loop filter) never read `messages` nor the parts of `loop` that
+ * depend on its length, and the tail doesn't assign anything, the context and loop state are kept between calls
+ * and only the loop body of the new messages and the tail are rendered.
+ * Any other template, or a call where earlier messages, tools, extra_context or add_generation_prompt changed,
+ * renders the whole prompt and diffs it against the previous one.
+ *
+ * The clock seen by strftime_now is frozen at the first (full) render so that the prefix stays byte-stable.
+ * The chat_template must outlive the session.
+ */
+class chat_session {
+    const chat_template & tmpl_;
+    chat_template_options opts_;
+
+    // Static analysis of the template (see is_incremental()).
+    bool incremental_ = false;
+    std::vector<std::shared_ptr<minja::TemplateNode>> prefix_;
+    std::shared_ptr<minja::TemplateNode> loop_node_;
+    std::vector<std::shared_ptr<minja::TemplateNode>> tail_;
+    int64_t max_prefix_index_ = -1;
+
+    // State retained from the previous call.
+    bool started_ = false;
+    bool halted_ = false;  // a top-level {% break %} / {% continue %} in the prefix ended the render
+    bool stopped_ = false; // the loop hit a {% break %}
+    Document history_;     // messages (after polyfills) already rendered, plus snapshots of the other inputs
+    rapidjson::Value tools_;
+    rapidjson::Value extra_context_;
+    bool add_generation_prompt_ = false;
+    size_t start_size_ = 0;
+    std::shared_ptr<minja::Context> context_;
+    std::shared_ptr<minja::Context> loop_context_;
+    minja::Value messages_;
+    minja::Value loop_;
+    minja::Value rendered_items_; // the items of loop_, i.e. the (filtered) messages rendered so far
+    size_t iterations_ = 0;
+    std::string prompt_;
+    size_t body_end_ = 0;  // end of the rendered loop bodies in prompt_, followed by the tail
+    // Memory the polyfilled messages of each update are built in, grown to the most any update needed so far.
+    std::vector<char> scratch_;
+
+    struct usage {
+        bool messages = false;  // `messages` is read other than as messages[<constant>]
+        int64_t max_index = -1; // highest <constant> in messages[<constant>]
+        bool loop = false;      // `loop` is read other than as loop.index / index0 / first / previtem
+        bool mutates = false;   // assigns variables or calls a mutating method
+    };
+
+    static void scan(const std::shared_ptr<minja::Expression> & expr, usage & u, bool check_loop) {
+        using namespace minja;
+        if (expr->mType == Expression::Type_Variable) {
+            auto name = ((VariableExpr*)expr.get())->get_name();
+            if (name == "messages") u.messages = true;
+            if (name == "loop" && check_loop) u.loop = true;
+            return;
+        }
+        if (expr->mType == Expression::Type_Subscript) {
+            auto subscript = (SubscriptExpr*)expr.get();
+            const auto & base = subscript->get_base();
+            const auto & index = subscript->get_index();
+            if (base->mType == Expression::Type_Variable && index->mType == Expression::Type_Liter) {
+                auto name = ((VariableExpr*)base.get())->get_name();
+                const auto & key = ((LiteralExpr*)index.get())->get_value();
+                if (name == "messages" && key.is_number_integer() && key.get<int64_t>() >= 0) {
+                    u.max_index = std::max(u.max_index, key.get<int64_t>());
+                    return;
+                }
+                if (name == "loop" && key.is_string()) {
+                    auto field = key.get<std::string>();
+                    if (field == "index" || field == "index0" || field == "first" || field == "previtem") return;
+                }
+            }
+        }
+        if (expr->mType == Expression::Type_MethodCall) {
+            auto method = ((MethodCallExpr*)expr.get())->get_method_name();
+            if (method == "append" || method == "pop" || method == "insert") u.mutates = true;
+        }
+        expr->for_each_child([&](const std::shared_ptr<Expression> & child) { scan(child, u, check_loop); });
+    }
+
+    static void scan(const std::shared_ptr<minja::TemplateNode> & node, usage & u, bool check_loop) {
+        using namespace minja;
+        switch (node->mType) {
+            case TemplateNode::Type_For: {
+                // A nested loop shadows `loop` in its own body.
+                auto for_node = (ForNode*)node.get();
+                u.mutates = true;
+                scan(for_node->get_iterable(), u, check_loop);
+                if (for_node->get_condition()) scan(for_node->get_condition(), u, check_loop);
+                scan(for_node->get_body(), u, false);
+                if (for_node->get_else_body()) scan(for_node->get_else_body(), u, false);
+                return;
+            }
+            case TemplateNode::Type_Set:
+            case TemplateNode::Type_SetTemplate:
+            case TemplateNode::Type_Macro:
+                u.mutates = true;
+                break;
+            default:
+                break;
+        }
+        node->for_each_child(
+            [&](const std::shared_ptr<TemplateNode> & child) { scan(child, u, check_loop); },
+            [&](const std::shared_ptr<Expression> & child) { scan(child, u, check_loop); });
+    }
+
+    void analyse() {
+        using namespace minja;
+        const auto & root = tmpl_.template_root_;
+        std::vector<std::shared_ptr<TemplateNode>> children;
+        if (root->mType == TemplateNode::Type_Sequence) {
+            children = ((SequenceNode*)root.get())->get_children();
+        } else {
+            children.push_back(root);
+        }
+        size_t loop_pos = children.size();
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (children[i]->mType != TemplateNode::Type_For) continue;
+            const auto & iterable = ((ForNode*)children[i].get())->get_iterable();
+            if (iterable->mType == Expression::Type_Variable && ((VariableExpr*)iterable.get())->get_name() == "messages") {
+                loop_pos = i;
+                break;
+            }
+        }
+        if (loop_pos == children.size()) return;
+        auto for_node = (ForNode*)children[loop_pos].get();
+        if (for_node->is_recursive() || for_node->get_else_body()) return;
+
+        usage prefix_usage;
+        for (size_t i = 0; i < loop_pos; ++i) scan(children[i], prefix_usage, false);
+        if (prefix_usage.messages) return;
+
+        usage body_usage;
+        if (for_node->get_condition()) scan(for_node->get_condition(), body_usage, true);
+        scan(for_node->get_body(), body_usage, true);
+        if (body_usage.messages || body_usage.loop) return;
+
+        usage tail_usage;
+        for (size_t i = loop_pos + 1; i < children.size(); ++i) scan(children[i], tail_usage, false);
+        if (tail_usage.mutates) return;
+
+        prefix_.assign(children.begin(), children.begin() + loop_pos);
+        loop_node_ = children[loop_pos];
+        tail_.assign(children.begin() + loop_pos + 1, children.end());
+        max_prefix_index_ = prefix_usage.max_index;
+        incremental_ = true;
+    }
+
+    static size_t common_prefix(const std::string & a, size_t a_from, const std::string & b) {
+        size_t n = std::min(a.size() - a_from, b.size());
+        size_t i = 0;
+        while (i < n && a[a_from + i] == b[i]) ++i;
+        return i;
+    }
+
+    bool can_extend(const chat_template_inputs & inputs, const rapidjson::Value & actual_messages) const {
+        if (!started_) return false;
+        if (inputs.add_generation_prompt != add_generation_prompt_) return false;
+        if (!(inputs.tools == tools_) || !(inputs.extra_context == extra_context_)) return false;
+        if (!actual_messages.IsArray() || actual_messages.Size() < history_.Size()) return false;
+        // The prefix read a message that didn't exist yet and now does.
+        if (max_prefix_index_ >= (int64_t) start_size_ && (int64_t) actual_messages.Size() > max_prefix_index_) return false;
+        for (size_t i = 0, n = history_.Size(); i < n; ++i) {
+            if (!(actual_messages[i] == history_[i])) return false;
+        }
+        return true;
+    }
+
+    // Runs the loop body for messages_[from:], mirroring ForNode (the items are filtered first, then rendered).
+    void render_items(minja::RenderSink & out, size_t from) {
+        auto for_node = (minja::ForNode*)loop_node_.get();
+        const auto & var_names = for_node->get_var_names();
+        const auto & condition = for_node->get_condition();
+        for (size_t i = from, n = messages_.size(); i < n; ++i) {
+            auto & item = messages_.at(i);
+            minja::destructuring_assign(var_names, context_, item);
+            if (!condition || condition->evaluate(context_).to_bool()) {
+                rendered_items_.push_back(item);
+            }
+        }
+        while (!stopped_ && iterations_ < rendered_items_.size()) {
+            minja::destructuring_assign(var_names, loop_context_, rendered_items_.at(iterations_));
+            loop_.set_loop_index(iterations_);
+            auto control_type = for_node->get_body()->render(out, loop_context_);
+            ++iterations_;
+            if (control_type == minja::LoopControlType::Break) stopped_ = true;
+        }
+    }
+
+    // Renders the tail after the loop; it is read-only, so the retained context is left untouched.
+    std::string render_tail() const {
+        minja::StringSink out;
+        if (halted_) return out.take();
+        for (const auto & node : tail_) {
+            if (node->render(out, context_) != minja::LoopControlType::Normal) break;
+        }
+        return out.take();
+    }
+
+    chat_delta replace_prompt(std::string && prompt) {
+        chat_delta delta;
+        delta.keep = common_prefix(prompt_, 0, prompt);
+        delta.append = prompt.substr(delta.keep);
+        prompt_ = std::move(prompt);
+        return delta;
+    }
+
+    // Renders everything from scratch, keeping the context and loop state for the next calls.
+    chat_delta restart(const chat_template_inputs & inputs, const rapidjson::Value & actual_messages) {
+        // Start over with a fresh allocator so that repeated restarts don't keep growing the old one.
+        Document fresh_history;
+        history_.Swap(fresh_history);
+        auto & history_allocator = history_.GetAllocator();
+        // Full copies: actual_messages may borrow strings from inputs (see prepare_messages).
+        chat_template::copy_value(history_, actual_messages, history_allocator, /* borrow_strings= */ false);
+        chat_template::copy_value(tools_, inputs.tools, history_allocator, /* borrow_strings= */ false);
+        chat_template::copy_value(extra_context_, inputs.extra_context, history_allocator, /* borrow_strings= */ false);
+        add_generation_prompt_ = inputs.add_generation_prompt;
+        start_size_ = history_.Size();
+        halted_ = false;
+        stopped_ = false;
+        iterations_ = 0;
+        rendered_items_ = minja::Value::array();
+
+        context_ = tmpl_.make_context(inputs, opts_, actual_messages, /* borrow_inputs= */ false);
+        messages_ = context_->get("messages");
+        loop_ = minja::Value::loop(rendered_items_);
+        loop_context_ = ((minja::ForNode*)loop_node_.get())->make_loop_context(context_);
+        loop_context_->set("loop", loop_);
+        started_ = true;
+
+        minja::StringSink out;
+        for (const auto & node : prefix_) {
+            if (node->render(out, context_) != minja::LoopControlType::Normal) {
+                halted_ = true;
+                break;
+            }
+        }
+        if (!halted_) render_items(out, 0);
+        auto prompt = out.take();
+        body_end_ = prompt.size();
+        prompt += render_tail();
+        return replace_prompt(std::move(prompt));
+    }
+
+    // Does the work of update(), with the polyfilled messages built with allocator.
+    chat_delta update(chat_template_inputs & inputs, rapidjson::Document::AllocatorType & allocator) {
+        rapidjson::Value polyfilled_messages;
+        const auto & actual_messages = tmpl_.prepare_messages(inputs, opts_, polyfilled_messages, allocator);
+        std::optional<minja::RenderMemo::Scope> memo_scope;
+        if (opts_.memoize) memo_scope.emplace(*tmpl_.memo_, tmpl_.template_root_);
+
+        if (!incremental_) {
+            std::shared_ptr<const minja::SharedJson> tools;
+            auto context = tmpl_.make_context(inputs, opts_, actual_messages, /* borrow_inputs= */ true, &tools);
+            return replace_prompt(tmpl_.template_root_->render(context));
+        }
+        if (!can_extend(inputs, actual_messages)) {
+            return restart(inputs, actual_messages);
+        }
+
+        auto & history_allocator = history_.GetAllocator();
+        auto from = history_.Size();
+        for (size_t i = from, n = actual_messages.Size(); i < n; ++i) {
+            rapidjson::Value message;
+            chat_template::copy_value(message, actual_messages[i], history_allocator, /* borrow_strings= */ false);
+            messages_.push_back(minja::Value(message));
+            history_.PushBack(message, history_allocator);
+        }
+        minja::StringSink out;
+        if (!halted_) render_items(out, from);
+        auto bodies = out.take();
+        auto text = bodies + render_tail();
+
+        // The previous tail (e.g. the generation prompt) often starts the newly rendered text.
+        chat_delta delta;
+        delta.keep = body_end_ + common_prefix(prompt_, body_end_, text);
+        delta.append = text.substr(delta.keep - body_end_);
+        body_end_ += bodies.size();
+        prompt_.resize(delta.keep);
+        prompt_ += delta.append;
+        return delta;
+    }
+
+public:
+    chat_session(const chat_template & tmpl, const chat_template_options & opts = chat_template_options())
+        : tmpl_(tmpl), opts_(opts), history_(rapidjson::kArrayType) {
+        analyse();
+    }
+
+    // Whether appended messages are rendered incrementally (otherwise every update renders the whole prompt).
+    bool is_incremental() const { return incremental_; }
+
+    // The full prompt as of the last update.
+    const std::string & prompt() const { return prompt_; }
+
+    // Renders inputs (the whole conversation so far) and returns how it differs from the previous prompt.
+    chat_delta update(chat_template_inputs & inputs) {
+        // MemoryPoolAllocator can't take an empty buffer: until polyfills first need memory, it allocates its own.
+        // Next time it starts from the memory this one needed, once it's gone: it writes into its buffer when destroyed.
+        std::optional<rapidjson::Document::AllocatorType> allocator;
+        if (scratch_.empty()) {
+            allocator.emplace();
+        } else {
+            allocator.emplace(scratch_.data(), scratch_.size());
+        }
+        auto delta = update(inputs, *allocator);
+        auto capacity = allocator->Capacity();
+        allocator.reset();
+        if (capacity > scratch_.size()) scratch_.resize(capacity);
+        return delta;
+    }
+
+    // Forgets the previous prompt: the next update renders from scratch and returns keep == 0.
+    void reset() {
+        started_ = false;
+        prompt_.clear();
+        body_end_ = 0;
+        context_.reset();
+        loop_context_.reset();
+    }
+};
 };
@@ -9,21 +9,30 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <cmath>
+#include <cstdio>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
-#include <regex>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -33,12 +42,343 @@
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/error/en.h" // For GetParseError_En
 
+// Vectorized byte scanning (see find_first_of_bytes), unless MINJA_NO_SIMD is defined.
+#ifndef MINJA_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MINJA_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define MINJA_NEON
+#endif
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 static void _printlog(const std::string& i) {
     printf("%s\n", i.c_str());
 }
 
 
 namespace minja {
+
+/* Raw memory for RenderMemory to hand out (e.g. an Arena); `deallocate` gets the size & alignment given to `allocate`. */
+class MemoryResource {
+public:
+    virtual ~MemoryResource() = default;
+    virtual void * allocate(size_t size, size_t alignment) = 0;
+    virtual void deallocate(void * ptr, size_t size, size_t alignment) = 0;
+};
+
+/**
+ * Where the values & contexts made on a thread while a RenderMemory::Scope is active come from: the arrays, objects,
+ * callables, loops & long strings of Value (their shared state and the elements of arrays & objects), and the
+ * Contexts of Context::make, for loops & macro calls. Allocates from `resource` if given (a per-render Arena frees
+ * them all in one go), otherwise from the heap, counting allocations & bytes either way.
+ *
+ * Whatever is allocated keeps the RenderMemory (and its resource) alive, so values may outlive the scope; they are
+ * then freed wherever their last copy goes, so a resource they are shared from across threads must be thread-safe
+ * (an Arena's deallocate is a no-op). An Arena's allocate isn't: copying an array or object allocates from the
+ * memory it came from, so don't share the values made in an Arena's scope with other threads while it's active.
+ * String & std::function buffers, object keys, the argument lists of calls (ArgumentsValue) and AST nodes stay on
+ * the heap, and so do the builtins.
+ */
+class RenderMemory : public std::enable_shared_from_this<RenderMemory> {
+    std::shared_ptr<MemoryResource> resource_;
+    std::atomic<size_t> allocations_{0};
+    std::atomic<size_t> total_bytes_{0};
+    std::atomic<size_t> live_bytes_{0};
+    std::atomic<size_t> peak_bytes_{0};
+
+public:
+    struct Stats {
+        size_t allocations = 0;
+        size_t total_bytes = 0;  // Allocated, freed or not.
+        size_t live_bytes = 0;
+        size_t peak_bytes = 0;  // The most live_bytes got to.
+    };
+
+    explicit RenderMemory(std::shared_ptr<MemoryResource> resource = nullptr) : resource_(std::move(resource)) {}
+    RenderMemory(const RenderMemory &) = delete;
+    RenderMemory & operator=(const RenderMemory &) = delete;
+
+    /* Makes the values & contexts made on the current thread come from `memory` until destroyed (from the heap if null). */
+    class Scope {
+        std::shared_ptr<RenderMemory> memory_;
+        RenderMemory * previous_;
+    public:
+        explicit Scope(std::shared_ptr<RenderMemory> memory) : memory_(std::move(memory)), previous_(current()) { current() = memory_.get(); }
+        ~Scope() { current() = previous_; }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+    };
+
+    static RenderMemory *& current() {
+        static thread_local RenderMemory * memory = nullptr;
+        return memory;
+    }
+
+    void * allocate(size_t size, size_t alignment) {
+        void * ptr = resource_ ? resource_->allocate(size, alignment) : ::operator new(size);
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+        total_bytes_.fetch_add(size, std::memory_order_relaxed);
+        auto live = live_bytes_.fetch_add(size, std::memory_order_relaxed) + size;
+        auto peak = peak_bytes_.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes_.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+        return ptr;
+    }
+    void deallocate(void * ptr, size_t size, size_t alignment) {
+        live_bytes_.fetch_sub(size, std::memory_order_relaxed);
+        if (resource_) {
+            resource_->deallocate(ptr, size, alignment);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    Stats stats() const {
+        Stats stats;
+        stats.allocations = allocations_.load(std::memory_order_relaxed);
+        stats.total_bytes = total_bytes_.load(std::memory_order_relaxed);
+        stats.live_bytes = live_bytes_.load(std::memory_order_relaxed);
+        stats.peak_bytes = peak_bytes_.load(std::memory_order_relaxed);
+        return stats;
+    }
+    /* Starts counting afresh (e.g. between the renders sharing this memory), from the bytes still live. */
+    void reset_stats() {
+        allocations_ = 0;
+        total_bytes_ = 0;
+        peak_bytes_ = live_bytes_.load();
+    }
+};
+
+/* Allocates from the RenderMemory that was current when the allocator was made (from the heap if none). */
+template <typename T>
+class RenderAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    std::shared_ptr<RenderMemory> memory;
+
+    RenderAllocator() {
+        if (auto current = RenderMemory::current()) memory = current->shared_from_this();
+    }
+    template <typename U>
+    RenderAllocator(const RenderAllocator<U> & other) : memory(other.memory) {}
+
+    T * allocate(size_t n) {
+        if (memory) return static_cast<T *>(memory->allocate(n * sizeof(T), alignof(T)));
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T * ptr, size_t n) {
+        if (memory) {
+            memory->deallocate(ptr, n * sizeof(T), alignof(T));
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const RenderAllocator<U> & other) const { return memory == other.memory; }
+    template <typename U>
+    bool operator!=(const RenderAllocator<U> & other) const { return memory != other.memory; }
+};
+
+/* Makes a value's or context's shared state, from the current RenderMemory if any. */
+template <typename T, typename... Args>
+static std::shared_ptr<T> make_render_shared(Args &&... args) {
+    if (RenderMemory::current()) return std::allocate_shared<T>(RenderAllocator<T>(), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+/**
+ * Limits on what the renders made on a thread while a RenderBudget::Scope is active may do: loop iterations (and,
+ * counted apart against the same limit, the items added to the lists built, e.g. by range(), `+`, map or select),
+ * nesting of macro calls & recursive loop() calls, bytes written to the output (what macro calls, filter & set
+ * blocks render is only counted once printed, but no string may grow longer either) and wall-clock time. Past any of
+ * them the render stops early: nodes render nothing, expressions evaluate to none and loops end, so it unwinds right
+ * away with the output it had, and exceeded() / error() tell which limit it hit. Outside of a scope the checks only
+ * read a thread-local pointer. Like the Context of a render, one budget is only used by one render (one thread) at
+ * a time.
+ */
+class RenderBudget {
+public:
+    struct Limits {
+        // 0 (or a zero timeout) means no limit.
+        size_t max_iterations = 0;
+        size_t max_depth = 0;
+        size_t max_output_bytes = 0;
+        std::chrono::steady_clock::duration timeout = std::chrono::steady_clock::duration::zero();
+    };
+    enum Exceeded {
+        Exceeded_None = 0,
+        Exceeded_Iterations,
+        Exceeded_Depth,
+        Exceeded_Output,
+        Exceeded_Deadline,
+        Exceeded_Items,
+    };
+
+    /* The timeout runs from here. */
+    explicit RenderBudget(const Limits & limits) : limits_(limits) {
+        if (limits_.timeout != std::chrono::steady_clock::duration::zero()) {
+            deadline_ = std::chrono::steady_clock::now() + limits_.timeout;
+        }
+    }
+    RenderBudget(const RenderBudget &) = delete;
+    RenderBudget & operator=(const RenderBudget &) = delete;
+
+    /* Makes the renders of the current thread count against `budget` until destroyed. */
+    class Scope {
+        RenderBudget * previous_;
+    public:
+        explicit Scope(RenderBudget & budget) : previous_(current()) { current() = &budget; }
+        ~Scope() { current() = previous_; }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+    };
+
+    /* One nested macro call or recursive loop() call, from construction to destruction: the call is skipped unless ok(). */
+    class Call {
+        RenderBudget * budget_;
+    public:
+        Call() : budget_(current()) {
+            if (budget_ && ++budget_->depth_ > budget_->limits_.max_depth && budget_->limits_.max_depth) budget_->exceed(Exceeded_Depth);
+        }
+        ~Call() { if (budget_) budget_->depth_--; }
+        Call(const Call &) = delete;
+        Call & operator=(const Call &) = delete;
+        bool ok() const { return !budget_ || !budget_->exceeded(); }
+    };
+
+    /*
+     * Rendering into a string rather than the output (a macro call, filter or set block), from construction to
+     * destruction: what is written meanwhile only counts against the length of that string.
+     */
+    class Capture {
+        RenderBudget * budget_;
+        size_t outer_bytes_ = 0;
+        bool outer_capturing_ = false;
+    public:
+        Capture() : budget_(current()) {
+            if (!budget_) return;
+            outer_bytes_ = budget_->captured_bytes_;
+            outer_capturing_ = budget_->capturing_;
+            budget_->captured_bytes_ = 0;
+            budget_->capturing_ = true;
+        }
+        ~Capture() {
+            if (!budget_) return;
+            budget_->captured_bytes_ = outer_bytes_;
+            budget_->capturing_ = outer_capturing_;
+        }
+        Capture(const Capture &) = delete;
+        Capture & operator=(const Capture &) = delete;
+    };
+
+    static RenderBudget *& current() {
+        static thread_local RenderBudget * budget = nullptr;
+        return budget;
+    }
+
+    /* Whether rendering may go on; checks the deadline every so often. */
+    bool poll() {
+        if (exceeded_) return false;
+        if (deadline_ != std::chrono::steady_clock::time_point() && (++polls_ & 255) == 0 && std::chrono::steady_clock::now() > deadline_) {
+            exceed(Exceeded_Deadline);
+        }
+        return !exceeded_;
+    }
+    bool count_iterations(size_t n) {
+        iterations_ += n;
+        if (limits_.max_iterations && iterations_ > limits_.max_iterations) exceed(Exceeded_Iterations);
+        return poll();
+    }
+    bool count_output(size_t bytes) {
+        auto & total = capturing_ ? captured_bytes_ : output_bytes_;
+        total += bytes;
+        if (limits_.max_output_bytes && total > limits_.max_output_bytes) exceed(Exceeded_Output);
+        return !exceeded_;
+    }
+    bool count_items(size_t n) {
+        items_ += n;
+        if (limits_.max_iterations && items_ > limits_.max_iterations) exceed(Exceeded_Items);
+        return !exceeded_;
+    }
+    /* Whether `n` more list items may be built (before building them, which counts them). */
+    bool check_items(size_t n) {
+        if (limits_.max_iterations && n > limits_.max_iterations - std::min(items_, limits_.max_iterations)) exceed(Exceeded_Items);
+        return !exceeded_;
+    }
+    /* Whether a string of `bytes` may be built. */
+    bool check_size(size_t bytes) {
+        if (limits_.max_output_bytes && bytes > limits_.max_output_bytes) exceed(Exceeded_Output);
+        return !exceeded_;
+    }
+
+    /* The null-safe forms of the above, for the current budget. */
+    static bool allow_iterations(size_t n) {
+        auto budget = current();
+        return !budget || budget->count_iterations(n);
+    }
+    static bool allow_output(size_t bytes) {
+        auto budget = current();
+        return !budget || budget->count_output(bytes);
+    }
+    static bool allow_size(size_t bytes) {
+        auto budget = current();
+        return !budget || budget->check_size(bytes);
+    }
+    static bool allow_items(size_t n) {
+        auto budget = current();
+        return !budget || budget->count_items(n);
+    }
+    static bool allow_more_items(size_t n) {
+        auto budget = current();
+        return !budget || budget->check_items(n);
+    }
+
+    bool exceeded() const { return exceeded_ != Exceeded_None; }
+    /* The first limit that was exceeded. */
+    Exceeded reason() const { return exceeded_; }
+    /* What went over, or an empty string. */
+    std::string error() const {
+        switch (exceeded_) {
+            case Exceeded_Iterations: return "Render budget exceeded: more than " + std::to_string(limits_.max_iterations) + " loop iterations";
+            case Exceeded_Depth: return "Render budget exceeded: calls nested more than " + std::to_string(limits_.max_depth) + " deep";
+            case Exceeded_Output: return "Render budget exceeded: more than " + std::to_string(limits_.max_output_bytes) + " bytes of output";
+            case Exceeded_Deadline: return "Render budget exceeded: past the deadline";
+            case Exceeded_Items: return "Render budget exceeded: more than " + std::to_string(limits_.max_iterations) + " list items built";
+            default: return "";
+        }
+    }
+    size_t iterations() const { return iterations_; }
+    size_t items() const { return items_; }
+    /* The bytes written to the output (not into macro calls, filter & set blocks). */
+    size_t output_bytes() const { return output_bytes_; }
+
+private:
+    Limits limits_;
+    std::chrono::steady_clock::time_point deadline_;
+    Exceeded exceeded_ = Exceeded_None;
+    size_t iterations_ = 0;
+    size_t items_ = 0;
+    size_t depth_ = 0;
+    size_t output_bytes_ = 0;
+    size_t captured_bytes_ = 0;  // Written into the innermost Capture
+    bool capturing_ = false;
+    uint32_t polls_ = 0;
+
+    void exceed(Exceeded reason) {
+        if (exceeded_) return;
+        exceeded_ = reason;
+        _printlog(error());
+    }
+};
+
 enum ObjectType {
     JSON_NULL = 0,
     JSON_INT64 = 1,
@@ -48,48 +388,88 @@ enum ObjectType {
 };
 class json {
 public:
+    // Strings up to this size are stored inline, longer ones are shared between copies (or borrowed).
+    static constexpr size_t kInlineSize = 16;
+
     ObjectType mType;
-    std::string mString;
-    int64_t mInt;
-    double mDouble;
-    bool mBool;
-    json() {
-        mType = JSON_NULL;
-    }
-    json(bool v) {
+    size_t mSize; // String length
+    // Scalars and string storage overlap, so that copying a primitive never allocates.
+    union {
+        int64_t mInt;
+        double mDouble;
+        bool mBool;
+        char mInline[kInlineSize];
+        const char * mChars; // Into *mString, or into borrowed memory if mString is null
+    };
+    std::shared_ptr<std::string> mString;
+    json() : mType(JSON_NULL), mSize(0), mInt(0) {}
+    json(bool v) : mType(JSON_BOOL), mSize(0), mInt(0) {
         mBool = v;
-        mType = JSON_BOOL;
-    }
-    json(int64_t v) {
-        mInt = v;
-        mType = JSON_INT64;
     }
-    json(double v) {
-        mDouble = v;
-        mType = JSON_DOUBLE;
+    json(int64_t v) : mType(JSON_INT64), mSize(0), mInt(v) {}
+    json(double v) : mType(JSON_DOUBLE), mSize(0), mDouble(v) {}
+    json(std::string v) : mType(JSON_STRING), mSize(v.size()), mInt(0) {
+        if (mSize <= kInlineSize) {
+            memcpy(mInline, v.data(), mSize);
+        } else {
+            RenderBudget::allow_size(mSize);
+            mString = make_render_shared<std::string>(std::move(v));
+            mChars = mString->data();
+        }
     }
-    json(std::string v) {
-        mString = v;
-        mType = JSON_STRING;
+    json(const char* c, size_t len) : mType(JSON_STRING), mSize(len), mInt(0) {
+        if (mSize <= kInlineSize) {
+            if (mSize) memcpy(mInline, c, mSize);
+        } else {
+            RenderBudget::allow_size(mSize);
+            mString = make_render_shared<std::string>(c, len);
+            mChars = mString->data();
+        }
     }
-    json(const char* c, size_t len) {
-        mString.assign(c, len);
-        mType = JSON_STRING;
+    /* A string that points to `c` without copying it: `c` must outlive the json and its copies. */
+    static json borrow(const char* c, size_t len) {
+        if (len <= kInlineSize) return json(c, len);
+        json result;
+        result.mType = JSON_STRING;
+        result.mSize = len;
+        result.mChars = c;
+        return result;
     }
-    json(const json& right) {
-        mType = right.mType;
-        mInt = right.mInt;
-        mBool = right.mBool;
-        mDouble = right.mDouble;
-        mString = right.mString;
+    /*
+     * Appends `s` to this string: in place when no other json shares its buffer (so that building a string piece by
+     * piece is linear), otherwise into a buffer of its own with room to grow.
+     */
+    void append(std::string_view s) {
+        auto size = mSize + s.size();
+        if (size <= kInlineSize) {
+            memcpy(mInline + mSize, s.data(), s.size());
+            mSize = size;
+            return;
+        }
+        RenderBudget::allow_size(size);
+        if (mString && mString.use_count() == 1) {
+            mString->append(s);
+            mChars = mString->data();
+        } else {
+            auto buffer = make_render_shared<std::string>();
+            buffer->reserve(size * 2);
+            buffer->append(str()).append(s);
+            mString = std::move(buffer);
+            mChars = mString->data();
+        }
+        mSize = size;
     }
+    json(const json& right) = default;
+    json(json&& right) = default;
+    json& operator=(const json& right) = default;
+    json& operator=(json&& right) = default;
     bool operator==(const json& right) const {
         if (mType != right.mType) {
             return false;
         }
         switch (mType) {
             case JSON_STRING:
-                return mString == right.mString;
+                return str() == right.str();
             case JSON_INT64:
                 return mInt == right.mInt;
             case JSON_DOUBLE:
@@ -109,32 +489,66 @@ public:
     bool is_number_integer() const { return mType == JSON_INT64; }
     bool is_number_float() const { return mType == JSON_DOUBLE; }
     bool is_number() const { return mType == JSON_DOUBLE || mType == JSON_INT64; }
+    /* The string value, or an empty string if this isn't a string. */
+    std::string_view str() const {
+        if (mType != JSON_STRING) return std::string_view();
+        return std::string_view(mSize <= kInlineSize ? mInline : mChars, mSize);
+    }
     bool empty() const {
-        return mString.empty();
+        return str().empty();
+    }
+    /* A hash consistent with operator== (which never equates different types). */
+    size_t hash() const {
+        size_t h;
+        switch (mType) {
+            case JSON_STRING: h = std::hash<std::string_view>()(str()); break;
+            case JSON_INT64: h = std::hash<int64_t>()(mInt); break;
+            case JSON_DOUBLE: h = mDouble == 0 ? 0 : std::hash<double>()(mDouble); break;  // 0.0 == -0.0
+            case JSON_BOOL: h = mBool; break;
+            default: h = 0; break;
+        }
+        return h ^ ((size_t) mType * 0x9e3779b97f4a7c15ull);
     }
     bool get(bool& ) const {
-        return mBool;
+        switch (mType) {
+            case JSON_BOOL: return mBool;
+            case JSON_INT64: return mInt != 0;
+            case JSON_DOUBLE: return mDouble != 0;
+            default: return false;
+        }
     }
     std::string get(std::string& ) const {
-        return mString;
+        return std::string(str());
     }
     int64_t get(int64_t& ) const {
-        return mInt;
+        switch (mType) {
+            case JSON_INT64: return mInt;
+            case JSON_DOUBLE: return static_cast<int64_t>(mDouble);
+            case JSON_BOOL: return mBool ? 1 : 0;
+            default: return 0;
+        }
     }
     int get(int& ) const {
-        return mInt;
+        int64_t v;
+        return static_cast<int>(get(v));
     }
     float get(float&) const {
-        return mDouble;
+        double v;
+        return static_cast<float>(get(v));
     }
     double get(double& ) const {
-        return mDouble;
+        switch (mType) {
+            case JSON_DOUBLE: return mDouble;
+            case JSON_INT64: return static_cast<double>(mInt);
+            case JSON_BOOL: return mBool ? 1 : 0;
+            default: return 0;
+        }
     }
 
     std::string dump() const {
         switch (mType) {
             case JSON_STRING:
-                return mString;
+                return std::string(str());
             case JSON_INT64:
                 return std::to_string(mInt);
             case JSON_DOUBLE:
@@ -146,6 +560,23 @@ public:
         }
         return "null";
     }
+    /* Same as dump(), appended to `out`. */
+    void dump(std::string & out) const {
+        switch (mType) {
+            case JSON_STRING:
+                out.append(str());
+                break;
+            case JSON_INT64: {
+                char buffer[24];
+                auto end = std::to_chars(buffer, buffer + sizeof(buffer), mInt).ptr;
+                out.append(buffer, end - buffer);
+                break;
+            }
+            default:
+                out.append(dump());
+                break;
+        }
+    }
 };
 
 class Context;
@@ -154,103 +585,493 @@ struct Options {
     bool trim_blocks;  // removes the first newline after a block
     bool lstrip_blocks;  // removes leading whitespace on the line of the block
     bool keep_trailing_newline;  // don't remove last newline
+    bool optimize = false;  // fold constants, drop dead branches & merge text after parsing (see TemplateOptimizer)
 };
 
 struct ArgumentsValue;
 
 inline std::string normalize_newlines(const std::string & s) {
 #ifdef _WIN32
-  static const std::regex nl_regex("\r\n");
-  return std::regex_replace(s, nl_regex, "\n");
+  std::string result;
+  result.reserve(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\r' && i + 1 < s.size() && s[i + 1] == '\n') continue;
+    result += s[i];
+  }
+  return result;
 #else
   return s;
 #endif
 }
 
+inline int count_trailing_zeros(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return (int) index;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+/* The first `c` in [p, end), or end (with memchr, which the C library vectorizes). */
+inline const char * find_byte(const char * p, const char * end, char c) {
+  auto found = p == end ? nullptr : static_cast<const char *>(std::memchr(p, c, end - p));
+  return found ? found : end;
+}
+
+/*
+ * The first byte in [p, end) that's one of `bytes`, or end. Up to 8 bytes are looked for 16 input bytes at a time,
+ * with SSE2 or NEON.
+ */
+inline const char * find_first_of_bytes(const char * p, const char * end, std::string_view bytes) {
+  if (bytes.size() == 1) return find_byte(p, end, bytes[0]);
+#if defined(MINJA_SSE2)
+  if (bytes.size() <= 8) {
+    __m128i wanted[8];
+    for (size_t i = 0; i < bytes.size(); ++i) wanted[i] = _mm_set1_epi8(bytes[i]);
+    for (; end - p >= 16; p += 16) {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      auto found = _mm_cmpeq_epi8(chunk, wanted[0]);
+      for (size_t i = 1; i < bytes.size(); ++i) found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, wanted[i]));
+      if (auto mask = _mm_movemask_epi8(found)) return p + count_trailing_zeros((uint64_t) mask);
+    }
+  }
+#elif defined(MINJA_NEON)
+  if (bytes.size() <= 8) {
+    uint8x16_t wanted[8];
+    for (size_t i = 0; i < bytes.size(); ++i) wanted[i] = vdupq_n_u8((uint8_t) bytes[i]);
+    for (; end - p >= 16; p += 16) {
+      auto chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+      auto found = vceqq_u8(chunk, wanted[0]);
+      for (size_t i = 1; i < bytes.size(); ++i) found = vorrq_u8(found, vceqq_u8(chunk, wanted[i]));
+      // 4 bits per byte of the chunk.
+      auto mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+      if (mask) return p + (count_trailing_zeros(mask) >> 2);
+    }
+  }
+#endif
+  for (; p != end; ++p) {
+    if (bytes.find(*p) != std::string_view::npos) return p;
+  }
+  return end;
+}
+
+/*
+ * An immutable copy of a rapidjson value whose arrays & objects remember how they were dumped (e.g. by `tools | tojson`),
+ * so that values borrowed from it (see Value::borrow) only serialize each of them once with given settings, across all
+ * the renders that borrow it. Can be shared by concurrent renders.
+ */
+class SharedJson {
+public:
+  explicit SharedJson(const rapidjson::Value & v) {
+    doc_.CopyFrom(v, doc_.GetAllocator());
+  }
+  SharedJson(const SharedJson &) = delete;
+  SharedJson & operator=(const SharedJson &) = delete;
+
+  const rapidjson::Value & get() const { return doc_; }
+
+  /* Appends the dump of `v` (in this document) made with these settings to `out` if there's one already. */
+  bool find_dump(const rapidjson::Value * v, int indent, int level, bool to_json, std::string & out) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = dumps_.find(DumpKey(v, indent, level, to_json));
+    if (it == dumps_.end()) return false;
+    out.append(it->second);
+    return true;
+  }
+  void add_dump(const rapidjson::Value * v, int indent, int level, bool to_json, std::string_view dump) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dumps_.emplace(DumpKey(v, indent, level, to_json), std::string(dump));
+  }
+
+private:
+  using DumpKey = std::tuple<const rapidjson::Value *, int, int, bool>;
+
+  rapidjson::Document doc_;
+  mutable std::mutex mutex_;
+  mutable std::map<DumpKey, std::string> dumps_;
+};
+
+/*
+ * A keyed 128-bit hash (SipHash-2-4-128) of what's added to it, e.g. values (see Value::fingerprint). With a secret
+ * random key, different inputs only get the same digest by chance (1 in 2^128), even when chosen to collide.
+ */
+class Fingerprint {
+public:
+  using Digest = std::pair<uint64_t, uint64_t>;
+
+  Fingerprint(uint64_t k0, uint64_t k1)
+    : k0_(k0), k1_(k1),
+      v0_(k0 ^ 0x736f6d6570736575ull), v1_(k1 ^ 0x646f72616e646f6dull ^ 0xee),
+      v2_(k0 ^ 0x6c7967656e657261ull), v3_(k1 ^ 0x7465646279746573ull) {}
+  /* A new fingerprint with the same key, e.g. for a part whose digest is added to this one. */
+  Fingerprint fork() const { return Fingerprint(k0_, k1_); }
+
+  void add(const void * data, size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    size_ += size;
+    for (; size && tail_size_; --size) add_tail(*bytes++);
+    for (; size >= 8; size -= 8, bytes += 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes, 8);
+      compress(word);
+    }
+    for (; size; --size) add_tail(*bytes++);
+  }
+  void add(char tag) { add(&tag, 1); }
+  void add(uint64_t n) { add(&n, sizeof(n)); }
+  void add(std::string_view s) {
+    add((uint64_t) s.size());
+    add(s.data(), s.size());
+  }
+  void add(const Digest & digest) {
+    add(digest.first);
+    add(digest.second);
+  }
+
+  Digest digest() const {
+    auto copy = *this;
+    auto last = ((uint64_t) size_ << 56) | copy.tail_;
+    copy.compress(last);
+    copy.v2_ ^= 0xee;
+    for (int i = 0; i < 4; ++i) copy.round();
+    auto first = copy.v0_ ^ copy.v1_ ^ copy.v2_ ^ copy.v3_;
+    copy.v1_ ^= 0xdd;
+    for (int i = 0; i < 4; ++i) copy.round();
+    return {first, copy.v0_ ^ copy.v1_ ^ copy.v2_ ^ copy.v3_};
+  }
+
+private:
+  uint64_t k0_, k1_;
+  uint64_t v0_, v1_, v2_, v3_;
+  uint64_t tail_ = 0;  // The last size_ % 8 bytes, little-endian
+  size_t tail_size_ = 0;
+  size_t size_ = 0;
+
+  static uint64_t rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+  void round() {
+    v0_ += v1_; v1_ = rotl(v1_, 13); v1_ ^= v0_; v0_ = rotl(v0_, 32);
+    v2_ += v3_; v3_ = rotl(v3_, 16); v3_ ^= v2_;
+    v0_ += v3_; v3_ = rotl(v3_, 21); v3_ ^= v0_;
+    v2_ += v1_; v1_ = rotl(v1_, 17); v1_ ^= v2_; v2_ = rotl(v2_, 32);
+  }
+  void compress(uint64_t word) {
+    v3_ ^= word;
+    round();
+    round();
+    v0_ ^= word;
+  }
+  void add_tail(unsigned char byte) {
+    tail_ |= (uint64_t) byte << (8 * tail_size_);
+    if (++tail_size_ == 8) {
+      compress(tail_);
+      tail_ = 0;
+      tail_size_ = 0;
+    }
+  }
+};
+
+/* The digests of borrowed arrays & objects already fingerprinted (see Value::fingerprint), by address. */
+using FingerprintCache = std::unordered_map<const rapidjson::Value *, Fingerprint::Digest>;
+
 /* Values that behave roughly like in Python. */
-class Value : public std::enable_shared_from_this<Value> {
+class Value {
 public:
   using CallableType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
   using FilterType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
 
 private:
-  using ObjectType = std::map<std::string, Value>;  // Only contains primitive keys
-  using ArrayType = std::vector<Value>;
+  // Only contains primitive keys; looked up by string_view
+  using ObjectType = std::map<std::string, Value, std::less<>, RenderAllocator<std::pair<const std::string, Value>>>;
+  using ArrayType = std::vector<Value, RenderAllocator<Value>>;
+
+  // A borrowed rapidjson array / object (see Value::borrow), shared by all the copies of the value so
+  // that materializing it (e.g. before a mutation) is seen by all of them.
+  struct Borrowed {
+    const rapidjson::Value * source;
+    const SharedJson * shared = nullptr;  // The document source is in, if it caches dumps
+    std::shared_ptr<ArrayType> array;
+    std::shared_ptr<ObjectType> object;
+  };
+
+  // The state of a for loop's `loop` object (see Value::loop): its position-dependent attributes are computed
+  // from the index on access instead of being stored in (and updated in) the object at each iteration.
+  struct Loop {
+    std::shared_ptr<ArrayType> items;
+    size_t index = 0;
+  };
 
-  std::shared_ptr<ArrayType> array_;
-  std::shared_ptr<ObjectType> object_;
+  // Mutable so that const accessors can materialize borrowed values on demand.
+  mutable std::shared_ptr<ArrayType> array_;
+  mutable std::shared_ptr<ObjectType> object_;
   std::shared_ptr<CallableType> callable_;
   json primitive_;
+  mutable std::shared_ptr<Borrowed> borrowed_;
+  std::shared_ptr<Loop> loop_;
+
+  /* The borrowed rapidjson value if this is a view that nobody materialized yet, nullptr otherwise. */
+  const rapidjson::Value * view() const {
+    if (!borrowed_) return nullptr;
+    if (borrowed_->array || borrowed_->object) {
+      array_ = borrowed_->array;
+      object_ = borrowed_->object;
+      borrowed_.reset();
+      return nullptr;
+    }
+    return borrowed_->source;
+  }
+  /* Turns one level of a borrowed view into regular containers (elements stay borrowed views). */
+  void materialize() const {
+    if (loop_) {
+      sync_loop();
+      return;
+    }
+    auto source = view();
+    if (!source) return;
+    if (source->IsArray()) {
+      auto array = make_render_shared<ArrayType>();
+      array->reserve(source->Size());
+      for (const auto & item : source->GetArray()) {
+        array->push_back(borrow(item, borrowed_->shared));
+      }
+      borrowed_->array = std::move(array);
+    } else {
+      auto object = make_render_shared<ObjectType>();
+      for (const auto & it : source->GetObject()) {
+        (*object)[std::string(it.name.GetString(), it.name.GetStringLength())] = borrow(it.value, borrowed_->shared);
+      }
+      borrowed_->object = std::move(object);
+    }
+    view();
+  }
+
+  /* The entry of the primitive `key` (matched by its string form, like all keys) in object_, or end(). */
+  ObjectType::iterator find_key(const Value & key) const {
+    if (key.primitive_.is_string()) return object_->find(key.primitive_.str());
+    return object_->find(key.primitive_.dump());
+  }
+
+  static bool is_loop_attribute(std::string_view name) {
+    static const char * names[] = {"index", "index0", "revindex", "revindex0", "first", "last", "length", "previtem", "nextitem", "cycle"};
+    for (auto n : names) {
+      if (name == n) return true;
+    }
+    return false;
+  }
+  /* Computes the attribute `name` of a loop object (see is_loop_attribute), except `cycle`. */
+  Value loop_attribute(std::string_view name) const {
+    auto i = loop_->index;
+    auto n = loop_->items->size();
+    if (name == "index") return (int64_t) i + 1;
+    if (name == "index0") return (int64_t) i;
+    if (name == "revindex") return (int64_t) (n - i);
+    if (name == "revindex0") return (int64_t) (n - i - 1);
+    if (name == "first") return i == 0;
+    if (name == "last") return i + 1 == n;
+    if (name == "length") return (int64_t) n;
+    if (name == "previtem") return i > 0 ? (*loop_->items)[i - 1] : Value();
+    if (name == "nextitem") return i + 1 < n ? (*loop_->items)[i + 1] : Value();
+    return Value();
+  }
+  /* Stores the current attributes of a loop object into it, for the rare uses that need it as a whole (e.g. dump, items). */
+  void sync_loop() const {
+    for (auto name : {"index", "index0", "revindex", "revindex0", "first", "last", "length", "previtem", "nextitem"}) {
+      (*object_)[name] = loop_attribute(name);
+    }
+    auto & cycle = (*object_)["cycle"];
+    if (!cycle.is_callable()) {
+      auto loop = loop_;
+      cycle = callable([loop](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+        return loop_cycle(*loop, args);
+      });
+    }
+  }
+  static inline Value loop_cycle(const Loop & loop, ArgumentsValue & args);
 
   Value(const std::shared_ptr<ArrayType> & array) : array_(array) {}
   Value(const std::shared_ptr<ObjectType> & object) : object_(object) {}
-  Value(const std::shared_ptr<CallableType> & callable) : object_(std::make_shared<ObjectType>()), callable_(callable) {}
+  Value(const std::shared_ptr<CallableType> & callable) : object_(make_render_shared<ObjectType>()), callable_(callable) {}
 
   /* Python-style string repr */
-  static void dump_string(const std::string& s, std::ostringstream & out, char string_quote = '\'') {
-    if (string_quote == '"' || s.find('\'') != std::string::npos) {
-      out << s;
+  static void dump_string(std::string_view s, std::string & out, char string_quote = '\'') {
+    if (string_quote == '"' || s.find('\'') != std::string_view::npos) {
+      out.append(s);
       return;
     }
     // Reuse json dump, just changing string quotes
-    out << string_quote;
-    for (size_t i = 1, n = s.size() - 1; i < n; ++i) {
-      if (s[i] == '\\' && s[i + 1] == '"') {
-        out << '"';
-        i++;
-      } else if (s[i] == string_quote) {
-        out << '\\' << string_quote;
+    out += string_quote;
+    const char special[] = {'\\', string_quote};
+    for (auto p = s.data() + 1, end = s.data() + s.size() - 1; p < end; ++p) {
+      auto next = find_first_of_bytes(p, end, std::string_view(special, 2));
+      out.append(p, next - p);
+      if (next == end) break;
+      p = next;
+      if (*p == '\\' && p[1] == '"') {
+        out += '"';
+        p++;
+      } else if (*p == string_quote) {
+        out += '\\';
+        out += string_quote;
       } else {
-        out << s[i];
+        out += *p;
       }
     }
-    out << string_quote;
+    out += string_quote;
+  }
+  static void dump_indent(std::string & out, int indent, int level) {
+    if (indent > 0) {
+      out += '\n';
+      out.append((size_t) level * indent, ' ');
+    }
+  }
+  static void dump_separator(std::string & out, int indent, int level) {
+    out += ',';
+    if (indent < 0) out += ' ';
+    else dump_indent(out, indent, level + 1);
+  }
+  /* The members of a rapidjson object in the (sorted) key order of materialized objects, the last duplicate winning. */
+  static void sorted_members(const rapidjson::Value & v, std::vector<const rapidjson::Value::Member *> & members) {
+    auto key = [](const rapidjson::Value::Member * m) { return std::string_view(m->name.GetString(), m->name.GetStringLength()); };
+    members.reserve(v.MemberCount());
+    for (auto it = v.MemberBegin(); it != v.MemberEnd(); ++it) members.push_back(&*it);
+    std::stable_sort(members.begin(), members.end(), [&](const rapidjson::Value::Member * a, const rapidjson::Value::Member * b) { return key(a) < key(b); });
+    size_t kept = 0;
+    for (size_t i = 0; i < members.size(); ++i) {
+      if (i + 1 < members.size() && key(members[i]) == key(members[i + 1])) continue;
+      members[kept++] = members[i];
+    }
+    members.resize(kept);
   }
-  void dump(std::ostringstream & out, int indent = -1, int level = 0, bool to_json = false) const {
-    auto print_indent = [&](int level) {
-      if (indent > 0) {
-          out << "\n";
-          for (int i = 0, n = level * indent; i < n; ++i) out << ' ';
+  /* Dumps a borrowed rapidjson value the way dump() does its Value (see Value::borrow), without making one. */
+  static void dump_json(const rapidjson::Value & v, std::string & out, int indent, int level, bool to_json) {
+    auto string_quote = to_json ? '"' : '\'';
+    if (v.IsArray()) {
+      out += '[';
+      dump_indent(out, indent, level + 1);
+      for (rapidjson::SizeType i = 0; i < v.Size(); ++i) {
+        if (i) dump_separator(out, indent, level);
+        dump_json(v[i], out, indent, level + 1, to_json);
       }
-    };
-    auto print_sub_sep = [&]() {
-      out << ',';
-      if (indent < 0) out << ' ';
-      else print_indent(level + 1);
-    };
+      dump_indent(out, indent, level);
+      out += ']';
+    } else if (v.IsObject()) {
+      std::vector<const rapidjson::Value::Member *> members;
+      sorted_members(v, members);
+      out += '{';
+      dump_indent(out, indent, level + 1);
+      for (size_t i = 0; i < members.size(); ++i) {
+        if (i) dump_separator(out, indent, level);
+        dump_string(std::string_view(members[i]->name.GetString(), members[i]->name.GetStringLength()), out, string_quote);
+        out.append(": ");
+        dump_json(members[i]->value, out, indent, level + 1, to_json);
+      }
+      dump_indent(out, indent, level);
+      out += '}';
+    } else if (v.IsString()) {
+      auto s = std::string_view(v.GetString(), v.GetStringLength());
+      if (to_json) out.append(s);
+      else dump_string(s, out, string_quote);
+    } else {
+      Value(v).dump(out, indent, level, to_json);
+    }
+  }
+  /* Fingerprints a borrowed rapidjson value the way fingerprint() does its Value. */
+  static void fingerprint_json(const rapidjson::Value & v, Fingerprint & fingerprint, FingerprintCache * cache) {
+    if (v.IsString()) {
+      fingerprint.add('s');
+      fingerprint.add(std::string_view(v.GetString(), v.GetStringLength()));
+      return;
+    }
+    if (!v.IsArray() && !v.IsObject()) {
+      Value(v).fingerprint(fingerprint);
+      return;
+    }
+    Fingerprint::Digest digest;
+    auto cached = cache ? cache->find(&v) : FingerprintCache::iterator();
+    if (cache && cached != cache->end()) {
+      digest = cached->second;
+    } else {
+      auto items = fingerprint.fork();
+      if (v.IsArray()) {
+        items.add('[');
+        items.add((uint64_t) v.Size());
+        for (const auto & item : v.GetArray()) fingerprint_json(item, items, cache);
+      } else {
+        std::vector<const rapidjson::Value::Member *> members;
+        sorted_members(v, members);
+        items.add('{');
+        items.add((uint64_t) members.size());
+        for (auto member : members) {
+          items.add(std::string_view(member->name.GetString(), member->name.GetStringLength()));
+          fingerprint_json(member->value, items, cache);
+        }
+      }
+      digest = items.digest();
+      if (cache) cache->emplace(&v, digest);
+    }
+    fingerprint.add('c');
+    fingerprint.add(digest);
+  }
 
+  void dump(std::string & out, int indent = -1, int level = 0, bool to_json = false) const {
     auto string_quote = to_json ? '"' : '\'';
 
-    if (is_null()) out << "null";
+    if (loop_) sync_loop();
+    if (auto source = view()) {
+      auto shared = borrowed_->shared;
+      if (!shared) {
+        dump_json(*source, out, indent, level, to_json);
+      } else if (!shared->find_dump(source, indent, level, to_json, out)) {
+        auto start = out.size();
+        dump_json(*source, out, indent, level, to_json);
+        shared->add_dump(source, indent, level, to_json, std::string_view(out).substr(start));
+      }
+    } else if (is_null()) out.append("null");
     else if (array_) {
-      out << "[";
-      print_indent(level + 1);
+      out += '[';
+      dump_indent(out, indent, level + 1);
       for (size_t i = 0; i < array_->size(); ++i) {
-        if (i) print_sub_sep();
+        if (i) dump_separator(out, indent, level);
         (*array_)[i].dump(out, indent, level + 1, to_json);
       }
-      print_indent(level);
-      out << "]";
+      dump_indent(out, indent, level);
+      out += ']';
     } else if (object_) {
-      out << "{";
-      print_indent(level + 1);
+      out += '{';
+      dump_indent(out, indent, level + 1);
       for (auto begin = object_->begin(), it = begin; it != object_->end(); ++it) {
-        if (it != begin) print_sub_sep();
+        if (it != begin) dump_separator(out, indent, level);
         dump_string(it->first, out, string_quote);
-        out << ": ";
+        out.append(": ");
         it->second.dump(out, indent, level + 1, to_json);
       }
-      print_indent(level);
-      out << "}";
+      dump_indent(out, indent, level);
+      out += '}';
     } else if (callable_) {
       _printlog("Cannot dump callable to JSON");
     } else if (is_boolean() && !to_json) {
-      out << (this->to_bool() ? "True" : "False");
+      out.append(this->to_bool() ? "True" : "False");
     } else if (is_string() && !to_json) {
-      dump_string(primitive_.mString, out, string_quote);
+      dump_string(primitive_.str(), out, string_quote);
     } else {
-      out << primitive_.dump();
+      primitive_.dump(out);
+    }
+  }
+
+  /* Borrows `v`, a value in `shared` if that's not null (see the public borrow() overloads). */
+  static Value borrow(const rapidjson::Value & v, const SharedJson * shared) {
+    if (v.IsString()) {
+      Value result;
+      result.primitive_ = json::borrow(v.GetString(), v.GetStringLength());
+      return result;
     }
+    if (!v.IsArray() && !v.IsObject()) return Value(v);
+    Value result;
+    result.borrowed_ = make_render_shared<Borrowed>();
+    result.borrowed_->source = &v;
+    result.borrowed_->shared = shared;
+    return result;
   }
 
 public:
@@ -261,19 +1082,20 @@ public:
   Value(const std::nullptr_t &) {}
   Value(const std::string & v) : primitive_(v) {}
   Value(const char * v) : primitive_(std::string(v)) {}
+  explicit Value(std::string_view v) : primitive_(v.data(), v.size()) {}
     Value(json& json) : primitive_(json) {
         // Do nothing
     }
 
   Value(const rapidjson::Value & v) {
     if (v.IsObject()) {
-      auto object = std::make_shared<ObjectType>();
+      auto object = make_render_shared<ObjectType>();
       for (auto& it : v.GetObject()) {
         (*object)[it.name.GetString()] = it.value;
       }
       object_ = std::move(object);
     } else if (v.IsArray()) {
-      auto array = std::make_shared<ArrayType>();
+      auto array = make_render_shared<ArrayType>();
       for (const auto& item : v.GetArray()) {
         array->push_back(Value(item));
       }
@@ -291,7 +1113,24 @@ public:
     }
   }
 
+  /*
+   * A read-only view of `v` that doesn't copy it: `v` must outlive the value and its copies.
+   * Arrays & objects are read in place, and only materialized (one level at a time) when something needs
+   * references into them or mutates them - which never changes `v` itself. Long strings aren't copied either.
+   */
+  static Value borrow(const rapidjson::Value & v) {
+    return borrow(v, nullptr);
+  }
+  /*
+   * Same for the document of `json`, whose arrays & objects are then only dumped once for all its borrowers
+   * (e.g. the same tools rendered with `tools | tojson` turn after turn): `json` must outlive the value and its copies.
+   */
+  static Value borrow(const SharedJson & json) {
+    return borrow(json.get(), &json);
+  }
+
   std::vector<Value> keys() {
+    materialize();
     if (!object_) _printlog("Value is not an object: " + dump());
     std::vector<Value> res;
     for (const auto& item : *object_) {
@@ -301,38 +1140,67 @@ public:
   }
 
   size_t size() const {
+    if (auto source = view()) return source->IsArray() ? source->Size() : source->MemberCount();
     if (is_object()) return object_->size();
     if (is_array()) return array_->size();
-    if (is_string()) return primitive_.mString.size();
+    if (is_string()) return primitive_.str().size();
     _printlog("Value is not an array or object: " + dump());
     return 0;
   }
 
   static Value array(const std::vector<Value> values = {}) {
-    auto array = std::make_shared<ArrayType>();
+    auto array = make_render_shared<ArrayType>();
     for (const auto& item : values) {
       array->push_back(item);
     }
     return Value(array);
   }
-  static Value object(const std::shared_ptr<ObjectType> object = std::make_shared<ObjectType>()) {
+  static Value object(const std::shared_ptr<ObjectType> object = make_render_shared<ObjectType>()) {
     return Value(object);
   }
   static Value callable(const CallableType & callable) {
-    return Value(std::make_shared<CallableType>(callable));
+    return Value(make_render_shared<CallableType>(callable));
+  }
+  /*
+   * The `loop` object of a for loop over `items` (an array, shared rather than copied), callable if `recurse` is
+   * given (recursive loops). Its index, first, last, previtem... follow set_loop_index without being stored.
+   */
+  static Value loop(const Value & items, const CallableType & recurse = nullptr) {
+    items.materialize();
+    auto result = recurse ? callable(recurse) : object();
+    result.loop_ = make_render_shared<Loop>();
+    result.loop_->items = items.array_ ? items.array_ : make_render_shared<ArrayType>();
+    return result;
+  }
+  void set_loop_index(size_t index) {
+    if (loop_) loop_->index = index;
+  }
+  bool is_loop() const { return !!loop_; }
+  /* loop.cycle(...): the argument at the loop's index (modulo their count). */
+  Value cycle(ArgumentsValue & args) const {
+    if (!loop_) {
+      _printlog("cycle() can only be called on a loop object");
+      return Value();
+    }
+    return loop_cycle(*loop_, args);
   }
 
   void insert(size_t index, const Value& v) {
+    materialize();
     if (!array_)
       _printlog("Value is not an array: " + dump());
+    if (!RenderBudget::allow_items(1)) return;
     array_->insert(array_->begin() + index, v);
   }
   void push_back(const Value& v) {
+    materialize();
     if (!array_)
       _printlog("Value is not an array: " + dump());
+    if (!RenderBudget::allow_items(1)) return;
     array_->push_back(v);
   }
   Value pop(const Value& index) {
+    materialize();
     if (is_array()) {
       if (array_->empty())
         _printlog("pop from empty list");
@@ -354,7 +1222,7 @@ public:
     } else if (is_object()) {
       if (!index.is_hashable())
         _printlog("Unhashable type: " + index.dump());
-      auto it = object_->find(index.primitive_.dump());
+      auto it = find_key(index);
       if (it == object_->end())
         _printlog("Key not found: " + index.dump());
       auto ret = it->second;
@@ -366,6 +1234,12 @@ public:
     return Value();
   }
   Value get(const Value& key) {
+    if (loop_ && key.is_string()) {
+      auto name = key.primitive_.str();
+      if (name != "cycle" && is_loop_attribute(name)) return loop_attribute(name);
+    }
+    // Materializing (rather than borrowing the element again) keeps aliasing: `{% set ys = xs %}` then `ys.append(...)`.
+    materialize();
     if (array_) {
       if (!key.is_number_integer()) {
         return Value();
@@ -374,13 +1248,14 @@ public:
       return array_->at(index < 0 ? array_->size() + index : index);
     } else if (object_) {
       if (!key.is_hashable()) _printlog("Unhashable type: " + dump());
-      auto it = object_->find(key.primitive_.dump());
+      auto it = find_key(key);
       if (it == object_->end()) return Value();
       return it->second;
     }
     return Value();
   }
   void set(const std::string& key, const Value& value) {
+      materialize();
       if (!object_) {
           _printlog("Value is not an object: " + dump());
           return;
@@ -395,30 +1270,110 @@ public:
     return (*callable_)(context, args);
   }
 
-  bool is_object() const { return !!object_; }
-  bool is_array() const { return !!array_; }
+  bool is_object() const {
+    if (auto source = view()) return source->IsObject();
+    return !!object_;
+  }
+  bool is_array() const {
+    if (auto source = view()) return source->IsArray();
+    return !!array_;
+  }
   bool is_callable() const { return !!callable_; }
-  bool is_null() const { return !object_ && !array_ && primitive_.is_null() && !callable_; }
+  /* Whether both values are copies of the same callable. */
+  bool same_callable(const Value & other) const { return callable_ && callable_ == other.callable_; }
+  bool is_null() const { return !view() && !object_ && !array_ && primitive_.is_null() && !callable_; }
   bool is_boolean() const { return primitive_.is_boolean(); }
   bool is_number_integer() const { return primitive_.is_number_integer(); }
   bool is_number_float() const { return primitive_.is_number_float(); }
   bool is_number() const { return primitive_.is_number(); }
   bool is_string() const { return primitive_.is_string(); }
+  /* The string, without copying it (empty if this isn't a string); only valid as long as this value. */
+  std::string_view string_view() const { return primitive_.str(); }
+  /* Appends `s` to this string, in place when no other value shares it (see json::append). */
+  void append_string(std::string_view s) { primitive_.append(s); }
   bool is_iterable() const { return is_array() || is_object() || is_string(); }
 
-  bool is_primitive() const { return !array_ && !object_ && !callable_; }
+  bool is_primitive() const { return !view() && !array_ && !object_ && !callable_; }
+  /*
+   * What this array or object is, as a pointer that's shared by all its copies (and null for other values): two
+   * values with the same identity are the same container, even while one of them is still a borrowed view.
+   */
+  const void * identity() const {
+    if (auto source = view()) return source;
+    if (object_) return object_.get();
+    if (array_) return array_.get();
+    return nullptr;
+  }
+  /*
+   * Adds the value to `fingerprint`, the same way for equal values whether they're borrowed or not, so that equal
+   * digests mean equal values; false if it holds a callable or a loop object, which can't be fingerprinted.
+   * `cache` keeps the digests of the borrowed arrays & objects, which never change, for when they're seen again.
+   */
+  bool fingerprint(Fingerprint & fingerprint, FingerprintCache * cache = nullptr) const {
+    if (loop_ || callable_) return false;
+    if (auto source = view()) {
+      fingerprint_json(*source, fingerprint, cache);
+      return true;
+    }
+    if (array_ || object_) {
+      auto items = fingerprint.fork();
+      if (array_) {
+        items.add('[');
+        items.add((uint64_t) array_->size());
+        for (const auto & item : *array_) {
+          if (!item.fingerprint(items, cache)) return false;
+        }
+      } else {
+        items.add('{');
+        items.add((uint64_t) object_->size());
+        for (const auto & it : *object_) {
+          items.add(std::string_view(it.first));
+          if (!it.second.fingerprint(items, cache)) return false;
+        }
+      }
+      fingerprint.add('c');
+      fingerprint.add(items.digest());
+      return true;
+    }
+    switch (primitive_.mType) {
+      case JSON_STRING:
+        fingerprint.add('s');
+        fingerprint.add(primitive_.str());
+        break;
+      case JSON_INT64:
+        fingerprint.add('i');
+        fingerprint.add((uint64_t) primitive_.mInt);
+        break;
+      case JSON_DOUBLE:
+        fingerprint.add('d');
+        fingerprint.add(&primitive_.mDouble, sizeof(double));
+        break;
+      case JSON_BOOL:
+        fingerprint.add(primitive_.mBool ? 't' : 'f');
+        break;
+      default:
+        fingerprint.add('n');
+        break;
+    }
+    return true;
+  }
+
   bool is_hashable() const { return is_primitive(); }
+  /* The hash of a primitive (see std::hash<Value>), computed without serializing it. */
+  size_t primitive_hash() const { return primitive_.hash(); }
 
   bool empty() const {
     if (is_null())
       _printlog("Undefined value or reference");
     if (is_string()) return primitive_.empty();
+    if (view()) return size() == 0;
     if (is_array()) return array_->empty();
     if (is_object()) return object_->empty();
     return false;
   }
 
   void for_each(const std::function<void(Value &)> & callback) const {
+    materialize();
     if (is_null())
       _printlog("Undefined value or reference");
     if (array_) {
@@ -431,7 +1386,7 @@ public:
         callback(key);
       }
     } else if (is_string()) {
-      for (char c : primitive_.mString) {
+      for (char c : primitive_.str()) {
         auto val = Value(std::string(1, c));
         callback(val);
       }
@@ -444,7 +1399,7 @@ public:
     if (is_null()) return false;
     if (is_boolean()) return get<bool>();
     if (is_number()) return get<double>() != 0;
-    if (is_string()) return !get<std::string>().empty();
+    if (is_string()) return !primitive_.empty();
     if (is_array()) return !empty();
     return true;
   }
@@ -465,7 +1420,7 @@ public:
       return false;
     }
     if (is_number() && other.is_number()) return get<double>() < other.get<double>();
-    if (is_string() && other.is_string()) return get<std::string>() < other.get<std::string>();
+    if (is_string() && other.is_string()) return primitive_.str() < other.primitive_.str();
     _printlog("Cannot compare values: " + dump() + " < " + other.dump());
     return false;
   }
@@ -477,13 +1432,15 @@ public:
       return false;
     }
     if (is_number() && other.is_number()) return get<double>() > other.get<double>();
-    if (is_string() && other.is_string()) return get<std::string>() > other.get<std::string>();
+    if (is_string() && other.is_string()) return primitive_.str() > other.primitive_.str();
     _printlog("Cannot compare values: " + dump() + " > " + other.dump());
     return false;
   }
   bool operator<=(const Value & other) const { return !(*this > other); }
 
   bool operator==(const Value & other) const {
+    materialize();
+    other.materialize();
     if (callable_ || other.callable_) {
       if (callable_.get() != other.callable_.get()) return false;
     }
@@ -498,7 +1455,9 @@ public:
       if (!other.object_) return false;
       if (object_->size() != other.object_->size()) return false;
       for (const auto& item : *object_) {
-        if (!item.second.to_bool() || !other.object_->count(item.first) || item.second != other.object_->at(item.first)) return false;
+        if (!item.second.to_bool()) return false;
+        auto it = other.object_->find(item.first);
+        if (it == other.object_->end() || item.second != it->second) return false;
       }
       return true;
     } else {
@@ -508,17 +1467,37 @@ public:
   bool operator!=(const Value & other) const { return !(*this == other); }
 
   bool contains(const char * key) const { return contains(std::string(key)); }
+  /* The value of `key` if this is an object that has it, nullptr otherwise. */
+  Value * find(const std::string & key) {
+    materialize();
+    if (!object_) return nullptr;
+    auto it = object_->find(key);
+    return it == object_->end() ? nullptr : &it->second;
+  }
+  Value * find(const char * key) { return find(std::string(key)); }
+  /* Same for a primitive key, in a single lookup (see contains / at). */
+  Value * find(const Value & key) {
+    materialize();
+    if (!object_) return nullptr;
+    if (!key.is_hashable()) _printlog("Unhashable type: " + key.dump());
+    auto it = find_key(key);
+    return it == object_->end() ? nullptr : &it->second;
+  }
   bool contains(const std::string & key) const {
+    if (auto source = view()) {
+      return source->IsObject() && source->HasMember(key.c_str());
+    }
     if (array_) {
       return false;
     } else if (object_) {
-      return object_->find(key) != object_->end();
+      return object_->find(key) != object_->end() || (loop_ && is_loop_attribute(key));
     } else {
       _printlog("contains can only be called on arrays and objects: " + dump());
     }
     return false;
   }
   bool contains(const Value & value) const {
+    materialize();
     if (is_null())
       _printlog("Undefined value or reference");
     if (array_) {
@@ -528,17 +1507,19 @@ public:
       return false;
     } else if (object_) {
       if (!value.is_hashable()) _printlog("Unhashable type: " + value.dump());
-      return object_->find(value.primitive_.dump()) != object_->end();
+      return find_key(value) != object_->end();
     } else {
       _printlog("contains can only be called on arrays and objects: " + dump());
     }
     return false;
   }
   void erase(size_t index) {
+    materialize();
     if (!array_) _printlog("Value is not an array: " + dump());
     array_->erase(array_->begin() + index);
   }
   void erase(const std::string & key) {
+    materialize();
     if (!object_) _printlog("Value is not an object: " + dump());
     object_->erase(key);
   }
@@ -546,11 +1527,16 @@ public:
     return const_cast<Value*>(this)->at(index);
   }
   Value& at(const Value & index) {
+    materialize();
     if (!index.is_hashable()) {
         _printlog("Unhashable type: " + dump());
     }
     if (is_array()) return array_->at(index.get<int>());
-    if (is_object()) return object_->at(index.primitive_.dump());
+    if (is_object()) {
+      auto it = find_key(index);
+      if (it != object_->end()) return it->second;
+      return object_->at(index.primitive_.dump());  // Throws, as a missing key always did
+    }
     _printlog("Value is not an array or object: " + dump());
     return object_->at(index.primitive_.dump());
   }
@@ -558,6 +1544,7 @@ public:
     return const_cast<Value*>(this)->at(index);
   }
   Value& at(size_t index) {
+    materialize();
     if (is_null()) {
       _printlog("Undefined value or reference");
     }
@@ -584,9 +1571,9 @@ public:
   }
 
   std::string dump(int indent=-1, bool to_json=false) const {
-    std::ostringstream out;
+    std::string out;
     dump(out, indent, 0, to_json);
-    return out.str();
+    return out;
   }
 
   Value operator-() const {
@@ -609,7 +1596,11 @@ public:
       } else if (is_number_integer() && rhs.is_number_integer()) {
         return get<int64_t>() + rhs.get<int64_t>();
       } else if (is_array() && rhs.is_array()) {
+        materialize();
+        rhs.materialize();
         auto res = Value::array();
+        if (!RenderBudget::allow_more_items(array_->size() + rhs.array_->size())) return res;
+        res.array_->reserve(array_->size() + rhs.array_->size());
         for (const auto& item : *array_) res.push_back(item);
         for (const auto& item : *rhs.array_) res.push_back(item);
         return res;
@@ -625,11 +1616,17 @@ public:
   }
   Value operator*(const Value& rhs) const {
       if (is_string() && rhs.is_number_integer()) {
-        std::ostringstream out;
-        for (int64_t i = 0, n = rhs.get<int64_t>(); i < n; ++i) {
-          out << to_str();
+        auto s = string_view();
+        auto n = rhs.get<int64_t>();
+        std::string out;
+        if (n > 0 && !RenderBudget::allow_size((uint64_t) n > SIZE_MAX / std::max<size_t>(s.size(), 1) ? SIZE_MAX : s.size() * (size_t) n)) {
+          return out;
         }
-        return out.str();
+        if (n > 0) out.reserve(s.size() * (size_t) n);
+        for (int64_t i = 0; i < n; ++i) {
+          out.append(s);
+        }
+        return out;
       }
       else if (is_number_integer() && rhs.is_number_integer())
         return get<int64_t>() * rhs.get<int64_t>();
@@ -647,6 +1644,7 @@ public:
   }
 };
 
+// (Short-lived, so its lists come from the heap rather than the RenderMemory of the render making the call.)
 struct ArgumentsValue {
   std::vector<Value> args;
   std::vector<std::pair<std::string, Value>> kwargs;
@@ -680,15 +1678,25 @@ struct ArgumentsValue {
   }
 };
 
+inline Value Value::loop_cycle(const Loop & loop, ArgumentsValue & args) {
+  if (args.args.empty() || !args.kwargs.empty()) {
+    _printlog("cycle() expects at least 1 positional argument and no named arg");
+    return Value();
+  }
+  return args.args[loop.index % args.args.size()];
+}
+
 } // namespace minja
 
 namespace std {
   template <>
   struct hash<minja::Value> {
     size_t operator()(const minja::Value & v) const {
-      if (!v.is_hashable())
+      if (!v.is_hashable()) {
         _printlog("Unsupported type for hashing: " + v.dump());
-      return std::hash<std::string>()(v.dump());
+        return std::hash<std::string>()(v.dump());
+      }
+      return v.primitive_hash();
     }
   };
 } // namespace std
@@ -724,44 +1732,366 @@ class Context : public std::enable_shared_from_this<Context> {
   protected:
     Value values_;
     std::shared_ptr<Context> parent_;
+    // Frame slots (see VariableResolver): the names of `slot_names_` live here rather than in values_.
+    const std::vector<std::string> * slot_names_ = nullptr;
+    std::vector<Value> slots_;
+    std::vector<bool> slot_set_;
+
+    int find_slot(std::string_view key) const {
+        if (!slot_names_) return -1;
+        for (size_t i = 0, n = slot_names_->size(); i < n; ++i) {
+            if ((*slot_names_)[i] == key) return (int) i;
+        }
+        return -1;
+    }
+    Value * find_local(const Value & key) {
+        if (slot_names_ && key.is_string()) {
+            auto slot = find_slot(key.string_view());
+            if (slot >= 0) return slot_set_[slot] ? &slots_[slot] : nullptr;
+        }
+        return values_.find(key);
+    }
+
+    static std::shared_ptr<Context> make_builtins();
+    static std::shared_ptr<Context> & builtins_instance();
   public:
-    Context(Value && values, const std::shared_ptr<Context> & parent = nullptr) : values_(std::move(values)), parent_(parent) {
+    Context(Value && values, const std::shared_ptr<Context> & parent = nullptr, const std::vector<std::string> * slot_names = nullptr)
+        : values_(std::move(values)), parent_(parent), slot_names_(slot_names) {
         if (!values_.is_object()) _printlog("Context values must be an object: " + values_.dump());
+        if (slot_names_) {
+            slots_.resize(slot_names_->size());
+            slot_set_.resize(slot_names_->size(), false);
+        }
     }
     virtual ~Context() {}
 
+    /*
+     * The global functions & filters, built once per process and shared by every render (it's never written to,
+     * so it's safe to share across threads).
+     */
     static std::shared_ptr<Context> builtins();
+    /* The builtins as first built, before any register_builtin call (see FilterExpr::bind_pipeline). */
+    static const std::shared_ptr<Context> & default_builtins();
+    /*
+     * Adds (or replaces) a global for all the templates rendered from now on, e.g. at startup. Safe to call while
+     * other threads render: renders that already started keep the previous builtins.
+     */
+    static void register_builtin(const std::string & name, const Value & value);
     static std::shared_ptr<Context> make(Value && values, const std::shared_ptr<Context> & parent = builtins());
 
+    const std::shared_ptr<Context> & get_parent() const { return parent_; }
+    const std::vector<std::string> * get_slot_names() const { return slot_names_; }
+    /* The value of a frame slot, or nullptr if it wasn't set yet. */
+    Value * get_slot(size_t slot) {
+        return slot_set_[slot] ? &slots_[slot] : nullptr;
+    }
+
     std::vector<Value> keys() {
-        return values_.keys();
+        auto keys = values_.keys();
+        for (size_t i = 0, n = slots_.size(); i < n; ++i) {
+            if (slot_set_[i]) keys.push_back((*slot_names_)[i]);
+        }
+        return keys;
     }
     virtual Value get(const Value & key) {
-        if (values_.contains(key)) return values_.at(key);
+        if (auto value = find_local(key)) return *value;
         if (parent_) return parent_->get(key);
         return Value();
     }
     virtual Value & at(const Value & key) {
-        if (values_.contains(key)) return values_.at(key);
+        if (auto value = find_local(key)) return *value;
         if (parent_) return parent_->at(key);
         _printlog("Undefined variable: " + key.dump());
         return values_.at(key);
     }
     virtual bool contains(const Value & key) {
-        if (values_.contains(key)) return true;
+        if (find_local(key)) return true;
         if (parent_) return parent_->contains(key);
         return false;
     }
-    virtual void set(const std::string & key, const Value & value) {
-        values_.set(key, value);
+    /* Looks `key` up the context chain in one pass (a single lookup per context), nullptr if undefined. */
+    virtual Value * find(const std::string & key) {
+        auto slot = find_slot(key);
+        if (slot >= 0) {
+            if (slot_set_[slot]) return &slots_[slot];
+        } else if (auto value = values_.find(key)) {
+            return value;
+        }
+        return parent_ ? parent_->find(key) : nullptr;
     }
-};
+    /* Same as find(key), except that reaching `resolved_in` returns `resolved` (its value for `key`) without a lookup. */
+    virtual Value * find(const std::string & key, const Context * resolved_in, Value * resolved) {
+        if (this == resolved_in) return resolved;
+        auto slot = find_slot(key);
+        if (slot >= 0) {
+            if (slot_set_[slot]) return &slots_[slot];
+        } else if (auto value = values_.find(key)) {
+            return value;
+        }
+        return parent_ ? parent_->find(key, resolved_in, resolved) : nullptr;
+    }
+    /* This context's own value for `key` (the one set(key, ...) replaces), or nullptr if it has none. */
+    Value * find_own(const std::string & key) {
+        auto slot = find_slot(key);
+        if (slot >= 0) return slot_set_[slot] ? &slots_[slot] : nullptr;
+        return values_.find(key);
+    }
+    virtual void set(const std::string & key, const Value & value) {
+        auto slot = find_slot(key);
+        if (slot >= 0) {
+            slots_[slot] = value;
+            slot_set_[slot] = true;
+            return;
+        }
+        values_.set(key, value);
+    }
+};
 
 struct Location {
     std::shared_ptr<std::string> source;
     size_t pos;
 };
 
+#ifdef MINJA_PROFILE
+/**
+ * Records, for every template line, how many times it was rendered / evaluated, the time spent there and the bytes
+ * allocated meanwhile, as well as the call tree (for a flame graph). Only in MINJA_PROFILE builds, and only for the
+ * renders made on a thread while a Profiler::Scope is active: otherwise TemplateNode::render & Expression::evaluate
+ * just check a thread-local pointer. While profiling, TemplateProgram renders through the tree it was compiled from.
+ *
+ * The header can't see allocations: a program that replaces operator new (as the benchmarks do) reports them with
+ * Profiler::count_allocation().
+ */
+class Profiler {
+public:
+    struct LineStats {
+        std::shared_ptr<std::string> source;
+        size_t line;       // 1-based.
+        size_t calls = 0;  // Times the line's most run node / expression ran.
+        double total_us = 0;
+        double self_us = 0;  // Excluding the time spent in other lines.
+        size_t bytes = 0;
+        size_t self_bytes = 0;
+        int depth = 0;
+
+        std::string text() const;
+    };
+
+    /* Makes `profiler` record the renders of the current thread until destroyed. */
+    class Scope {
+        Profiler * previous_;
+    public:
+        explicit Scope(Profiler & profiler) : previous_(current()) { current() = &profiler; }
+        ~Scope() { current() = previous_; }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+    };
+
+    /* One node render / expression evaluation, from construction to destruction. */
+    class Frame {
+        Profiler & profiler_;
+    public:
+        Frame(Profiler & profiler, const Location & location, int kind) : profiler_(profiler) { profiler_.enter(location, kind); }
+        ~Frame() { profiler_.exit(); }
+        Frame(const Frame &) = delete;
+        Frame & operator=(const Frame &) = delete;
+    };
+    enum Kind {
+        Kind_Node = 0,
+        Kind_Expression = 64,  // Plus the Expression::Type (a TemplateNode::Type for nodes).
+    };
+
+    static Profiler *& current() {
+        static thread_local Profiler * profiler = nullptr;
+        return profiler;
+    }
+    static void count_allocation(size_t bytes) {
+        auto profiler = current();
+        if (profiler && !profiler->busy_) profiler->allocated_ += bytes;
+    }
+
+    /* The lines that were reached, the slowest (in self time) first. */
+    std::vector<LineStats> lines() const {
+        auto lines = lines_;
+        for (const auto & site : sites_) lines[site.line].calls = std::max(lines[site.line].calls, site.calls);
+        std::sort(lines.begin(), lines.end(), [](const LineStats & a, const LineStats & b) { return a.self_us > b.self_us; });
+        return lines;
+    }
+
+    /* lines() as a table. */
+    std::string report() const {
+        std::ostringstream out;
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%10s %12s %12s %12s %12s  %s\n", "calls", "total us", "self us", "bytes", "self bytes", "line");
+        out << buf;
+        for (const auto & line : lines()) {
+            snprintf(buf, sizeof(buf), "%10zu %12.1f %12.1f %12zu %12zu  ", line.calls, line.total_us, line.self_us, line.bytes, line.self_bytes);
+            out << buf << line.line << ": " << line.text() << "\n";
+        }
+        return out.str();
+    }
+
+    /*
+     * The call tree in the "folded stacks" format of flamegraph.pl / speedscope / inferno: one `frame;frame;... value`
+     * line per path, where frames are `<Type>@<line>:<column>` and values are self times in microseconds.
+     */
+    std::string folded() const {
+        std::ostringstream out;
+        std::vector<size_t> path;
+        std::function<void(size_t)> visit = [&](size_t index) {
+            const auto & call = calls_[index];
+            if (index) path.push_back(call.site);
+            auto us = (long long) std::llround(call.self_us);
+            if (index && us > 0) {
+                for (size_t i = 0; i < path.size(); i++) {
+                    if (i) out << ';';
+                    out << sites_[path[i]].label;
+                }
+                out << ' ' << us << '\n';
+            }
+            for (const auto & child : call.children) visit(child.second);
+            if (index) path.pop_back();
+        };
+        visit(0);
+        return out.str();
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    struct Site {
+        size_t line;  // In lines_.
+        std::string label;
+        size_t calls;
+    };
+    struct Call {
+        size_t site;
+        std::map<size_t, size_t> children;  // Site to call.
+        double self_us = 0;
+    };
+    struct Active {
+        size_t site;
+        size_t call;
+        clock::time_point start;
+        size_t allocated_at_start;
+        double child_us;     // Spent in nested frames.
+        size_t child_bytes;
+        double absorbed_us;  // Self time of nested frames of the same line, which stays that line's own.
+        size_t absorbed_bytes;
+    };
+    std::map<std::tuple<const std::string *, size_t, int>, size_t> site_ids_;
+    std::map<std::pair<const std::string *, size_t>, size_t> line_ids_;
+    std::vector<Site> sites_;
+    std::vector<LineStats> lines_;
+    std::vector<Call> calls_ {Call {0, {}, 0}};  // calls_[0] is the root.
+    std::vector<Active> stack_;
+    size_t allocated_ = 0;
+    bool busy_ = false;
+
+    static const char * type_name(int kind) {
+        static const char * node_types[] = {"Sequence", "Text", "Expression", "If", "LoopControl", "For", "Macro", "Filter", "Set", "SetTemplate", "Generation"};
+        static const char * expr_types[] = {"Variable", "If", "Literal", "Array", "Dict", "Slice", "Subscript", "Unary", "Binary", "MethodCall", "Call", "Filter"};
+        if (kind >= Kind_Expression) {
+            auto type = (size_t) (kind - Kind_Expression);
+            return type < sizeof(expr_types) / sizeof(expr_types[0]) ? expr_types[type] : "Expression";
+        }
+        return (size_t) kind < sizeof(node_types) / sizeof(node_types[0]) ? node_types[kind] : "Node";
+    }
+
+    size_t site_id(const Location & location, int kind) {
+        auto key = std::make_tuple(location.source.get(), location.pos, kind);
+        auto it = site_ids_.find(key);
+        if (it != site_ids_.end()) return it->second;
+
+        size_t line = 1, column = 1;
+        if (location.source) {
+            const auto & source = *location.source;
+            auto end = std::min(location.pos, source.size());
+            line += std::count(source.begin(), source.begin() + end, '\n');
+            auto line_start = source.rfind('\n', end ? end - 1 : 0);
+            column = line_start == std::string::npos || line == 1 ? end + 1 : end - line_start;
+        }
+        auto line_key = std::make_pair(location.source.get(), line);
+        auto line_it = line_ids_.find(line_key);
+        if (line_it == line_ids_.end()) {
+            LineStats stats;
+            stats.source = location.source;
+            stats.line = line;
+            lines_.push_back(stats);
+            line_it = line_ids_.emplace(line_key, lines_.size() - 1).first;
+        }
+        sites_.push_back({line_it->second, std::string(type_name(kind)) + "@" + std::to_string(line) + ":" + std::to_string(column), 0});
+        return site_ids_[key] = sites_.size() - 1;
+    }
+
+    void enter(const Location & location, int kind) {
+        busy_ = true;
+        auto site = site_id(location, kind);
+        auto parent = stack_.empty() ? 0 : stack_.back().call;
+        auto it = calls_[parent].children.find(site);
+        size_t call;
+        if (it == calls_[parent].children.end()) {
+            call = calls_.size();
+            calls_[parent].children[site] = call;
+            calls_.push_back({site, {}, 0});
+        } else {
+            call = it->second;
+        }
+        sites_[site].calls++;
+        lines_[sites_[site].line].depth++;
+        stack_.push_back({site, call, clock::time_point(), 0, 0, 0, 0, 0});
+        busy_ = false;
+        stack_.back().allocated_at_start = allocated_;
+        stack_.back().start = clock::now();
+    }
+
+    void exit() {
+        auto end = clock::now();
+        busy_ = true;
+        auto frame = stack_.back();
+        stack_.pop_back();
+        auto us = std::chrono::duration<double, std::micro>(end - frame.start).count();
+        auto bytes = allocated_ - frame.allocated_at_start;
+        auto & line = lines_[sites_[frame.site].line];
+        auto same_line_parent = !stack_.empty() && sites_[stack_.back().site].line == sites_[frame.site].line;
+        line.depth--;
+        // Nested frames of the same line (or recursion through it) are already in the outermost one's totals.
+        if (line.depth == 0) {
+            line.total_us += us;
+            line.bytes += bytes;
+        }
+        auto self_us = us - frame.child_us;
+        auto self_bytes = bytes - frame.child_bytes;
+        calls_[frame.call].self_us += self_us;
+        if (!stack_.empty()) {
+            stack_.back().child_us += us;
+            stack_.back().child_bytes += bytes;
+        }
+        if (same_line_parent) {
+            stack_.back().absorbed_us += self_us + frame.absorbed_us;
+            stack_.back().absorbed_bytes += self_bytes + frame.absorbed_bytes;
+        } else {
+            line.self_us += self_us + frame.absorbed_us;
+            line.self_bytes += self_bytes + frame.absorbed_bytes;
+        }
+        busy_ = false;
+    }
+};
+
+inline std::string Profiler::LineStats::text() const {
+    if (!source) return "";
+    size_t start = 0;
+    for (size_t i = 1; i < line && start != std::string::npos; i++) {
+        start = source->find('\n', start);
+        if (start != std::string::npos) start++;
+    }
+    if (start == std::string::npos) return "";
+    auto end = source->find('\n', start);
+    auto text = source->substr(start, end == std::string::npos ? std::string::npos : end - start);
+    auto first = text.find_first_not_of(" \t");
+    return first == std::string::npos ? "" : text.substr(first);
+}
+#endif
+
 class Expression {
 protected:
     virtual Value do_evaluate(const std::shared_ptr<Context> & context) const = 0;
@@ -789,21 +2119,61 @@ public:
     virtual ~Expression() = default;
 
     Value evaluate(const std::shared_ptr<Context> & context) const {
+        if (auto budget = RenderBudget::current()) {
+            if (!budget->poll()) return Value();
+        }
+#ifdef MINJA_PROFILE
+        if (auto profiler = Profiler::current()) {
+            Profiler::Frame frame(*profiler, location, Profiler::Kind_Expression + mType);
+            return do_evaluate(context);
+        }
+#endif
             return do_evaluate(context);
     }
+    /* Calls `fn` on every direct sub-expression (skipping nulls), used by static analysis passes; rewriting passes may replace the child through the reference. */
+    virtual void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> &) {}
 };
 
 class VariableExpr : public Expression {
     std::string name;
+    // Set by VariableResolver: the variable is slot `frame_slot` of the context `frame_hops` levels up,
+    // provided that context has the `frame` layout (otherwise it's looked up by name).
+    const std::vector<std::string> * frame = nullptr;
+    size_t frame_hops = 0;
+    size_t frame_slot = 0;
+    // Also set by VariableResolver when `name` is a builtin: its value in the `builtins` table the template was
+    // resolved against, used when the lookup reaches that table (renders against newer builtins look it up).
+    std::shared_ptr<Context> builtins;
+    Value * builtin = nullptr;
 public:
     VariableExpr(const Location & loc, const std::string& n)
       : Expression(loc, Expression::Type_Variable), name(n) {}
-    std::string get_name() const { return name; }
-    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!context->contains(name)) {
-            return Value();
+    const std::string & get_name() const { return name; }
+    void bind_slot(const std::vector<std::string> * slot_names, size_t hops, size_t slot) {
+        frame = slot_names;
+        frame_hops = hops;
+        frame_slot = slot;
+    }
+    void bind_builtin(const std::shared_ptr<Context> & table, Value * value) {
+        builtins = table;
+        builtin = value;
+    }
+    /* The builtin this variable was resolved to, if any (never written to, so it can be used in place). */
+    const Value * get_builtin() const { return builtin; }
+    /* The variable's value in `context`, nullptr if it's undefined. */
+    Value * find(const std::shared_ptr<Context> & context) const {
+        if (frame) {
+            auto ctx = context.get();
+            for (size_t i = 0; i < frame_hops && ctx; ++i) ctx = ctx->get_parent().get();
+            if (ctx && ctx->get_slot_names() == frame) {
+                if (auto value = ctx->get_slot(frame_slot)) return value;
+            }
         }
-        return context->at(name);
+        return builtin ? context->find(name, builtins.get(), builtin) : context->find(name);
+    }
+    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
+        auto value = find(context);
+        return value ? *value : Value();
     }
 };
 
@@ -956,31 +2326,378 @@ struct LoopControlTemplateToken : public TemplateToken {
     LoopControlTemplateToken(const Location & loc, SpaceHandling pre, SpaceHandling post, LoopControlType control_type) : TemplateToken(Type::Break, loc, pre, post), control_type(control_type) {}
 };
 
+/*
+ * Where templates render to. Text is written as soon as it's produced, so a sink can hand it over (e.g. to a
+ * tokenizer) while the rest of the template is still rendering.
+ */
+class RenderSink {
+public:
+    virtual ~RenderSink() = default;
+    virtual void write(const char * data, size_t size) = 0;
+    /* Hands over anything buffered; called by chat_template::apply once the prompt is complete. */
+    virtual void flush() {}
+    /*
+     * Structure events, for sinks that track which part of the template produced which bytes (see SpanSink):
+     * a for loop starts iterating, moves on to one of its items, and is done; a {% generation %} block starts & ends.
+     */
+    virtual void enter_loop() {}
+    virtual void loop_item(const Value & /* item */) {}
+    virtual void exit_loop() {}
+    virtual void enter_generation() {}
+    virtual void exit_generation() {}
+    /* Whether the sink uses the structure events, which the blocks a RenderMemo replays don't send. */
+    virtual bool wants_events() const { return false; }
+    RenderSink & operator<<(const std::string & s) {
+        write(s.data(), s.size());
+        return *this;
+    }
+    RenderSink & operator<<(const char * s) {
+        write(s, strlen(s));
+        return *this;
+    }
+};
+
+/* Renders into a string, whose capacity is kept across clear() calls so one sink can be reused for many renders. */
+class StringSink : public RenderSink {
+    std::string buffer_;
+public:
+    explicit StringSink(size_t capacity = 0) {
+        buffer_.reserve(capacity);
+    }
+    void write(const char * data, size_t size) override {
+        buffer_.append(data, size);
+    }
+    const std::string & str() const { return buffer_; }
+    void clear() { buffer_.clear(); }
+    /* Moves the text out, leaving the sink empty (and without its capacity). */
+    std::string take() {
+        std::string result;
+        result.swap(buffer_);
+        return result;
+    }
+};
+
+/* Passes the text to a callback as it's rendered, batching writes into chunks of at least `min_chunk` bytes. */
+class CallbackSink : public RenderSink {
+public:
+    using Callback = std::function<void(const char * data, size_t size)>;
+private:
+    Callback callback_;
+    size_t min_chunk_;
+    std::string pending_;
+public:
+    explicit CallbackSink(Callback callback, size_t min_chunk = 0) : callback_(std::move(callback)), min_chunk_(min_chunk) {}
+    void write(const char * data, size_t size) override {
+        if (pending_.empty() && size >= min_chunk_) {
+            if (size) callback_(data, size);
+            return;
+        }
+        pending_.append(data, size);
+        if (pending_.size() >= min_chunk_) flush();
+    }
+    void flush() override {
+        if (pending_.empty()) return;
+        callback_(pending_.data(), pending_.size());
+        pending_.clear();
+    }
+};
+
+/*
+ * Forwards the text to another sink while recording which bytes each message rendered to, and where each
+ * {% generation %} block (the assistant's part of the prompt, for training masks) starts & ends.
+ *
+ * A message's span runs from the for loop iteration that has the message as its item to the next iteration (or the
+ * end of the loop): loops over `messages`, slices of it or anything else holding the same message objects all count,
+ * and loops nested in a message's span (e.g. over its content parts, or looking ahead at the next messages) don't
+ * split it. Offsets are relative to the first byte written through this sink; bytes outside of any span (the
+ * template's header, the generation prompt...) belong to no message.
+ */
+class SpanSink : public RenderSink {
+public:
+    static constexpr size_t npos = (size_t) -1;
+    struct Span {
+        size_t begin;
+        size_t end;
+        size_t message;  // npos for generation spans
+    };
+private:
+    RenderSink & out_;
+    size_t size_ = 0;
+    Value messages_;
+    std::vector<size_t> origins_;
+    size_t hint_ = 0;
+    std::vector<Span> message_spans_;
+    std::vector<Span> generation_spans_;
+    // For each loop being rendered, which of message_spans_ its current item opened (npos if none).
+    std::vector<size_t> loops_;
+    size_t open_ = 0;
+    std::vector<size_t> generations_;
+
+    size_t find_message(const Value & item) {
+        auto identity = item.identity();
+        if (!identity || !messages_.is_array()) return npos;
+        auto count = messages_.size();
+        for (size_t n = 0; n < count; ++n) {
+            // Messages are nearly always rendered in order, so start looking after the last one found.
+            auto index = (hint_ + n) % count;
+            if (messages_.get(Value((int64_t) index)).identity() == identity) {
+                hint_ = index + 1;
+                return index;
+            }
+        }
+        return npos;
+    }
+    void close_item() {
+        auto & open = loops_.back();
+        if (open == npos) return;
+        message_spans_[open].end = size_;
+        if (message_spans_[open].begin == size_ && open + 1 == message_spans_.size()) message_spans_.pop_back();
+        open = npos;
+        --open_;
+    }
+
+public:
+    explicit SpanSink(RenderSink & out) : out_(out) {}
+
+    /*
+     * The messages to look for. Their spans are numbered by index in `messages`, or by `origins[index]` when
+     * given (e.g. to map polyfilled messages back to the caller's; messages whose origin is npos get no span).
+     */
+    void set_messages(const Value & messages, std::vector<size_t> origins = {}) {
+        messages_ = messages;
+        origins_ = std::move(origins);
+        hint_ = 0;
+    }
+
+    void write(const char * data, size_t size) override {
+        size_ += size;
+        out_.write(data, size);
+    }
+    void flush() override { out_.flush(); }
+
+    void enter_loop() override { loops_.push_back(npos); }
+    void loop_item(const Value & item) override {
+        if (loops_.empty()) return;
+        close_item();
+        if (open_) return;
+        auto index = find_message(item);
+        if (index == npos) return;
+        auto message = origins_.empty() ? index : index < origins_.size() ? origins_[index] : npos;
+        if (message == npos) return;
+        loops_.back() = message_spans_.size();
+        ++open_;
+        message_spans_.push_back({size_, size_, message});
+    }
+    void exit_loop() override {
+        if (loops_.empty()) return;
+        close_item();
+        loops_.pop_back();
+    }
+    bool wants_events() const override { return true; }
+    void enter_generation() override { generations_.push_back(size_); }
+    void exit_generation() override {
+        if (generations_.empty()) return;
+        generation_spans_.push_back({generations_.back(), size_, npos});
+        generations_.pop_back();
+    }
+
+    /* The bytes written so far. */
+    size_t size() const { return size_; }
+    /* The non-empty spans of the messages, in output order; a message can have several (or none). */
+    const std::vector<Span> & message_spans() const { return message_spans_; }
+    /* The spans of the {% generation %} blocks, in the order they end. */
+    const std::vector<Span> & generation_spans() const { return generation_spans_; }
+};
+
+class TemplateNode;
+
+/**
+ * Remembers what the blocks of a template rendered to, so that rendering a block again with the same inputs (e.g.
+ * the tools section at each turn of a conversation) writes its output out instead. Opt-in: only the renders made on
+ * a thread while a RenderMemo::Scope is active use it, and TemplateProgram renders through its tree meanwhile.
+ *
+ * If / for blocks and macro bodies are cached when rendering them has no effect besides their output: they don't set
+ * namespace attributes, append to / pop from / insert into anything nor break out of an enclosing loop, and none of
+ * the names they can set where they render (including for loop variables, which stay set after the loop) is read
+ * anywhere in the template, except inside loops over that name. Their output is looked up by a fingerprint of what
+ * they read: the value of each variable (or of the constant paths they read in it, like `messages[0].role`) where
+ * they render. Blocks that read callables other than the builtins (macros, strftime_now...) or `loop` objects
+ * (except through their attributes) render as usual, and so does everything written to a sink that wants structure
+ * events (see SpanSink). Errors are only reported by the renders that don't hit the cache.
+ *
+ * Thread-safe: concurrent renders (each with its own Scope) can share a memo. Past `max_bytes` of cached output, the
+ * least recently used blocks are forgotten.
+ */
+class RenderMemo {
+    // A variable a block reads, or the constant subscripts it reads in it.
+    struct Read {
+        std::string name;
+        std::vector<Value> path;
+    };
+    struct Analysis {
+        std::weak_ptr<TemplateNode> root;
+        uint64_t id;
+        std::unordered_map<const TemplateNode *, std::vector<Read>> blocks;  // The cacheable ones, with what they read
+    };
+
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    /* Makes the renders of `root` (or of its nodes) on the current thread use `memo` until destroyed: one per render. */
+    class Scope {
+        friend class RenderMemo;
+        RenderMemo & memo_;
+        std::shared_ptr<const Analysis> analysis_;
+        Scope * previous_;
+        const TemplateNode * rendering_ = nullptr;  // The block being rendered for the cache, which mustn't look itself up
+        FingerprintCache digests_;  // Of the borrowed values read during this render
+    public:
+        Scope(RenderMemo & memo, const std::shared_ptr<TemplateNode> & root);
+        ~Scope() { current() = previous_; }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+    };
+
+    explicit RenderMemo(size_t max_bytes = 16 * 1024 * 1024) : max_bytes_(max_bytes) {
+        std::random_device random;
+        k0_ = ((uint64_t) random() << 32) ^ random();
+        k1_ = ((uint64_t) random() << 32) ^ random();
+    }
+    RenderMemo(const RenderMemo &) = delete;
+    RenderMemo & operator=(const RenderMemo &) = delete;
+
+    static Scope *& current() {
+        static thread_local Scope * scope = nullptr;
+        return scope;
+    }
+
+    /*
+     * Writes what `block` renders to in `context` (by rendering `body` if it's not cached yet) to `out`, or returns
+     * false without doing anything if there's no memo in use or the block can't be cached there.
+     */
+    static bool render(const TemplateNode & block, const TemplateNode & body, RenderSink & out, const std::shared_ptr<Context> & context);
+
+    Stats stats() const {
+        Stats stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        for (const auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.entries += shard.entries.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+    void clear() {
+        for (auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.index.clear();
+            shard.bytes = 0;
+        }
+    }
+
+private:
+    struct Key {
+        uint64_t template_id;
+        const TemplateNode * block;
+        Fingerprint::Digest digest;
+        bool operator==(const Key & other) const {
+            return template_id == other.template_id && block == other.block && digest == other.digest;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key & key) const { return (size_t) key.digest.first; }
+    };
+    struct Entry {
+        Key key;
+        std::shared_ptr<const std::string> output;
+    };
+    // Entries are spread over shards by digest, so that concurrent renders rarely wait for each other.
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> entries;  // Most recently used first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        size_t bytes = 0;
+    };
+    static constexpr size_t kShards = 16;
+
+    uint64_t k0_, k1_;  // The fingerprints' key
+    size_t max_bytes_;
+    std::mutex analyses_mutex_;
+    std::vector<std::shared_ptr<const Analysis>> analyses_;
+    uint64_t next_id_ = 0;
+    Shard shards_[kShards];
+    std::atomic<size_t> hits_ {0};
+    std::atomic<size_t> misses_ {0};
+
+    std::shared_ptr<const Analysis> analysis_for(const std::shared_ptr<TemplateNode> & root);
+    static void analyze(const std::shared_ptr<TemplateNode> & root, Analysis & analysis);
+    static void collect_reads(const std::shared_ptr<TemplateNode> & node, std::vector<std::string> & shadowed, std::vector<Read> & reads);
+    static void collect_reads(const std::shared_ptr<Expression> & expr, std::vector<std::string> & shadowed, std::vector<Read> & reads);
+    static bool has_effects(const std::shared_ptr<TemplateNode> & node, bool in_loop);
+    static bool has_effects(const std::shared_ptr<Expression> & expr);
+    static bool step(Value & value, const Value & key);
+    void store(const Key & key, const std::shared_ptr<const std::string> & output);
+};
+
 class TemplateNode {
     Location location_;
 protected:
-    virtual LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const = 0;
+    virtual LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const = 0;
 
 public:
-    TemplateNode(const Location & location) : location_(location) {}
-    LoopControlType render(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
+    enum Type {
+        Type_Sequence = 0,
+        Type_Text,
+        Type_Expression,
+        Type_If,
+        Type_LoopControl,
+        Type_For,
+        Type_Macro,
+        Type_Filter,
+        Type_Set,
+        Type_SetTemplate,
+        Type_Generation,
+    };
+    const int mType;
+
+    TemplateNode(const Location & location, int type) : location_(location), mType(type) {}
+    LoopControlType render(RenderSink & out, const std::shared_ptr<Context> & context) const {
+        if (auto budget = RenderBudget::current()) {
+            if (!budget->poll()) return LoopControlType::Normal;
+        }
+#ifdef MINJA_PROFILE
+        if (auto profiler = Profiler::current()) {
+            Profiler::Frame frame(*profiler, location_, Profiler::Kind_Node + mType);
+            return do_render(out, context);
+        }
+#endif
         return do_render(out, context);
     }
     const Location & location() const { return location_; }
     virtual ~TemplateNode() = default;
     std::string render(const std::shared_ptr<Context> & context) const {
-        std::ostringstream out;
+        StringSink out;
         render(out, context);
-        return out.str();
+        return out.take();
     }
+    /* Calls `node_fn` on every direct child node and `expr_fn` on every expression owned by this node (skipping nulls); either may replace the child it's given. */
+    virtual void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) = 0;
 };
 
 class SequenceNode : public TemplateNode {
     std::vector<std::shared_ptr<TemplateNode>> children;
 public:
     SequenceNode(const Location & loc, std::vector<std::shared_ptr<TemplateNode>> && c)
-      : TemplateNode(loc), children(std::move(c)) {}
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+      : TemplateNode(loc, TemplateNode::Type_Sequence), children(std::move(c)) {}
+    const std::vector<std::shared_ptr<TemplateNode>> & get_children() const { return children; }
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
         for (const auto& child : children) {
             auto type = child->render(out, context);
             if (LoopControlType::Normal != type) {
@@ -989,42 +2706,59 @@ public:
         }
         return LoopControlType::Normal;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> &) override {
+        for (auto & child : children) if (child) node_fn(child);
+    }
 };
 
 class TextNode : public TemplateNode {
     std::string text;
 public:
-    TextNode(const Location & loc, const std::string& t) : TemplateNode(loc), text(t) {}
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> &) const override {
+    TextNode(const Location & loc, const std::string& t) : TemplateNode(loc, TemplateNode::Type_Text), text(t) {}
+    const std::string & get_text() const { return text; }
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> &) const override {
+        if (!RenderBudget::allow_output(text.size())) return LoopControlType::Normal;
         out << text;
         return LoopControlType::Normal;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> &, const std::function<void(std::shared_ptr<Expression> &)> &) override {}
 };
 
 class ExpressionNode : public TemplateNode {
     std::shared_ptr<Expression> expr;
 public:
-    ExpressionNode(const Location & loc, std::shared_ptr<Expression> && e) : TemplateNode(loc), expr(std::move(e)) {}
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    ExpressionNode(const Location & loc, std::shared_ptr<Expression> && e) : TemplateNode(loc, TemplateNode::Type_Expression), expr(std::move(e)) {}
+    const std::shared_ptr<Expression> & get_expr() const { return expr; }
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
       if (!expr) _printlog("ExpressionNode.expr is null");
-      auto result = expr->evaluate(context);
+      render_value(out, expr->evaluate(context));
+        return LoopControlType::Normal;
+  }
+    /* How `{{ }}` prints a value: strings as is, booleans as True / False, none as nothing and anything else as JSON. */
+    static void render_value(RenderSink & out, const Value & result) {
       if (result.is_string()) {
+          if (!RenderBudget::allow_output(result.string_view().size())) return;
           out << result.get<std::string>();
       } else if (result.is_boolean()) {
           out << (result.get<bool>() ? "True" : "False");
       } else if (!result.is_null()) {
-          out << result.dump();
+          auto dump = result.dump();
+          if (RenderBudget::allow_output(dump.size())) out << dump;
       }
-        return LoopControlType::Normal;
-  }
+    }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> &, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        if (expr) expr_fn(expr);
+    }
 };
 
 class IfNode : public TemplateNode {
     std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade;
 public:
     IfNode(const Location & loc, std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> && c)
-        : TemplateNode(loc), cascade(std::move(c)) {}
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+        : TemplateNode(loc, TemplateNode::Type_If), cascade(std::move(c)) {}
+    const std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> & get_cascade() const { return cascade; }
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
+      if (RenderMemo::current() && RenderMemo::render(*this, *this, out, context)) return LoopControlType::Normal;
       for (const auto& branch : cascade) {
           auto enter_branch = true;
           if (branch.first) {
@@ -1037,15 +2771,23 @@ public:
       }
         return LoopControlType::Normal;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        for (auto & branch : cascade) {
+            if (branch.first) expr_fn(branch.first);
+            if (branch.second) node_fn(branch.second);
+        }
+    }
 };
 
 class LoopControlNode : public TemplateNode {
     LoopControlType control_type_;
   public:
-    LoopControlNode(const Location & loc, LoopControlType control_type) : TemplateNode(loc), control_type_(control_type) {}
-    LoopControlType do_render(std::ostringstream &, const std::shared_ptr<Context> &) const override {
+    LoopControlNode(const Location & loc, LoopControlType control_type) : TemplateNode(loc, TemplateNode::Type_LoopControl), control_type_(control_type) {}
+    LoopControlType get_control_type() const { return control_type_; }
+    LoopControlType do_render(RenderSink &, const std::shared_ptr<Context> &) const override {
         return control_type_;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> &, const std::function<void(std::shared_ptr<Expression> &)> &) override {}
 };
 
 class ForNode : public TemplateNode {
@@ -1055,13 +2797,36 @@ class ForNode : public TemplateNode {
     std::shared_ptr<TemplateNode> body;
     bool recursive;
     std::shared_ptr<TemplateNode> else_body;
+    // Slots of the loop context: the loop variables, `loop`, then whatever the body sets (see VariableResolver).
+    std::vector<std::string> frame_names;
 public:
     ForNode(const Location & loc, std::vector<std::string> && var_names, std::shared_ptr<Expression> && iterable,
       std::shared_ptr<Expression> && condition, std::shared_ptr<TemplateNode> && body, bool recursive, std::shared_ptr<TemplateNode> && else_body)
-            : TemplateNode(loc), var_names(var_names), iterable(std::move(iterable)), condition(std::move(condition)), body(std::move(body)), recursive(recursive), else_body(std::move(else_body)) {}
+            : TemplateNode(loc, TemplateNode::Type_For), var_names(var_names), iterable(std::move(iterable)), condition(std::move(condition)), body(std::move(body)), recursive(recursive), else_body(std::move(else_body)) {
+        add_frame_names(this->var_names);
+        add_frame_names({"loop"});
+    }
+
+    const std::vector<std::string> & get_var_names() const { return var_names; }
+    const std::vector<std::string> & get_frame_names() const { return frame_names; }
+    void add_frame_names(const std::vector<std::string> & names) {
+        for (const auto & name : names) {
+            if (std::find(frame_names.begin(), frame_names.end(), name) == frame_names.end()) frame_names.push_back(name);
+        }
+    }
+    /* The context the body renders in, for one run of the loop. */
+    std::shared_ptr<Context> make_loop_context(const std::shared_ptr<Context> & parent) const {
+        return make_render_shared<Context>(Value::object(), parent, &frame_names);
+    }
+    const std::shared_ptr<Expression> & get_iterable() const { return iterable; }
+    const std::shared_ptr<Expression> & get_condition() const { return condition; }
+    const std::shared_ptr<TemplateNode> & get_body() const { return body; }
+    const std::shared_ptr<TemplateNode> & get_else_body() const { return else_body; }
+    bool is_recursive() const { return recursive; }
 
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
       // https://jinja.palletsprojects.com/en/3.0.x/templates/#for
+      if (RenderMemo::current() && RenderMemo::render(*this, *this, out, context)) return LoopControlType::Normal;
       if (!iterable) _printlog("ForNode.iterable is null");
       if (!body) _printlog("ForNode.body is null");
 
@@ -1069,19 +2834,8 @@ public:
       Value::CallableType loop_function;
 
       std::function<LoopControlType(Value&)> visit = [&](Value& iter) {
-          auto filtered_items = Value::array();
-          if (!iter.is_null()) {
-            if (!iterable_value.is_iterable()) {
-              _printlog("For loop iterable must be iterable: " + iterable_value.dump());
-            }
-            iterable_value.for_each([&](Value & item) {
-                destructuring_assign(var_names, context, item);
-                if (!condition || condition->evaluate(context).to_bool()) {
-                  filtered_items.push_back(item);
-                }
-            });
-          }
-          if (filtered_items.empty()) {
+          auto items = collect_items(iter, context);
+          if (items.empty()) {
             if (else_body) {
               auto loopcode = else_body->render(out, context);
                 if (loopcode != LoopControlType::Normal) {
@@ -1089,53 +2843,72 @@ public:
                 }
             }
           } else {
-              auto loop = recursive ? Value::callable(loop_function) : Value::object();
-              loop.set("length", (int64_t) filtered_items.size());
-
-              size_t cycle_index = 0;
-              loop.set("cycle", Value::callable([&](const std::shared_ptr<Context> &, ArgumentsValue & args) {
-                  if (args.args.empty() || !args.kwargs.empty()) {
-                      _printlog("cycle() expects at least 1 positional argument and no named arg");
-                  }
-                  auto item = args.args[cycle_index];
-                  cycle_index = (cycle_index + 1) % args.args.size();
-                  return item;
-              }));
-              auto loop_context = Context::make(Value::object(), context);
+              auto loop = Value::loop(items, recursive ? loop_function : nullptr);
+              auto loop_context = make_loop_context(context);
               loop_context->set("loop", loop);
-              for (size_t i = 0, n = filtered_items.size(); i < n; ++i) {
-                  auto & item = filtered_items.at(i);
-                  destructuring_assign(var_names, loop_context, item);
-                  loop.set("index", (int64_t) i + 1);
-                  loop.set("index0", (int64_t) i);
-                  loop.set("revindex", (int64_t) (n - i));
-                  loop.set("revindex0", (int64_t) (n - i - 1));
-                  loop.set("length", (int64_t) n);
-                  loop.set("first", i == 0);
-                  loop.set("last", i == (n - 1));
-                  loop.set("previtem", i > 0 ? filtered_items.at(i - 1) : Value());
-                  loop.set("nextitem", i < n - 1 ? filtered_items.at(i + 1) : Value());
+              out.enter_loop();
+              // (Checking the size again as the body may shrink the array.)
+              for (size_t i = 0, n = items.size(); i < n && i < items.size(); ++i) {
+                  if (!RenderBudget::allow_iterations(1)) break;
+                  out.loop_item(items.at(i));
+                  destructuring_assign(var_names, loop_context, items.at(i));
+                  loop.set_loop_index(i);
                   auto control_type = body->render(out, loop_context);
                   if (control_type == LoopControlType::Break) break;
                   if (control_type == LoopControlType::Continue) continue;
               }
+              out.exit_loop();
           }
           return LoopControlType::Normal;
       };
 
       if (recursive) {
         loop_function = [&](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+            RenderBudget::Call call;
+            if (!call.ok()) return Value();
             if (args.args.size() != 1 || !args.kwargs.empty() || !args.args[0].is_array()) {
                 _printlog("loop() expects exactly 1 positional iterable argument");
+                return Value();
             }
             auto & items = args.args[0];
-            auto code = visit(items);
+            visit(items);
             return Value();
         };
       }
 
       return visit(iterable_value);
   }
+    /* The items the body runs for, out of the evaluated iterable. */
+    Value collect_items(Value & iter, const std::shared_ptr<Context> & context) const {
+          // Arrays are iterated in place; anything filtered (or the keys / chars of objects / strings) is collected first.
+          // Either way, the loop variables are left set to the last item in the enclosing context, where the condition
+          // is evaluated.
+          Value items;
+          if (iter.is_array() && !condition) {
+            items = iter;
+            if (auto n = items.size()) destructuring_assign(var_names, context, items.at(n - 1));
+          } else {
+            items = Value::array();
+            if (!iter.is_null()) {
+              if (!iter.is_iterable()) {
+                _printlog("For loop iterable must be iterable: " + iter.dump());
+              }
+              iter.for_each([&](Value & item) {
+                  destructuring_assign(var_names, context, item);
+                  if (!condition || condition->evaluate(context).to_bool()) {
+                    items.push_back(item);
+                  }
+              });
+            }
+          }
+          return items;
+    }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        if (iterable) expr_fn(iterable);
+        if (condition) expr_fn(condition);
+        if (body) node_fn(body);
+        if (else_body) node_fn(else_body);
+    }
 };
 
 class MacroNode : public TemplateNode {
@@ -1143,25 +2916,53 @@ class MacroNode : public TemplateNode {
     Expression::Parameters params;
     std::shared_ptr<TemplateNode> body;
     std::unordered_map<std::string, size_t> named_param_positions;
+    // Slots of each call's context: the parameters, then whatever the body sets (see VariableResolver).
+    std::vector<std::string> frame_names;
 public:
     MacroNode(const Location & loc, std::shared_ptr<VariableExpr> && n, Expression::Parameters && p, std::shared_ptr<TemplateNode> && b)
-        : TemplateNode(loc), name(std::move(n)), params(std::move(p)), body(std::move(b)) {
+        : TemplateNode(loc, TemplateNode::Type_Macro), name(std::move(n)), params(std::move(p)), body(std::move(b)) {
         for (size_t i = 0; i < params.size(); ++i) {
           const auto & name = params[i].first;
           if (!name.empty()) {
             named_param_positions[name] = i;
           }
+          add_frame_names({name});
         }
     }
-    LoopControlType do_render(std::ostringstream &, const std::shared_ptr<Context> & macro_context) const override {
+    const std::shared_ptr<VariableExpr> & get_name() const { return name; }
+    const Expression::Parameters & get_params() const { return params; }
+    const std::shared_ptr<TemplateNode> & get_body() const { return body; }
+    const std::vector<std::string> & get_frame_names() const { return frame_names; }
+    void add_frame_names(const std::vector<std::string> & names) {
+        for (const auto & name : names) {
+            if (std::find(frame_names.begin(), frame_names.end(), name) == frame_names.end()) frame_names.push_back(name);
+        }
+    }
+    /*
+     * Each call renders in its own context (child of the one the macro was defined in), so calls never write
+     * to shared state: the parsed template stays immutable, and concurrent renders / nested calls don't interfere.
+     */
+    LoopControlType do_render(RenderSink &, const std::shared_ptr<Context> & macro_context) const override {
         if (!name) _printlog("MacroNode.name is null");
         if (!body) _printlog("MacroNode.body is null");
-        auto callable = Value::callable([&](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
-            auto call_context = macro_context;
+        // Weak, as the defining context holds the macro (and the macro is only reachable from it or its children).
+        std::weak_ptr<Context> weak_macro_context = macro_context;
+        auto callable = Value::callable([this, weak_macro_context](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+            RenderBudget::Call call;
+            if (!call.ok()) return Value();
+            auto parent_context = weak_macro_context.lock();
+            if (!parent_context) {
+                _printlog("Macro " + name->get_name() + " called outside of the scope it was defined in");
+                return Value();
+            }
+            auto call_context = make_render_shared<Context>(Value::object(), parent_context, &frame_names);
             std::vector<bool> param_set(params.size(), false);
             for (size_t i = 0, n = args.args.size(); i < n; i++) {
                 auto & arg = args.args[i];
-                if (i >= params.size()) _printlog("Too many positional arguments for macro " + name->get_name());
+                if (i >= params.size()) {
+                    _printlog("Too many positional arguments for macro " + name->get_name());
+                    break;
+                }
                 param_set[i] = true;
                 auto & param_name = params[i].first;
                 call_context->set(param_name, arg);
@@ -1170,7 +2971,10 @@ public:
                 auto& arg_name = iter.first;
                 auto& value = iter.second;
                 auto it = named_param_positions.find(arg_name);
-                if (it == named_param_positions.end()) _printlog("Unknown parameter name for macro " + name->get_name() + ": " + arg_name);
+                if (it == named_param_positions.end()) {
+                    _printlog("Unknown parameter name for macro " + name->get_name() + ": " + arg_name);
+                    continue;
+                }
 
                 call_context->set(arg_name, value);
                 param_set[it->second] = true;
@@ -1182,11 +2986,18 @@ public:
                     call_context->set(params[i].first, val);
                 }
             }
-            return body->render(call_context);
+            StringSink rendered;
+            RenderBudget::Capture capture;
+            if (!RenderMemo::current() || !RenderMemo::render(*this, *body, rendered, call_context)) body->render(rendered, call_context);
+            return Value(rendered.take());
         });
         macro_context->set(name->get_name(), callable);
         return LoopControlType::Normal;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        for (auto & param : params) if (param.second) expr_fn(param.second);
+        if (body) node_fn(body);
+    }
 };
 
 class FilterNode : public TemplateNode {
@@ -1195,22 +3006,33 @@ class FilterNode : public TemplateNode {
 
 public:
     FilterNode(const Location & loc, std::shared_ptr<Expression> && f, std::shared_ptr<TemplateNode> && b)
-        : TemplateNode(loc), filter(std::move(f)), body(std::move(b)) {}
+        : TemplateNode(loc, TemplateNode::Type_Filter), filter(std::move(f)), body(std::move(b)) {}
+    const std::shared_ptr<Expression> & get_filter() const { return filter; }
+    const std::shared_ptr<TemplateNode> & get_body() const { return body; }
 
-    LoopControlType do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
         if (!filter) _printlog("FilterNode.filter is null");
         if (!body) _printlog("FilterNode.body is null");
         auto filter_value = filter->evaluate(context);
         if (!filter_value.is_callable()) {
             _printlog("Filter must be a callable: " + filter_value.dump());
         }
-        std::string rendered_body = body->render(context);
+        std::string rendered_body;
+        {
+            RenderBudget::Capture capture;
+            rendered_body = body->render(context);
+        }
 
         ArgumentsValue filter_args = {{Value(rendered_body)}, {}};
         auto result = filter_value.call(context, filter_args);
-        out << result.to_str();
+        auto str = result.to_str();
+        if (RenderBudget::allow_output(str.size())) out << str;
         return LoopControlType::Normal;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        if (filter) expr_fn(filter);
+        if (body) node_fn(body);
+    }
 };
 
 class SetNode : public TemplateNode {
@@ -1219,8 +3041,19 @@ class SetNode : public TemplateNode {
     std::shared_ptr<Expression> value;
 public:
     SetNode(const Location & loc, const std::string & ns, const std::vector<std::string> & vns, std::shared_ptr<Expression> && v)
-        : TemplateNode(loc), ns(ns), var_names(vns), value(std::move(v)) {}
-    LoopControlType do_render(std::ostringstream &, const std::shared_ptr<Context> & context) const override {
+        : TemplateNode(loc, TemplateNode::Type_Set), ns(ns), var_names(vns), value(std::move(v)) {}
+    const std::string & get_ns() const { return ns; }
+    const std::vector<std::string> & get_var_names() const { return var_names; }
+    const std::shared_ptr<Expression> & get_value() const { return value; }
+    /* For `set x = x ~ a ~ b` (or with `+`, or `set ns.x = ns.x ~ ...`): the `x` that chain starts with, otherwise null. */
+    const Expression * append_target() const;
+    /*
+     * Renders the sets append_target() matches (returning false for the others): when x is a string, a & b are
+     * appended to the stored x in place if nothing else shares it, instead of copying the whole string at each step
+     * (which makes loops accumulating a prompt quadratic).
+     */
+    bool append(const std::shared_ptr<Context> & context, Value * ns_value) const;
+    LoopControlType do_render(RenderSink &, const std::shared_ptr<Context> & context) const override {
       if (!value) _printlog("SetNode.value is null");
       if (!ns.empty()) {
         if (var_names.size() != 1) {
@@ -1229,14 +3062,17 @@ public:
         auto & name = var_names[0];
         auto ns_value = context->get(ns);
         if (!ns_value.is_object()) _printlog("Namespace '" + ns + "' is not an object");
-        ns_value.set(name, this->value->evaluate(context));
-      } else {
+        if (!append(context, &ns_value)) ns_value.set(name, this->value->evaluate(context));
+      } else if (!append(context, nullptr)) {
         auto val = value->evaluate(context);
         destructuring_assign(var_names, context, val);
       }
         return LoopControlType::Normal;
 
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> &, const std::function<void(std::shared_ptr<Expression> &)> & expr_fn) override {
+        if (value) expr_fn(value);
+    }
 };
 
 class SetTemplateNode : public TemplateNode {
@@ -1244,14 +3080,38 @@ class SetTemplateNode : public TemplateNode {
     std::shared_ptr<TemplateNode> template_value;
 public:
     SetTemplateNode(const Location & loc, const std::string & name, std::shared_ptr<TemplateNode> && tv)
-        : TemplateNode(loc), name(name), template_value(std::move(tv)) {}
-    LoopControlType do_render(std::ostringstream &, const std::shared_ptr<Context> & context) const override {
+        : TemplateNode(loc, TemplateNode::Type_SetTemplate), name(name), template_value(std::move(tv)) {}
+    const std::string & get_name() const { return name; }
+    const std::shared_ptr<TemplateNode> & get_template_value() const { return template_value; }
+    LoopControlType do_render(RenderSink &, const std::shared_ptr<Context> & context) const override {
       if (!template_value) _printlog("SetTemplateNode.template_value is null");
+      RenderBudget::Capture capture;
       Value value { template_value->render(context) };
       context->set(name, value);
         return LoopControlType::Normal;
 
     }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> &) override {
+        if (template_value) node_fn(template_value);
+    }
+};
+
+/* `{% generation %}...{% endgeneration %}`: renders its body as is, telling the sink where it starts & ends (see SpanSink). */
+class GenerationNode : public TemplateNode {
+    std::shared_ptr<TemplateNode> body;
+public:
+    GenerationNode(const Location & loc, std::shared_ptr<TemplateNode> && b)
+        : TemplateNode(loc, TemplateNode::Type_Generation), body(std::move(b)) {}
+    const std::shared_ptr<TemplateNode> & get_body() const { return body; }
+    LoopControlType do_render(RenderSink & out, const std::shared_ptr<Context> & context) const override {
+        out.enter_generation();
+        auto control_type = body ? body->render(out, context) : LoopControlType::Normal;
+        out.exit_generation();
+        return control_type;
+    }
+    void for_each_child(const std::function<void(std::shared_ptr<TemplateNode> &)> & node_fn, const std::function<void(std::shared_ptr<Expression> &)> &) override {
+        if (body) node_fn(body);
+    }
 };
 
 class IfExpr : public Expression {
@@ -1261,6 +3121,9 @@ class IfExpr : public Expression {
 public:
     IfExpr(const Location & loc, std::shared_ptr<Expression> && c, std::shared_ptr<Expression> && t, std::shared_ptr<Expression> && e)
         : Expression(loc, Expression::Type_If), condition(std::move(c)), then_expr(std::move(t)), else_expr(std::move(e)) {}
+    const std::shared_ptr<Expression> & get_condition() const { return condition; }
+    const std::shared_ptr<Expression> & get_then_expr() const { return then_expr; }
+    const std::shared_ptr<Expression> & get_else_expr() const { return else_expr; }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
       if (!condition) _printlog("IfExpr.condition is null");
       if (!then_expr) _printlog("IfExpr.then_expr is null");
@@ -1272,6 +3135,11 @@ public:
       }
       return nullptr;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+      if (condition) fn(condition);
+      if (then_expr) fn(then_expr);
+      if (else_expr) fn(else_expr);
+    }
 };
 
 class LiteralExpr : public Expression {
@@ -1279,6 +3147,7 @@ class LiteralExpr : public Expression {
 public:
     LiteralExpr(const Location & loc, const Value& v)
       : Expression(loc, Expression::Type_Liter), value(v) {}
+    const Value & get_value() const { return value; }
     Value do_evaluate(const std::shared_ptr<Context> &) const override { return value; }
 };
 
@@ -1287,6 +3156,7 @@ class ArrayExpr : public Expression {
 public:
     ArrayExpr(const Location & loc, std::vector<std::shared_ptr<Expression>> && e)
       : Expression(loc, Expression::Type_Array), elements(std::move(e)) {}
+    const std::vector<std::shared_ptr<Expression>> & get_elements() const { return elements; }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         auto result = Value::array();
         for (const auto& e : elements) {
@@ -1295,6 +3165,9 @@ public:
         }
         return result;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        for (auto & e : elements) if (e) fn(e);
+    }
 };
 
 class DictExpr : public Expression {
@@ -1302,6 +3175,7 @@ class DictExpr : public Expression {
 public:
     DictExpr(const Location & loc, std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> && e)
       : Expression(loc, Expression::Type_Dict), elements(std::move(e)) {}
+    const std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> & get_elements() const { return elements; }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         auto result = Value::object();
         for (const auto& iter : elements) {
@@ -1313,6 +3187,12 @@ public:
         }
         return result;
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        for (auto & iter : elements) {
+            if (iter.first) fn(iter.first);
+            if (iter.second) fn(iter.second);
+        }
+    }
 };
 
 class SliceExpr : public Expression {
@@ -1325,6 +3205,11 @@ public:
         _printlog("SliceExpr not implemented");
         return Value();
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (start) fn(start);
+        if (end) fn(end);
+        if (step) fn(step);
+    }
 };
 
 class SubscriptExpr : public Expression {
@@ -1333,6 +3218,12 @@ class SubscriptExpr : public Expression {
 public:
     SubscriptExpr(const Location & loc, std::shared_ptr<Expression> && b, std::shared_ptr<Expression> && i)
         : Expression(loc, Expression::Type_Subscript), base(std::move(b)), index(std::move(i)) {}
+    const std::shared_ptr<Expression> & get_base() const { return base; }
+    const std::shared_ptr<Expression> & get_index() const { return index; }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (base) fn(base);
+        if (index) fn(index);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         auto target_value = base->evaluate(context);
         if (index->mType == Expression::Type_Slice){
@@ -1394,7 +3285,12 @@ public:
                 }
             }
         } else {
-          auto index_value = index->evaluate(context);
+          return get_item(target_value, index->evaluate(context), context);
+        }
+        return Value();
+    }
+    /* The (non-slice) subscript of the evaluated base. */
+    Value get_item(Value & target_value, const Value & index_value, const std::shared_ptr<Context> & context) const {
           if (target_value.is_null()) {
             if (base->mType == Expression::Type_Variable) {
                 auto t = (VariableExpr*)(base.get());
@@ -1403,8 +3299,6 @@ public:
             _printlog("Trying to access property '" +  index_value.dump() + "' on null!");
           }
           return target_value.get(index_value);
-        }
-        return Value();
     }
 };
 
@@ -1430,6 +3324,9 @@ public:
         _printlog("Unknown unary operator");
         return Value();
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (expr) fn(expr);
+    }
 };
 
 class BinaryOpExpr : public Expression {
@@ -1439,14 +3336,51 @@ private:
     std::shared_ptr<Expression> left;
     std::shared_ptr<Expression> right;
     Op op;
+    // For `in` / `not in` a literal list of primitives (e.g. tool names): its truthy items, the only ones
+    // Value::contains matches, hashed once so that membership doesn't scan (or rebuild) the list.
+    std::shared_ptr<const std::unordered_set<Value>> members;
+
+    static std::shared_ptr<const std::unordered_set<Value>> literal_members(const std::shared_ptr<Expression> & list) {
+        if (!list) return nullptr;
+        std::vector<Value> items;
+        if (list->mType == Expression::Type_Array) {
+            for (const auto & element : ((ArrayExpr*)list.get())->get_elements()) {
+                if (!element || element->mType != Expression::Type_Liter) return nullptr;
+                items.push_back(((LiteralExpr*)element.get())->get_value());
+            }
+        } else if (list->mType == Expression::Type_Liter && ((LiteralExpr*)list.get())->get_value().is_array()) {
+            ((LiteralExpr*)list.get())->get_value().for_each([&](Value & item) { items.push_back(item); });
+        } else {
+            return nullptr;
+        }
+        auto set = std::make_shared<std::unordered_set<Value>>();
+        for (const auto & item : items) {
+            if (!item.is_primitive()) return nullptr;
+            if (item.to_bool()) set->insert(item);
+        }
+        return set;
+    }
 public:
     BinaryOpExpr(const Location & loc, std::shared_ptr<Expression> && l, std::shared_ptr<Expression> && r, Op o)
-        : Expression(loc, Expression::Type_Binary), left(std::move(l)), right(std::move(r)), op(o) {}
+        : Expression(loc, Expression::Type_Binary), left(std::move(l)), right(std::move(r)), op(o) {
+        if (op == Op::In || op == Op::NotIn) members = literal_members(right);
+    }
+    const std::shared_ptr<Expression> & get_left() const { return left; }
+    const std::shared_ptr<Expression> & get_right() const { return right; }
+    Op get_op() const { return op; }
+    const std::unordered_set<Value> * get_members() const { return members.get(); }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (left) fn(left);
+        // The right side of `is` / `is not` names a test, not a variable.
+        if (right && op != Op::Is && op != Op::IsNot) fn(right);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         if (!left) _printlog("BinaryOpExpr.left is null");
         if (!right) _printlog("BinaryOpExpr.right is null");
-        auto l = left->evaluate(context);
-
+        return apply(left->evaluate(context), context);
+    }
+    /* The result for the already evaluated left operand (the right one is evaluated here, if needed). */
+    Value apply(const Value & l, const std::shared_ptr<Context> & context) const {
         auto do_eval = [&](const Value & l) -> Value {
           if (op == Op::Is || op == Op::IsNot) {
             auto t = (VariableExpr*)(right.get());
@@ -1473,6 +3407,11 @@ public:
             return Value(op == Op::Is ? value : !value);
           }
 
+          if (members) {
+            auto found = l.is_primitive() && members->count(l);
+            return Value(op == Op::In ? found : !found);
+          }
+
           if (op == Op::And) {
             if (!l.to_bool()) return Value(false);
             return right->evaluate(context).to_bool();
@@ -1481,7 +3420,20 @@ public:
             return right->evaluate(context);
           }
 
-          auto r = right->evaluate(context);
+          return combine(op, l, right->evaluate(context));
+        };
+
+        if (l.is_callable()) {
+          return Value::callable([l, do_eval](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+            auto ll = l.call(context, args);
+            return do_eval(ll); //args[0].second);
+          });
+        } else {
+          return do_eval(l);
+        }
+    }
+    /* Applies any operator but `and`, `or` & `is` to evaluated operands. */
+    static Value combine(Op op, const Value & l, const Value & r) {
           switch (op) {
               case Op::StrConcat: return l.to_str() + r.to_str();
               case Op::Add:       return l + r;
@@ -1503,18 +3455,71 @@ public:
           }
           _printlog("Unknown binary operator");
           return false;
-        };
+    }
+};
 
-        if (l.is_callable()) {
-          return Value::callable([l, do_eval](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
-            auto ll = l.call(context, args);
-            return do_eval(ll); //args[0].second);
-          });
-        } else {
-          return do_eval(l);
+inline const Expression * SetNode::append_target() const {
+    if (!value || value->mType != Expression::Type_Binary || var_names.size() != 1) return nullptr;
+    auto expr = value.get();
+    while (expr->mType == Expression::Type_Binary) {
+        auto binary = (const BinaryOpExpr*)expr;
+        if (binary->get_op() != BinaryOpExpr::Op::StrConcat && binary->get_op() != BinaryOpExpr::Op::Add) return nullptr;
+        if (!binary->get_left() || !binary->get_right()) return nullptr;
+        expr = binary->get_left().get();
+    }
+    if (ns.empty()) {
+        return expr->mType == Expression::Type_Variable && ((const VariableExpr*)expr)->get_name() == var_names[0] ? expr : nullptr;
+    }
+    if (expr->mType != Expression::Type_Subscript) return nullptr;
+    const auto & base = ((const SubscriptExpr*)expr)->get_base();
+    const auto & index = ((const SubscriptExpr*)expr)->get_index();
+    if (!base || base->mType != Expression::Type_Variable || ((const VariableExpr*)base.get())->get_name() != ns) return nullptr;
+    if (!index || index->mType != Expression::Type_Liter) return nullptr;
+    return ((const LiteralExpr*)index.get())->get_value().string_view() == var_names[0] ? expr : nullptr;
+}
+
+inline bool SetNode::append(const std::shared_ptr<Context> & context, Value * ns_value) const {
+    auto target = append_target();
+    if (!target) return false;
+    // The chain's operators, innermost (the first to apply) last.
+    std::vector<const BinaryOpExpr *> chain;
+    for (auto expr = value.get(); expr != target; expr = ((const BinaryOpExpr*)expr)->get_left().get()) {
+        chain.push_back((const BinaryOpExpr*)expr);
+    }
+    auto store = [&](Value & result) {
+        if (ns_value) ns_value->set(var_names[0], result);
+        else destructuring_assign(var_names, context, result);
+    };
+    auto current = target->evaluate(context);
+    if (!current.is_string()) {
+        // Same evaluation as the tree's (e.g. `count + 1`).
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) current = (*it)->apply(current, context);
+        store(current);
+        return true;
+    }
+    // Both `~` and `+` on a string concatenate the operands' strings. They're all evaluated before anything is
+    // appended, as they may read x too.
+    std::vector<Value> operands;
+    operands.reserve(chain.size());
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) operands.push_back((*it)->get_right()->evaluate(context));
+    auto append_operands = [&](Value & s) {
+        for (const auto & operand : operands) {
+            if (operand.is_string()) s.append_string(operand.string_view());
+            else s.append_string(operand.to_str());
         }
+    };
+    auto stored = ns_value ? (ns_value->is_object() ? ns_value->find(var_names[0]) : nullptr) : context->find_own(var_names[0]);
+    if (stored && stored->is_string() && stored->string_view().data() == current.string_view().data()
+        && stored->string_view().size() == current.string_view().size()) {
+        // x is set right where this node sets it: grow that value (the only owner of its buffer once `current` is gone).
+        current = Value();
+        append_operands(*stored);
+        return true;
     }
-};
+    append_operands(current);
+    store(current);
+    return true;
+}
 
 struct ArgumentsExpression {
     std::vector<std::shared_ptr<Expression>> args;
@@ -1554,27 +3559,37 @@ struct ArgumentsExpression {
         }
         return vargs;
     }
+
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) {
+        for (auto & arg : args) if (arg) fn(arg);
+        for (auto & kwarg : kwargs) if (kwarg.second) fn(kwarg.second);
+    }
 };
 
-static std::string strip(const std::string & s, const std::string & chars = "", bool left = true, bool right = true) {
-  auto charset = chars.empty() ? " \t\n\r" : chars;
+/* The part of `s` left once the `chars` (by default, whitespace) at its start and / or end are removed. */
+static std::string_view strip(std::string_view s, std::string_view chars = {}, bool left = true, bool right = true) {
+  auto charset = chars.empty() ? std::string_view(" \t\n\r") : chars;
   auto start = left ? s.find_first_not_of(charset) : 0;
-  if (start == std::string::npos) return "";
+  if (start == std::string_view::npos) return {};
   auto end = right ? s.find_last_not_of(charset) : s.size() - 1;
   return s.substr(start, end - start + 1);
 }
 
-static std::vector<std::string> split(const std::string & s, const std::string & sep) {
-  std::vector<std::string> result;
-  size_t start = 0;
-  size_t end = s.find(sep);
-  while (end != std::string::npos) {
-    result.push_back(s.substr(start, end - start));
-    start = end + sep.length();
-    end = s.find(sep, start);
+/* Calls `fn` on each part of `s` between occurrences of the (non-empty) `sep`. */
+template <typename Fn>
+static void split(std::string_view s, std::string_view sep, Fn && fn) {
+  auto data = s.data(), end = data + s.size();
+  for (auto start = data;;) {
+    auto p = start;
+    // memchr to the candidates, which are mostly matches for the short separators templates use.
+    while ((p = find_byte(p, end, sep[0])) != end && (size_t) (end - p) >= sep.size() && std::memcmp(p, sep.data(), sep.size()) != 0) ++p;
+    if (p == end || (size_t) (end - p) < sep.size()) {
+      fn(std::string_view(start, end - start));
+      return;
+    }
+    fn(std::string_view(start, p - start));
+    start = p + sep.size();
   }
-  result.push_back(s.substr(start));
-  return result;
 }
 
 static std::string capitalize(const std::string & s) {
@@ -1584,29 +3599,78 @@ static std::string capitalize(const std::string & s) {
   return result;
 }
 
-static std::string html_escape(const std::string & s) {
+static std::string html_escape(std::string_view s) {
   std::string result;
   result.reserve(s.size());
-  for (const auto & c : s) {
-    switch (c) {
+  // Copies the runs between the characters to escape (usually, the whole string) in one go.
+  for (auto p = s.data(), end = p + s.size();; ++p) {
+    auto special = find_first_of_bytes(p, end, "&<>\"'");
+    result.append(p, special - p);
+    if (special == end) break;
+    p = special;
+    switch (*p) {
       case '&': result += "&amp;"; break;
       case '<': result += "&lt;"; break;
       case '>': result += "&gt;"; break;
       case '"': result += "&#34;"; break;
-      case '\'': result += "&apos;"; break;
-      default: result += c; break;
+      default: result += "&apos;"; break;
     }
   }
   return result;
 }
 
 class MethodCallExpr : public Expression {
-    std::shared_ptr<Expression> object;
-    std::shared_ptr<VariableExpr> method;
+public:
+    // The builtin methods, resolved from the method name once when the expression is built.
+    enum Method {
+        Method_Other = 0,  // Only found as a callable property of an object
+        Method_Append,
+        Method_Pop,
+        Method_Insert,
+        Method_Items,
+        Method_Get,
+        Method_Cycle,
+        Method_Strip,
+        Method_LStrip,
+        Method_RStrip,
+        Method_Split,
+        Method_Capitalize,
+        Method_EndsWith,
+        Method_StartsWith,
+        Method_Title,
+    };
+    static Method resolve_method(const std::string & name) {
+        static const std::pair<const char *, Method> methods[] = {
+            {"append", Method_Append}, {"pop", Method_Pop}, {"insert", Method_Insert}, {"items", Method_Items},
+            {"get", Method_Get}, {"cycle", Method_Cycle}, {"strip", Method_Strip}, {"lstrip", Method_LStrip},
+            {"rstrip", Method_RStrip}, {"split", Method_Split}, {"capitalize", Method_Capitalize},
+            {"endswith", Method_EndsWith}, {"startswith", Method_StartsWith}, {"title", Method_Title},
+        };
+        for (const auto & m : methods) {
+            if (name == m.first) return m.second;
+        }
+        return Method_Other;
+    }
+
+private:
+    std::shared_ptr<Expression> object;
+    std::shared_ptr<VariableExpr> method;
     ArgumentsExpression args;
+    Method method_id;
 public:
     MethodCallExpr(const Location & loc, std::shared_ptr<Expression> && obj, std::shared_ptr<VariableExpr> && m, ArgumentsExpression && a)
-        : Expression(loc, Expression::Type_MethodCall), object(std::move(obj)), method(std::move(m)), args(std::move(a)) {}
+        : Expression(loc, Expression::Type_MethodCall), object(std::move(obj)), method(std::move(m)), args(std::move(a)),
+          method_id(method ? resolve_method(method->get_name()) : Method_Other) {}
+    std::string get_method_name() const { return method->get_name(); }
+    Method get_method_id() const { return method_id; }
+    const std::shared_ptr<Expression> & get_object() const { return object; }
+    const std::shared_ptr<VariableExpr> & get_method() const { return method; }
+    const ArgumentsExpression & get_args() const { return args; }
+    // The method name is not a variable reference, only the object and the arguments are visited.
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (object) fn(object);
+        args.for_each_child(fn);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         if (!object) _printlog("MethodCallExpr.object is null");
         if (!method) _printlog("MethodCallExpr.method is null");
@@ -1617,88 +3681,107 @@ public:
             return Value();
         }
         if (obj.is_array()) {
-          if (method->get_name() == "append") {
+          switch (method_id) {
+            case Method_Append:
               vargs.expectArgs("append method", {1, 1}, {0, 0});
               obj.push_back(vargs.args[0]);
               return Value();
-          } else if (method->get_name() == "pop") {
+            case Method_Pop:
               vargs.expectArgs("pop method", {0, 1}, {0, 0});
               return obj.pop(vargs.args.empty() ? Value() : vargs.args[0]);
-          } else if (method->get_name() == "insert") {
+            case Method_Insert: {
               vargs.expectArgs("insert method", {2, 2}, {0, 0});
               auto index = vargs.args[0].get<int64_t>();
               if (index < 0 || index > (int64_t) obj.size()) _printlog("Index out of range for insert method");
               obj.insert(index, vargs.args[1]);
               return Value();
+            }
+            default:
+              break;
           }
         } else if (obj.is_object()) {
-          if (method->get_name() == "items") {
-            vargs.expectArgs("items method", {0, 0}, {0, 0});
-            auto result = Value::array();
-            for (const auto& key : obj.keys()) {
-              result.push_back(Value::array({key, obj.at(key)}));
-            }
-            return result;
-          } else if (method->get_name() == "pop") {
-            vargs.expectArgs("pop method", {1, 1}, {0, 0});
-            return obj.pop(vargs.args[0]);
-          } else if (method->get_name() == "get") {
-            vargs.expectArgs("get method", {1, 2}, {0, 0});
-            auto key = vargs.args[0];
-            if (vargs.args.size() == 1) {
-              return obj.contains(key) ? obj.at(key) : Value();
-            } else {
-              return obj.contains(key) ? obj.at(key) : vargs.args[1];
+          switch (method_id) {
+            case Method_Items: {
+              vargs.expectArgs("items method", {0, 0}, {0, 0});
+              auto result = Value::array();
+              for (const auto& key : obj.keys()) {
+                result.push_back(Value::array({key, obj.at(key)}));
+              }
+              return result;
             }
-          } else if (obj.contains(method->get_name())) {
-            auto callable = obj.at(method->get_name());
+            case Method_Pop:
+              vargs.expectArgs("pop method", {1, 1}, {0, 0});
+              return obj.pop(vargs.args[0]);
+            case Method_Get: {
+              vargs.expectArgs("get method", {1, 2}, {0, 0});
+              auto key = vargs.args[0];
+              if (vargs.args.size() == 1) {
+                return obj.contains(key) ? obj.at(key) : Value();
+              } else {
+                return obj.contains(key) ? obj.at(key) : vargs.args[1];
+              }
+            }
+            case Method_Cycle:
+              if (obj.is_loop()) return obj.cycle(vargs);
+              break;
+            default:
+              break;
+          }
+          const auto & name = method->get_name();
+          if (obj.contains(name)) {
+            auto callable = obj.at(name);
             if (!callable.is_callable()) {
-              _printlog("Property '" + method->get_name() + "' is not callable");
+              _printlog("Property '" + name + "' is not callable");
             }
             return callable.call(context, vargs);
           }
         } else if (obj.is_string()) {
-          auto str = obj.get<std::string>();
-          if (method->get_name() == "strip") {
-            vargs.expectArgs("strip method", {0, 1}, {0, 0});
-            auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
-            return Value(strip(str, chars));
-          } else if (method->get_name() == "lstrip") {
-            vargs.expectArgs("lstrip method", {0, 1}, {0, 0});
-            auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
-            return Value(strip(str, chars, /* left= */ true, /* right= */ false));
-          } else if (method->get_name() == "rstrip") {
-            vargs.expectArgs("rstrip method", {0, 1}, {0, 0});
-            auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
-            return Value(strip(str, chars, /* left= */ false, /* right= */ true));
-          } else if (method->get_name() == "split") {
-            vargs.expectArgs("split method", {1, 1}, {0, 0});
-            auto sep = vargs.args[0].get<std::string>();
-            auto parts = split(str, sep);
-            Value result = Value::array();
-            for (const auto& part : parts) {
-              result.push_back(Value(part));
-            }
-            return result;
-          } else if (method->get_name() == "capitalize") {
-            vargs.expectArgs("capitalize method", {0, 0}, {0, 0});
-            return Value(capitalize(str));
-          } else if (method->get_name() == "endswith") {
-            vargs.expectArgs("endswith method", {1, 1}, {0, 0});
-            auto suffix = vargs.args[0].get<std::string>();
-            return suffix.length() <= str.length() && std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
-          } else if (method->get_name() == "startswith") {
-            vargs.expectArgs("startswith method", {1, 1}, {0, 0});
-            auto prefix = vargs.args[0].get<std::string>();
-            return prefix.length() <= str.length() && std::equal(prefix.begin(), prefix.end(), str.begin());
-          } else if (method->get_name() == "title") {
-            vargs.expectArgs("title method", {0, 0}, {0, 0});
-            auto res = str;
-            for (size_t i = 0, n = res.size(); i < n; ++i) {
-              if (i == 0 || std::isspace(res[i - 1])) res[i] = std::toupper(res[i]);
-              else res[i] = std::tolower(res[i]);
-            }
-            return res;
+          switch (method_id) {
+            case Method_Strip:
+            case Method_LStrip:
+            case Method_RStrip: {
+              const char * method_name = method_id == Method_Strip ? "strip method" : method_id == Method_LStrip ? "lstrip method" : "rstrip method";
+              vargs.expectArgs(method_name, {0, 1}, {0, 0});
+              auto chars = vargs.args.empty() ? std::string_view() : vargs.args[0].string_view();
+              return Value(strip(obj.string_view(), chars, /* left= */ method_id != Method_RStrip, /* right= */ method_id != Method_LStrip));
+            }
+            case Method_Split: {
+              vargs.expectArgs("split method", {1, 1}, {0, 0});
+              auto sep = vargs.args[0].string_view();
+              if (sep.empty()) {
+                _printlog("Empty separator");
+                return Value();
+              }
+              Value result = Value::array();
+              split(obj.string_view(), sep, [&](std::string_view part) { result.push_back(Value(part)); });
+              return result;
+            }
+            case Method_Capitalize:
+              vargs.expectArgs("capitalize method", {0, 0}, {0, 0});
+              return Value(capitalize(obj.get<std::string>()));
+            case Method_EndsWith: {
+              vargs.expectArgs("endswith method", {1, 1}, {0, 0});
+              auto suffix = vargs.args[0].string_view();
+              auto str = obj.string_view();
+              return suffix.length() <= str.length() && std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
+            }
+            case Method_StartsWith: {
+              vargs.expectArgs("startswith method", {1, 1}, {0, 0});
+              auto prefix = vargs.args[0].string_view();
+              auto str = obj.string_view();
+              return prefix.length() <= str.length() && std::equal(prefix.begin(), prefix.end(), str.begin());
+            }
+            case Method_Title: {
+              vargs.expectArgs("title method", {0, 0}, {0, 0});
+              auto res = obj.get<std::string>();
+              for (size_t i = 0, n = res.size(); i < n; ++i) {
+                if (i == 0 || std::isspace((unsigned char) res[i - 1])) res[i] = std::toupper(res[i]);
+                else res[i] = std::tolower(res[i]);
+              }
+              return res;
+            }
+            default:
+              break;
           }
         }
         // _printlog("Unknown method: " + method->get_name());
@@ -1712,6 +3795,10 @@ public:
     ArgumentsExpression args;
     CallExpr(const Location & loc, std::shared_ptr<Expression> && obj, ArgumentsExpression && a)
         : Expression(loc, Expression::Type_Call), object(std::move(obj)), args(std::move(a)) {}
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        if (object) fn(object);
+        args.for_each_child(fn);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         if (!object) {
             _printlog("CallExpr.object is null");
@@ -1728,214 +3815,1182 @@ public:
 };
 
 class FilterExpr : public Expression {
+public:
+    // The default builtin filters a part can call that run fused with their neighbours (see bind_pipeline).
+    enum Stage : uint8_t {
+        Stage_None = 0,
+        // Sequence filters, taking each item through to the next stage or dropping it
+        Stage_Select,
+        Stage_Reject,
+        Stage_SelectAttr,
+        Stage_RejectAttr,
+        Stage_Map,
+        Stage_Unique,
+        Stage_List,
+        // Filters consuming the sequence (`length` and `count`, `last`, `join`)
+        Stage_Length,
+        Stage_Last,
+        Stage_Join,
+    };
+
+private:
     std::vector<std::shared_ptr<Expression>> parts;
+    std::vector<Stage> stages;  // One per part, empty until bind_pipeline
+
+    // The per-render state of a sequence stage.
+    struct StageState {
+        Stage stage;
+        ArgumentsValue args;  // The evaluated arguments, after the implicit input
+        Value fn;  // The test (select & co) or filter (map) called on each item
+        Value key;  // The attribute selectattr, rejectattr and map read
+        Value fallback;  // map's default
+        std::unordered_set<Value> seen;
+    };
+
+    static bool accepts_args(Stage stage, const ArgumentsExpression * args) {
+        size_t positional = args ? args->args.size() : 0;
+        std::vector<std::string> names;
+        if (args) {
+            for (const auto & arg : args->args) {
+                if (!arg) return false;
+                // Expansions make the number of arguments dynamic.
+                if (arg->mType == Expression::Type_Unary && (((UnaryOpExpr*)arg.get())->op == UnaryOpExpr::Op::Expansion
+                                                              || ((UnaryOpExpr*)arg.get())->op == UnaryOpExpr::Op::ExpansionDict)) {
+                    return false;
+                }
+            }
+            for (const auto & kwarg : args->kwargs) {
+                if (!kwarg.second) return false;
+                names.push_back(kwarg.first);
+            }
+        }
+        std::sort(names.begin(), names.end());
+        switch (stage) {
+            case Stage_Select:
+            case Stage_Reject:
+                return positional >= 1 && names.empty();
+            case Stage_SelectAttr:
+            case Stage_RejectAttr:
+                return positional >= 1;
+            case Stage_Map:
+                if (positional == 0) return names == std::vector<std::string> {"attribute"} || names == std::vector<std::string> {"attribute", "default"};
+                return names.empty();
+            case Stage_Join:
+                return (positional <= 1 && names.empty()) || (positional == 0 && names == std::vector<std::string> {"d"});
+            default:
+                return positional == 0 && names.empty();
+        }
+    }
+
+    Stage stage_at(size_t i) const { return i < stages.size() ? stages[i] : Stage_None; }
+    /* Whether part `i` calls the default builtin of its stage in this render (rather than a variable shadowing it). */
+    bool calls_default(size_t i, const std::shared_ptr<Context> & context) const {
+        if (stage_at(i) == Stage_None) return false;
+        auto callee = parts[i]->mType == Expression::Type_Call ? ((CallExpr*)parts[i].get())->object.get() : parts[i].get();
+        auto var = (VariableExpr*)callee;
+        return var->find(context) == var->get_builtin();
+    }
+
+    /*
+     * Runs parts [begin, end) - sequence stages, the last of which may be a consumer - in a single pass over `input`
+     * (an array), with the same results as applying them one after the other.
+     */
+    Value run_pipeline(size_t begin, size_t end, Value & input, const std::shared_ptr<Context> & context) const {
+        std::vector<StageState> states(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            auto & state = states[i - begin];
+            state.stage = stages[i];
+            if (parts[i]->mType == Expression::Type_Call) state.args = ((CallExpr*)parts[i].get())->args.evaluate(context);
+            switch (state.stage) {
+                case Stage_Select:
+                case Stage_Reject:
+                    state.fn = context->get(state.args.args[0]);
+                    if (state.fn.is_null()) _printlog("Undefined filter: " + state.args.args[0].dump());
+                    state.args.args.erase(state.args.args.begin());
+                    break;
+                case Stage_SelectAttr:
+                case Stage_RejectAttr:
+                    state.key = Value(state.args.args[0].get<std::string>());
+                    if (state.args.args.size() >= 2) {
+                        state.fn = context->get(state.args.args[1]);
+                        if (state.fn.is_null()) _printlog("Undefined test: " + state.args.args[1].dump());
+                        state.args.args[1] = Value();
+                    }
+                    state.args.args.erase(state.args.args.begin());
+                    break;
+                case Stage_Map:
+                    if (state.args.args.empty()) {
+                        state.key = state.args.get_named("attribute");
+                        state.fallback = state.args.get_named("default");
+                    } else {
+                        state.fn = context->get(state.args.args[0]);
+                        if (state.fn.is_null()) _printlog("Undefined filter: " + state.args.args[0].dump());
+                        state.args.args[0] = Value();
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        auto consumer = states.back().stage >= Stage_Length ? states.back().stage : Stage_None;
+        if (consumer != Stage_None) states.pop_back();
+
+        auto result = Value::array();
+        int64_t count = 0;
+        Value last;
+        std::string joined, sep;
+        if (consumer == Stage_Join && parts[end - 1]->mType == Expression::Type_Call) {
+            auto & join_args = ((CallExpr*)parts[end - 1].get())->args;
+            auto join_values = join_args.evaluate(context);
+            if (!join_values.args.empty()) sep = join_values.args[0].get<std::string>();
+            else if (!join_values.kwargs.empty()) sep = join_values.kwargs[0].second.get<std::string>();
+        }
+        for (size_t k = 0, n = input.size(); k < n; ++k) {
+            Value * item = &input.at(k);
+            Value mapped;
+            bool kept = true;
+            for (auto & state : states) {
+                switch (state.stage) {
+                    case Stage_Select:
+                    case Stage_Reject: {
+                        ArgumentsValue test_args;
+                        test_args.args.emplace_back(*item);
+                        for (const auto & arg : state.args.args) test_args.args.emplace_back(arg);
+                        kept = state.fn.call(context, test_args).to_bool() == (state.stage == Stage_Select);
+                        break;
+                    }
+                    case Stage_SelectAttr:
+                    case Stage_RejectAttr: {
+                        auto attr = item->get(state.key);
+                        if (state.fn.is_null() && state.args.args.empty()) {
+                            // Without a test, selectattr/rejectattr pass the attribute through.
+                            mapped = std::move(attr);
+                            item = &mapped;
+                        } else {
+                            state.args.args[0] = attr;
+                            kept = state.fn.call(context, state.args).to_bool() == (state.stage == Stage_SelectAttr);
+                        }
+                        break;
+                    }
+                    case Stage_Map:
+                        if (state.args.args.empty()) {
+                            auto attr = item->get(state.key);
+                            mapped = attr.is_null() ? state.fallback : std::move(attr);
+                        } else {
+                            state.args.args[0] = *item;
+                            mapped = state.fn.call(context, state.args);
+                        }
+                        item = &mapped;
+                        break;
+                    case Stage_Unique:
+                        kept = state.seen.insert(*item).second;
+                        break;
+                    default:
+                        break;
+                }
+                if (!kept) break;
+            }
+            if (!kept) continue;
+            switch (consumer) {
+                case Stage_Length:
+                    ++count;
+                    break;
+                case Stage_Last:
+                    last = *item;
+                    break;
+                case Stage_Join:
+                    if (count++) joined += sep;
+                    joined += item->to_str();
+                    break;
+                default:
+                    result.push_back(*item);
+                    break;
+            }
+        }
+        switch (consumer) {
+            case Stage_Length: return count;
+            case Stage_Last: return last;
+            case Stage_Join: return joined;
+            default: return result;
+        }
+    }
+
 public:
     FilterExpr(const Location & loc, std::vector<std::shared_ptr<Expression>> && p)
       : Expression(loc, Expression::Type_Filter), parts(std::move(p)) {}
+    const std::vector<std::shared_ptr<Expression>> & get_parts() const { return parts; }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        Value result;
-        bool first = true;
-        for (const auto& part : parts) {
-          if (!part) _printlog("FilterExpr.part is null");
-          if (first) {
-            first = false;
-            result = part->evaluate(context);
-          } else {
+        if (parts.empty()) return Value();
+        if (!parts[0]) _printlog("FilterExpr.part is null");
+        return apply_parts(1, parts[0]->evaluate(context), context);
+    }
+    /*
+     * Pipes `input` through parts [first, end). Chains of the default sequence filters over an array (e.g.
+     * `messages | selectattr('role', 'equalto', 'tool') | map(attribute='content') | join`) run in a single pass
+     * that only keeps the items making it to the end, or nothing when a consumer (length, last, join) ends it.
+     */
+    Value apply_parts(size_t first, Value input, const std::shared_ptr<Context> & context) const {
+        for (size_t i = first, n = parts.size(); i < n;) {
+            if (!parts[i]) _printlog("FilterExpr.part is null");
+            size_t end = i;
+            while (end < n && stage_at(end) != Stage_None && stage_at(end) < Stage_Length && calls_default(end, context)) ++end;
+            if (end > i && stage_at(end) >= Stage_Length && calls_default(end, context)) ++end;
+            if (end - i >= 2 && input.is_array()) {
+                input = run_pipeline(i, end, input, context);
+                i = end;
+            } else {
+                input = apply_filter(parts[i], input, context);
+                ++i;
+            }
+        }
+        return input;
+    }
+    /* Pipes `input` through one of the filters after the first part (a callable, or a call given extra arguments). */
+    static Value apply_filter(const std::shared_ptr<Expression> & part, const Value & input, const std::shared_ptr<Context> & context) {
               if (part->mType == Expression::Type_Call) {
                   auto ce = (CallExpr*)(part.get());
-              auto target = ce->object->evaluate(context);
               ArgumentsValue args = ce->args.evaluate(context);
-              args.args.insert(args.args.begin(), result);
-              result = target.call(context, args);
+              args.args.insert(args.args.begin(), input);
+              return call_filter(ce->object, context, args);
             } else {
-              auto callable = part->evaluate(context);
               ArgumentsValue args;
-              args.args.insert(args.args.begin(), result);
-              result = callable.call(context, args);
+              args.args.insert(args.args.begin(), input);
+              return call_filter(part, context, args);
+            }
+    }
+    /* Calls the filter `callee` evaluates to; builtin filters are called in place rather than copied out of the context. */
+    static Value call_filter(const std::shared_ptr<Expression> & callee, const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+        if (callee->mType == Expression::Type_Variable) {
+            auto var = (VariableExpr*)callee.get();
+            auto value = var->find(context);
+            if (value && value == var->get_builtin()) return value->call(context, args);
+            return (value ? Value(*value) : Value()).call(context, args);
+        }
+        return callee->evaluate(context).call(context, args);
+    }
+    /*
+     * Marks the parts calling one of the default sequence filters (resolved by VariableResolver, and not replaced by
+     * register_builtin) with arguments the fused pipeline handles; the others are always called as they are.
+     */
+    void bind_pipeline() {
+        static const std::pair<const char *, Stage> names[] = {
+            {"select", Stage_Select}, {"reject", Stage_Reject}, {"selectattr", Stage_SelectAttr}, {"rejectattr", Stage_RejectAttr},
+            {"map", Stage_Map}, {"unique", Stage_Unique}, {"list", Stage_List}, {"length", Stage_Length}, {"count", Stage_Length},
+            {"last", Stage_Last}, {"join", Stage_Join},
+        };
+        stages.assign(parts.size(), Stage_None);
+        const auto & defaults = Context::default_builtins();
+        for (size_t i = 1; i < parts.size(); ++i) {
+            if (!parts[i]) continue;
+            const ArgumentsExpression * args = nullptr;
+            auto callee = parts[i].get();
+            if (callee->mType == Expression::Type_Call) {
+                args = &((CallExpr*)callee)->args;
+                callee = ((CallExpr*)callee)->object.get();
+            }
+            if (!callee || callee->mType != Expression::Type_Variable) continue;
+            auto var = (VariableExpr*)callee;
+            if (!var->get_builtin()) continue;
+            for (const auto & entry : names) {
+                if (var->get_name() != entry.first) continue;
+                auto original = defaults->find(entry.first);
+                if (original && var->get_builtin()->same_callable(*original) && accepts_args(entry.second, args)) stages[i] = entry.second;
+                break;
             }
-          }
         }
-        return result;
     }
 
     void prepend(std::shared_ptr<Expression> && e) {
         parts.insert(parts.begin(), std::move(e));
     }
+    void for_each_child(const std::function<void(std::shared_ptr<Expression> &)> & fn) override {
+        for (auto & part : parts) if (part) fn(part);
+    }
 };
 
-class Parser {
-private:
-    using CharIterator = std::string::const_iterator;
-
-    std::shared_ptr<std::string> template_str;
-    CharIterator start, end, it;
-    Options options;
-
-    Parser(const std::shared_ptr<std::string>& template_str, const Options & options) : template_str(template_str), options(options) {
-      if (!template_str) _printlog("Template string is null");
-      start = it = this->template_str->begin();
-      end = this->template_str->end();
+/**
+ * Binds variables to the slots of the contexts they live in, once after parsing (see `Parser::parse`).
+ *
+ * Only for loops and macro calls create contexts at render time, so each for / macro body is a frame whose names
+ * are known statically: the loop variables & `loop` or the macro parameters, and everything set in it (set, macro
+ * definitions, nested loops' variables). A variable read in such a body and bound by an enclosing frame becomes a
+ * (hops, slot) pair, read without any string lookup. Everything else - globals, names set in the root context,
+ * namespaces, macro parameter defaults (evaluated in the caller's context) - keeps the dynamic lookup up the
+ * context chain, which is also the fallback when a frame doesn't match at render time.
+ *
+ * Variables naming a builtin (filters, `range`, `namespace`...) also keep a pointer to it in the builtins table of
+ * the time, returned when the lookup reaches that table instead of searching it: variables of the same name set by
+ * the template or the caller still shadow it, and renders against builtins registered later look the name up.
+ */
+class VariableResolver {
+    friend class RenderMemo;
+    std::vector<const std::vector<std::string> *> frames_;
+    std::shared_ptr<Context> builtins_ = Context::builtins();
+
+    // Names the rendering of `node` can set in the context it renders in.
+    static void collect_names(const std::shared_ptr<TemplateNode> & node, std::vector<std::string> & names) {
+        if (!node) return;
+        switch (node->mType) {
+            case TemplateNode::Type_Set: {
+                auto set_node = (SetNode*)node.get();
+                if (set_node->get_ns().empty()) {
+                    names.insert(names.end(), set_node->get_var_names().begin(), set_node->get_var_names().end());
+                }
+                return;
+            }
+            case TemplateNode::Type_SetTemplate:
+                names.push_back(((SetTemplateNode*)node.get())->get_name());
+                return;
+            case TemplateNode::Type_Macro: {
+                auto macro_node = (MacroNode*)node.get();
+                if (macro_node->get_name()) names.push_back(macro_node->get_name()->get_name());
+                return;
+            }
+            case TemplateNode::Type_For: {
+                // The loop variables are also assigned in the outer context (to evaluate the loop's condition).
+                auto for_node = (ForNode*)node.get();
+                names.insert(names.end(), for_node->get_var_names().begin(), for_node->get_var_names().end());
+                collect_names(for_node->get_else_body(), names);
+                return;
+            }
+            default:
+                node->for_each_child([&](const std::shared_ptr<TemplateNode> & child) { collect_names(child, names); },
+                                     [](const std::shared_ptr<Expression> &) {});
+                return;
+        }
     }
 
-    bool consumeSpaces(SpaceHandling space_handling = SpaceHandling::Strip) {
-      if (space_handling == SpaceHandling::Strip) {
-        while (it != end && std::isspace(*it)) ++it;
-      }
-      return true;
+    void resolve(const std::shared_ptr<Expression> & expr) {
+        if (!expr) return;
+        if (expr->mType == Expression::Type_Variable) {
+            auto var = (VariableExpr*)expr.get();
+            const auto & name = var->get_name();
+            if (auto value = builtins_->find(name)) var->bind_builtin(builtins_, value);
+            for (size_t hops = 0, n = frames_.size(); hops < n; ++hops) {
+                const auto & slot_names = *frames_[n - 1 - hops];
+                auto it = std::find(slot_names.begin(), slot_names.end(), name);
+                if (it != slot_names.end()) {
+                    var->bind_slot(&slot_names, hops, it - slot_names.begin());
+                    return;
+                }
+            }
+            return;
+        }
+        expr->for_each_child([&](const std::shared_ptr<Expression> & child) { resolve(child); });
+        if (expr->mType == Expression::Type_Filter) ((FilterExpr*)expr.get())->bind_pipeline();
     }
 
-    std::shared_ptr<std::string> parseString() {
-      auto doParse = [&](char quote) -> std::shared_ptr<std::string> {
-        if (it == end || *it != quote) return nullptr;
-        std::string result;
-        bool escape = false;
-        for (++it; it != end; ++it) {
-          if (escape) {
-            escape = false;
-            switch (*it) {
-              case 'n': result += '\n'; break;
-              case 'r': result += '\r'; break;
-              case 't': result += '\t'; break;
-              case 'b': result += '\b'; break;
-              case 'f': result += '\f'; break;
-              case '\\': result += '\\'; break;
-              default:
-                if (*it == quote) {
-                  result += quote;
-                } else {
-                  result += *it;
-                }
-                break;
+    void resolve(const std::shared_ptr<TemplateNode> & node) {
+        if (!node) return;
+        switch (node->mType) {
+            case TemplateNode::Type_For: {
+                auto for_node = (ForNode*)node.get();
+                resolve(for_node->get_iterable());
+                resolve(for_node->get_condition());
+                std::vector<std::string> names;
+                collect_names(for_node->get_body(), names);
+                for_node->add_frame_names(names);
+                frames_.push_back(&for_node->get_frame_names());
+                resolve(for_node->get_body());
+                frames_.pop_back();
+                resolve(for_node->get_else_body());
+                return;
             }
-          } else if (*it == '\\') {
-            escape = true;
-          } else if (*it == quote) {
-              ++it;
-              std::shared_ptr<std::string> res(new std::string);
-              *res = result;
-              return res;
-          } else {
-            result += *it;
-          }
+            case TemplateNode::Type_Macro: {
+                // Skips the parameter defaults, which are evaluated in whichever context calls the macro.
+                auto macro_node = (MacroNode*)node.get();
+                std::vector<std::string> names;
+                collect_names(macro_node->get_body(), names);
+                macro_node->add_frame_names(names);
+                frames_.push_back(&macro_node->get_frame_names());
+                resolve(macro_node->get_body());
+                frames_.pop_back();
+                return;
+            }
+            default:
+                node->for_each_child([&](const std::shared_ptr<TemplateNode> & child) { resolve(child); },
+                                     [&](const std::shared_ptr<Expression> & child) { resolve(child); });
+                return;
         }
-        return nullptr;
-      };
+    }
 
-      consumeSpaces();
-      if (it == end) return nullptr;
-      if (*it == '"') return doParse('"');
-      if (*it == '\'') return doParse('\'');
-      return nullptr;
+public:
+    static void resolve_template(const std::shared_ptr<TemplateNode> & root) {
+        VariableResolver resolver;
+        resolver.resolve(root);
     }
+};
 
-    json parseNumber(CharIterator& it, const CharIterator& end) {
-        auto before = it;
-        consumeSpaces();
-        auto start = it;
-        bool hasDecimal = false;
-        bool hasExponent = false;
+inline std::shared_ptr<const RenderMemo::Analysis> RenderMemo::analysis_for(const std::shared_ptr<TemplateNode> & root) {
+    std::lock_guard<std::mutex> lock(analyses_mutex_);
+    for (size_t i = 0; i < analyses_.size();) {
+        auto analysed = analyses_[i]->root.lock();
+        if (analysed == root) return analyses_[i];
+        if (!analysed) {
+            analyses_[i] = analyses_.back();
+            analyses_.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    auto analysis = std::make_shared<Analysis>();
+    analysis->root = root;
+    analysis->id = next_id_++;
+    if (root) analyze(root, *analysis);
+    analyses_.push_back(analysis);
+    return analysis;
+}
 
-        if (it != end && (*it == '-' || *it == '+')) ++it;
+inline RenderMemo::Scope::Scope(RenderMemo & memo, const std::shared_ptr<TemplateNode> & root)
+    : memo_(memo), analysis_(memo.analysis_for(root)), previous_(current()) {
+    current() = this;
+}
 
-        while (it != end) {
-          if (std::isdigit(*it)) {
-            ++it;
-          } else if (*it == '.') {
-              if (hasDecimal) {
-                  _printlog("Multiple decimal points");
-                  return json();
-              }
-            hasDecimal = true;
-            ++it;
-          } else if (it != start && (*it == 'e' || *it == 'E')) {
-              if (hasExponent) {
-                  _printlog("Multiple exponents");
-                  return json();
-              }
-            hasExponent = true;
-            ++it;
-          } else {
-            break;
-          }
+inline void RenderMemo::analyze(const std::shared_ptr<TemplateNode> & root, Analysis & analysis) {
+    // The names read anywhere in the template, except where a loop variable or macro parameter hides them.
+    std::unordered_set<std::string> observed;
+    std::vector<std::string> shadowed;
+    std::function<void(const std::shared_ptr<Expression> &)> observe_expr = [&](const std::shared_ptr<Expression> & expr) {
+        if (!expr) return;
+        if (expr->mType == Expression::Type_Variable) {
+            auto & name = ((VariableExpr*)expr.get())->get_name();
+            if (std::find(shadowed.begin(), shadowed.end(), name) == shadowed.end()) observed.insert(name);
+            return;
         }
-        if (start == it) {
-          it = before;
-          return json(); // No valid characters found
+        expr->for_each_child([&](std::shared_ptr<Expression> & child) { observe_expr(child); });
+    };
+    std::vector<std::shared_ptr<TemplateNode>> candidates;
+    std::function<void(const std::shared_ptr<TemplateNode> &)> observe = [&](const std::shared_ptr<TemplateNode> & node) {
+        if (!node) return;
+        switch (node->mType) {
+            case TemplateNode::Type_For: {
+                auto for_node = (ForNode*)node.get();
+                candidates.push_back(node);
+                observe_expr(for_node->get_iterable());
+                auto n = shadowed.size();
+                shadowed.insert(shadowed.end(), for_node->get_var_names().begin(), for_node->get_var_names().end());
+                shadowed.push_back("loop");
+                observe_expr(for_node->get_condition());
+                observe(for_node->get_body());
+                shadowed.resize(n);
+                observe(for_node->get_else_body());
+                return;
+            }
+            case TemplateNode::Type_Macro: {
+                auto macro_node = (MacroNode*)node.get();
+                candidates.push_back(node);
+                for (auto & param : macro_node->get_params()) observe_expr(param.second);
+                auto n = shadowed.size();
+                for (auto & param : macro_node->get_params()) shadowed.push_back(param.first);
+                observe(macro_node->get_body());
+                shadowed.resize(n);
+                return;
+            }
+            case TemplateNode::Type_Set: {
+                auto & ns = ((SetNode*)node.get())->get_ns();
+                if (!ns.empty() && std::find(shadowed.begin(), shadowed.end(), ns) == shadowed.end()) observed.insert(ns);
+                break;
+            }
+            case TemplateNode::Type_If:
+                candidates.push_back(node);
+                break;
+            default:
+                break;
         }
-        std::string str(start, it);
-        if (hasExponent || hasDecimal) {
-            double v = std::stof(str);
-            return json(v);
+        node->for_each_child([&](std::shared_ptr<TemplateNode> & child) { observe(child); },
+                             [&](std::shared_ptr<Expression> & child) { observe_expr(child); });
+    };
+    observe(root);
+
+    for (auto & node : candidates) {
+        auto block = node;
+        bool in_loop = false;
+        if (node->mType == TemplateNode::Type_Macro) {
+            // A call's context is its own, and what its body returns is dropped.
+            block = ((MacroNode*)node.get())->get_body();
+            in_loop = true;
+            if (!block) continue;
+        } else {
+            std::vector<std::string> names;
+            VariableResolver::collect_names(node, names);
+            if (std::any_of(names.begin(), names.end(), [&](const std::string & name) { return observed.count(name); })) continue;
         }
-        int64_t v = std::stoi(str);
-        return json(v);
+        if (has_effects(block, in_loop)) continue;
+        std::vector<Read> reads;
+        std::vector<std::string> block_shadowed;
+        collect_reads(block, block_shadowed, reads);
+        // Just the variable when it's read whole somewhere, otherwise each distinct path once.
+        std::vector<Read> unique;
+        for (auto & read : reads) {
+            auto same_name = [&](const Read & other) { return other.name == read.name; };
+            auto bare = std::find_if(reads.begin(), reads.end(), [&](const Read & other) { return other.name == read.name && other.path.empty(); });
+            if (bare != reads.end()) {
+                if (std::find_if(unique.begin(), unique.end(), same_name) == unique.end()) unique.push_back(*bare);
+                continue;
+            }
+            auto same_path = [&](const Read & other) {
+                if (other.name != read.name || other.path.size() != read.path.size()) return false;
+                for (size_t i = 0; i < read.path.size(); ++i) {
+                    if (other.path[i].dump() != read.path[i].dump()) return false;
+                }
+                return true;
+            };
+            if (std::find_if(unique.begin(), unique.end(), same_path) == unique.end()) unique.push_back(read);
+        }
+        analysis.blocks[node.get()] = std::move(unique);
     }
+}
 
-    /** integer, float, bool, string */
-    std::shared_ptr<Value> parseConstant() {
-      auto start = it;
-      consumeSpaces();
-      if (it == end) return nullptr;
-      if (*it == '"' || *it == '\'') {
-        auto str = parseString();
-          if (str) return std::make_shared<Value>(*str);
-      }
-      static std::regex prim_tok(R"(true\b|True\b|false\b|False\b|None\b)");
-      auto token = consumeToken(prim_tok);
-      if (!token.empty()) {
-        if (token == "true" || token == "True") return std::make_shared<Value>(true);
-        if (token == "false" || token == "False") return std::make_shared<Value>(false);
-        if (token == "None") return std::make_shared<Value>(nullptr);
-        _printlog("Unknown constant token: " + token);
-      }
+inline void RenderMemo::collect_reads(const std::shared_ptr<TemplateNode> & node, std::vector<std::string> & shadowed, std::vector<Read> & reads) {
+    if (!node) return;
+    if (node->mType == TemplateNode::Type_For) {
+        auto for_node = (ForNode*)node.get();
+        collect_reads(for_node->get_iterable(), shadowed, reads);
+        auto n = shadowed.size();
+        shadowed.insert(shadowed.end(), for_node->get_var_names().begin(), for_node->get_var_names().end());
+        shadowed.push_back("loop");
+        collect_reads(for_node->get_condition(), shadowed, reads);
+        collect_reads(for_node->get_body(), shadowed, reads);
+        shadowed.resize(n);
+        collect_reads(for_node->get_else_body(), shadowed, reads);
+        return;
+    }
+    // (The parameters of the macros defined in the block are read too: more than needed, which is harmless.)
+    node->for_each_child([&](std::shared_ptr<TemplateNode> & child) { collect_reads(child, shadowed, reads); },
+                         [&](std::shared_ptr<Expression> & child) { collect_reads(child, shadowed, reads); });
+}
 
-      auto number = parseNumber(it, end);
-      if (!number.is_null()) return std::make_shared<Value>(number);
+inline void RenderMemo::collect_reads(const std::shared_ptr<Expression> & expr, std::vector<std::string> & shadowed, std::vector<Read> & reads) {
+    if (!expr) return;
+    // A chain of constant subscripts, like `message.tool_calls[0]`, reads that path in the variable.
+    std::vector<Value> path;
+    auto base = expr.get();
+    while (base->mType == Expression::Type_Subscript) {
+        auto subscript = (SubscriptExpr*)base;
+        auto index = subscript->get_index().get();
+        if (!index || !subscript->get_base() || index->mType != Expression::Type_Liter) break;
+        auto & key = ((LiteralExpr*)index)->get_value();
+        if (!key.is_string() && !key.is_number_integer()) break;
+        path.push_back(key);
+        base = subscript->get_base().get();
+    }
+    if (base->mType == Expression::Type_Variable) {
+        auto & name = ((VariableExpr*)base)->get_name();
+        if (std::find(shadowed.begin(), shadowed.end(), name) == shadowed.end()) {
+            std::reverse(path.begin(), path.end());
+            reads.push_back({name, std::move(path)});
+        }
+        return;
+    }
+    expr->for_each_child([&](std::shared_ptr<Expression> & child) { collect_reads(child, shadowed, reads); });
+}
 
-      it = start;
-      return nullptr;
+inline bool RenderMemo::has_effects(const std::shared_ptr<TemplateNode> & node, bool in_loop) {
+    if (!node) return false;
+    switch (node->mType) {
+        case TemplateNode::Type_Set:
+            if (!((SetNode*)node.get())->get_ns().empty()) return true;
+            break;
+        case TemplateNode::Type_LoopControl:
+            return !in_loop;
+        case TemplateNode::Type_For: {
+            auto for_node = (ForNode*)node.get();
+            return has_effects(for_node->get_iterable()) || has_effects(for_node->get_condition())
+                || has_effects(for_node->get_body(), true) || has_effects(for_node->get_else_body(), in_loop);
+        }
+        default:
+            break;
     }
+    bool effects = false;
+    node->for_each_child([&](std::shared_ptr<TemplateNode> & child) { effects = effects || has_effects(child, in_loop); },
+                         [&](std::shared_ptr<Expression> & child) { effects = effects || has_effects(child); });
+    return effects;
+}
 
-    bool peekSymbols(const std::vector<std::string> & symbols) const {
-        for (const auto & symbol : symbols) {
-            if (std::distance(it, end) >= (int64_t) symbol.size() && std::string(it, it + symbol.size()) == symbol) {
+inline bool RenderMemo::has_effects(const std::shared_ptr<Expression> & expr) {
+    if (!expr) return false;
+    if (expr->mType == Expression::Type_MethodCall) {
+        switch (((MethodCallExpr*)expr.get())->get_method_id()) {
+            case MethodCallExpr::Method_Append:
+            case MethodCallExpr::Method_Pop:
+            case MethodCallExpr::Method_Insert:
                 return true;
-            }
+            default:
+                break;
         }
+    }
+    bool effects = false;
+    expr->for_each_child([&](std::shared_ptr<Expression> & child) { effects = effects || has_effects(child); });
+    return effects;
+}
+
+inline bool RenderMemo::step(Value & value, const Value & key) {
+    if (value.is_loop()) {
+        if (!key.is_string() || key.string_view() == "cycle" || !value.contains(key.get<std::string>())) return false;
+    } else if (value.is_array()) {
+        if (!key.is_number_integer()) return false;
+        auto index = key.get<int64_t>();
+        auto size = (int64_t) value.size();
+        if (index < std::numeric_limits<int>::min() || index > std::numeric_limits<int>::max()) return false;
+        if (index < 0) index += size;
+        if (index < 0 || index >= size) return false;
+    } else if (value.is_object()) {
+        if (!key.is_string() || !value.contains(key.get<std::string>())) return false;
+    } else {
         return false;
     }
+    value = value.get(key);
+    return true;
+}
 
-    std::vector<std::string> consumeTokenGroups(const std::regex & regex, SpaceHandling space_handling = SpaceHandling::Strip) {
-        auto start = it;
-        consumeSpaces(space_handling);
-        std::smatch match;
-        if (std::regex_search(it, end, match, regex) && match.position() == 0) {
-            it += match[0].length();
-            std::vector<std::string> ret;
-            for (size_t i = 0, n = match.size(); i < n; ++i) {
-                ret.push_back(match[i].str());
+inline bool RenderMemo::render(const TemplateNode & block, const TemplateNode & body, RenderSink & out, const std::shared_ptr<Context> & context) {
+    auto scope = current();
+    if (!scope) return false;
+    if (scope->rendering_ == &block) {
+        // The miss below, rendering the block itself.
+        scope->rendering_ = nullptr;
+        return false;
+    }
+    if (out.wants_events()) return false;
+    auto it = scope->analysis_->blocks.find(&block);
+    if (it == scope->analysis_->blocks.end()) return false;
+
+    auto & memo = scope->memo_;
+    Fingerprint fingerprint(memo.k0_, memo.k1_);
+    for (const auto & read : it->second) {
+        fingerprint.add(std::string_view(read.name));
+        auto found = context->find(read.name);
+        if (!found) {
+            fingerprint.add('u');
+            continue;
+        }
+        if (found->is_callable() && read.path.empty()) {
+            // Only the builtins as first built are known to be pure (and to stay the same).
+            auto builtin = Context::default_builtins()->find(read.name);
+            if (!builtin || !found->same_callable(*builtin)) return false;
+            fingerprint.add('b');
+            continue;
+        }
+        fingerprint.add('v');
+        Value value = *found;
+        uint64_t depth = 0;
+        while (depth < read.path.size() && step(value, read.path[depth])) ++depth;
+        fingerprint.add(depth);
+        if (!value.fingerprint(fingerprint, &scope->digests_)) return false;
+    }
+    Key key {scope->analysis_->id, &block, fingerprint.digest()};
+    auto & shard = memo.shards_[key.digest.second % kShards];
+    std::shared_ptr<const std::string> output;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto entry = shard.index.find(key);
+        if (entry != shard.index.end()) {
+            shard.entries.splice(shard.entries.begin(), shard.entries, entry->second);
+            output = entry->second->output;
+        }
+    }
+    if (output) {
+        ++memo.hits_;
+        if (RenderBudget::allow_output(output->size())) out.write(output->data(), output->size());
+        return true;
+    }
+    ++memo.misses_;
+    StringSink rendered;
+    auto previous = scope->rendering_;
+    scope->rendering_ = &body;
+    body.render(rendered, context);
+    scope->rendering_ = previous;
+    output = std::make_shared<const std::string>(rendered.take());
+    // (An interrupted render isn't what the block renders to.)
+    if (RenderBudget::current() && RenderBudget::current()->exceeded()) return true;
+    out.write(output->data(), output->size());
+    memo.store(key, output);
+    return true;
+}
+
+inline void RenderMemo::store(const Key & key, const std::shared_ptr<const std::string> & output) {
+    auto budget = max_bytes_ / kShards;
+    if (output->size() > budget) return;
+    auto & shard = shards_[key.digest.second % kShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(key)) return;  // Rendered concurrently
+    shard.entries.push_front({key, output});
+    shard.index[key] = shard.entries.begin();
+    shard.bytes += output->size();
+    while (shard.bytes > budget) {
+        auto & last = shard.entries.back();
+        shard.bytes -= last.output->size();
+        shard.index.erase(last.key);
+        shard.entries.pop_back();
+    }
+}
+
+/**
+ * Monotonic buffer the parser can allocate a template's AST from (see `Parser::parse`).
+ *
+ * Nodes (and their shared_ptr control blocks) are bump-allocated next to each other in a few large
+ * blocks; deallocation is a no-op and the memory is released in one go once the arena and every node
+ * allocated from it are gone (each node keeps its arena alive). Not thread-safe: don't parse several
+ * templates into the same arena concurrently (rendering is fine, as it doesn't allocate AST nodes). Also a
+ * MemoryResource, to make a render's values from (see RenderMemory), with the same caveat: one render at a time.
+ */
+class Arena final : public MemoryResource {
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char * cursor_ = nullptr;
+    size_t remaining_ = 0;
+    size_t next_block_size_;
+    size_t bytes_used_ = 0;
+    size_t bytes_reserved_ = 0;
+
+public:
+    explicit Arena(size_t initial_block_size = 16 * 1024) : next_block_size_(initial_block_size) {}
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    void * allocate(size_t size, size_t alignment) override {
+        void * ptr = cursor_;
+        if (!cursor_ || !std::align(alignment, size, ptr, remaining_)) {
+            auto block_size = std::max(next_block_size_, size + alignment);
+            next_block_size_ = std::min<size_t>(next_block_size_ * 2, 1024 * 1024);
+            blocks_.emplace_back(new char[block_size]);
+            bytes_reserved_ += block_size;
+            ptr = blocks_.back().get();
+            remaining_ = block_size;
+            std::align(alignment, size, ptr, remaining_);
+        }
+        cursor_ = static_cast<char *>(ptr) + size;
+        remaining_ -= size;
+        bytes_used_ += size;
+        return ptr;
+    }
+    void deallocate(void *, size_t, size_t) override {}
+
+    size_t bytes_used() const { return bytes_used_; }
+    size_t bytes_reserved() const { return bytes_reserved_; }
+};
+
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    std::shared_ptr<Arena> arena;
+
+    explicit ArenaAllocator(const std::shared_ptr<Arena> & arena) : arena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> & other) : arena(other.arena) {}
+
+    T * allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> & other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> & other) const { return arena != other.arena; }
+};
+
+/** Allocates an AST node (expression or template node), from `arena` if given. */
+template <typename T, typename... Args>
+static std::shared_ptr<T> make_ast_node(const std::shared_ptr<Arena> & arena, Args &&... args) {
+    if (arena) return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+/**
+ * Rewrites a freshly parsed template into a cheaper one that renders the same output (see `Options::optimize`):
+ * constant expressions (including `~` chains ending in literals) are folded, `{{ }}` over constants becomes text,
+ * branches with constant conditions are resolved, nested sequences are flattened and adjacent text is merged.
+ *
+ * `constants` names primitive values every render is known to set (e.g. a chat template's special tokens); they're
+ * substituted for the variables of the same name, unless the template assigns that name anywhere.
+ * Only folds operations on primitives that can't fail, so errors are still reported when (and if) rendering hits them.
+ */
+class TemplateOptimizer {
+    std::shared_ptr<Arena> arena_;
+    std::map<std::string, Value> constants_;
+
+    // Names the template can bind anywhere (set, for, macros & their parameters).
+    static void collect_bound_names(const std::shared_ptr<TemplateNode> & node, std::unordered_set<std::string> & names) {
+        switch (node->mType) {
+            case TemplateNode::Type_Set: {
+                auto set_node = (SetNode*)node.get();
+                if (set_node->get_ns().empty()) names.insert(set_node->get_var_names().begin(), set_node->get_var_names().end());
+                break;
+            }
+            case TemplateNode::Type_SetTemplate:
+                names.insert(((SetTemplateNode*)node.get())->get_name());
+                break;
+            case TemplateNode::Type_Macro: {
+                auto macro_node = (MacroNode*)node.get();
+                if (macro_node->get_name()) names.insert(macro_node->get_name()->get_name());
+                for (const auto & param : macro_node->get_params()) names.insert(param.first);
+                break;
+            }
+            case TemplateNode::Type_For: {
+                auto for_node = (ForNode*)node.get();
+                names.insert(for_node->get_var_names().begin(), for_node->get_var_names().end());
+                break;
             }
-            return ret;
+            default:
+                break;
         }
-        it = start;
-        return {};
+        node->for_each_child([&](const std::shared_ptr<TemplateNode> & child) { collect_bound_names(child, names); },
+                             [](const std::shared_ptr<Expression> &) {});
+    }
+
+    static const Value * constant_of(const std::shared_ptr<Expression> & expr) {
+        if (!expr || expr->mType != Expression::Type_Liter) return nullptr;
+        const auto & value = ((LiteralExpr*)expr.get())->get_value();
+        // Arrays & objects are mutable and shared by reference: each evaluation must build a fresh one.
+        return value.is_primitive() ? &value : nullptr;
+    }
+
+    std::shared_ptr<Expression> literal(const Location & location, const Value & value) const {
+        return make_ast_node<LiteralExpr>(arena_, location, value);
+    }
+
+    void fold(std::shared_ptr<Expression> & expr) {
+        if (!expr) return;
+        expr->for_each_child([&](std::shared_ptr<Expression> & child) { fold(child); });
+        switch (expr->mType) {
+            case Expression::Type_Variable: {
+                auto it = constants_.find(((VariableExpr*)expr.get())->get_name());
+                if (it != constants_.end()) expr = literal(expr->location, it->second);
+                return;
+            }
+            case Expression::Type_If: {
+                auto if_expr = (IfExpr*)expr.get();
+                auto condition = constant_of(if_expr->get_condition());
+                if (!condition) return;
+                if (condition->to_bool()) {
+                    expr = if_expr->get_then_expr();
+                } else if (if_expr->get_else_expr()) {
+                    expr = if_expr->get_else_expr();
+                } else {
+                    expr = literal(expr->location, Value());
+                }
+                return;
+            }
+            case Expression::Type_Unary: {
+                auto unary = (UnaryOpExpr*)expr.get();
+                auto operand = constant_of(unary->expr);
+                if (!operand) return;
+                if (unary->op == UnaryOpExpr::Op::Plus || unary->op == UnaryOpExpr::Op::LogicalNot
+                    || (unary->op == UnaryOpExpr::Op::Minus && operand->is_number())) {
+                    expr = literal(expr->location, expr->evaluate(nullptr));
+                }
+                return;
+            }
+            case Expression::Type_Binary: {
+                using Op = BinaryOpExpr::Op;
+                auto binary = (BinaryOpExpr*)expr.get();
+                auto op = binary->get_op();
+                auto l = constant_of(binary->get_left());
+                auto r = constant_of(binary->get_right());
+                if (l && (op == Op::And || op == Op::Or)) {
+                    // `false and x` is false, `true or x` is true and `false or x` is x, whatever x is.
+                    if (op == Op::And && !l->to_bool()) {
+                        expr = literal(expr->location, Value(false));
+                    } else if (op == Op::Or && l->to_bool()) {
+                        expr = binary->get_left();
+                    } else if (op == Op::Or) {
+                        expr = binary->get_right();
+                    } else if (r) {
+                        expr = literal(expr->location, Value(r->to_bool()));
+                    }
+                    return;
+                }
+                if (op == Op::StrConcat && r && binary->get_left() && binary->get_left()->mType == Expression::Type_Binary) {
+                    // (x ~ 'a') ~ 'b' is x ~ 'ab'.
+                    auto inner = (BinaryOpExpr*)binary->get_left().get();
+                    auto inner_r = constant_of(inner->get_right());
+                    if (inner->get_op() == Op::StrConcat && inner_r) {
+                        auto left = inner->get_left();
+                        expr = make_ast_node<BinaryOpExpr>(arena_, inner->location, std::move(left),
+                                                           literal(inner->get_right()->location, Value(inner_r->to_str() + r->to_str())), Op::StrConcat);
+                        return;
+                    }
+                }
+                if (!l || !r) return;
+                bool numbers = l->is_number() && r->is_number();
+                bool strings = l->is_string() && r->is_string();
+                bool foldable = false;
+                switch (op) {
+                    case Op::StrConcat: case Op::Eq: case Op::Ne: foldable = true; break;
+                    case Op::Add: foldable = numbers || l->is_string() || r->is_string(); break;
+                    case Op::Sub: case Op::Mul: foldable = numbers; break;
+                    case Op::Lt: case Op::Gt: case Op::Le: case Op::Ge: foldable = numbers || strings; break;
+                    default: break;
+                }
+                if (foldable) expr = literal(expr->location, expr->evaluate(nullptr));
+                return;
+            }
+            default:
+                return;
+        }
+    }
+
+    void optimize(std::shared_ptr<TemplateNode> & node) {
+        if (!node) return;
+        node->for_each_child([&](std::shared_ptr<TemplateNode> & child) { optimize(child); },
+                             [&](std::shared_ptr<Expression> & child) { fold(child); });
+        switch (node->mType) {
+            case TemplateNode::Type_Expression: {
+                if (constant_of(((ExpressionNode*)node.get())->get_expr())) {
+                    node = make_ast_node<TextNode>(arena_, node->location(), node->render(nullptr));
+                }
+                return;
+            }
+            case TemplateNode::Type_If: {
+                std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade;
+                bool changed = false;
+                for (const auto & branch : ((IfNode*)node.get())->get_cascade()) {
+                    auto condition = constant_of(branch.first);
+                    if (condition && !condition->to_bool()) {
+                        changed = true;
+                        continue;
+                    }
+                    if (condition) changed = true;
+                    cascade.emplace_back(condition ? nullptr : branch.first, branch.second);
+                    if (!cascade.back().first) break;
+                }
+                if (cascade.empty()) {
+                    node = make_ast_node<TextNode>(arena_, node->location(), std::string());
+                } else if (!cascade.front().first) {
+                    node = cascade.front().second;
+                } else if (changed) {
+                    node = make_ast_node<IfNode>(arena_, node->location(), std::move(cascade));
+                }
+                return;
+            }
+            case TemplateNode::Type_Sequence: {
+                std::vector<std::shared_ptr<TemplateNode>> children;
+                auto add = [&](const std::shared_ptr<TemplateNode> & child) {
+                    if (child->mType == TemplateNode::Type_Text) {
+                        const auto & str = ((TextNode*)child.get())->get_text();
+                        if (str.empty()) return;
+                        if (!children.empty() && children.back()->mType == TemplateNode::Type_Text) {
+                            const auto & prev = children.back();
+                            children.back() = make_ast_node<TextNode>(arena_, prev->location(), ((TextNode*)prev.get())->get_text() + str);
+                            return;
+                        }
+                    }
+                    children.push_back(child);
+                };
+                for (const auto & child : ((SequenceNode*)node.get())->get_children()) {
+                    if (child->mType == TemplateNode::Type_Sequence) {
+                        for (const auto & grandchild : ((SequenceNode*)child.get())->get_children()) add(grandchild);
+                    } else {
+                        add(child);
+                    }
+                }
+                if (children.empty()) {
+                    node = make_ast_node<TextNode>(arena_, node->location(), std::string());
+                } else if (children.size() == 1) {
+                    node = children[0];
+                } else if (children != ((SequenceNode*)node.get())->get_children()) {
+                    node = make_ast_node<SequenceNode>(arena_, node->location(), std::move(children));
+                }
+                return;
+            }
+            default:
+                return;
+        }
+    }
+
+public:
+    static void optimize_template(std::shared_ptr<TemplateNode> & root, const std::shared_ptr<Arena> & arena = nullptr,
+                                  const std::map<std::string, Value> & constants = {}) {
+        TemplateOptimizer optimizer;
+        optimizer.arena_ = arena;
+        if (root && !constants.empty()) {
+            std::unordered_set<std::string> bound;
+            collect_bound_names(root, bound);
+            for (const auto & constant : constants) {
+                if (constant.second.is_primitive() && !bound.count(constant.first)) optimizer.constants_.insert(constant);
+            }
+        }
+        optimizer.optimize(root);
+    }
+};
+
+class Parser {
+private:
+    using CharIterator = std::string::const_iterator;
+
+    std::shared_ptr<std::string> template_str;
+    CharIterator start, end, it;
+    Options options;
+    std::shared_ptr<Arena> arena;
+
+    Parser(const std::shared_ptr<std::string>& template_str, const Options & options, const std::shared_ptr<Arena> & arena = nullptr)
+      : template_str(template_str), options(options), arena(arena) {
+      if (!template_str) _printlog("Template string is null");
+      start = it = this->template_str->begin();
+      end = this->template_str->end();
+    }
+
+    /** Allocates an AST node (expression or template node), from the arena if parsing into one. */
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make_node(Args &&... args) const {
+        return make_ast_node<T>(arena, std::forward<Args>(args)...);
+    }
+
+    bool consumeSpaces(SpaceHandling space_handling = SpaceHandling::Strip) {
+      if (space_handling == SpaceHandling::Strip) {
+        while (it != end && isSpaceChar(*it)) ++it;
+      }
+      return true;
+    }
+
+    std::shared_ptr<std::string> parseString() {
+      auto doParse = [&](char quote) -> std::shared_ptr<std::string> {
+        if (it == end || *it != quote) return nullptr;
+        std::string result;
+        bool escape = false;
+        for (++it; it != end; ++it) {
+          if (escape) {
+            escape = false;
+            switch (*it) {
+              case 'n': result += '\n'; break;
+              case 'r': result += '\r'; break;
+              case 't': result += '\t'; break;
+              case 'b': result += '\b'; break;
+              case 'f': result += '\f'; break;
+              case '\\': result += '\\'; break;
+              default:
+                if (*it == quote) {
+                  result += quote;
+                } else {
+                  result += *it;
+                }
+                break;
+            }
+          } else if (*it == '\\') {
+            escape = true;
+          } else if (*it == quote) {
+              ++it;
+              std::shared_ptr<std::string> res(new std::string);
+              *res = result;
+              return res;
+          } else {
+            result += *it;
+          }
+        }
+        return nullptr;
+      };
+
+      consumeSpaces();
+      if (it == end) return nullptr;
+      if (*it == '"') return doParse('"');
+      if (*it == '\'') return doParse('\'');
+      return nullptr;
     }
-    std::string consumeToken(const std::regex & regex, SpaceHandling space_handling = SpaceHandling::Strip) {
+
+    json parseNumber(CharIterator& it, const CharIterator& end) {
+        auto before = it;
+        consumeSpaces();
         auto start = it;
-        consumeSpaces(space_handling);
-        std::smatch match;
-        if (std::regex_search(it, end, match, regex) && match.position() == 0) {
-            it += match[0].length();
-            return match[0].str();
+        bool hasDecimal = false;
+        bool hasExponent = false;
+
+        if (it != end && (*it == '-' || *it == '+')) ++it;
+
+        while (it != end) {
+          if (std::isdigit(*it)) {
+            ++it;
+          } else if (*it == '.') {
+              if (hasDecimal) {
+                  _printlog("Multiple decimal points");
+                  return json();
+              }
+            hasDecimal = true;
+            ++it;
+          } else if (it != start && (*it == 'e' || *it == 'E')) {
+              if (hasExponent) {
+                  _printlog("Multiple exponents");
+                  return json();
+              }
+            hasExponent = true;
+            ++it;
+          } else {
+            break;
+          }
         }
-        it = start;
-        return "";
+        if (start == it) {
+          it = before;
+          return json(); // No valid characters found
+        }
+        std::string str(start, it);
+        if (hasExponent || hasDecimal) {
+            double v = std::stof(str);
+            return json(v);
+        }
+        int64_t v = std::stoi(str);
+        return json(v);
+    }
+
+    /** integer, float, bool, string */
+    std::shared_ptr<Value> parseConstant() {
+      auto start = it;
+      consumeSpaces();
+      if (it == end) return nullptr;
+      if (*it == '"' || *it == '\'') {
+        auto str = parseString();
+          if (str) return std::make_shared<Value>(*str);
+      }
+      if (consumeKeyword("true") || consumeKeyword("True")) return std::make_shared<Value>(true);
+      if (consumeKeyword("false") || consumeKeyword("False")) return std::make_shared<Value>(false);
+      if (consumeKeyword("None")) return std::make_shared<Value>(nullptr);
+
+      auto number = parseNumber(it, end);
+      if (!number.is_null()) return std::make_shared<Value>(number);
+
+      it = start;
+      return nullptr;
+    }
+
+    /** Same character classes as `\w` and `\s` in (ASCII) regexes. */
+    static bool isWordChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+    static bool isSpaceChar(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+    }
+
+    bool peekAt(CharIterator pos, const char * symbol) const {
+        for (; *symbol; ++symbol, ++pos) {
+            if (pos == end || *pos != *symbol) return false;
+        }
+        return true;
+    }
+
+    /* The first `c` at or after `pos`, or end. */
+    CharIterator findChar(CharIterator pos, char c) const {
+        if (pos == end) return end;
+        auto p = &*pos;
+        return pos + (find_byte(p, p + (end - pos), c) - p);
+    }
+
+    CharIterator findSymbol(CharIterator pos, const char * symbol) const {
+        for (; (pos = findChar(pos, symbol[0])) != end; ++pos) {
+            if (peekAt(pos, symbol)) return pos;
+        }
+        return end;
+    }
+
+    bool peekSymbols(const std::vector<std::string> & symbols) const {
+        for (const auto & symbol : symbols) {
+            if (peekAt(it, symbol.c_str())) {
+                return true;
+            }
+        }
+        return false;
     }
 
     std::string consumeToken(const std::string & token, SpaceHandling space_handling = SpaceHandling::Strip) {
         auto start = it;
         consumeSpaces(space_handling);
-        if (std::distance(it, end) >= (int64_t) token.size() && std::string(it, it + token.size()) == token) {
+        if (peekAt(it, token.c_str())) {
             it += token.size();
             return token;
         }
@@ -1943,14 +4998,49 @@ private:
         return "";
     }
 
+    /** Consumes `keyword` only if followed by a word boundary (i.e. matches `keyword\b`). */
+    bool consumeKeyword(const char * keyword, SpaceHandling space_handling = SpaceHandling::Strip) {
+        auto start = it;
+        consumeSpaces(space_handling);
+        auto len = std::char_traits<char>::length(keyword);
+        if (peekAt(it, keyword) && (it + len == end || !isWordChar(*(it + len)))) {
+            it += len;
+            return true;
+        }
+        it = start;
+        return false;
+    }
+
+    /** Consumes `\w*` at the current position (no space skipping). */
+    std::string consumeWord() {
+        auto start = it;
+        while (it != end && isWordChar(*it)) ++it;
+        return std::string(start, it);
+    }
+
+    /** Matches `\s*([-~])?<close>` (e.g. `-%}`), storing the optional whitespace control marker. */
+    bool consumeTagClose(const char * close, std::string & space_marker) {
+        auto start = it;
+        consumeSpaces();
+        space_marker.clear();
+        if (it != end && (*it == '-' || *it == '~') && peekAt(it + 1, close)) {
+            space_marker = *(it++);
+        }
+        if (peekAt(it, close)) {
+            it += std::char_traits<char>::length(close);
+            return true;
+        }
+        it = start;
+        return false;
+    }
+
     std::shared_ptr<Expression> parseExpression(bool allow_if_expr = true) {
         auto left = parseLogicalOr();
         if (it == end) return left;
 
         if (!allow_if_expr) return left;
 
-        static std::regex if_tok(R"(if\b)");
-        if (consumeToken(if_tok).empty()) {
+        if (!consumeKeyword("if")) {
           return left;
         }
 
@@ -1958,7 +5048,7 @@ private:
         auto cepair = parseIfExpression();
         auto condition = cepair.first;
         auto else_expr = cepair.second;
-        return std::make_shared<IfExpr>(location, std::move(condition), std::move(left), std::move(else_expr));
+        return make_node<IfExpr>(location, std::move(condition), std::move(left), std::move(else_expr));
     }
 
     Location get_location() const {
@@ -1969,9 +5059,8 @@ private:
         auto condition = parseLogicalOr();
         if (!condition) _printlog("Expected condition expression");
 
-        static std::regex else_tok(R"(else\b)");
         std::shared_ptr<Expression> else_expr;
-        if (!consumeToken(else_tok).empty()) {
+        if (consumeKeyword("else")) {
           else_expr = parseExpression();
           if (!else_expr) _printlog("Expected 'else' expression");
         }
@@ -1982,24 +5071,22 @@ private:
         auto left = parseLogicalAnd();
         if (!left) _printlog("Expected left side of 'logical or' expression");
 
-        static std::regex or_tok(R"(or\b)");
         auto location = get_location();
-        while (!consumeToken(or_tok).empty()) {
+        while (consumeKeyword("or")) {
             auto right = parseLogicalAnd();
             if (!right) _printlog("Expected right side of 'or' expression");
-            left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::Or);
+            left = make_node<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::Or);
         }
         return left;
     }
 
     std::shared_ptr<Expression> parseLogicalNot() {
-        static std::regex not_tok(R"(not\b)");
         auto location = get_location();
 
-        if (!consumeToken(not_tok).empty()) {
+        if (consumeKeyword("not")) {
           auto sub = parseLogicalNot();
           if (!sub) _printlog("Expected expression after 'not' keyword");
-          return std::make_shared<UnaryOpExpr>(location, std::move(sub), UnaryOpExpr::Op::LogicalNot);
+          return make_node<UnaryOpExpr>(location, std::move(sub), UnaryOpExpr::Op::LogicalNot);
         }
         return parseLogicalCompare();
     }
@@ -2008,12 +5095,11 @@ private:
         auto left = parseLogicalNot();
         if (!left) _printlog("Expected left side of 'logical and' expression");
 
-        static std::regex and_tok(R"(and\b)");
         auto location = get_location();
-        while (!consumeToken(and_tok).empty()) {
+        while (consumeKeyword("and")) {
             auto right = parseLogicalNot();
             if (!right) _printlog("Expected right side of 'and' expression");
-            left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::And);
+            left = make_node<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::And);
         }
         return left;
     }
@@ -2022,18 +5108,16 @@ private:
         auto left = parseStringConcat();
         if (!left) _printlog("Expected left side of 'logical compare' expression");
 
-        static std::regex compare_tok(R"(==|!=|<=?|>=?|in\b|is\b|not\s+in\b)");
-        static std::regex not_tok(R"(not\b)");
         std::string op_str;
-        while (!(op_str = consumeToken(compare_tok)).empty()) {
+        while (!(op_str = consumeCompareOp()).empty()) {
             auto location = get_location();
             if (op_str == "is") {
-              auto negated = !consumeToken(not_tok).empty();
+              auto negated = consumeKeyword("not");
 
               auto identifier = parseIdentifier();
               if (!identifier) _printlog("Expected identifier after 'is' keyword");
 
-              return std::make_shared<BinaryOpExpr>(
+              return make_node<BinaryOpExpr>(
                   left->location,
                   std::move(left), std::move(identifier),
                   negated ? BinaryOpExpr::Op::IsNot : BinaryOpExpr::Op::Is);
@@ -2048,13 +5132,36 @@ private:
             else if (op_str == "<=") op = BinaryOpExpr::Op::Le;
             else if (op_str == ">=") op = BinaryOpExpr::Op::Ge;
             else if (op_str == "in") op = BinaryOpExpr::Op::In;
-            else if (op_str.substr(0, 3) == "not") op = BinaryOpExpr::Op::NotIn;
+            else if (op_str == "not in") op = BinaryOpExpr::Op::NotIn;
             else _printlog("Unknown comparison operator: " + op_str);
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
         return left;
     }
 
+    /** Matches `==|!=|<=?|>=?|in\b|is\b|not\s+in\b`. */
+    std::string consumeCompareOp() {
+        auto start = it;
+        consumeSpaces();
+        for (const char * op : {"==", "!=", "<=", ">="}) {
+            if (peekAt(it, op)) {
+                it += 2;
+                return op;
+            }
+        }
+        if (it != end && (*it == '<' || *it == '>')) {
+            return std::string(1, *(it++));
+        }
+        if (consumeKeyword("in", SpaceHandling::Keep)) return "in";
+        if (consumeKeyword("is", SpaceHandling::Keep)) return "is";
+        if (peekAt(it, "not") && it + 3 != end && isSpaceChar(*(it + 3))) {
+            it += 3;
+            if (consumeKeyword("in")) return "not in";
+        }
+        it = start;
+        return "";
+    }
+
     Expression::Parameters parseParameters() {
         consumeSpaces();
         if (consumeToken("(").empty()) _printlog("Expected opening parenthesis in param list");
@@ -2127,23 +5234,34 @@ private:
     }
 
     std::shared_ptr<VariableExpr> parseIdentifier() {
-        static std::regex ident_regex(R"((?!(?:not|is|and|or|del)\b)[a-zA-Z_]\w*)");
         auto location = get_location();
-        auto ident = consumeToken(ident_regex);
-        if (ident.empty())
+        auto start = it;
+        consumeSpaces();
+        if (it == end || !isWordChar(*it) || std::isdigit(*it)) {
+          it = start;
           return nullptr;
-        return std::make_shared<VariableExpr>(location, ident);
-    }
+        }
+        auto ident = consumeWord();
+        if (ident == "not" || ident == "is" || ident == "and" || ident == "or" || ident == "del") {
+          it = start;
+          return nullptr;
+        }
+        return make_node<VariableExpr>(location, ident);
+    }
 
     std::shared_ptr<Expression> parseStringConcat() {
         auto left = parseMathPow();
         if (!left) _printlog("Expected left side of 'string concat' expression");
 
-        static std::regex concat_tok(R"(~(?!\}))");
-        if (!consumeToken(concat_tok).empty()) {
+        auto concat_start = it;
+        consumeSpaces();
+        if (it != end && *it == '~' && !peekAt(it + 1, "}")) {
+            ++it;
             auto right = parseLogicalAnd();
             if (!right) _printlog("Expected right side of 'string concat' expression");
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::StrConcat);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::StrConcat);
+        } else {
+            it = concat_start;
         }
         return left;
     }
@@ -2155,22 +5273,55 @@ private:
         while (!consumeToken("**").empty()) {
             auto right = parseMathPlusMinus();
             if (!right) _printlog("Expected right side of 'math pow' expression");
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::MulMul);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::MulMul);
         }
         return left;
     }
 
-    std::shared_ptr<Expression> parseMathPlusMinus() {
-        static std::regex plus_minus_tok(R"(\+|-(?![}%#]\}))");
+    /** Matches `\+|-(?![}%#]\})`, i.e. a minus that doesn't start a whitespace-stripping tag close. */
+    std::string consumePlusMinus() {
+        auto start = it;
+        consumeSpaces();
+        if (it != end && *it == '+') {
+            ++it;
+            return "+";
+        }
+        if (it != end && *it == '-' && !peekAt(it + 1, "}}") && !peekAt(it + 1, "%}") && !peekAt(it + 1, "#}")) {
+            ++it;
+            return "-";
+        }
+        it = start;
+        return "";
+    }
 
+    /** Matches `\*\*?|//?|%(?!\})`. */
+    std::string consumeMulDiv() {
+        auto start = it;
+        consumeSpaces();
+        for (const char * op : {"**", "*", "//", "/"}) {
+            if (peekAt(it, op)) {
+                std::string op_str(op);
+                it += op_str.size();
+                return op_str;
+            }
+        }
+        if (it != end && *it == '%' && !peekAt(it + 1, "}")) {
+            ++it;
+            return "%";
+        }
+        it = start;
+        return "";
+    }
+
+    std::shared_ptr<Expression> parseMathPlusMinus() {
         auto left = parseMathMulDiv();
         if (!left) _printlog("Expected left side of 'math plus/minus' expression");
         std::string op_str;
-        while (!(op_str = consumeToken(plus_minus_tok)).empty()) {
+        while (!(op_str = consumePlusMinus()).empty()) {
             auto right = parseMathMulDiv();
             if (!right) _printlog("Expected right side of 'math plus/minus' expression");
             auto op = op_str == "+" ? BinaryOpExpr::Op::Add : BinaryOpExpr::Op::Sub;
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
         return left;
     }
@@ -2179,9 +5330,8 @@ private:
         auto left = parseMathUnaryPlusMinus();
         if (!left) _printlog("Expected left side of 'math mul/div' expression");
 
-        static std::regex mul_div_tok(R"(\*\*?|//?|%(?!\}))");
         std::string op_str;
-        while (!(op_str = consumeToken(mul_div_tok)).empty()) {
+        while (!(op_str = consumeMulDiv()).empty()) {
             auto right = parseMathUnaryPlusMinus();
             if (!right) _printlog("Expected right side of 'math mul/div' expression");
             auto op = op_str == "*" ? BinaryOpExpr::Op::Mul
@@ -2189,7 +5339,7 @@ private:
                 : op_str == "/" ? BinaryOpExpr::Op::Div
                 : op_str == "//" ? BinaryOpExpr::Op::DivDiv
                 : BinaryOpExpr::Op::Mod;
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
 
         if (!consumeToken("|").empty()) {
@@ -2202,49 +5352,47 @@ private:
                 std::vector<std::shared_ptr<Expression>> parts;
                 parts.emplace_back(std::move(left));
                 parts.emplace_back(std::move(expr));
-                return std::make_shared<FilterExpr>(get_location(), std::move(parts));
+                return make_node<FilterExpr>(get_location(), std::move(parts));
             }
         }
         return left;
     }
 
     std::shared_ptr<Expression> call_func(const std::string & name, ArgumentsExpression && args) const {
-        return std::make_shared<CallExpr>(get_location(), std::make_shared<VariableExpr>(get_location(), name), std::move(args));
+        return make_node<CallExpr>(get_location(), make_node<VariableExpr>(get_location(), name), std::move(args));
     }
 
     std::shared_ptr<Expression> parseMathUnaryPlusMinus() {
-        static std::regex unary_plus_minus_tok(R"(\+|-(?![}%#]\}))");
-        auto op_str = consumeToken(unary_plus_minus_tok);
+        auto op_str = consumePlusMinus();
         auto expr = parseExpansion();
         if (!expr) _printlog("Expected expr of 'unary plus/minus/expansion' expression");
 
         if (!op_str.empty()) {
             auto op = op_str == "+" ? UnaryOpExpr::Op::Plus : UnaryOpExpr::Op::Minus;
-            return std::make_shared<UnaryOpExpr>(get_location(), std::move(expr), op);
+            return make_node<UnaryOpExpr>(get_location(), std::move(expr), op);
         }
         return expr;
     }
 
     std::shared_ptr<Expression> parseExpansion() {
-      static std::regex expansion_tok(R"(\*\*?)");
-      auto op_str = consumeToken(expansion_tok);
+      auto op_str = consumeToken("**");
+      if (op_str.empty()) op_str = consumeToken("*");
       auto expr = parseValueExpression();
       if (op_str.empty()) return expr;
         if (!expr) {
             _printlog("Expected expr of 'expansion' expression");
             return nullptr;
         }
-      return std::make_shared<UnaryOpExpr>(get_location(), std::move(expr), op_str == "*" ? UnaryOpExpr::Op::Expansion : UnaryOpExpr::Op::ExpansionDict);
+      return make_node<UnaryOpExpr>(get_location(), std::move(expr), op_str == "*" ? UnaryOpExpr::Op::Expansion : UnaryOpExpr::Op::ExpansionDict);
     }
 
     std::shared_ptr<Expression> parseValueExpression() {
       auto parseValue = [&]() -> std::shared_ptr<Expression> {
         auto location = get_location();
         auto constant = parseConstant();
-        if (constant) return std::make_shared<LiteralExpr>(location, *constant);
+        if (constant) return make_node<LiteralExpr>(location, *constant);
 
-        static std::regex null_regex(R"(null\b)");
-        if (!consumeToken(null_regex).empty()) return std::make_shared<LiteralExpr>(location, Value());
+        if (consumeKeyword("null")) return make_node<LiteralExpr>(location, Value());
 
         auto identifier = parseIdentifier();
         if (identifier) return identifier;
@@ -2289,7 +5437,7 @@ private:
             }
     
             if ((c1 || c2) && (start || end || step)) {
-              index = std::make_shared<SliceExpr>(slice_loc, std::move(start), std::move(end), std::move(step));
+              index = make_node<SliceExpr>(slice_loc, std::move(start), std::move(end), std::move(step));
             } else {
               index = std::move(start);
             }
@@ -2300,7 +5448,7 @@ private:
                   MNN_ERROR("Expected closing bracket in subscript");
               }
 
-            value = std::make_shared<SubscriptExpr>(value->location, std::move(value), std::move(index));
+            value = make_node<SubscriptExpr>(value->location, std::move(value), std::move(index));
         } else if (!consumeToken(".").empty()) {
             auto identifier = parseIdentifier();
             if (!identifier) _printlog("Expected identifier in subscript");
@@ -2308,10 +5456,10 @@ private:
             consumeSpaces();
             if (peekSymbols({ "(" })) {
               auto callParams = parseCallArgs();
-              value = std::make_shared<MethodCallExpr>(identifier->location, std::move(value), std::move(identifier), std::move(callParams));
+              value = make_node<MethodCallExpr>(identifier->location, std::move(value), std::move(identifier), std::move(callParams));
             } else {
-              auto key = std::make_shared<LiteralExpr>(identifier->location, Value(identifier->get_name()));
-              value = std::make_shared<SubscriptExpr>(identifier->location, std::move(value), std::move(key));
+              auto key = make_node<LiteralExpr>(identifier->location, Value(identifier->get_name()));
+              value = make_node<SubscriptExpr>(identifier->location, std::move(value), std::move(key));
             }
         }
         consumeSpaces();
@@ -2320,7 +5468,7 @@ private:
       if (peekSymbols({ "(" })) {
         auto location = get_location();
         auto callParams = parseCallArgs();
-        value = std::make_shared<CallExpr>(location, std::move(value), std::move(callParams));
+        value = make_node<CallExpr>(location, std::move(value), std::move(callParams));
       }
       return value;
     }
@@ -2345,7 +5493,7 @@ private:
           tuple.push_back(std::move(next));
 
           if (!consumeToken(")").empty()) {
-              return std::make_shared<ArrayExpr>(get_location(), std::move(tuple));
+              return make_node<ArrayExpr>(get_location(), std::move(tuple));
           }
         }
         _printlog("Expected closing parenthesis");
@@ -2357,7 +5505,7 @@ private:
 
         std::vector<std::shared_ptr<Expression>> elements;
         if (!consumeToken("]").empty()) {
-            return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
+            return make_node<ArrayExpr>(get_location(), std::move(elements));
         }
         auto first_expr = parseExpression();
         if (!first_expr) _printlog("Expected first expression in array");
@@ -2369,7 +5517,7 @@ private:
               if (!expr) _printlog("Expected expression in array");
               elements.push_back(std::move(expr));
             } else if (!consumeToken("]").empty()) {
-                return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
+                return make_node<ArrayExpr>(get_location(), std::move(elements));
             } else {
                 _printlog("Expected comma or closing bracket in array");
             }
@@ -2383,7 +5531,7 @@ private:
 
         std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> elements;
         if (!consumeToken("}").empty()) {
-            return std::make_shared<DictExpr>(get_location(), std::move(elements));
+            return make_node<DictExpr>(get_location(), std::move(elements));
         }
 
         auto parseKeyValuePair = [&]() {
@@ -2401,7 +5549,7 @@ private:
             if (!consumeToken(",").empty()) {
                 parseKeyValuePair();
             } else if (!consumeToken("}").empty()) {
-                return std::make_shared<DictExpr>(get_location(), std::move(elements));
+                return make_node<DictExpr>(get_location(), std::move(elements));
             } else {
                 _printlog("Expected comma or closing brace in dictionary");
             }
@@ -2425,19 +5573,50 @@ private:
     using TemplateTokenIterator = TemplateTokenVector::const_iterator;
 
     std::vector<std::string> parseVarNames() {
-      static std::regex varnames_regex(R"(((?:\w+)(?:\s*,\s*(?:\w+))*)\s*)");
-
-      std::vector<std::string> group;
-      if ((group = consumeTokenGroups(varnames_regex)).empty()) _printlog("Expected variable names");
+      // Matches `\w+(\s*,\s*\w+)*\s*`
       std::vector<std::string> varnames;
-      std::istringstream iss(group[1]);
-      std::string varname;
-      while (std::getline(iss, varname, ',')) {
-        varnames.push_back(strip(varname));
+      auto start = it;
+      consumeSpaces();
+      auto varname = consumeWord();
+      if (varname.empty()) {
+        it = start;
+        _printlog("Expected variable names");
+        return varnames;
+      }
+      varnames.push_back(varname);
+      while (true) {
+        auto before_comma = it;
+        if (consumeToken(",").empty()) break;
+        consumeSpaces();
+        varname = consumeWord();
+        if (varname.empty()) {
+          it = before_comma;
+          break;
+        }
+        varnames.push_back(varname);
       }
+      consumeSpaces();
       return varnames;
     }
 
+    /** Matches `(\w+)\s*\.\s*(\w+)` (the target of `{% set ns.var = ... %}`). */
+    bool consumeNamespacedVar(std::string & ns, std::vector<std::string> & var_names) {
+      auto start = it;
+      consumeSpaces();
+      auto name = consumeWord();
+      if (!name.empty() && !consumeToken(".").empty()) {
+        consumeSpaces();
+        auto var_name = consumeWord();
+        if (!var_name.empty()) {
+          ns = name;
+          var_names.push_back(var_name);
+          return true;
+        }
+      }
+      it = start;
+      return false;
+    }
+
     std::string unexpected(const TemplateToken & token) const {
       return std::string("Unexpected " + TemplateToken::typeToString(token.type)
         + error_location_suffix(*template_str, token.location.pos));
@@ -2448,48 +5627,79 @@ private:
     }
 
     TemplateTokenVector tokenize() {
-      static std::regex comment_tok(R"(\{#([-~]?)([\s\S]*?)([-~]?)#\})");
-      static std::regex expr_open_regex(R"(\{\{([-~])?)");
-      static std::regex block_open_regex(R"(^\{%([-~])?\s*)");
-      static std::regex block_keyword_tok(R"((if|else|elif|endif|for|endfor|generation|endgeneration|set|endset|block|endblock|macro|endmacro|filter|endfilter|break|continue)\b)");
-      static std::regex non_text_open_regex(R"(\{\{|\{%|\{#)");
-      static std::regex expr_close_regex(R"(\s*([-~])?\}\})");
-      static std::regex block_close_regex(R"(\s*([-~])?%\})");
+      static const char * block_keywords[] = {
+        "if", "else", "elif", "endif", "for", "endfor", "generation", "endgeneration", "set", "endset",
+        "block", "endblock", "macro", "endmacro", "filter", "endfilter", "break", "continue",
+      };
 
       TemplateTokenVector tokens;
-      std::vector<std::string> group;
       std::string text;
-      std::smatch match;
+      std::string space_marker;
+
+      auto consumeSpaceMarker = [&]() -> std::string {
+        if (it != end && (*it == '-' || *it == '~')) return std::string(1, *(it++));
+        return "";
+      };
 
+      // Single left-to-right scan: tags are recognized by their first two characters, and text runs
+      // up to the next `{{`, `{%` or `{#`, so no position is ever rescanned.
         while (it != end) {
           auto location = get_location();
 
-          if (!(group = consumeTokenGroups(comment_tok, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
-            auto content = group[2];
-            auto post_space = parsePostSpace(group[3]);
+          if (peekAt(it, "{#")) {
+            auto content_start = it + 2;
+            std::string pre_marker;
+            if (content_start != end && (*content_start == '-' || *content_start == '~')) {
+              pre_marker = *(content_start++);
+            }
+            auto close = findSymbol(content_start, "#}");
+            if (close == end) {
+              _printlog("Missing end of comment tag");
+              tokens.push_back(std::make_shared<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, std::string(it, end)));
+              it = end;
+              break;
+            }
+            auto content_end = close;
+            std::string post_marker;
+            if (content_end != content_start && (*(content_end - 1) == '-' || *(content_end - 1) == '~')) {
+              post_marker = *(--content_end);
+            }
+            auto pre_space = parsePreSpace(pre_marker);
+            auto content = std::string(content_start, content_end);
+            auto post_space = parsePostSpace(post_marker);
+            it = close + 2;
             tokens.push_back(std::make_shared<CommentTemplateToken>(location, pre_space, post_space, content));
-          } else if (!(group = consumeTokenGroups(expr_open_regex, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
+          } else if (peekAt(it, "{{")) {
+            it += 2;
+            auto pre_space = parsePreSpace(consumeSpaceMarker());
             auto expr = parseExpression();
 
-            if ((group = consumeTokenGroups(expr_close_regex)).empty()) {
+            if (!consumeTagClose("}}", space_marker)) {
               _printlog("Expected closing expression tag");
             }
 
-            auto post_space = parsePostSpace(group[1]);
+            auto post_space = parsePostSpace(space_marker);
             tokens.push_back(std::make_shared<ExpressionTemplateToken>(location, pre_space, post_space, std::move(expr)));
-          } else if (!(group = consumeTokenGroups(block_open_regex, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
+          } else if (peekAt(it, "{%")) {
+            it += 2;
+            auto pre_space = parsePreSpace(consumeSpaceMarker());
+            consumeSpaces();
 
             std::string keyword;
 
             auto parseBlockClose = [&]() -> SpaceHandling {
-              if ((group = consumeTokenGroups(block_close_regex)).empty()) _printlog("Expected closing block tag");
-              return parsePostSpace(group[1]);
+              if (!consumeTagClose("%}", space_marker)) _printlog("Expected closing block tag");
+              return parsePostSpace(space_marker);
             };
 
-            if ((keyword = consumeToken(block_keyword_tok)).empty()) _printlog("Expected block keyword");
+            auto keyword_start = it;
+            keyword = consumeWord();
+            if (std::find_if(std::begin(block_keywords), std::end(block_keywords),
+                  [&](const char * k) { return keyword == k; }) == std::end(block_keywords)) {
+              keyword.clear();
+              it = keyword_start;
+              _printlog("Expected block keyword");
+            }
 
             if (keyword == "if") {
               auto condition = parseExpression();
@@ -2510,20 +5720,16 @@ private:
               auto post_space = parseBlockClose();
               tokens.push_back(std::make_shared<EndIfTemplateToken>(location, pre_space, post_space));
             } else if (keyword == "for") {
-              static std::regex recursive_tok(R"(recursive\b)");
-              static std::regex if_tok(R"(if\b)");
-
               auto varnames = parseVarNames();
-              static std::regex in_tok(R"(in\b)");
-              if (consumeToken(in_tok).empty()) _printlog("Expected 'in' keyword in for block");
+              if (!consumeKeyword("in")) _printlog("Expected 'in' keyword in for block");
               auto iterable = parseExpression(/* allow_if_expr = */ false);
               if (!iterable) _printlog("Expected iterable in for block");
 
               std::shared_ptr<Expression> condition;
-              if (!consumeToken(if_tok).empty()) {
+              if (consumeKeyword("if")) {
                 condition = parseExpression();
               }
-              auto recursive = !consumeToken(recursive_tok).empty();
+              auto recursive = consumeKeyword("recursive");
 
               auto post_space = parseBlockClose();
               tokens.push_back(std::make_shared<ForTemplateToken>(location, pre_space, post_space, std::move(varnames), std::move(iterable), std::move(condition), recursive));
@@ -2537,14 +5743,10 @@ private:
               auto post_space = parseBlockClose();
               tokens.push_back(std::make_shared<EndGenerationTemplateToken>(location, pre_space, post_space));
             } else if (keyword == "set") {
-              static std::regex namespaced_var_regex(R"((\w+)\s*\.\s*(\w+))");
-
               std::string ns;
               std::vector<std::string> var_names;
               std::shared_ptr<Expression> value;
-              if (!(group = consumeTokenGroups(namespaced_var_regex)).empty()) {
-                ns = group[1];
-                var_names.push_back(group[2]);
+              if (consumeNamespacedVar(ns, var_names)) {
 
                 if (consumeToken("=").empty()) _printlog("Expected equals sign in set block");
 
@@ -2568,201 +5770,1359 @@ private:
               if (!macroname) _printlog("Expected macro name in macro block");
               auto params = parseParameters();
 
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_shared<MacroTemplateToken>(location, pre_space, post_space, std::move(macroname), std::move(params)));
-            } else if (keyword == "endmacro") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_shared<EndMacroTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "filter") {
-              auto filter = parseExpression();
-              if (!filter) _printlog("Expected expression in filter block");
+              auto post_space = parseBlockClose();
+              tokens.push_back(std::make_shared<MacroTemplateToken>(location, pre_space, post_space, std::move(macroname), std::move(params)));
+            } else if (keyword == "endmacro") {
+              auto post_space = parseBlockClose();
+              tokens.push_back(std::make_shared<EndMacroTemplateToken>(location, pre_space, post_space));
+            } else if (keyword == "filter") {
+              auto filter = parseExpression();
+              if (!filter) _printlog("Expected expression in filter block");
+
+              auto post_space = parseBlockClose();
+              tokens.push_back(std::make_shared<FilterTemplateToken>(location, pre_space, post_space, std::move(filter)));
+            } else if (keyword == "endfilter") {
+              auto post_space = parseBlockClose();
+              tokens.push_back(std::make_shared<EndFilterTemplateToken>(location, pre_space, post_space));
+            } else if (keyword == "break" || keyword == "continue") {
+              auto post_space = parseBlockClose();
+              tokens.push_back(std::make_shared<LoopControlTemplateToken>(location, pre_space, post_space, keyword == "break" ? LoopControlType::Break : LoopControlType::Continue));
+            } else {
+              _printlog("Unexpected block: " + keyword);
+            }
+          } else {
+            auto text_end = it;
+            while ((text_end = findChar(text_end + 1, '{')) != end) {
+              if (text_end + 1 != end && (*(text_end + 1) == '{' || *(text_end + 1) == '%' || *(text_end + 1) == '#')) break;
+            }
+            text = std::string(it, text_end);
+            it = text_end;
+            tokens.push_back(std::make_shared<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
+          }
+        }
+        return tokens;
+    }
+
+    std::shared_ptr<TemplateNode> parseTemplate(
+          const TemplateTokenIterator & begin,
+          TemplateTokenIterator & it,
+          const TemplateTokenIterator & end,
+          bool fully = false) const {
+        std::vector<std::shared_ptr<TemplateNode>> children;
+        while (it != end) {
+          const auto start = it;
+          const auto & token = *(it++);
+            if (token->type == TemplateToken::Type::If) {
+                auto if_token = (IfTemplateToken*)(token.get());
+              std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade;
+              cascade.emplace_back(std::move(if_token->condition), parseTemplate(begin, it, end));
+
+              while (it != end && (*it)->type == TemplateToken::Type::Elif) {
+                  auto elif_token = (ElifTemplateToken*)((*(it++)).get());
+                  cascade.emplace_back(std::move(elif_token->condition), parseTemplate(begin, it, end));
+              }
+
+              if (it != end && (*it)->type == TemplateToken::Type::Else) {
+                cascade.emplace_back(nullptr, parseTemplate(begin, ++it, end));
+              }
+              if (it == end || (*(it++))->type != TemplateToken::Type::EndIf) {
+                  MNN_ERROR("%s\n", unterminated(**start).c_str());
+              }
+              children.emplace_back(make_node<IfNode>(token->location, std::move(cascade)));
+            } else if (token->type == TemplateToken::Type::For) {
+                auto for_token = (ForTemplateToken*)(token.get());
+              auto body = parseTemplate(begin, it, end);
+              auto else_body = std::shared_ptr<TemplateNode>();
+              if (it != end && (*it)->type == TemplateToken::Type::Else) {
+                else_body = parseTemplate(begin, ++it, end);
+              }
+              if (it == end || (*(it++))->type != TemplateToken::Type::EndFor) {
+                  MNN_ERROR("%s\n", unterminated(**start).c_str());
+              }
+              children.emplace_back(make_node<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body)));
+            } else if(token->type == TemplateToken::Type::Generation) {
+              auto body = parseTemplate(begin, it, end);
+              if (it == end || (*(it++))->type != TemplateToken::Type::EndGeneration) {
+                  MNN_ERROR("%s\n", unterminated(**start).c_str());
+              }
+              // Renders as its body; sinks that care (see SpanSink) are told where it is, to mask the generated tokens for training.
+              children.emplace_back(make_node<GenerationNode>(token->location, std::move(body)));
+            } else if(token->type == TemplateToken::Type::Text) {
+                auto text_token = (TextTemplateToken*)(token.get());
+              SpaceHandling pre_space = (it - 1) != begin ? (*(it - 2))->post_space : SpaceHandling::Keep;
+              SpaceHandling post_space = it != end ? (*it)->pre_space : SpaceHandling::Keep;
+
+              auto text = text_token->text;
+              if (post_space == SpaceHandling::Strip) {
+                text.erase(text.find_last_not_of(" \t\n\r\f\v") + 1);
+              } else if (options.lstrip_blocks && it != end) {
+                auto i = text.size();
+                while (i > 0 && (text[i - 1] == ' ' || text[i - 1] == '\t')) i--;
+                if ((i == 0 && (it - 1) == begin) || (i > 0 && text[i - 1] == '\n')) {
+                  text.resize(i);
+                }
+              }
+              if (pre_space == SpaceHandling::Strip) {
+                text.erase(0, text.find_first_not_of(" \t\n\r\f\v"));
+              } else if (options.trim_blocks && (it - 1) != begin && (*(it - 2))->type != TemplateToken::Type::Expression) {
+                if (!text.empty() && text[0] == '\n') {
+                  text.erase(0, 1);
+                }
+              }
+              if (it == end && !options.keep_trailing_newline) {
+                auto i = text.size();
+                if (i > 0 && text[i - 1] == '\n') {
+                  i--;
+                  if (i > 0 && text[i - 1] == '\r') i--;
+                  text.resize(i);
+                }
+              }
+              children.emplace_back(make_node<TextNode>(token->location, text));
+            } else if(token->type == TemplateToken::Type::Expression) {
+                auto expr_token = (ExpressionTemplateToken*)(token.get());
+                children.emplace_back(make_node<ExpressionNode>(token->location, std::move(expr_token->expr)));
+            } else if(token->type == TemplateToken::Type::Set) {
+                auto set_token = (SetTemplateToken*)(token.get());
+                if (set_token->value) {
+                  children.emplace_back(make_node<SetNode>(token->location, set_token->ns, set_token->var_names, std::move(set_token->value)));
+                } else {
+                  auto value_template = parseTemplate(begin, it, end);
+                  if (it == end || (*(it++))->type != TemplateToken::Type::EndSet) {
+                      MNN_ERROR("%s\n", unterminated(**start).c_str());
+                  }
+                  if (!set_token->ns.empty()) _printlog("Namespaced set not supported in set with template value");
+                  if (set_token->var_names.size() != 1) _printlog("Structural assignment not supported in set with template value");
+                  auto & name = set_token->var_names[0];
+                  children.emplace_back(make_node<SetTemplateNode>(token->location, name, std::move(value_template)));
+                }
+            } else if(token->type == TemplateToken::Type::Macro) {
+                auto macro_token = (MacroTemplateToken*)(token.get());
+              auto body = parseTemplate(begin, it, end);
+              if (it == end || (*(it++))->type != TemplateToken::Type::EndMacro) {
+                  MNN_ERROR("%s\n", unterminated(**start).c_str());
+              }
+              children.emplace_back(make_node<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body)));
+            } else if(token->type == TemplateToken::Type::Filter) {
+                auto filter_token = (FilterTemplateToken*)(token.get());
+                auto body = parseTemplate(begin, it, end);
+                if (it == end || (*(it++))->type != TemplateToken::Type::EndFilter) {
+                    MNN_ERROR("%s\n", unterminated(**start).c_str());
+                }
+                children.emplace_back(make_node<FilterNode>(token->location, std::move(filter_token->filter), std::move(body)));
+            } else if(token->type == TemplateToken::Type::Comment) {
+                // Ignore comments
+            } else if(token->type == TemplateToken::Type::Break) {
+                auto ctrl_token = (LoopControlTemplateToken*)(token.get());
+                children.emplace_back(make_node<LoopControlNode>(token->location, ctrl_token->control_type));
+            } else {
+                bool needBreak = false;
+                switch (token->type) {
+                    case TemplateToken::Type::EndSet:
+                    case TemplateToken::Type::EndFor:
+                    case TemplateToken::Type::EndMacro:
+                    case TemplateToken::Type::EndFilter:
+                    case TemplateToken::Type::EndIf:
+                    case TemplateToken::Type::Else:
+                    case TemplateToken::Type::Elif:
+                    case TemplateToken::Type::EndGeneration:
+                        it--;
+                        needBreak = true;
+                        break;
+                    default:
+                        MNN_ERROR("%s\n", unexpected(**(it-1)).c_str());
+                }
+                if (needBreak) {
+                    break;
+                }
+          }
+        }
+        if (fully && it != end) {
+            MNN_ERROR("%s\n", unexpected(**it).c_str());
+        }
+        if (children.empty()) {
+          return make_node<TextNode>(Location { template_str, 0 }, std::string());
+        } else if (children.size() == 1) {
+          return std::move(children[0]);
+        } else {
+          return make_node<SequenceNode>(children[0]->location(), std::move(children));
+        }
+    }
+
+public:
+
+    /**
+     * Parses a template; if `arena` is given, the whole AST is allocated from it.
+     * With `options.optimize`, the tree is simplified by TemplateOptimizer, specialized for `constants` if given.
+     * The returned tree is never modified by rendering, so it can be rendered from several threads at once
+     * (each with its own Context).
+     */
+    static std::shared_ptr<TemplateNode> parse(const std::string& template_str, const Options & options, const std::shared_ptr<Arena> & arena = nullptr,
+                                               const std::map<std::string, Value> & constants = {}) {
+        Parser parser(std::make_shared<std::string>(normalize_newlines(template_str)), options, arena);
+        auto tokens = parser.tokenize();
+        TemplateTokenIterator begin = tokens.begin();
+        auto it = begin;
+        TemplateTokenIterator end = tokens.end();
+        auto root = parser.parseTemplate(begin, it, end, /* fully= */ true);
+        if (options.optimize) TemplateOptimizer::optimize_template(root, arena, constants);
+        VariableResolver::resolve_template(root);
+        return root;
+    }
+};
+
+/**
+ * Writes parsed template trees in the binary form `TemplateReader` loads back without tokenizing or parsing
+ * (see `chat_template::compile`).
+ *
+ * Each node or expression is a type tag (0 for a null child, else `mType + 1`), its source position and its fields,
+ * children inline in pre-order. Strings are indices into a table of distinct strings that `finish()` puts first.
+ * Integers are LEB128 varints and doubles their IEEE-754 bits, so the format doesn't depend on the host's byte order.
+ */
+class TemplateWriter {
+    std::string body_;
+    std::vector<const std::string *> strings_;
+    std::unordered_map<std::string, size_t> string_ids_;
+
+    static void append_varint(std::string & out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back((char) (0x80 | (v & 0x7f)));
+            v >>= 7;
+        }
+        out.push_back((char) v);
+    }
+    void write_header(int type, const Location & location) {
+        write_varint((uint64_t) type + 1);
+        write_varint(location.pos);
+    }
+    bool write_value(const Value & value) {
+        if (value.is_null()) {
+            write_varint(0);
+        } else if (value.is_boolean()) {
+            write_varint(value.get<bool>() ? 2 : 1);
+        } else if (value.is_number_integer()) {
+            auto v = value.get<int64_t>();
+            write_varint(3);
+            write_varint(((uint64_t) v << 1) ^ (v < 0 ? ~(uint64_t) 0 : 0));
+        } else if (value.is_number_float()) {
+            auto d = value.get<double>();
+            uint64_t bits;
+            std::memcpy(&bits, &d, sizeof(bits));
+            write_varint(4);
+            for (int i = 0; i < 8; ++i) body_.push_back((char) ((bits >> (8 * i)) & 0xff));
+        } else if (value.is_string()) {
+            write_varint(5);
+            write_string(value.get<std::string>());
+        } else {
+            _printlog("Can't compile a non-primitive literal: " + value.dump());
+            return false;
+        }
+        return true;
+    }
+    bool write_args(const ArgumentsExpression & args) {
+        write_varint(args.args.size());
+        for (const auto & arg : args.args) if (!write_expr(arg)) return false;
+        write_varint(args.kwargs.size());
+        for (const auto & kwarg : args.kwargs) {
+            write_string(kwarg.first);
+            if (!write_expr(kwarg.second)) return false;
+        }
+        return true;
+    }
+    bool write_exprs(const std::vector<std::shared_ptr<Expression>> & exprs) {
+        write_varint(exprs.size());
+        for (const auto & expr : exprs) if (!write_expr(expr)) return false;
+        return true;
+    }
+    bool write_expr(const std::shared_ptr<Expression> & expr) {
+        if (!expr) {
+            write_varint(0);
+            return true;
+        }
+        write_header(expr->mType, expr->location);
+        switch (expr->mType) {
+            case Expression::Type_Variable:
+                write_string(((VariableExpr*)expr.get())->get_name());
+                return true;
+            case Expression::Type_If: {
+                auto e = (IfExpr*)expr.get();
+                return write_expr(e->get_condition()) && write_expr(e->get_then_expr()) && write_expr(e->get_else_expr());
+            }
+            case Expression::Type_Liter:
+                return write_value(((LiteralExpr*)expr.get())->get_value());
+            case Expression::Type_Array:
+                return write_exprs(((ArrayExpr*)expr.get())->get_elements());
+            case Expression::Type_Dict: {
+                const auto & elements = ((DictExpr*)expr.get())->get_elements();
+                write_varint(elements.size());
+                for (const auto & element : elements) {
+                    if (!write_expr(element.first) || !write_expr(element.second)) return false;
+                }
+                return true;
+            }
+            case Expression::Type_Slice: {
+                auto e = (SliceExpr*)expr.get();
+                return write_expr(e->start) && write_expr(e->end) && write_expr(e->step);
+            }
+            case Expression::Type_Subscript: {
+                auto e = (SubscriptExpr*)expr.get();
+                return write_expr(e->get_base()) && write_expr(e->get_index());
+            }
+            case Expression::Type_Unary: {
+                auto e = (UnaryOpExpr*)expr.get();
+                write_varint((uint64_t) e->op);
+                return write_expr(e->expr);
+            }
+            case Expression::Type_Binary: {
+                auto e = (BinaryOpExpr*)expr.get();
+                write_varint((uint64_t) e->get_op());
+                return write_expr(e->get_left()) && write_expr(e->get_right());
+            }
+            case Expression::Type_MethodCall: {
+                auto e = (MethodCallExpr*)expr.get();
+                return write_expr(e->get_object()) && write_expr(e->get_method()) && write_args(e->get_args());
+            }
+            case Expression::Type_Call: {
+                auto e = (CallExpr*)expr.get();
+                return write_expr(e->object) && write_args(e->args);
+            }
+            case Expression::Type_Filter:
+                return write_exprs(((FilterExpr*)expr.get())->get_parts());
+        }
+        _printlog("Can't compile expression of type " + std::to_string(expr->mType));
+        return false;
+    }
+    bool write_node(const std::shared_ptr<TemplateNode> & node) {
+        if (!node) {
+            write_varint(0);
+            return true;
+        }
+        write_header(node->mType, node->location());
+        switch (node->mType) {
+            case TemplateNode::Type_Sequence: {
+                const auto & children = ((SequenceNode*)node.get())->get_children();
+                write_varint(children.size());
+                for (const auto & child : children) if (!write_node(child)) return false;
+                return true;
+            }
+            case TemplateNode::Type_Text:
+                write_string(((TextNode*)node.get())->get_text());
+                return true;
+            case TemplateNode::Type_Expression:
+                return write_expr(((ExpressionNode*)node.get())->get_expr());
+            case TemplateNode::Type_If: {
+                const auto & cascade = ((IfNode*)node.get())->get_cascade();
+                write_varint(cascade.size());
+                for (const auto & branch : cascade) {
+                    if (!write_expr(branch.first) || !write_node(branch.second)) return false;
+                }
+                return true;
+            }
+            case TemplateNode::Type_LoopControl:
+                write_varint((uint64_t) ((LoopControlNode*)node.get())->get_control_type());
+                return true;
+            case TemplateNode::Type_For: {
+                auto n = (ForNode*)node.get();
+                write_strings(n->get_var_names());
+                if (!write_expr(n->get_iterable()) || !write_expr(n->get_condition()) || !write_node(n->get_body())) return false;
+                write_varint(n->is_recursive() ? 1 : 0);
+                return write_node(n->get_else_body());
+            }
+            case TemplateNode::Type_Macro: {
+                auto n = (MacroNode*)node.get();
+                if (!write_expr(n->get_name())) return false;
+                write_varint(n->get_params().size());
+                for (const auto & param : n->get_params()) {
+                    write_string(param.first);
+                    if (!write_expr(param.second)) return false;
+                }
+                return write_node(n->get_body());
+            }
+            case TemplateNode::Type_Filter: {
+                auto n = (FilterNode*)node.get();
+                return write_expr(n->get_filter()) && write_node(n->get_body());
+            }
+            case TemplateNode::Type_Set: {
+                auto n = (SetNode*)node.get();
+                write_string(n->get_ns());
+                write_strings(n->get_var_names());
+                return write_expr(n->get_value());
+            }
+            case TemplateNode::Type_SetTemplate: {
+                auto n = (SetTemplateNode*)node.get();
+                write_string(n->get_name());
+                return write_node(n->get_template_value());
+            }
+            case TemplateNode::Type_Generation:
+                return write_node(((GenerationNode*)node.get())->get_body());
+        }
+        _printlog("Can't compile node of type " + std::to_string(node->mType));
+        return false;
+    }
+    void write_strings(const std::vector<std::string> & strings) {
+        write_varint(strings.size());
+        for (const auto & s : strings) write_string(s);
+    }
+
+public:
+    void write_varint(uint64_t v) { append_varint(body_, v); }
+    void write_string(const std::string & s) {
+        auto it = string_ids_.emplace(s, strings_.size()).first;
+        if (it->second == strings_.size()) strings_.push_back(&it->first);
+        write_varint(it->second);
+    }
+    /* Appends the tree under `root`; returns false (after logging why) if it holds something the format can't represent. */
+    bool write_tree(const std::shared_ptr<TemplateNode> & root) {
+        if (!root) {
+            _printlog("Can't compile an empty template");
+            return false;
+        }
+        return write_node(root);
+    }
+    /* The string table followed by everything written so far. */
+    std::string finish() const {
+        std::string out;
+        append_varint(out, strings_.size());
+        for (auto s : strings_) {
+            append_varint(out, s->size());
+            out += *s;
+        }
+        return out + body_;
+    }
+};
+
+/**
+ * Loads back what `TemplateWriter` wrote (e.g. straight from a memory-mapped file): reads the string table up front
+ * then rebuilds each tree node by node, without tokenizing or parsing, and binds its variables as `Parser::parse` does.
+ *
+ * Strings are copied into the nodes, so `data` only needs to outlive the reader. Every read is bounds-checked:
+ * corrupted or truncated input is logged once and makes `ok()` false (and `read_tree` return nullptr). So are
+ * locations past the end of the source and trees nested more than `max_depth` deep, which would exhaust the stack.
+ */
+class TemplateReader {
+public:
+    static constexpr size_t max_depth = 512;
+
+private:
+    const char * data_;
+    size_t size_;
+    size_t pos_ = 0;
+    size_t depth_ = 0;
+    bool ok_ = true;
+    std::vector<std::string_view> strings_;
+    std::shared_ptr<std::string> source_;
+    std::shared_ptr<Arena> arena_;
+
+    bool fail() {
+        if (ok_) _printlog("Corrupted compiled template (at byte " + std::to_string(pos_) + ")");
+        ok_ = false;
+        return false;
+    }
+    // Counts the expressions & nodes being read, from the root down.
+    struct Nesting {
+        size_t & depth;
+        explicit Nesting(size_t & d) : depth(++d) {}
+        ~Nesting() { --depth; }
+    };
+    // Counts prefix lists whose elements take at least a byte each, so a bogus one can't make us allocate much.
+    bool read_count(size_t & n) {
+        n = 0;  // (Set either way, so that GCC can tell callers never read it uninitialized.)
+        uint64_t v;
+        if (!read_varint(v)) return false;
+        if (v > size_ - pos_) return fail();
+        n = (size_t) v;
+        return true;
+    }
+    bool read_strings(std::vector<std::string> & strings) {
+        size_t n;
+        if (!read_count(n)) return false;
+        strings.resize(n);
+        for (auto & s : strings) if (!read_string(s)) return false;
+        return true;
+    }
+    bool read_header(uint64_t & tag, Location & location) {
+        if (!read_varint(tag)) return false;
+        if (tag == 0) return true;
+        uint64_t pos;
+        if (!read_varint(pos)) return false;
+        if (pos > (source_ ? source_->size() : 0)) return fail();
+        location = {source_, (size_t) pos};
+        return true;
+    }
+    bool read_value(Value & value) {
+        uint64_t tag;
+        if (!read_varint(tag)) return false;
+        switch (tag) {
+            case 0: value = Value(); return true;
+            case 1: value = Value(false); return true;
+            case 2: value = Value(true); return true;
+            case 3: {
+                uint64_t v;
+                if (!read_varint(v)) return false;
+                value = Value((int64_t) ((v >> 1) ^ (~(v & 1) + 1)));
+                return true;
+            }
+            case 4: {
+                if (size_ - pos_ < 8) return fail();
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; ++i) bits |= (uint64_t) (unsigned char) data_[pos_++] << (8 * i);
+                double d;
+                std::memcpy(&d, &bits, sizeof(d));
+                value = Value(d);
+                return true;
+            }
+            case 5: {
+                std::string s;
+                if (!read_string(s)) return false;
+                value = Value(s);
+                return true;
+            }
+        }
+        return fail();
+    }
+    bool read_args(ArgumentsExpression & args) {
+        if (!read_exprs(args.args)) return false;
+        size_t n;
+        if (!read_count(n)) return false;
+        args.kwargs.resize(n);
+        for (auto & kwarg : args.kwargs) {
+            if (!read_string(kwarg.first) || !read_expr(kwarg.second)) return false;
+        }
+        return true;
+    }
+    bool read_exprs(std::vector<std::shared_ptr<Expression>> & exprs) {
+        size_t n;
+        if (!read_count(n)) return false;
+        exprs.resize(n);
+        for (auto & expr : exprs) if (!read_expr(expr)) return false;
+        return true;
+    }
+    bool read_expr(std::shared_ptr<Expression> & expr) {
+        Nesting nesting(depth_);
+        if (depth_ > max_depth) return fail();
+        uint64_t tag;
+        Location location;
+        if (!read_header(tag, location)) return false;
+        if (tag == 0) {
+            expr = nullptr;
+            return true;
+        }
+        switch ((int) tag - 1) {
+            case Expression::Type_Variable: {
+                std::string name;
+                if (!read_string(name)) return false;
+                expr = make_ast_node<VariableExpr>(arena_, location, name);
+                return true;
+            }
+            case Expression::Type_If: {
+                std::shared_ptr<Expression> condition, then_expr, else_expr;
+                if (!read_expr(condition) || !read_expr(then_expr) || !read_expr(else_expr)) return false;
+                expr = make_ast_node<IfExpr>(arena_, location, std::move(condition), std::move(then_expr), std::move(else_expr));
+                return true;
+            }
+            case Expression::Type_Liter: {
+                Value value;
+                if (!read_value(value)) return false;
+                expr = make_ast_node<LiteralExpr>(arena_, location, value);
+                return true;
+            }
+            case Expression::Type_Array: {
+                std::vector<std::shared_ptr<Expression>> elements;
+                if (!read_exprs(elements)) return false;
+                expr = make_ast_node<ArrayExpr>(arena_, location, std::move(elements));
+                return true;
+            }
+            case Expression::Type_Dict: {
+                size_t n;
+                if (!read_count(n)) return false;
+                std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> elements(n);
+                for (auto & element : elements) {
+                    if (!read_expr(element.first) || !read_expr(element.second)) return false;
+                }
+                expr = make_ast_node<DictExpr>(arena_, location, std::move(elements));
+                return true;
+            }
+            case Expression::Type_Slice: {
+                std::shared_ptr<Expression> start, end, step;
+                if (!read_expr(start) || !read_expr(end) || !read_expr(step)) return false;
+                expr = make_ast_node<SliceExpr>(arena_, location, std::move(start), std::move(end), std::move(step));
+                return true;
+            }
+            case Expression::Type_Subscript: {
+                std::shared_ptr<Expression> base, index;
+                if (!read_expr(base) || !read_expr(index)) return false;
+                expr = make_ast_node<SubscriptExpr>(arena_, location, std::move(base), std::move(index));
+                return true;
+            }
+            case Expression::Type_Unary: {
+                uint64_t op;
+                std::shared_ptr<Expression> operand;
+                if (!read_varint(op) || !read_expr(operand)) return false;
+                if (op > (uint64_t) UnaryOpExpr::Op::ExpansionDict) return fail();
+                expr = make_ast_node<UnaryOpExpr>(arena_, location, std::move(operand), (UnaryOpExpr::Op) op);
+                return true;
+            }
+            case Expression::Type_Binary: {
+                uint64_t op;
+                std::shared_ptr<Expression> left, right;
+                if (!read_varint(op) || !read_expr(left) || !read_expr(right)) return false;
+                if (op > (uint64_t) BinaryOpExpr::Op::IsNot) return fail();
+                expr = make_ast_node<BinaryOpExpr>(arena_, location, std::move(left), std::move(right), (BinaryOpExpr::Op) op);
+                return true;
+            }
+            case Expression::Type_MethodCall: {
+                std::shared_ptr<Expression> object, method;
+                ArgumentsExpression args;
+                if (!read_expr(object) || !read_expr(method) || !read_args(args)) return false;
+                if (!method || method->mType != Expression::Type_Variable) return fail();
+                expr = make_ast_node<MethodCallExpr>(arena_, location, std::move(object),
+                                                     std::static_pointer_cast<VariableExpr>(method), std::move(args));
+                return true;
+            }
+            case Expression::Type_Call: {
+                std::shared_ptr<Expression> object;
+                ArgumentsExpression args;
+                if (!read_expr(object) || !read_args(args)) return false;
+                expr = make_ast_node<CallExpr>(arena_, location, std::move(object), std::move(args));
+                return true;
+            }
+            case Expression::Type_Filter: {
+                std::vector<std::shared_ptr<Expression>> parts;
+                if (!read_exprs(parts)) return false;
+                expr = make_ast_node<FilterExpr>(arena_, location, std::move(parts));
+                return true;
+            }
+        }
+        return fail();
+    }
+    bool read_node(std::shared_ptr<TemplateNode> & node) {
+        Nesting nesting(depth_);
+        if (depth_ > max_depth) return fail();
+        uint64_t tag;
+        Location location;
+        if (!read_header(tag, location)) return false;
+        if (tag == 0) {
+            node = nullptr;
+            return true;
+        }
+        switch ((int) tag - 1) {
+            case TemplateNode::Type_Sequence: {
+                size_t n;
+                if (!read_count(n)) return false;
+                std::vector<std::shared_ptr<TemplateNode>> children(n);
+                for (auto & child : children) if (!read_node(child)) return false;
+                node = make_ast_node<SequenceNode>(arena_, location, std::move(children));
+                return true;
+            }
+            case TemplateNode::Type_Text: {
+                std::string text;
+                if (!read_string(text)) return false;
+                node = make_ast_node<TextNode>(arena_, location, text);
+                return true;
+            }
+            case TemplateNode::Type_Expression: {
+                std::shared_ptr<Expression> expr;
+                if (!read_expr(expr)) return false;
+                node = make_ast_node<ExpressionNode>(arena_, location, std::move(expr));
+                return true;
+            }
+            case TemplateNode::Type_If: {
+                size_t n;
+                if (!read_count(n)) return false;
+                std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade(n);
+                for (auto & branch : cascade) {
+                    if (!read_expr(branch.first) || !read_node(branch.second)) return false;
+                }
+                node = make_ast_node<IfNode>(arena_, location, std::move(cascade));
+                return true;
+            }
+            case TemplateNode::Type_LoopControl: {
+                uint64_t control_type;
+                if (!read_varint(control_type)) return false;
+                if (control_type > (uint64_t) LoopControlType::Continue) return fail();
+                node = make_ast_node<LoopControlNode>(arena_, location, (LoopControlType) control_type);
+                return true;
+            }
+            case TemplateNode::Type_For: {
+                std::vector<std::string> var_names;
+                std::shared_ptr<Expression> iterable, condition;
+                std::shared_ptr<TemplateNode> body, else_body;
+                uint64_t recursive;
+                if (!read_strings(var_names) || !read_expr(iterable) || !read_expr(condition) || !read_node(body)
+                    || !read_varint(recursive) || !read_node(else_body)) return false;
+                node = make_ast_node<ForNode>(arena_, location, std::move(var_names), std::move(iterable), std::move(condition),
+                                              std::move(body), recursive != 0, std::move(else_body));
+                return true;
+            }
+            case TemplateNode::Type_Macro: {
+                std::shared_ptr<Expression> name;
+                size_t n;
+                if (!read_expr(name) || !read_count(n)) return false;
+                if (!name || name->mType != Expression::Type_Variable) return fail();
+                Expression::Parameters params(n);
+                for (auto & param : params) {
+                    if (!read_string(param.first) || !read_expr(param.second)) return false;
+                }
+                std::shared_ptr<TemplateNode> body;
+                if (!read_node(body)) return false;
+                node = make_ast_node<MacroNode>(arena_, location, std::static_pointer_cast<VariableExpr>(name), std::move(params), std::move(body));
+                return true;
+            }
+            case TemplateNode::Type_Filter: {
+                std::shared_ptr<Expression> filter;
+                std::shared_ptr<TemplateNode> body;
+                if (!read_expr(filter) || !read_node(body)) return false;
+                node = make_ast_node<FilterNode>(arena_, location, std::move(filter), std::move(body));
+                return true;
+            }
+            case TemplateNode::Type_Set: {
+                std::string ns;
+                std::vector<std::string> var_names;
+                std::shared_ptr<Expression> value;
+                if (!read_string(ns) || !read_strings(var_names) || !read_expr(value)) return false;
+                node = make_ast_node<SetNode>(arena_, location, ns, var_names, std::move(value));
+                return true;
+            }
+            case TemplateNode::Type_SetTemplate: {
+                std::string name;
+                std::shared_ptr<TemplateNode> template_value;
+                if (!read_string(name) || !read_node(template_value)) return false;
+                node = make_ast_node<SetTemplateNode>(arena_, location, name, std::move(template_value));
+                return true;
+            }
+            case TemplateNode::Type_Generation: {
+                std::shared_ptr<TemplateNode> body;
+                if (!read_node(body)) return false;
+                node = make_ast_node<GenerationNode>(arena_, location, std::move(body));
+                return true;
+            }
+        }
+        return fail();
+    }
+
+public:
+    /* `source` is what the trees' locations point into (the template they were parsed from), for error messages. */
+    TemplateReader(const char * data, size_t size, const std::shared_ptr<std::string> & source, const std::shared_ptr<Arena> & arena = nullptr)
+        : data_(data), size_(size), source_(source), arena_(arena) {
+        size_t n;
+        if (!read_count(n)) return;
+        strings_.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            size_t length;
+            if (!read_count(length)) return;
+            strings_.emplace_back(data_ + pos_, length);
+            pos_ += length;
+        }
+    }
+    bool ok() const { return ok_; }
+    bool at_end() const { return pos_ == size_; }
+    bool read_varint(uint64_t & v) {
+        v = 0;
+        for (int shift = 0; shift < 64 && ok_; shift += 7) {
+            if (pos_ == size_) break;
+            auto byte = (unsigned char) data_[pos_++];
+            v |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return fail();
+    }
+    bool read_string(std::string & s) {
+        uint64_t id;
+        if (!read_varint(id)) return false;
+        if (id >= strings_.size()) return fail();
+        s.assign(strings_[id].data(), strings_[id].size());
+        return true;
+    }
+    /* Reads the next tree `TemplateWriter::write_tree` wrote, or returns nullptr if the input is corrupted. */
+    std::shared_ptr<TemplateNode> read_tree() {
+        std::shared_ptr<TemplateNode> root;
+        if (!ok_ || !read_node(root)) return nullptr;
+        if (!root) {
+            fail();
+            return nullptr;
+        }
+        VariableResolver::resolve_template(root);
+        return root;
+    }
+};
+
+/**
+ * A template compiled into a linear instruction stream, rendering the same output as the tree it's compiled from
+ * without walking it: text is emitted directly, conditions, `and` / `or` and loops become jumps, and variable loads,
+ * subscripts, operators and filters get their own instructions, which evaluate their operands on a value stack.
+ * What has no dedicated instruction (calls, macros, recursive loops...) is left to the tree, so any template compiles.
+ *
+ * Immutable once built: each render keeps its state on its own stack, so a program can be shared across threads
+ * like the tree it came from (and keeps alive).
+ */
+class TemplateProgram {
+public:
+    enum Op : uint8_t {
+        Op_Text,        // Emits texts_[a].
+        Op_Print,       // Pops a value and prints it as `{{ }}` does.
+        Op_Const,       // Pushes constants_[a].
+        Op_Load,        // Pushes the value of variable exprs_[a].
+        Op_Eval,        // Pushes the value of exprs_[a], evaluated by the tree.
+        Op_GetItem,     // Pops an index and replaces the value below by its subscript (exprs_[a] is the subscript expression).
+        Op_GetAttr,     // Replaces the value on top by its subscript constants_[b] (exprs_[a] is the subscript expression).
+        Op_LoadAttr,    // Pushes subscript constants_[b] of the variable subscripted by exprs_[a].
+        Op_Not,
+        Op_Neg,
+        Op_ToBool,
+        Op_Apply,       // Replaces the value on top by the result of binary expression exprs_[a] for that left operand.
+        Op_Callable,    // Same as Op_Apply followed by a jump to b, but only if the value on top is callable.
+        // These three do what Op_Callable does first, for binary expression exprs_[a].
+        Op_And,         // Replaces the value on top by false and jumps to b if it's falsy, otherwise pops it.
+        Op_Or,          // Jumps to b if the value on top is truthy, otherwise pops it.
+        Op_BinaryConst, // Replaces the left operand on top by its combination with the right one, constants_[b].
+        Op_Binary,      // Pops the right operand and replaces the left one by the result of BinaryOpExpr::Op a.
+        // A printed chain of `+` / `~`, which is written out operand by operand as soon as it's known to be a string:
+        Op_Concat,      // Pops the right operand of `+` / `~` expression exprs_[a] and combines it with the left one (or prints it).
+        Op_ConcatConst, // Same, with constants_[b] as the right operand.
+        Op_PrintConcat, // Ends the chain: prints its value unless it was already written out.
+        Op_Filter,      // Pipes the value on top through the filters of exprs_[a] (a FilterExpr) after its first part.
+        Op_Jump,        // Jumps to b.
+        Op_JumpIfFalse, // Pops a value and jumps to b if it's falsy.
+        Op_Set,         // Pops a value and assigns it as set node nodes_[a] does.
+        Op_Render,      // Renders nodes_[a] with the tree.
+        Op_ForBegin,    // Pops an iterable and enters loop loops_[a], or jumps to b if it has no items.
+        Op_ForNext,     // Starts the next iteration of the innermost loop, or leaves it and jumps to b after the last one.
+        Op_Break,
+        Op_Continue,
+        Op_BeginGeneration,
+        Op_EndGeneration,
+    };
+    struct Instruction {
+        Op op;
+        uint32_t a;
+        uint32_t b;
+    };
+
+private:
+    struct Loop {
+        std::shared_ptr<ForNode> node;
+        uint32_t next;  // The loop's Op_ForNext.
+        uint32_t end;   // Right after the loop (and its else body).
+    };
+    // A loop being run.
+    struct LoopState {
+        const Loop * loop;
+        Value items;
+        Value loop_value;
+        std::shared_ptr<Context> parent;
+        size_t index;
+        size_t count;
+    };
+    std::vector<Instruction> code_;
+    std::vector<std::string> texts_;
+    std::vector<Value> constants_;
+    std::vector<std::shared_ptr<Expression>> exprs_;
+    std::vector<std::shared_ptr<TemplateNode>> nodes_;
+    std::vector<Loop> loops_;
+    std::shared_ptr<TemplateNode> root_;
+
+    uint32_t here() const { return (uint32_t) code_.size(); }
+    uint32_t emit(Op op, uint32_t a = 0, uint32_t b = 0) {
+        code_.push_back({op, a, b});
+        return here() - 1;
+    }
+    void patch(uint32_t at) { code_[at].b = here(); }
+    uint32_t add_expr(const std::shared_ptr<Expression> & expr) {
+        exprs_.push_back(expr);
+        return (uint32_t) exprs_.size() - 1;
+    }
+    uint32_t add_node(const std::shared_ptr<TemplateNode> & node) {
+        nodes_.push_back(node);
+        return (uint32_t) nodes_.size() - 1;
+    }
+    uint32_t add_constant(const Value & value) {
+        constants_.push_back(value);
+        return (uint32_t) constants_.size() - 1;
+    }
+
+    void compile_expr(const std::shared_ptr<Expression> & expr) {
+        switch (expr->mType) {
+            case Expression::Type_Variable:
+                emit(Op_Load, add_expr(expr));
+                return;
+            case Expression::Type_Liter:
+                emit(Op_Const, add_constant(((LiteralExpr*)expr.get())->get_value()));
+                return;
+            case Expression::Type_Subscript: {
+                auto e = (SubscriptExpr*)expr.get();
+                if (!e->get_base() || !e->get_index() || e->get_index()->mType == Expression::Type_Slice) break;
+                if (e->get_index()->mType == Expression::Type_Liter) {
+                    auto key = add_constant(((LiteralExpr*)e->get_index().get())->get_value());
+                    if (e->get_base()->mType == Expression::Type_Variable) {
+                        emit(Op_LoadAttr, add_expr(expr), key);
+                    } else {
+                        compile_expr(e->get_base());
+                        emit(Op_GetAttr, add_expr(expr), key);
+                    }
+                } else {
+                    compile_expr(e->get_base());
+                    compile_expr(e->get_index());
+                    emit(Op_GetItem, add_expr(expr));
+                }
+                return;
+            }
+            case Expression::Type_Unary: {
+                auto e = (UnaryOpExpr*)expr.get();
+                if (!e->expr || e->op == UnaryOpExpr::Op::Expansion || e->op == UnaryOpExpr::Op::ExpansionDict) break;
+                compile_expr(e->expr);
+                if (e->op == UnaryOpExpr::Op::Minus) emit(Op_Neg);
+                if (e->op == UnaryOpExpr::Op::LogicalNot) emit(Op_Not);
+                return;
+            }
+            case Expression::Type_Binary: {
+                auto e = (BinaryOpExpr*)expr.get();
+                if (!e->get_left() || !e->get_right()) break;
+                auto op = e->get_op();
+                compile_expr(e->get_left());
+                auto index = add_expr(expr);
+                if (op == BinaryOpExpr::Op::Is || op == BinaryOpExpr::Op::IsNot || e->get_members()) {
+                    emit(Op_Apply, index);
+                    return;
+                }
+                // A callable left operand makes the whole expression a callable, which the tree builds.
+                if (op == BinaryOpExpr::Op::And || op == BinaryOpExpr::Op::Or) {
+                    auto short_circuit = emit(op == BinaryOpExpr::Op::And ? Op_And : Op_Or, index);
+                    compile_expr(e->get_right());
+                    if (op == BinaryOpExpr::Op::And) emit(Op_ToBool);
+                    patch(short_circuit);
+                } else if (e->get_right()->mType == Expression::Type_Liter) {
+                    emit(Op_BinaryConst, index, add_constant(((LiteralExpr*)e->get_right().get())->get_value()));
+                } else {
+                    // (Literals are never callable.)
+                    auto callable = e->get_left()->mType == Expression::Type_Liter ? 0 : emit(Op_Callable, index);
+                    compile_expr(e->get_right());
+                    emit(Op_Binary, (uint32_t) op);
+                    if (e->get_left()->mType != Expression::Type_Liter) patch(callable);
+                }
+                return;
+            }
+            case Expression::Type_If: {
+                auto e = (IfExpr*)expr.get();
+                if (!e->get_condition() || !e->get_then_expr()) break;
+                compile_expr(e->get_condition());
+                auto to_else = emit(Op_JumpIfFalse);
+                compile_expr(e->get_then_expr());
+                auto to_end = emit(Op_Jump);
+                patch(to_else);
+                if (e->get_else_expr()) {
+                    compile_expr(e->get_else_expr());
+                } else {
+                    emit(Op_Const, add_constant(Value()));
+                }
+                patch(to_end);
+                return;
+            }
+            case Expression::Type_Filter: {
+                const auto & parts = ((FilterExpr*)expr.get())->get_parts();
+                if (parts.empty() || std::find(parts.begin(), parts.end(), nullptr) != parts.end()) break;
+                compile_expr(parts[0]);
+                if (parts.size() > 1) emit(Op_Filter, add_expr(expr));
+                return;
+            }
+            default:
+                break;
+        }
+        emit(Op_Eval, add_expr(expr));
+    }
 
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_shared<FilterTemplateToken>(location, pre_space, post_space, std::move(filter)));
-            } else if (keyword == "endfilter") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_shared<EndFilterTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "break" || keyword == "continue") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_shared<LoopControlTemplateToken>(location, pre_space, post_space, keyword == "break" ? LoopControlType::Break : LoopControlType::Continue));
+    static bool is_concat(const std::shared_ptr<Expression> & expr) {
+        if (expr->mType != Expression::Type_Binary) return false;
+        auto e = (BinaryOpExpr*)expr.get();
+        return e->get_left() && e->get_right() && (e->get_op() == BinaryOpExpr::Op::Add || e->get_op() == BinaryOpExpr::Op::StrConcat);
+    }
+    // Prints `a + b ~ c...` without building the intermediate strings, if `expr` is such a chain.
+    bool compile_print_concat(const std::shared_ptr<Expression> & expr) {
+        std::vector<std::shared_ptr<Expression>> levels;
+        for (auto e = expr; is_concat(e); e = ((BinaryOpExpr*)e.get())->get_left()) levels.push_back(e);
+        if (levels.empty()) return false;
+        std::reverse(levels.begin(), levels.end());
+        const auto & first = ((BinaryOpExpr*)levels[0].get())->get_left();
+        compile_expr(first);
+        // A callable first operand makes each level a callable, which the tree builds (without evaluating the rest).
+        auto callable = first->mType == Expression::Type_Liter ? 0 : emit(Op_Callable, add_expr(levels[0]));
+        for (const auto & level : levels) {
+            const auto & right = ((BinaryOpExpr*)level.get())->get_right();
+            if (right->mType == Expression::Type_Liter) {
+                emit(Op_ConcatConst, add_expr(level), add_constant(((LiteralExpr*)right.get())->get_value()));
             } else {
-              _printlog("Unexpected block: " + keyword);
+                compile_expr(right);
+                emit(Op_Concat, add_expr(level));
             }
-          } else if (std::regex_search(it, end, match, non_text_open_regex)) {
-            if (!match.position()) {
-                if (match[0] != "{#")
-                    _printlog("Internal error: Expected a comment");
-                _printlog("Missing end of comment tag");
-            }
-            auto text_end = it + match.position();
-            text = std::string(it, text_end);
-            it = text_end;
-            tokens.push_back(std::make_shared<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
-          } else {
-            text = std::string(it, end);
-            it = end;
-            tokens.push_back(std::make_shared<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
-          }
         }
-        return tokens;
+        emit(Op_PrintConcat);
+        if (first->mType != Expression::Type_Liter) {
+            auto to_end = emit(Op_Jump);
+            patch(callable);
+            for (size_t i = 1; i < levels.size(); ++i) emit(Op_Apply, add_expr(levels[i]));
+            emit(Op_Print);
+            patch(to_end);
+        }
+        return true;
     }
 
-    std::shared_ptr<TemplateNode> parseTemplate(
-          const TemplateTokenIterator & begin,
-          TemplateTokenIterator & it,
-          const TemplateTokenIterator & end,
-          bool fully = false) const {
-        std::vector<std::shared_ptr<TemplateNode>> children;
-        while (it != end) {
-          const auto start = it;
-          const auto & token = *(it++);
-            if (token->type == TemplateToken::Type::If) {
-                auto if_token = (IfTemplateToken*)(token.get());
-              std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade;
-              cascade.emplace_back(std::move(if_token->condition), parseTemplate(begin, it, end));
+    // Whether a break / continue in `node` can leave it (i.e. isn't in a loop of its own).
+    static bool has_loop_control(const std::shared_ptr<TemplateNode> & node) {
+        if (!node) return false;
+        if (node->mType == TemplateNode::Type_LoopControl) return true;
+        if (node->mType == TemplateNode::Type_For) return has_loop_control(((ForNode*)node.get())->get_else_body());
+        if (node->mType == TemplateNode::Type_Macro) return false;
+        bool found = false;
+        node->for_each_child([&](const std::shared_ptr<TemplateNode> & child) { found = found || has_loop_control(child); },
+                             [](const std::shared_ptr<Expression> &) {});
+        return found;
+    }
 
-              while (it != end && (*it)->type == TemplateToken::Type::Elif) {
-                  auto elif_token = (ElifTemplateToken*)((*(it++)).get());
-                  cascade.emplace_back(std::move(elif_token->condition), parseTemplate(begin, it, end));
-              }
+    void compile_node(const std::shared_ptr<TemplateNode> & node) {
+        switch (node->mType) {
+            case TemplateNode::Type_Sequence: {
+                const auto & children = ((SequenceNode*)node.get())->get_children();
+                if (std::find(children.begin(), children.end(), nullptr) != children.end()) break;
+                for (const auto & child : children) compile_node(child);
+                return;
+            }
+            case TemplateNode::Type_Text:
+                texts_.push_back(((TextNode*)node.get())->get_text());
+                emit(Op_Text, (uint32_t) texts_.size() - 1);
+                return;
+            case TemplateNode::Type_Expression: {
+                const auto & expr = ((ExpressionNode*)node.get())->get_expr();
+                if (!expr) break;
+                if (!compile_print_concat(expr)) {
+                    compile_expr(expr);
+                    emit(Op_Print);
+                }
+                return;
+            }
+            case TemplateNode::Type_If: {
+                const auto & cascade = ((IfNode*)node.get())->get_cascade();
+                if (std::any_of(cascade.begin(), cascade.end(), [](const auto & branch) { return !branch.second; })) break;
+                std::vector<uint32_t> to_end;
+                for (const auto & branch : cascade) {
+                    if (!branch.first) {
+                        compile_node(branch.second);
+                        break;
+                    }
+                    compile_expr(branch.first);
+                    auto to_next = emit(Op_JumpIfFalse);
+                    compile_node(branch.second);
+                    to_end.push_back(emit(Op_Jump));
+                    patch(to_next);
+                }
+                for (auto at : to_end) patch(at);
+                return;
+            }
+            case TemplateNode::Type_LoopControl:
+                switch (((LoopControlNode*)node.get())->get_control_type()) {
+                    case LoopControlType::Break: emit(Op_Break); break;
+                    case LoopControlType::Continue: emit(Op_Continue); break;
+                    case LoopControlType::Normal: break;
+                }
+                return;
+            case TemplateNode::Type_For: {
+                auto for_node = std::static_pointer_cast<ForNode>(node);
+                if (for_node->is_recursive() || !for_node->get_iterable() || !for_node->get_body()) break;
+                compile_expr(for_node->get_iterable());
+                auto index = (uint32_t) loops_.size();
+                loops_.push_back({for_node, 0, 0});
+                auto begin = emit(Op_ForBegin, index);
+                auto next = emit(Op_ForNext, index);
+                compile_node(for_node->get_body());
+                emit(Op_Jump, 0, next);
+                // Only reached when there are no items, outside of the loop.
+                patch(begin);
+                if (for_node->get_else_body()) compile_node(for_node->get_else_body());
+                patch(next);
+                loops_[index].next = next;
+                loops_[index].end = here();
+                return;
+            }
+            case TemplateNode::Type_Set: {
+                auto set_node = (SetNode*)node.get();
+                // (Sets appending to their variable are left to the tree, which grows the string in place.)
+                if (!set_node->get_ns().empty() || !set_node->get_value() || set_node->append_target()) break;
+                compile_expr(set_node->get_value());
+                emit(Op_Set, add_node(node));
+                return;
+            }
+            case TemplateNode::Type_Generation: {
+                // A break or continue would jump past the end of the block, so those are left to the tree.
+                const auto & body = ((GenerationNode*)node.get())->get_body();
+                if (!body || has_loop_control(body)) break;
+                emit(Op_BeginGeneration);
+                compile_node(body);
+                emit(Op_EndGeneration);
+                return;
+            }
+            default:
+                break;
+        }
+        emit(Op_Render, add_node(node));
+    }
 
-              if (it != end && (*it)->type == TemplateToken::Type::Else) {
-                cascade.emplace_back(nullptr, parseTemplate(begin, ++it, end));
-              }
-              if (it == end || (*(it++))->type != TemplateToken::Type::EndIf) {
-                  MNN_ERROR("%s\n", unterminated(**start).c_str());
-              }
-              children.emplace_back(std::make_shared<IfNode>(token->location, std::move(cascade)));
-            } else if (token->type == TemplateToken::Type::For) {
-                auto for_token = (ForTemplateToken*)(token.get());
-              auto body = parseTemplate(begin, it, end);
-              auto else_body = std::shared_ptr<TemplateNode>();
-              if (it != end && (*it)->type == TemplateToken::Type::Else) {
-                else_body = parseTemplate(begin, ++it, end);
-              }
-              if (it == end || (*(it++))->type != TemplateToken::Type::EndFor) {
-                  MNN_ERROR("%s\n", unterminated(**start).c_str());
-              }
-              children.emplace_back(std::make_shared<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body)));
-            } else if(token->type == TemplateToken::Type::Generation) {
-              auto body = parseTemplate(begin, it, end);
-              if (it == end || (*(it++))->type != TemplateToken::Type::EndGeneration) {
-                  MNN_ERROR("%s\n", unterminated(**start).c_str());
-              }
-              // Treat as a no-op, as our scope is templates for inference, not training (`{% generation %}` wraps generated tokens for masking).
-              children.emplace_back(std::move(body));
-            } else if(token->type == TemplateToken::Type::Text) {
-                auto text_token = (TextTemplateToken*)(token.get());
-              SpaceHandling pre_space = (it - 1) != begin ? (*(it - 2))->post_space : SpaceHandling::Keep;
-              SpaceHandling post_space = it != end ? (*it)->pre_space : SpaceHandling::Keep;
+public:
+    explicit TemplateProgram(const std::shared_ptr<TemplateNode> & root) : root_(root) {
+        if (root) compile_node(root);
+    }
+    const std::vector<Instruction> & get_code() const { return code_; }
+    const std::shared_ptr<TemplateNode> & get_root() const { return root_; }
+    /* Roughly the memory the program takes on top of its tree (its instructions, texts & tables). */
+    size_t bytes() const {
+        size_t bytes = sizeof(*this) + code_.capacity() * sizeof(Instruction) + texts_.capacity() * sizeof(std::string)
+            + constants_.capacity() * sizeof(Value) + exprs_.capacity() * sizeof(exprs_[0]) + nodes_.capacity() * sizeof(nodes_[0])
+            + loops_.capacity() * sizeof(Loop);
+        for (const auto & text : texts_) bytes += text.capacity();
+        return bytes;
+    }
 
-              auto text = text_token->text;
-              if (post_space == SpaceHandling::Strip) {
-                static std::regex trailing_space_regex(R"(\s+$)");
-                text = std::regex_replace(text, trailing_space_regex, "");
-              } else if (options.lstrip_blocks && it != end) {
-                auto i = text.size();
-                while (i > 0 && (text[i - 1] == ' ' || text[i - 1] == '\t')) i--;
-                if ((i == 0 && (it - 1) == begin) || (i > 0 && text[i - 1] == '\n')) {
-                  text.resize(i);
+    LoopControlType render(RenderSink & out, const std::shared_ptr<Context> & root_context) const {
+#ifdef MINJA_PROFILE
+        if (Profiler::current() && root_) return root_->render(out, root_context);
+#endif
+        // The memo caches the tree's blocks.
+        if (RenderMemo::current() && root_) return root_->render(out, root_context);
+        std::vector<Value> stack;
+        stack.reserve(16);
+        std::vector<LoopState> loops;
+        auto context = root_context;
+        // Whether the chain being printed by Op_Concat turned into a string, whose start was written out.
+        auto concatenating = false;
+        auto write_str = [&](const Value & value) {
+            if (value.is_string()) {
+                auto s = value.string_view();
+                if (RenderBudget::allow_output(s.size())) out.write(s.data(), s.size());
+            } else {
+                auto s = value.to_str();
+                if (RenderBudget::allow_output(s.size())) out << s;
+            }
+        };
+        auto budget = RenderBudget::current();
+        // Leaves the innermost loop (or stops rendering, outside of any loop) on a break or continue from the tree.
+        auto control = [&](LoopControlType type, uint32_t & pc) {
+            if (type == LoopControlType::Normal) return true;
+            if (loops.empty()) return false;
+            auto & state = loops.back();
+            if (type == LoopControlType::Continue) {
+                pc = state.loop->next;
+                return true;
+            }
+            pc = state.loop->end;
+            context = std::move(state.parent);
+            loops.pop_back();
+            out.exit_loop();
+            return true;
+        };
+        // The {% generation %} blocks entered and not yet left.
+        size_t generations = 0;
+        for (uint32_t pc = 0, n = here(); pc < n;) {
+            if (budget && budget->exceeded()) {
+                // Leaves the open loops and generation blocks, as the tree does when unwinding.
+                while (!loops.empty()) {
+                    context = std::move(loops.back().parent);
+                    loops.pop_back();
+                    out.exit_loop();
                 }
-              }
-              if (pre_space == SpaceHandling::Strip) {
-                static std::regex leading_space_regex(R"(^\s+)");
-                text = std::regex_replace(text, leading_space_regex, "");
-              } else if (options.trim_blocks && (it - 1) != begin && (*(it - 2))->type != TemplateToken::Type::Expression) {
-                if (!text.empty() && text[0] == '\n') {
-                  text.erase(0, 1);
+                for (; generations; --generations) out.exit_generation();
+                return LoopControlType::Normal;
+            }
+            const auto & ins = code_[pc++];
+            switch (ins.op) {
+                case Op_Text:
+                    if (budget && !budget->count_output(texts_[ins.a].size())) break;
+                    out << texts_[ins.a];
+                    break;
+                case Op_Print:
+                    ExpressionNode::render_value(out, stack.back());
+                    stack.pop_back();
+                    break;
+                case Op_Const:
+                    stack.push_back(constants_[ins.a]);
+                    break;
+                case Op_Load:
+                    stack.push_back(((VariableExpr*)exprs_[ins.a].get())->VariableExpr::do_evaluate(context));
+                    break;
+                case Op_Eval:
+                    stack.push_back(exprs_[ins.a]->evaluate(context));
+                    break;
+                case Op_GetItem: {
+                    auto index = std::move(stack.back());
+                    stack.pop_back();
+                    stack.back() = ((SubscriptExpr*)exprs_[ins.a].get())->get_item(stack.back(), index, context);
+                    break;
                 }
-              }
-              if (it == end && !options.keep_trailing_newline) {
-                auto i = text.size();
-                if (i > 0 && text[i - 1] == '\n') {
-                  i--;
-                  if (i > 0 && text[i - 1] == '\r') i--;
-                  text.resize(i);
+                case Op_GetAttr:
+                    stack.back() = ((SubscriptExpr*)exprs_[ins.a].get())->get_item(stack.back(), constants_[ins.b], context);
+                    break;
+                case Op_LoadAttr: {
+                    auto e = (SubscriptExpr*)exprs_[ins.a].get();
+                    auto base = ((VariableExpr*)e->get_base().get())->VariableExpr::do_evaluate(context);
+                    stack.push_back(e->get_item(base, constants_[ins.b], context));
+                    break;
                 }
-              }
-              children.emplace_back(std::make_shared<TextNode>(token->location, text));
-            } else if(token->type == TemplateToken::Type::Expression) {
-                auto expr_token = (ExpressionTemplateToken*)(token.get());
-                children.emplace_back(std::make_shared<ExpressionNode>(token->location, std::move(expr_token->expr)));
-            } else if(token->type == TemplateToken::Type::Set) {
-                auto set_token = (SetTemplateToken*)(token.get());
-                if (set_token->value) {
-                  children.emplace_back(std::make_shared<SetNode>(token->location, set_token->ns, set_token->var_names, std::move(set_token->value)));
-                } else {
-                  auto value_template = parseTemplate(begin, it, end);
-                  if (it == end || (*(it++))->type != TemplateToken::Type::EndSet) {
-                      MNN_ERROR("%s\n", unterminated(**start).c_str());
-                  }
-                  if (!set_token->ns.empty()) _printlog("Namespaced set not supported in set with template value");
-                  if (set_token->var_names.size() != 1) _printlog("Structural assignment not supported in set with template value");
-                  auto & name = set_token->var_names[0];
-                  children.emplace_back(std::make_shared<SetTemplateNode>(token->location, name, std::move(value_template)));
+                case Op_Not:
+                    stack.back() = Value(!stack.back().to_bool());
+                    break;
+                case Op_Neg:
+                    stack.back() = -stack.back();
+                    break;
+                case Op_ToBool:
+                    stack.back() = Value(stack.back().to_bool());
+                    break;
+                case Op_Apply:
+                    stack.back() = ((BinaryOpExpr*)exprs_[ins.a].get())->apply(stack.back(), context);
+                    break;
+                case Op_Callable:
+                    if (stack.back().is_callable()) {
+                        stack.back() = ((BinaryOpExpr*)exprs_[ins.a].get())->apply(stack.back(), context);
+                        pc = ins.b;
+                    }
+                    break;
+                case Op_And:
+                    if (stack.back().is_callable()) {
+                        stack.back() = ((BinaryOpExpr*)exprs_[ins.a].get())->apply(stack.back(), context);
+                        pc = ins.b;
+                    } else if (!stack.back().to_bool()) {
+                        stack.back() = Value(false);
+                        pc = ins.b;
+                    } else {
+                        stack.pop_back();
+                    }
+                    break;
+                case Op_Or:
+                    if (stack.back().is_callable()) {
+                        stack.back() = ((BinaryOpExpr*)exprs_[ins.a].get())->apply(stack.back(), context);
+                        pc = ins.b;
+                    } else if (stack.back().to_bool()) {
+                        pc = ins.b;
+                    } else {
+                        stack.pop_back();
+                    }
+                    break;
+                case Op_BinaryConst: {
+                    auto e = (BinaryOpExpr*)exprs_[ins.a].get();
+                    if (stack.back().is_callable()) {
+                        stack.back() = e->apply(stack.back(), context);
+                    } else {
+                        stack.back() = BinaryOpExpr::combine(e->get_op(), stack.back(), constants_[ins.b]);
+                    }
+                    break;
                 }
-            } else if(token->type == TemplateToken::Type::Macro) {
-                auto macro_token = (MacroTemplateToken*)(token.get());
-              auto body = parseTemplate(begin, it, end);
-              if (it == end || (*(it++))->type != TemplateToken::Type::EndMacro) {
-                  MNN_ERROR("%s\n", unterminated(**start).c_str());
-              }
-              children.emplace_back(std::make_shared<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body)));
-            } else if(token->type == TemplateToken::Type::Filter) {
-                auto filter_token = (FilterTemplateToken*)(token.get());
-                auto body = parseTemplate(begin, it, end);
-                if (it == end || (*(it++))->type != TemplateToken::Type::EndFilter) {
-                    MNN_ERROR("%s\n", unterminated(**start).c_str());
+                case Op_Binary: {
+                    auto right = std::move(stack.back());
+                    stack.pop_back();
+                    stack.back() = BinaryOpExpr::combine((BinaryOpExpr::Op) ins.a, stack.back(), right);
+                    break;
                 }
-                children.emplace_back(std::make_shared<FilterNode>(token->location, std::move(filter_token->filter), std::move(body)));
-            } else if(token->type == TemplateToken::Type::Comment) {
-                // Ignore comments
-            } else if(token->type == TemplateToken::Type::Break) {
-                auto ctrl_token = (LoopControlTemplateToken*)(token.get());
-                children.emplace_back(std::make_shared<LoopControlNode>(token->location, ctrl_token->control_type));
-            } else {
-                bool needBreak = false;
-                switch (token->type) {
-                    case TemplateToken::Type::EndSet:
-                    case TemplateToken::Type::EndFor:
-                    case TemplateToken::Type::EndMacro:
-                    case TemplateToken::Type::EndFilter:
-                    case TemplateToken::Type::EndIf:
-                    case TemplateToken::Type::Else:
-                    case TemplateToken::Type::Elif:
-                    case TemplateToken::Type::EndGeneration:
-                        it--;
-                        needBreak = true;
+                case Op_Concat:
+                case Op_ConcatConst: {
+                    Value popped;
+                    if (ins.op == Op_Concat) {
+                        popped = std::move(stack.back());
+                        stack.pop_back();
+                    }
+                    const auto & right = ins.op == Op_Concat ? popped : constants_[ins.b];
+                    auto op = ((BinaryOpExpr*)exprs_[ins.a].get())->get_op();
+                    if (concatenating) {
+                        write_str(right);
+                    } else if (op == BinaryOpExpr::Op::StrConcat || stack.back().is_string() || right.is_string()) {
+                        // Both operators are now to_str() concatenations (see Value::operator+).
+                        write_str(stack.back());
+                        write_str(right);
+                        stack.pop_back();
+                        concatenating = true;
+                    } else {
+                        stack.back() = BinaryOpExpr::combine(op, stack.back(), right);
+                    }
+                    break;
+                }
+                case Op_PrintConcat:
+                    if (concatenating) {
+                        concatenating = false;
+                    } else {
+                        ExpressionNode::render_value(out, stack.back());
+                        stack.pop_back();
+                    }
+                    break;
+                case Op_Filter:
+                    stack.back() = ((FilterExpr*)exprs_[ins.a].get())->apply_parts(1, std::move(stack.back()), context);
+                    break;
+                case Op_Jump:
+                    pc = ins.b;
+                    break;
+                case Op_JumpIfFalse: {
+                    auto condition = stack.back().to_bool();
+                    stack.pop_back();
+                    if (!condition) pc = ins.b;
+                    break;
+                }
+                case Op_Set:
+                    destructuring_assign(((SetNode*)nodes_[ins.a].get())->get_var_names(), context, stack.back());
+                    stack.pop_back();
+                    break;
+                case Op_Render: {
+                    auto type = nodes_[ins.a]->render(out, context);
+                    if (!control(type, pc)) return type;
+                    break;
+                }
+                case Op_ForBegin: {
+                    auto iterable = std::move(stack.back());
+                    stack.pop_back();
+                    const auto & loop = loops_[ins.a];
+                    auto items = loop.node->collect_items(iterable, context);
+                    if (items.empty()) {
+                        pc = ins.b;
                         break;
-                    default:
-                        MNN_ERROR("%s\n", unexpected(**(it-1)).c_str());
+                    }
+                    auto loop_value = Value::loop(items);
+                    auto loop_context = loop.node->make_loop_context(context);
+                    loop_context->set("loop", loop_value);
+                    auto count = items.size();
+                    loops.push_back({&loop, std::move(items), std::move(loop_value), std::move(context), 0, count});
+                    context = std::move(loop_context);
+                    out.enter_loop();
+                    break;
                 }
-                if (needBreak) {
+                case Op_ForNext: {
+                    auto & state = loops.back();
+                    // (Checking the size again as the body may shrink the array.)
+                    if (state.index < state.count && state.index < state.items.size() && (!budget || budget->count_iterations(1))) {
+                        out.loop_item(state.items.at(state.index));
+                        destructuring_assign(state.loop->node->get_var_names(), context, state.items.at(state.index));
+                        state.loop_value.set_loop_index(state.index);
+                        ++state.index;
+                    } else {
+                        context = std::move(state.parent);
+                        loops.pop_back();
+                        out.exit_loop();
+                        pc = ins.b;
+                    }
                     break;
                 }
-          }
-        }
-        if (fully && it != end) {
-            MNN_ERROR("%s\n", unexpected(**it).c_str());
-        }
-        if (children.empty()) {
-          return std::make_shared<TextNode>(Location { template_str, 0 }, std::string());
-        } else if (children.size() == 1) {
-          return std::move(children[0]);
-        } else {
-          return std::make_shared<SequenceNode>(children[0]->location(), std::move(children));
+                case Op_Break:
+                    if (!control(LoopControlType::Break, pc)) return LoopControlType::Break;
+                    break;
+                case Op_Continue:
+                    if (!control(LoopControlType::Continue, pc)) return LoopControlType::Continue;
+                    break;
+                case Op_BeginGeneration:
+                    out.enter_generation();
+                    ++generations;
+                    break;
+                case Op_EndGeneration:
+                    out.exit_generation();
+                    --generations;
+                    break;
+            }
         }
+        return LoopControlType::Normal;
     }
-
-public:
-
-    static std::shared_ptr<TemplateNode> parse(const std::string& template_str, const Options & options) {
-        Parser parser(std::make_shared<std::string>(normalize_newlines(template_str)), options);
-        auto tokens = parser.tokenize();
-        TemplateTokenIterator begin = tokens.begin();
-        auto it = begin;
-        TemplateTokenIterator end = tokens.end();
-        return parser.parseTemplate(begin, it, end, /* fully= */ true);
+    std::string render(const std::shared_ptr<Context> & context) const {
+        StringSink out;
+        render(out, context);
+        return out.take();
     }
 };
 
@@ -2796,7 +7156,8 @@ static Value simple_function(const std::string & fn_name, const std::vector<std:
   });
 }
 
-inline std::shared_ptr<Context> Context::builtins() {
+inline std::shared_ptr<Context> Context::make_builtins() {
+  RenderMemory::Scope heap(nullptr);  // The builtins outlive any render
   auto globals = Value::object();
 
 //  globals.set("raise_exception", simple_function("raise_exception", { "message" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
@@ -2831,7 +7192,7 @@ inline std::shared_ptr<Context> Context::builtins() {
   }));
   globals.set("trim", simple_function("trim", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
     auto & text = args.at("text");
-    return text.is_null() ? text : Value(strip(text.get<std::string>()));
+    return text.is_null() ? text : Value(strip(text.string_view()));
   }));
   auto char_transform_function = [](const std::string & name, const std::function<char(char)> & fn) {
     return simple_function(name, { "text" }, [=](const std::shared_ptr<Context> &, Value & args) {
@@ -2861,7 +7222,7 @@ inline std::shared_ptr<Context> Context::builtins() {
     return boolean ? (value.to_bool() ? value : default_value) : value.is_null() ? default_value : value;
   }));
   auto escape = simple_function("escape", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value(html_escape(args.at("text").get<std::string>()));
+    return Value(html_escape(args.at("text").string_view()));
   });
   globals.set("e", escape);
   globals.set("escape", escape);
@@ -2925,9 +7286,14 @@ inline std::shared_ptr<Context> Context::builtins() {
       }
     return ns;
   }));
-  auto equalto = simple_function("equalto", { "expected", "actual" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
+  auto equalto_named = simple_function("equalto", { "expected", "actual" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
       return args.at("actual") == args.at("expected");
   });
+  // Called once per item by selectattr & co, so the usual positional call skips building the arguments object.
+  auto equalto = Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
+      if (args.args.size() == 2 && args.kwargs.empty()) return args.args[1] == args.args[0];
+      return equalto_named.call(context, args);
+  });
   globals.set("equalto", equalto);
   globals.set("==", equalto);
   globals.set("length", simple_function("length", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
@@ -3122,6 +7488,7 @@ inline std::shared_ptr<Context> Context::builtins() {
         i = 2;
       } else {
         _printlog("Unknown argument " + name + " for function range");
+        continue;
       }
 
       if (param_set[i]) {
@@ -3138,6 +7505,13 @@ inline std::shared_ptr<Context> Context::builtins() {
     int64_t step = param_set[2] ? startEndStep[2] : 1;
 
     auto res = Value::array();
+    if (step == 0) {
+      _printlog("range() step must not be zero");
+      return res;
+    }
+    auto count = step > 0 ? (end > start ? ((uint64_t) end - (uint64_t) start - 1) / (uint64_t) step + 1 : 0)
+                          : (start > end ? ((uint64_t) start - (uint64_t) end - 1) / (0 - (uint64_t) step) + 1 : 0);
+    if (!RenderBudget::allow_more_items((size_t) count)) return res;
     if (step > 0) {
       for (int64_t i = start; i < end; i += step) {
         res.push_back(Value(i));
@@ -3153,8 +7527,36 @@ inline std::shared_ptr<Context> Context::builtins() {
   return std::make_shared<Context>(std::move(globals));
 }
 
+inline const std::shared_ptr<Context> & Context::default_builtins() {
+  static const std::shared_ptr<Context> instance = make_builtins();
+  return instance;
+}
+
+inline std::shared_ptr<Context> & Context::builtins_instance() {
+  static std::shared_ptr<Context> instance = default_builtins();
+  return instance;
+}
+
+inline std::shared_ptr<Context> Context::builtins() {
+  return std::atomic_load(&builtins_instance());
+}
+
+inline void Context::register_builtin(const std::string & name, const Value & value) {
+  // Copy-on-write, so that the table a render is using never changes under it.
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  RenderMemory::Scope heap(nullptr);
+  auto current = builtins();
+  auto globals = Value::object();
+  for (const auto & key : current->values_.keys()) {
+    globals.set(key.get<std::string>(), current->values_.at(key));
+  }
+  globals.set(name, value);
+  std::atomic_store(&builtins_instance(), std::make_shared<Context>(std::move(globals)));
+}
+
 inline std::shared_ptr<Context> Context::make(Value && values, const std::shared_ptr<Context> & parent) {
-  return std::make_shared<Context>(values.is_null() ? Value::object() : std::move(values), parent);
+  return make_render_shared<Context>(values.is_null() ? Value::object() : std::move(values), parent);
 }
 
 }  // namespace minja
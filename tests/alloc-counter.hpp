@@ -0,0 +1,73 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Counts every heap allocation the process makes through operator new, in all its forms (the std containers &
+    shared_ptrs minja uses all go through it; malloc's callers, e.g. rapidjson's allocators, don't), into
+    g_allocations & g_allocated_bytes. Replaces the global operators, so include it from one file of a program.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC flags the malloc / free pairs below once the replaced operators get inlined into their callers.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<size_t> g_allocations(0);
+static std::atomic<size_t> g_allocated_bytes(0);
+
+static void * counted_alloc(size_t size, size_t alignment = 0) {
+    g_allocations++;
+    g_allocated_bytes += size;
+    if (!size) size = 1;
+    if (!alignment) return std::malloc(size);
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    // aligned_alloc wants a multiple of the alignment.
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+static void aligned_free(void * p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+static void * counted_alloc_or_throw(size_t size, size_t alignment = 0) {
+    if (void * p = counted_alloc(size, alignment)) return p;
+    throw std::bad_alloc();
+}
+
+void * operator new(size_t size) { return counted_alloc_or_throw(size); }
+void * operator new[](size_t size) { return counted_alloc_or_throw(size); }
+void * operator new(size_t size, std::align_val_t alignment) { return counted_alloc_or_throw(size, (size_t) alignment); }
+void * operator new[](size_t size, std::align_val_t alignment) { return counted_alloc_or_throw(size, (size_t) alignment); }
+void * operator new(size_t size, const std::nothrow_t &) noexcept { return counted_alloc(size); }
+void * operator new[](size_t size, const std::nothrow_t &) noexcept { return counted_alloc(size); }
+void * operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return counted_alloc(size, (size_t) alignment); }
+void * operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return counted_alloc(size, (size_t) alignment); }
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete[](void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+void operator delete[](void * p, size_t) noexcept { std::free(p); }
+void operator delete(void * p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete(void * p, size_t, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete[](void * p, size_t, std::align_val_t) noexcept { aligned_free(p); }
+void operator delete(void * p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void * p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete(void * p, std::align_val_t, const std::nothrow_t &) noexcept { aligned_free(p); }
+void operator delete[](void * p, std::align_val_t, const std::nothrow_t &) noexcept { aligned_free(p); }
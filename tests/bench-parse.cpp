@@ -0,0 +1,92 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Parse-time benchmark: tokenizes and parses each template file given on the command line
+    (e.g. the *.jinja files written to the build's tests/ folder by scripts/fetch_templates_and_goldens.py).
+
+    Usage: bench-parse [--iterations N] [--arena] template1.jinja template2.jinja ...
+*/
+#include "minja/minja.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static std::string read_file(const std::string &path) {
+    std::ifstream fs(path, std::ios_base::binary);
+    if (!fs.is_open()) {
+        return "";
+    }
+    fs.seekg(0, std::ios_base::end);
+    auto size = fs.tellg();
+    fs.seekg(0);
+    std::string out;
+    out.resize(static_cast<size_t>(size));
+    fs.read(&out[0], static_cast<std::streamsize>(size));
+    return out;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 100;
+    bool use_arena = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--arena")) {
+            use_arena = true;
+        } else {
+            files.emplace_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        fprintf(stderr, "Usage: %s [--iterations N] [--arena] template1.jinja ...\n", argv[0]);
+        return 1;
+    }
+
+    const minja::Options options {
+        /* .trim_blocks = */ true,
+        /* .lstrip_blocks = */ true,
+        /* .keep_trailing_newline = */ false,
+    };
+
+    using clock = std::chrono::steady_clock;
+    size_t total_bytes = 0;
+    double total_us = 0;
+    for (const auto & file : files) {
+        auto source = read_file(file);
+        if (source.empty()) {
+            fprintf(stderr, "Skipping empty or unreadable file: %s\n", file.c_str());
+            continue;
+        }
+        // Warm-up (also surfaces parse errors once rather than once per iteration).
+        if (!minja::Parser::parse(source, options)) {
+            fprintf(stderr, "Failed to parse: %s\n", file.c_str());
+            continue;
+        }
+        auto start = clock::now();
+        for (int i = 0; i < iterations; i++) {
+            // Includes the time to free the AST.
+            auto root = minja::Parser::parse(source, options, use_arena ? std::make_shared<minja::Arena>() : nullptr);
+        }
+        auto us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / iterations;
+        total_bytes += source.size();
+        total_us += us;
+        printf("%10.1f us  %8zu bytes  %s\n", us, source.size(), file.c_str());
+    }
+    if (total_us > 0) {
+        printf("%10.1f us  %8zu bytes  total (%.1f MB/s)\n", total_us, total_bytes, total_bytes / total_us);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Render-time benchmark: renders a typical ~20-message conversation (with tools) through a ChatML-style
+    template, or through the template file given on the command line, and reports the time, heap allocations
+    and heap bytes per render and per message (i.e. per iteration of the template's messages loop).
+    With --reuse-sink, every render goes into the same preallocated minja::StringSink; --messages sets the
+    length of the conversation (e.g. --messages 200 to weigh the loop over the fixed costs).
+
+    Usage: bench-render [--iterations N] [--messages N] [--reuse-sink] [template.jinja]
+*/
+#include "minja/chat-template.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+
+#include "alloc-counter.hpp"
+
+static const char * kChatMLTemplate = R"({%- if tools %}
+{{- '<|im_start|>system\n' }}
+{%- if messages[0]['role'] == 'system' %}{{- messages[0]['content'] }}{%- else %}You are a helpful assistant.{%- endif %}
+{{- '\n\n# Tools\n\n<tools>' }}
+{%- for tool in tools %}{{- '\n' }}{{- tool | tojson }}{%- endfor %}
+{{- '\n</tools><|im_end|>\n' }}
+{%- elif messages[0]['role'] == 'system' %}
+{{- '<|im_start|>system\n' + messages[0]['content'] + '<|im_end|>\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' or (message.role == 'system' and not loop.first) %}
+{{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
+{%- elif message.role == 'assistant' %}
+{{- '<|im_start|>' + message.role }}
+{%- if message.content %}{{- '\n' + message.content }}{%- endif %}
+{%- for tool_call in message.tool_calls %}
+{%- if tool_call.function is defined %}{%- set tool_call = tool_call.function %}{%- endif %}
+{{- '\n<tool_call>\n{"name": "' + tool_call.name + '", "arguments": ' + (tool_call.arguments | tojson) + '}\n</tool_call>' }}
+{%- endfor %}
+{{- '<|im_end|>\n' }}
+{%- elif message.role == 'tool' %}
+{{- '<|im_start|>user\n<tool_response>\n' + message.content + '\n</tool_response><|im_end|>\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}{{- '<|im_start|>assistant\n' }}{%- endif %})";
+
+static std::string read_file(const std::string &path) {
+    std::ifstream fs(path, std::ios_base::binary);
+    if (!fs.is_open()) {
+        return "";
+    }
+    fs.seekg(0, std::ios_base::end);
+    auto size = fs.tellg();
+    fs.seekg(0);
+    std::string out;
+    out.resize(static_cast<size_t>(size));
+    fs.read(&out[0], static_cast<std::streamsize>(size));
+    return out;
+}
+
+static void fill_inputs(minja::chat_template_inputs & inputs, size_t n_messages) {
+    auto & alloc = inputs.messages.GetAllocator();
+    auto add = [&](const char * role, const std::string & content) -> rapidjson::Value & {
+        rapidjson::Value msg(rapidjson::kObjectType);
+        msg.AddMember("role", rapidjson::Value(role, alloc), alloc);
+        msg.AddMember("content", rapidjson::Value(content.c_str(), alloc), alloc);
+        inputs.messages.PushBack(msg, alloc);
+        return inputs.messages[inputs.messages.Size() - 1];
+    };
+    add("system", "You are a helpful assistant that answers questions about the weather.");
+    for (int turn = 0; inputs.messages.Size() < n_messages; turn++) {
+        add("user", "What's the weather like in city #" + std::to_string(turn) + " today, and should I bring an umbrella?");
+        if (turn % 3 == 1) {
+            auto & call = add("assistant", "");
+            rapidjson::Value args(rapidjson::kObjectType);
+            args.AddMember("city", rapidjson::Value(("city #" + std::to_string(turn)).c_str(), alloc), alloc);
+            rapidjson::Value function(rapidjson::kObjectType);
+            function.AddMember("name", "get_weather", alloc);
+            function.AddMember("arguments", args, alloc);
+            rapidjson::Value tool_call(rapidjson::kObjectType);
+            tool_call.AddMember("type", "function", alloc);
+            tool_call.AddMember("function", function, alloc);
+            rapidjson::Value tool_calls(rapidjson::kArrayType);
+            tool_calls.PushBack(tool_call, alloc);
+            call.AddMember("tool_calls", tool_calls, alloc);
+            add("tool", "{\"temperature\": 21, \"conditions\": \"light rain\"}");
+        }
+        add("assistant", "It's mild with light rain expected in the afternoon, so yes, an umbrella would be a good idea.");
+    }
+    inputs.tools.Parse(R"([{"type": "function", "function": {"name": "get_weather", "description": "Get the current weather in a city",
+        "parameters": {"type": "object", "properties": {"city": {"type": "string", "description": "The city name"}}, "required": ["city"]}}}])");
+    inputs.add_generation_prompt = true;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 1000;
+    size_t n_messages = 20;
+    bool reuse_sink = false;
+    std::string source = kChatMLTemplate;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--messages") && i + 1 < argc) {
+            n_messages = (size_t) std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--reuse-sink")) {
+            reuse_sink = true;
+        } else {
+            source = read_file(argv[i]);
+            if (source.empty()) {
+                fprintf(stderr, "Empty or unreadable file: %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    minja::chat_template tmpl(source, "<s>", "</s>");
+    minja::chat_template_inputs inputs;
+    fill_inputs(inputs, n_messages);
+
+    // Warm-up (also gets the lazily initialized builtins out of the way).
+    auto prompt = tmpl.apply(inputs);
+    minja::StringSink sink(prompt.size() * 2);
+
+    using clock = std::chrono::steady_clock;
+    size_t allocations = g_allocations;
+    size_t bytes = g_allocated_bytes;
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        if (reuse_sink) {
+            sink.clear();
+            tmpl.apply(inputs, sink);
+        } else {
+            prompt = tmpl.apply(inputs);
+        }
+    }
+    auto us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / iterations;
+    allocations = (g_allocations - allocations) / iterations;
+    bytes = (g_allocated_bytes - bytes) / iterations;
+
+    printf("sizeof(minja::Value) = %zu, sizeof(minja::json) = %zu\n", sizeof(minja::Value), sizeof(minja::json));
+    printf("%zu messages, %zu output bytes\n", (size_t) inputs.messages.Size(), prompt.size());
+    printf("%10.1f us  %8zu allocations  %10zu bytes  per render\n", us, allocations, bytes);
+    auto n = (double) inputs.messages.Size();
+    printf("%10.3f us  %8.1f allocations  %10.1f bytes  per message\n", us / n, allocations / n, bytes / n);
+    return 0;
+}
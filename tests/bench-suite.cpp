@@ -0,0 +1,306 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Benchmark suite: for each template file given on the command line (e.g. the *.jinja files written to the
+    build's tests/ folder by scripts/fetch_templates_and_goldens.py), measures the time, heap allocations and
+    heap bytes of:
+    - parse: tokenizing & parsing the source;
+    - construct: building a minja::chat_template (which includes the capability probes in MINJA_ADD_TEST builds);
+    - construct cached: building it again, from the parse & capabilities kept by minja::chat_template_cache::global();
+    - apply: applying it to each context file given (e.g. the ones in tests/contexts), with and without polyfills;
+    - render: applying it to a synthetic conversation of 1, 10, 100 and 1000 messages (with tools);
+    - batch: apply_batch() over 256 conversations of 10 messages, on one thread and on one per core.
+    With --json, every measurement is also written to that file as one JSON object per line, for tracking
+    results across commits.
+
+    Usage: bench-suite [--iterations N] [--json results.jsonl] template1.jinja ... [context1.json ...]
+*/
+#include "minja/chat-template.hpp"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alloc-counter.hpp"
+
+static std::string read_file(const std::string &path) {
+    std::ifstream fs(path, std::ios_base::binary);
+    if (!fs.is_open()) {
+        return "";
+    }
+    fs.seekg(0, std::ios_base::end);
+    auto size = fs.tellg();
+    fs.seekg(0);
+    std::string out;
+    out.resize(static_cast<size_t>(size));
+    fs.read(&out[0], static_cast<std::streamsize>(size));
+    return out;
+}
+
+static bool ends_with(const std::string & str, const std::string & suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static std::string file_name(const std::string & path) {
+    auto pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// Same conversation as bench-render: a system prompt, then user / assistant turns with a tool call every third turn.
+static void fill_inputs(minja::chat_template_inputs & inputs, size_t n_messages) {
+    auto & alloc = inputs.messages.GetAllocator();
+    auto add = [&](const char * role, const std::string & content) -> rapidjson::Value & {
+        rapidjson::Value msg(rapidjson::kObjectType);
+        msg.AddMember("role", rapidjson::Value(role, alloc), alloc);
+        msg.AddMember("content", rapidjson::Value(content.c_str(), alloc), alloc);
+        inputs.messages.PushBack(msg, alloc);
+        return inputs.messages[inputs.messages.Size() - 1];
+    };
+    add("system", "You are a helpful assistant that answers questions about the weather.");
+    for (int turn = 0; inputs.messages.Size() < n_messages; turn++) {
+        add("user", "What's the weather like in city #" + std::to_string(turn) + " today, and should I bring an umbrella?");
+        if (turn % 3 == 1) {
+            auto & call = add("assistant", "");
+            rapidjson::Value args(rapidjson::kObjectType);
+            args.AddMember("city", rapidjson::Value(("city #" + std::to_string(turn)).c_str(), alloc), alloc);
+            rapidjson::Value function(rapidjson::kObjectType);
+            function.AddMember("name", "get_weather", alloc);
+            function.AddMember("arguments", args, alloc);
+            rapidjson::Value tool_call(rapidjson::kObjectType);
+            tool_call.AddMember("type", "function", alloc);
+            tool_call.AddMember("function", function, alloc);
+            rapidjson::Value tool_calls(rapidjson::kArrayType);
+            tool_calls.PushBack(tool_call, alloc);
+            call.AddMember("tool_calls", tool_calls, alloc);
+            add("tool", "{\"temperature\": 21, \"conditions\": \"light rain\"}");
+        }
+        add("assistant", "It's mild with light rain expected in the afternoon, so yes, an umbrella would be a good idea.");
+    }
+    inputs.tools.Parse(R"([{"type": "function", "function": {"name": "get_weather", "description": "Get the current weather in a city",
+        "parameters": {"type": "object", "properties": {"city": {"type": "string", "description": "The city name"}}, "required": ["city"]}}}])");
+    inputs.add_generation_prompt = true;
+}
+
+// A tests/contexts/*.json file: messages, tools & add_generation_prompt go to the inputs, everything else but the
+// bos / eos tokens to the extra context (as test-supported-template does).
+struct ContextFile {
+    std::string name;
+    std::string bos_token;
+    std::string eos_token;
+    rapidjson::Document doc;
+};
+
+static void fill_inputs(minja::chat_template_inputs & inputs, const ContextFile & ctx) {
+    const auto & doc = ctx.doc;
+    if (doc.HasMember("messages")) {
+        inputs.messages.CopyFrom(doc["messages"], inputs.messages.GetAllocator());
+    }
+    if (doc.HasMember("tools")) {
+        inputs.tools.CopyFrom(doc["tools"], inputs.tools.GetAllocator());
+    }
+    if (doc.HasMember("add_generation_prompt") && doc["add_generation_prompt"].IsBool()) {
+        inputs.add_generation_prompt = doc["add_generation_prompt"].GetBool();
+    }
+    auto & alloc = inputs.extra_context.GetAllocator();
+    inputs.extra_context.SetObject();
+    for (const auto & kv : doc.GetObject()) {
+        std::string key = kv.name.GetString();
+        if (key == "messages" || key == "tools" || key == "add_generation_prompt" || key == "bos_token" || key == "eos_token") {
+            continue;
+        }
+        inputs.extra_context.AddMember(rapidjson::Value(key.c_str(), alloc), rapidjson::Value(kv.value, alloc), alloc);
+    }
+}
+
+struct Measurement {
+    double us = 0;
+    double allocations = 0;
+    double bytes = 0;
+};
+
+// Runs `fn` once to warm up (lazily initialized builtins, first-touch of the inputs), then `iterations` times.
+template <class F>
+static Measurement measure(int iterations, F && fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    size_t allocations = g_allocations;
+    size_t bytes = g_allocated_bytes;
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fn();
+    }
+    Measurement m;
+    m.us = std::chrono::duration<double, std::micro>(clock::now() - start).count() / iterations;
+    m.allocations = (double) (g_allocations - allocations) / iterations;
+    m.bytes = (double) (g_allocated_bytes - bytes) / iterations;
+    return m;
+}
+
+class Reporter {
+    FILE * json_ = nullptr;
+
+public:
+    explicit Reporter(FILE * json) : json_(json) {
+        printf("%-16s %12s %12s %14s  %s\n", "benchmark", "us/op", "allocs/op", "bytes/op", "case");
+    }
+
+    // One table row, plus one JSON line when --json was given: {"benchmark": ..., "template": ..., "case": ..., "us": ...}
+    void report(const char * benchmark, const std::string & tmpl, const std::string & label, const Measurement & m, size_t output_bytes = 0) {
+        printf("%-16s %12.1f %12.1f %14.1f  %s%s%s\n", benchmark, m.us, m.allocations, m.bytes,
+            tmpl.c_str(), label.empty() ? "" : " ", label.c_str());
+        if (!json_) {
+            return;
+        }
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        writer.StartObject();
+        writer.Key("benchmark");
+        writer.String(benchmark);
+        writer.Key("template");
+        writer.String(tmpl.c_str(), (rapidjson::SizeType) tmpl.size());
+        writer.Key("case");
+        writer.String(label.c_str(), (rapidjson::SizeType) label.size());
+        writer.Key("us");
+        writer.Double(m.us);
+        writer.Key("allocations");
+        writer.Double(m.allocations);
+        writer.Key("bytes");
+        writer.Double(m.bytes);
+        writer.Key("output_bytes");
+        writer.Uint64(output_bytes);
+        writer.EndObject();
+        fprintf(json_, "%s\n", buffer.GetString());
+    }
+};
+
+int main(int argc, char *argv[]) {
+    int iterations = 100;
+    const char * json_path = nullptr;
+    std::vector<std::string> template_files;
+    std::vector<ContextFile> contexts;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (ends_with(argv[i], ".json")) {
+            ContextFile ctx;
+            ctx.name = file_name(argv[i]);
+            ctx.doc.Parse(read_file(argv[i]).c_str());
+            if (ctx.doc.HasParseError() || !ctx.doc.IsObject()) {
+                fprintf(stderr, "Skipping invalid context file: %s\n", argv[i]);
+                continue;
+            }
+            if (ctx.doc.HasMember("bos_token") && ctx.doc["bos_token"].IsString()) ctx.bos_token = ctx.doc["bos_token"].GetString();
+            if (ctx.doc.HasMember("eos_token") && ctx.doc["eos_token"].IsString()) ctx.eos_token = ctx.doc["eos_token"].GetString();
+            contexts.emplace_back(std::move(ctx));
+        } else {
+            template_files.emplace_back(argv[i]);
+        }
+    }
+    if (template_files.empty()) {
+        fprintf(stderr, "Usage: %s [--iterations N] [--json results.jsonl] template1.jinja ... [context1.json ...]\n", argv[0]);
+        return 1;
+    }
+    FILE * json = nullptr;
+    if (json_path && !(json = fopen(json_path, "w"))) {
+        fprintf(stderr, "Failed to open %s for writing\n", json_path);
+        return 1;
+    }
+
+    // Same options as chat_template uses.
+    const minja::Options options {
+        /* .trim_blocks = */ true,
+        /* .lstrip_blocks = */ true,
+        /* .keep_trailing_newline = */ false,
+        /* .optimize = */ true,
+    };
+    const std::string bos_token = contexts.empty() ? "<s>" : contexts[0].bos_token;
+    const std::string eos_token = contexts.empty() ? "</s>" : contexts[0].eos_token;
+
+    Reporter reporter(json);
+    for (const auto & file : template_files) {
+        auto source = read_file(file);
+        if (source.empty()) {
+            fprintf(stderr, "Skipping empty or unreadable file: %s\n", file.c_str());
+            continue;
+        }
+        if (!minja::Parser::parse(source, options)) {
+            fprintf(stderr, "Failed to parse: %s\n", file.c_str());
+            continue;
+        }
+        auto name = file_name(file);
+
+        reporter.report("parse", name, "", measure(iterations, [&]() {
+            // Includes the time to free the AST.
+            minja::Parser::parse(source, options, std::make_shared<minja::Arena>());
+        }));
+
+        // Each construction detects the capabilities anew (the shared cache being emptied first), so this runs a
+        // dozen renders per iteration: keep it short.
+        reporter.report("construct", name, "", measure(std::max(1, iterations / 10), [&]() {
+            minja::chat_template_cache::global().clear();
+            minja::chat_template tmpl(source, bos_token, eos_token);
+        }));
+
+        // Constructions reusing the parse and capabilities of the last one through the shared cache.
+        reporter.report("construct cached", name, "", measure(iterations, [&]() {
+            minja::chat_template tmpl(source, bos_token, eos_token);
+        }));
+
+        minja::chat_template tmpl(source, bos_token, eos_token);
+        std::string prompt;
+        for (const auto & ctx : contexts) {
+            minja::chat_template_inputs inputs;
+            fill_inputs(inputs, ctx);
+            for (bool polyfills : {true, false}) {
+                minja::chat_template_options opts;
+                opts.apply_polyfills = polyfills;
+                auto m = measure(iterations, [&]() { prompt = tmpl.apply(inputs, opts); });
+                reporter.report("apply", name, ctx.name + (polyfills ? " polyfills" : " raw"), m, prompt.size());
+            }
+        }
+
+        for (size_t n_messages : {1, 10, 100, 1000}) {
+            minja::chat_template_inputs inputs;
+            fill_inputs(inputs, n_messages);
+            // Scale the iterations down with the length of the conversation so each row takes about as long.
+            auto n = std::max(1, iterations * 10 / (int) std::max<size_t>(10, n_messages));
+            auto m = measure(n, [&]() { prompt = tmpl.apply(inputs); });
+            reporter.report("render", name, std::to_string(inputs.messages.Size()) + " messages", m, prompt.size());
+        }
+
+        std::vector<minja::chat_template_inputs> batch(256);
+        for (auto & inputs : batch) fill_inputs(inputs, 10);
+        std::vector<size_t> thread_counts {1};
+        if (std::thread::hardware_concurrency() > 1) thread_counts.push_back(std::thread::hardware_concurrency());
+        for (auto num_threads : thread_counts) {
+            std::vector<std::string> prompts;
+            auto m = measure(std::max(1, iterations / 10), [&]() { prompts = tmpl.apply_batch(batch, minja::chat_template_options(), num_threads); });
+            size_t output_bytes = 0;
+            for (const auto & p : prompts) output_bytes += p.size();
+            reporter.report("batch", name, std::to_string(batch.size()) + " conversations, " + std::to_string(num_threads) + " threads", m, output_bytes);
+        }
+    }
+    if (json) {
+        fclose(json);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Concurrency benchmark: renders the ChatML-style template of bench-render (or the template file given on the
+    command line) over the same ~20-message conversation from 1, 2, 4, ... threads sharing one parsed
+    minja::chat_template, checks every output against a single-threaded render and reports renders/sec.
+
+    Usage: bench-threads [--iterations N] [--max-threads N] [template.jinja]
+*/
+#include "minja/chat-template.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char * kChatMLTemplate = R"({%- if tools %}
+{{- '<|im_start|>system\n' }}
+{%- if messages[0]['role'] == 'system' %}{{- messages[0]['content'] }}{%- else %}You are a helpful assistant.{%- endif %}
+{{- '\n\n# Tools\n\n<tools>' }}
+{%- for tool in tools %}{{- '\n' }}{{- tool | tojson }}{%- endfor %}
+{{- '\n</tools><|im_end|>\n' }}
+{%- elif messages[0]['role'] == 'system' %}
+{{- '<|im_start|>system\n' + messages[0]['content'] + '<|im_end|>\n' }}
+{%- endif %}
+{%- for message in messages %}
+{%- if message.role == 'user' or (message.role == 'system' and not loop.first) %}
+{{- '<|im_start|>' + message.role + '\n' + message.content + '<|im_end|>' + '\n' }}
+{%- elif message.role == 'assistant' %}
+{{- '<|im_start|>' + message.role }}
+{%- if message.content %}{{- '\n' + message.content }}{%- endif %}
+{%- for tool_call in message.tool_calls %}
+{%- if tool_call.function is defined %}{%- set tool_call = tool_call.function %}{%- endif %}
+{{- '\n<tool_call>\n{"name": "' + tool_call.name + '", "arguments": ' + (tool_call.arguments | tojson) + '}\n</tool_call>' }}
+{%- endfor %}
+{{- '<|im_end|>\n' }}
+{%- elif message.role == 'tool' %}
+{{- '<|im_start|>user\n<tool_response>\n' + message.content + '\n</tool_response><|im_end|>\n' }}
+{%- endif %}
+{%- endfor %}
+{%- if add_generation_prompt %}{{- '<|im_start|>assistant\n' }}{%- endif %})";
+
+static std::string read_file(const std::string &path) {
+    std::ifstream fs(path, std::ios_base::binary);
+    if (!fs.is_open()) {
+        return "";
+    }
+    fs.seekg(0, std::ios_base::end);
+    auto size = fs.tellg();
+    fs.seekg(0);
+    std::string out;
+    out.resize(static_cast<size_t>(size));
+    fs.read(&out[0], static_cast<std::streamsize>(size));
+    return out;
+}
+
+static void fill_inputs(minja::chat_template_inputs & inputs) {
+    auto & alloc = inputs.messages.GetAllocator();
+    auto add = [&](const char * role, const std::string & content) -> rapidjson::Value & {
+        rapidjson::Value msg(rapidjson::kObjectType);
+        msg.AddMember("role", rapidjson::Value(role, alloc), alloc);
+        msg.AddMember("content", rapidjson::Value(content.c_str(), alloc), alloc);
+        inputs.messages.PushBack(msg, alloc);
+        return inputs.messages[inputs.messages.Size() - 1];
+    };
+    add("system", "You are a helpful assistant that answers questions about the weather.");
+    for (int turn = 0; inputs.messages.Size() < 20; turn++) {
+        add("user", "What's the weather like in city #" + std::to_string(turn) + " today, and should I bring an umbrella?");
+        if (turn % 3 == 1) {
+            auto & call = add("assistant", "");
+            rapidjson::Value args(rapidjson::kObjectType);
+            args.AddMember("city", rapidjson::Value(("city #" + std::to_string(turn)).c_str(), alloc), alloc);
+            rapidjson::Value function(rapidjson::kObjectType);
+            function.AddMember("name", "get_weather", alloc);
+            function.AddMember("arguments", args, alloc);
+            rapidjson::Value tool_call(rapidjson::kObjectType);
+            tool_call.AddMember("type", "function", alloc);
+            tool_call.AddMember("function", function, alloc);
+            rapidjson::Value tool_calls(rapidjson::kArrayType);
+            tool_calls.PushBack(tool_call, alloc);
+            call.AddMember("tool_calls", tool_calls, alloc);
+            add("tool", "{\"temperature\": 21, \"conditions\": \"light rain\"}");
+        }
+        add("assistant", "It's mild with light rain expected in the afternoon, so yes, an umbrella would be a good idea.");
+    }
+    inputs.tools.Parse(R"([{"type": "function", "function": {"name": "get_weather", "description": "Get the current weather in a city",
+        "parameters": {"type": "object", "properties": {"city": {"type": "string", "description": "The city name"}}, "required": ["city"]}}}])");
+    inputs.add_generation_prompt = true;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 1000;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string source = kChatMLTemplate;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--max-threads") && i + 1 < argc) {
+            max_threads = (unsigned) std::max(1, atoi(argv[++i]));
+        } else {
+            source = read_file(argv[i]);
+            if (source.empty()) {
+                fprintf(stderr, "Empty or unreadable file: %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    const minja::chat_template tmpl(source, "<s>", "</s>");
+    minja::chat_template_inputs inputs;
+    fill_inputs(inputs);
+    // Single-threaded reference (also gets the lazily initialized builtins out of the way).
+    const auto expected = tmpl.apply(inputs);
+
+    using clock = std::chrono::steady_clock;
+    double single_thread_rate = 0;
+    for (unsigned n_threads = 1;; n_threads = std::min(max_threads, n_threads * 2)) {
+        std::atomic<size_t> mismatches(0);
+        std::vector<std::thread> threads;
+        auto start = clock::now();
+        for (unsigned t = 0; t < n_threads; t++) {
+            threads.emplace_back([&]() {
+                minja::StringSink sink(expected.size() * 2);
+                for (int i = 0; i < iterations; i++) {
+                    sink.clear();
+                    tmpl.apply(inputs, sink);
+                    if (sink.str() != expected) mismatches++;
+                }
+            });
+        }
+        for (auto & thread : threads) thread.join();
+        auto seconds = std::chrono::duration<double>(clock::now() - start).count();
+        auto rate = n_threads * (double) iterations / seconds;
+        if (n_threads == 1) single_thread_rate = rate;
+        printf("%3u threads  %12.0f renders/s  %5.2fx%s\n", n_threads, rate, rate / single_thread_rate,
+            mismatches ? "  OUTPUT MISMATCH" : "");
+        if (mismatches) {
+            return 1;
+        }
+        if (n_threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -14,7 +14,10 @@
 
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace minja;
 using namespace testing;
@@ -67,3 +70,345 @@ static std::string render(const std::string & template_str, const chat_template_
 TEST(ChatTemplateTest, SimpleCases) {
     EXPECT_THAT(render("{{ strftime_now('%Y-%m-%d %H:%M:%S') }}", {}, {}), MatchesRegex(R"([0-9]{4}-[0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2})"));
 }
+
+static std::string apply_messages(const chat_template & tmpl, const std::string & messages_json) {
+    chat_template_inputs inputs;
+    inputs.messages.Parse(messages_json.c_str());
+    return tmpl.apply(inputs);
+}
+
+TEST(ChatSessionTest, RendersOnlyAppendedMessages) {
+    chat_template tmpl(
+        "{{ bos_token }}{% for message in messages %}<|{{ message.role }}|>{{ message.content }}<|end|>{% endfor %}"
+        "{% if add_generation_prompt %}<|assistant|>{% endif %}",
+        "<s>", "</s>");
+    chat_session session(tmpl);
+    EXPECT_TRUE(session.is_incremental());
+
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "user", "content": "Hi"}])");
+    auto first = session.update(inputs);
+    EXPECT_EQ(0u, first.keep);
+    EXPECT_EQ("<s><|user|>Hi<|end|><|assistant|>", first.append);
+
+    inputs.messages.Parse(R"([{"role": "user", "content": "Hi"}, {"role": "assistant", "content": "Hello"}, {"role": "user", "content": "Bye"}])");
+    auto second = session.update(inputs);
+    EXPECT_EQ(std::string("<s><|user|>Hi<|end|><|assistant|>").size(), second.keep);
+    EXPECT_EQ("Hello<|end|><|user|>Bye<|end|><|assistant|>", second.append);
+    EXPECT_EQ(apply_messages(tmpl, R"([{"role": "user", "content": "Hi"}, {"role": "assistant", "content": "Hello"}, {"role": "user", "content": "Bye"}])"), session.prompt());
+
+    // Editing the history falls back to a full render.
+    inputs.messages.Parse(R"([{"role": "user", "content": "Hey"}])");
+    auto edited = session.update(inputs);
+    EXPECT_EQ(std::string("<s><|user|>H").size(), edited.keep);
+    EXPECT_EQ("ey<|end|><|assistant|>", edited.append);
+}
+
+TEST(ChatSessionTest, FallsBackWhenNotPrefixStable) {
+    chat_template tmpl("{% for message in messages %}{{ message.content }}{% if not loop.last %}, {% endif %}{% endfor %}", "", "");
+    chat_session session(tmpl);
+    EXPECT_FALSE(session.is_incremental());
+
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "user", "content": "a"}])");
+    EXPECT_EQ("a", session.update(inputs).append);
+    inputs.messages.Parse(R"([{"role": "user", "content": "a"}, {"role": "assistant", "content": "b"}])");
+    auto delta = session.update(inputs);
+    EXPECT_EQ(1u, delta.keep);
+    EXPECT_EQ(", b", delta.append);
+}
+
+TEST(ChatTemplateTest, SavedCaps) {
+    const std::string source = "{% for message in messages %}<{{ message.role }}>{{ message.content }}{% endfor %}";
+    const std::string messages = R"([{"role": "system", "content": "sys"}, {"role": "user", "content": "hi"}])";
+    const std::string saved = R"({"version": 1, "key": ")" + chat_template::caps_key(source, "<s>", "</s>") + R"(",
+        "supports_tools": false, "supports_tool_calls": false, "supports_tool_responses": false,
+        "supports_system_role": true, "supports_parallel_tool_calls": false, "supports_tool_call_id": false,
+        "requires_object_arguments": false, "requires_non_null_content": false, "requires_typed_content": false,
+        "tool_call_example": "<call>"})";
+
+    chat_template tmpl(source, "<s>", "</s>", saved);
+    EXPECT_TRUE(tmpl.original_caps().supports_system_role);
+    EXPECT_EQ("<call>", tmpl.tool_call_example());
+    EXPECT_EQ("<system>sys<user>hi", apply_messages(tmpl, messages));
+
+    // Round-trips through save_caps().
+    chat_template reloaded(source, "<s>", "</s>", tmpl.save_caps());
+    EXPECT_TRUE(reloaded.original_caps().supports_system_role);
+    EXPECT_EQ(tmpl.save_caps(), reloaded.save_caps());
+
+    // Caps saved for another template (or other special tokens) are ignored.
+    chat_template other(source, "<s>", "<|end|>");
+    auto original = other.save_caps();
+    EXPECT_FALSE(other.load_caps(saved));
+    EXPECT_FALSE(other.load_caps("{}"));
+    EXPECT_FALSE(other.load_caps("not json"));
+    EXPECT_EQ(original, other.save_caps());
+}
+
+TEST(ChatTemplateTest, SpecializedTokens) {
+    chat_template tmpl("{{ bos_token }}{% for message in messages %}{{ message.content }}{{ eos_token }}{% endfor %}"
+                       "{% if add_generation_prompt %}[gen]{% endif %}", "<s>", "</s>");
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "user", "content": "hi"}])");
+    EXPECT_EQ("<s>hi</s>[gen]", tmpl.apply(inputs));
+    inputs.add_generation_prompt = false;
+    EXPECT_EQ("<s>hi</s>", tmpl.apply(inputs));
+
+    // Values changed by the options or extra_context still apply.
+    chat_template_options opts;
+    opts.use_bos_token = false;
+    EXPECT_EQ("hi</s>", tmpl.apply(inputs, opts));
+    inputs.extra_context.Parse(R"({"eos_token": "<end>", "add_generation_prompt": true})");
+    EXPECT_EQ("<s>hi<end>[gen]", tmpl.apply(inputs));
+}
+
+TEST(ChatSessionTest, PolyfillsDontModifyInputs) {
+    const std::string source = "{% for message in messages %}<{{ message.role }}>{{ message.content }}{% endfor %}";
+    const std::string caps = R"({"version": 1, "key": ")" + chat_template::caps_key(source, "", "") + R"(",
+        "supports_tools": false, "supports_tool_calls": false, "supports_tool_responses": false,
+        "supports_system_role": false, "supports_parallel_tool_calls": false, "supports_tool_call_id": false,
+        "requires_object_arguments": false, "requires_non_null_content": false, "requires_typed_content": false,
+        "tool_call_example": ""})";
+    chat_template tmpl(source, "", "", caps);
+
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "system", "content": "sys"}, {"role": "user", "content": "hi"}])");
+    EXPECT_EQ("<user>sys\nhi", tmpl.apply(inputs));
+    ASSERT_EQ(2u, inputs.messages.Size());
+    EXPECT_STREQ("system", inputs.messages[0]["role"].GetString());
+
+    // Each update builds the polyfilled messages afresh (in memory reused across updates).
+    chat_session session(tmpl);
+    session.update(inputs);
+    inputs.messages.Parse(R"([{"role": "system", "content": "sys"}, {"role": "user", "content": "hi"},
+        {"role": "assistant", "content": "yo"}, {"role": "system", "content": "more"}, {"role": "user", "content": "q"}])");
+    auto delta = session.update(inputs);
+    EXPECT_EQ(tmpl.apply(inputs), session.prompt());
+    EXPECT_EQ("<user>sys\nhi<assistant>yo<user>more\nq", session.prompt());
+    EXPECT_EQ(std::string("<user>sys\nhi").size(), delta.keep);
+
+    // Polyfilled messages outgrowing the memory of the previous updates.
+    std::string messages = R"([{"role": "system", "content": "sys"}, {"role": "user", "content": "hi"})";
+    for (size_t n : {10, 1000, 4000}) {
+        while (n--) messages += R"(, {"role": "assistant", "content": "a"}, {"role": "system", "content": "s"}, {"role": "user", "content": "u"})";
+        inputs.messages.Parse((messages + "]").c_str());
+        session.update(inputs);
+        EXPECT_EQ(tmpl.apply(inputs), session.prompt());
+    }
+}
+
+TEST(ChatTemplateTest, CompiledTemplates) {
+    const std::string source = "{{ bos_token }}{% for message in messages %}<{{ message.role }}>{{ message.content | trim }}{{ eos_token }}{% endfor %}"
+                               "{% if add_generation_prompt %}<assistant>{% endif %}";
+    const std::string messages = R"([{"role": "system", "content": "sys"}, {"role": "user", "content": " hi "}])";
+    chat_template tmpl(source, "<s>", "</s>");
+    auto compiled = tmpl.compile();
+    ASSERT_FALSE(compiled.empty());
+
+    auto loaded = chat_template::from_compiled(compiled.data(), compiled.size());
+    ASSERT_TRUE(loaded);
+    EXPECT_EQ(source, loaded->source());
+    EXPECT_EQ("</s>", loaded->eos_token());
+    EXPECT_EQ(tmpl.save_caps(), loaded->save_caps());
+    EXPECT_EQ(apply_messages(tmpl, messages), apply_messages(*loaded, messages));
+    EXPECT_EQ("<s><system>sys</s><user>hi</s><assistant>", apply_messages(*loaded, messages));
+    chat_template_options opts;
+    opts.use_bos_token = false;
+    chat_template_inputs inputs;
+    inputs.messages.Parse(messages.c_str());
+    EXPECT_EQ(tmpl.apply(inputs, opts), loaded->apply(inputs, opts));
+
+    {
+        std::ofstream of("compiled.minja", std::ios::binary);
+        of << compiled;
+    }
+    auto mapped = chat_template::from_compiled_file("compiled.minja");
+    ASSERT_TRUE(mapped);
+    EXPECT_EQ(apply_messages(tmpl, messages), apply_messages(*mapped, messages));
+
+    // Truncated or foreign data is rejected.
+    EXPECT_FALSE(chat_template::from_compiled(compiled.data(), compiled.size() - 1));
+    EXPECT_FALSE(chat_template::from_compiled(compiled.data(), 4));
+    EXPECT_FALSE(chat_template::from_compiled(source.data(), source.size()));
+    EXPECT_FALSE(chat_template::from_compiled_file("does-not-exist.minja"));
+}
+
+TEST(ChatTemplateTest, ConcurrentCapsDetection) {
+    const std::string source = R"({%- for message in messages %}<{{ message.role }}>{{ message.content }}
+{%- for tool_call in message.tool_calls %}[{{ tool_call.function.name }}: {{ tool_call.function.arguments }}]{% endfor %}
+{%- endfor %}{% if tools %}{{ tools | tojson }}{% endif %})";
+    chat_template serial(source, "<s>", "</s>");
+
+    // Detect them afresh each time rather than taking the cached ones (see SharedParses).
+    auto & cache = chat_template_cache::global();
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+    chat_template_executor on_threads = [&](std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.emplace_back(std::move(task));
+    };
+    cache.clear();
+    chat_template concurrent(source, "<s>", "</s>", "", on_threads);
+    EXPECT_EQ(serial.save_caps(), concurrent.save_caps());
+
+    cache.clear();
+    auto loaded = chat_template::load_async(source, "<s>", "</s>", on_threads).get();
+    ASSERT_TRUE(loaded);
+    EXPECT_EQ(serial.save_caps(), loaded->save_caps());
+    cache.clear();
+    EXPECT_EQ(serial.save_caps(), chat_template::load_async(source, "<s>", "</s>").get()->save_caps());
+    for (auto & thread : threads) thread.join();
+
+    // The constructor runs the probes its executor didn't get to, so one that never runs tasks still works.
+    std::vector<std::function<void()>> never_run;
+    cache.clear();
+    chat_template deferred(source, "<s>", "</s>", "", [&](std::function<void()> task) { never_run.push_back(std::move(task)); });
+    EXPECT_EQ(serial.save_caps(), deferred.save_caps());
+    for (auto & task : never_run) task();
+}
+
+TEST(ChatTemplateTest, MessageSpans) {
+    // No system role: the system message gets merged into the next user message.
+    chat_template tmpl(R"({% for m in messages %}{% if m.role != 'system' %}<{{ m.role }}>{% if m.role == 'assistant' %}{% generation %}{{ m.content }}{% endgeneration %}{% else %}{{ m.content }}{% endif %}{% endif %}{% endfor %})", "", "");
+    EXPECT_FALSE(tmpl.original_caps().supports_system_role);
+
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "system", "content": "S"}, {"role": "user", "content": "U"}, {"role": "assistant", "content": "A"}])");
+    StringSink text;
+    SpanSink out(text);
+    tmpl.apply(inputs, out);
+    EXPECT_EQ("<user>S\nU<assistant>A", text.str());
+    EXPECT_EQ(tmpl.apply(inputs), text.str());
+
+    ASSERT_EQ(2u, out.message_spans().size());
+    EXPECT_EQ(0u, out.message_spans()[0].begin);
+    EXPECT_EQ(9u, out.message_spans()[0].end);
+    EXPECT_EQ(1u, out.message_spans()[0].message);
+    EXPECT_EQ(9u, out.message_spans()[1].begin);
+    EXPECT_EQ(21u, out.message_spans()[1].end);
+    EXPECT_EQ(2u, out.message_spans()[1].message);
+    ASSERT_EQ(1u, out.generation_spans().size());
+    EXPECT_EQ(20u, out.generation_spans()[0].begin);
+    EXPECT_EQ(21u, out.generation_spans()[0].end);
+}
+
+TEST(ChatTemplateTest, BatchApply) {
+    // No system role, so that most conversations need polyfills (and their scratch memory).
+    chat_template tmpl(R"({{ bos_token }}{% for m in messages %}{% if m.role != 'system' %}<{{ m.role }}>{{ m.content }}{% endif %}{% endfor %}{% if add_generation_prompt %}<assistant>{% endif %})", "<s>", "</s>");
+    std::vector<chat_template_inputs> inputs(100);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        std::string messages = "[";
+        for (size_t j = 0; j <= i % 7; ++j) {
+            messages += std::string(j ? ", " : "") + R"({"role": ")" + (j % 2 ? "assistant" : j ? "user" : "system") + R"(", "content": ")" + std::to_string(i * j) + "\"}";
+        }
+        inputs[i].messages.Parse((messages + "]").c_str());
+        inputs[i].add_generation_prompt = i % 2 == 0;
+    }
+    for (size_t num_threads : {1, 4, 0}) {
+        auto prompts = tmpl.apply_batch(inputs, chat_template_options(), num_threads);
+        ASSERT_EQ(inputs.size(), prompts.size());
+        for (size_t i = 0; i < inputs.size(); ++i) EXPECT_EQ(tmpl.apply(inputs[i]), prompts[i]) << i;
+    }
+    EXPECT_TRUE(tmpl.apply_batch(nullptr, 0).empty());
+}
+
+TEST(ChatTemplateTest, SharedTools) {
+    const std::string source = R"({% if tools %}{{ tools | tojson }}{% for t in tools %}|{{ t | tojson }}{{ t.name }}{% endfor %}{% endif %}{% for m in messages %}<{{ m.role }}>{{ m.content }}{% endfor %})";
+    chat_template tmpl(source, "<s>", "</s>");
+    // More of them than are kept, and some only equal to others for operator==.
+    std::vector<std::string> tools = {
+        R"([{"name": "a", "v": 1}])",
+        R"([{"name": "a", "v": 1.0}])",
+        R"([{"v": 1, "name": "a"}])",
+        R"([{"name": "b", "v": [0.0]}, {"name": "c"}])",
+        R"([{"name": "b", "v": [-0.0]}, {"name": "c"}])",
+        R"([{"name": "d", "v": "it's"}])",
+        R"([])",
+    };
+    std::vector<chat_template_inputs> inputs(tools.size() * 3);
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        inputs[i].messages.Parse(R"([{"role": "user", "content": "hi"}])");
+        inputs[i].tools.Parse(tools[i % tools.size()].c_str());
+        expected.push_back(chat_template(source, "<s>", "</s>").apply(inputs[i]));
+    }
+    EXPECT_NE(expected[0], expected[1]);
+    EXPECT_NE(expected[3], expected[4]);
+    for (size_t i = 0; i < inputs.size(); ++i) EXPECT_EQ(expected[i], tmpl.apply(inputs[i])) << i;
+    EXPECT_EQ(expected, tmpl.apply_batch(inputs, chat_template_options(), 4));
+}
+
+TEST(ChatTemplateTest, Memoize) {
+    const std::string source = R"({% if tools %}# Tools{% for t in tools %}
+- {{ t.name }}: {{ t.parameters | tojson }}{% endfor %}
+{% endif %}{% for m in messages %}<|{{ m.role }}|>{{ m.content | trim }}{% if m.role == 'assistant' %}{{ eos_token }}{% endif %}{% endfor %}{% if add_generation_prompt %}<|assistant|>{% endif %})";
+    chat_template tmpl(source, "<s>", "</s>");
+    chat_template_options memoize;
+    memoize.memoize = true;
+    chat_session session(tmpl, memoize);
+
+    std::string messages = R"([{"role": "system", "content": " Be brief. "})";
+    const char * turns[] = {
+        R"({"role": "user", "content": "Hi"})",
+        R"({"role": "assistant", "content": "Hello"})",
+        R"({"role": "user", "content": "Weather?"})",
+    };
+    for (auto turn : turns) {
+        messages += std::string(", ") + turn;
+        chat_template_inputs inputs;
+        inputs.messages.Parse((messages + "]").c_str());
+        inputs.tools.Parse(R"([{"name": "weather", "parameters": {"type": "object", "properties": {"city": {"type": "string"}}}}])");
+        inputs.add_generation_prompt = true;
+        auto expected = tmpl.apply(inputs);
+        EXPECT_EQ(expected, tmpl.apply(inputs, memoize));
+        session.update(inputs);
+        EXPECT_EQ(expected, session.prompt());
+    }
+    // The tools section & the earlier messages were rendered once.
+    EXPECT_LT(0u, tmpl.memo().stats().hits);
+    EXPECT_LT(0u, tmpl.memo().stats().entries);
+}
+
+TEST(ChatTemplateTest, SharedParses) {
+    const std::string source = R"({% for m in messages %}<|{{ m.role }}|>{{ m.content }}{% endfor %}{% if add_generation_prompt %}<|assistant|>{% endif %})";
+    auto & cache = chat_template_cache::global();
+    cache.clear();
+    auto before = cache.stats();
+
+    chat_template first(source, "<s>", "</s>");
+    EXPECT_EQ(before.misses + 1, cache.stats().misses);
+    EXPECT_EQ(1u, cache.stats().entries);
+    EXPECT_LT(0u, cache.stats().bytes);
+
+    // The same template again is taken from the cache, with its capabilities.
+    chat_template second(source, "<s>", "</s>");
+    EXPECT_EQ(before.hits + 1, cache.stats().hits);
+    EXPECT_EQ(1u, cache.stats().entries);
+    EXPECT_EQ(first.save_caps(), second.save_caps());
+    EXPECT_EQ(first.tool_call_example(), second.tool_call_example());
+    chat_template_inputs inputs;
+    inputs.messages.Parse(R"([{"role": "user", "content": "Hi"}])");
+    inputs.add_generation_prompt = true;
+    EXPECT_EQ("<|user|>Hi<|assistant|>", first.apply(inputs));
+    EXPECT_EQ(first.apply(inputs), second.apply(inputs));
+
+    // Other special tokens make another entry.
+    chat_template other(source, "", "");
+    EXPECT_EQ(before.misses + 2, cache.stats().misses);
+    EXPECT_EQ(2u, cache.stats().entries);
+    EXPECT_EQ(first.apply(inputs), other.apply(inputs));
+
+    // Past the budget, the least recently used entries go (the templates made from them still work).
+    cache.set_max_bytes(cache.stats().bytes - 1);
+    EXPECT_EQ(1u, cache.stats().entries);
+    chat_template again(source, "", "");
+    EXPECT_EQ(before.hits + 2, cache.stats().hits);
+    cache.set_max_bytes(0);
+    EXPECT_EQ(0u, cache.stats().entries);
+    chat_template uncached(source, "<s>", "</s>");
+    EXPECT_EQ(0u, cache.stats().entries);
+    EXPECT_EQ(first.apply(inputs), uncached.apply(inputs));
+    EXPECT_EQ(first.apply(inputs), second.apply(inputs));
+    cache.set_max_bytes(64 * 1024 * 1024);
+}
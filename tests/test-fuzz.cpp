@@ -11,6 +11,7 @@
 #include <gtest/gtest.h>
 #include <minja/minja.hpp>
 #include <minja/chat-template.hpp>
+#include <chrono>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
@@ -126,6 +127,27 @@ void TestParseAndRenderDoesNotCrash(const std::string& template_str, const std::
     }
 }
 
+// Slow inputs: under a budget, any template (however it loops, recurses or repeats strings) must stop quickly.
+void TestParseAndRenderIsBounded(const std::string& template_str, const std::string& json_str) {
+    RenderBudget::Limits limits;
+    limits.max_iterations = 100000;
+    limits.max_depth = 50;
+    limits.max_output_bytes = 1 << 20;
+    limits.timeout = std::chrono::milliseconds(100);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        auto root = Parser::parse(template_str, {});
+        auto context = Context::make(json::parse(json_str));
+        RenderBudget budget(limits);
+        RenderBudget::Scope scope(budget);
+        auto output = root->render(context);
+        EXPECT_LE(output.size(), limits.max_output_bytes);
+    } catch (const std::exception& e) {
+        std::cerr << "Exception caught: " << e.what() << std::endl;
+    }
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+
 void TestParseAndRenderJsonDoesNotCrash(const std::string & x)   {
     EXPECT_EQ(dump(json::parse(x)), parse_and_render("{{ x | tojson }}", {{"x", json::parse(x)}}, {}));
 }
@@ -269,6 +291,20 @@ FUZZ_TEST(Fuzz, TestParseAndRenderDoesNotCrash)
         AnyText(),
         AnyJsonObject()
     );
+FUZZ_TEST(Fuzz, TestParseAndRenderIsBounded)
+    .WithSeeds({
+        {"{% for i in range(1000000000) %}{{ i }}{% endfor %}", "{}"},
+        {"{% for i in range(100000) %}{% for j in range(100000) %}{% endfor %}{% endfor %}", "{}"},
+        {"{% macro f(n) %}{{ f(n + 1) }}{% endmacro %}{{ f(0) }}", "{}"},
+        {"{% for x in xs recursive %}{{ loop(xs) }}{% endfor %}", "{\"xs\": [1]}"},
+        {"{{ 'x' * (1000000 * 1000000) }}", "{}"},
+        {"{% set s = 'ab' %}{% for i in range(64) %}{% set s = s ~ s %}{% endfor %}{{ s }}", "{}"},
+        {"{% set xs = [1] %}{% for i in range(30) %}{% set xs = xs + xs %}{% endfor %}", "{}"},
+    })
+    .WithDomains(
+        AnyText(),
+        AnyJsonObject()
+    );
 FUZZ_TEST(Fuzz, TestParseAndRenderJsonDoesNotCrash)
     // .WithSeeds({
     //     {"null"},
@@ -0,0 +1,55 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+// Built with MINJA_PROFILE (unlike the other tests, which cover the default build).
+#include "minja/minja.hpp"
+#include <gtest/gtest.h>
+#include <gmock/gmock-matchers.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+TEST(ProfilerTest, LinesAndCallTree) {
+    auto root = minja::Parser::parse("{%- for i in xs %}\n{{- i }}\n{%- endfor %}\n{{- xs | length }}", {});
+    // Long enough for each path of the call tree to add up to some microseconds, even in optimized builds.
+    const size_t n = 10000;
+    auto make_context = [&] {
+        std::vector<minja::Value> xs;
+        for (size_t i = 0; i < n; i++) xs.emplace_back((int64_t) (i % 10));
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("xs", minja::Value::array(xs));
+        return context;
+    };
+    auto expected = root->render(make_context());
+    EXPECT_EQ(n + 5, expected.size());
+
+    minja::Profiler profiler;
+    minja::TemplateProgram program(root);
+    {
+        minja::Profiler::Scope scope(profiler);
+        EXPECT_EQ(expected, root->render(make_context()));
+        // Renders through the tree while profiling.
+        EXPECT_EQ(expected, program.render(make_context()));
+    }
+    // Nothing is recorded outside of the scope.
+    root->render(make_context());
+    auto lines = profiler.lines();
+    ASSERT_EQ(4u, lines.size());
+    std::map<size_t, minja::Profiler::LineStats> by_line;
+    for (const auto & line : lines) by_line[line.line] = line;
+    EXPECT_EQ("{{- i }}", by_line[2].text());
+    EXPECT_EQ(2 * n, by_line[2].calls);
+    EXPECT_EQ(2u, by_line[4].calls);
+    for (const auto & line : lines) {
+        EXPECT_GE(line.total_us, line.self_us);
+        EXPECT_GE(line.bytes, line.self_bytes);
+    }
+    EXPECT_THAT(profiler.report(), testing::HasSubstr("2: {{- i }}\n"));
+    EXPECT_THAT(profiler.folded(), testing::HasSubstr("For@1:1;Sequence@1:19;Expression@2:1;Variable@2:"));
+}
@@ -10,9 +10,13 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock-matchers.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 static std::string render_python(const std::string & template_str, const json & bindings, const minja::Options & options) {
     json data {
@@ -570,3 +574,774 @@ TEST(SyntaxTest, SimpleCases) {
     // expect_throws_with_message_substr([]() { render("{{ a.b }}", {}, {}); }, "'a' is not defined");
     // expect_throws_with_message_substr([]() { render("{{ raise_exception('hey') }}", {}, {}); }, "hey");
 }
+
+TEST(SyntaxTest, ArenaParse) {
+    const std::string tmpl = "{% for x in xs if x %}{{ x ~ '!' }}{% endfor %}{% set y = 2 %}{{ y }}";
+    auto arena = std::make_shared<minja::Arena>(256);
+    std::weak_ptr<minja::Arena> weak_arena = arena;
+
+    auto root = minja::Parser::parse(tmpl, {}, arena);
+    EXPECT_GT(arena->bytes_used(), 0u);
+    EXPECT_GE(arena->bytes_reserved(), arena->bytes_used());
+
+    auto heap_root = minja::Parser::parse(tmpl, {}, nullptr);
+    auto bindings = json({{"xs", json::array({"a", "", "b"})}});
+    EXPECT_EQ(heap_root->render(minja::Context::make(bindings)), root->render(minja::Context::make(bindings)));
+
+    // The nodes keep the arena alive, and it's released with the last one.
+    arena.reset();
+    EXPECT_FALSE(weak_arena.expired());
+    root.reset();
+    EXPECT_TRUE(weak_arena.expired());
+}
+
+TEST(SyntaxTest, BorrowedValues) {
+    rapidjson::Document doc;
+    doc.Parse(R"({"tools": [{"name": "b", "params": {"z": 1, "a": [true, null, "x"]}}], "xs": [1, 2, 3]})");
+
+    auto render_with = [](const std::string & tmpl, minja::Value bindings) {
+        return minja::Parser::parse(tmpl, {})->render(minja::Context::make(std::move(bindings)));
+    };
+    for (const auto & tmpl : {
+        "{{ tools | tojson }}",
+        "{{ tools[0].params }}|{{ tools[0]['params'].a[-1] }}|{{ tools[0].missing is defined }}",
+        "{% for t in tools %}{{ t.name }}{% for k, v in t.params.items() %}{{ k }}{% endfor %}{% endfor %}",
+        "{{ xs | length }}|{{ 2 in xs }}|{{ xs[1:] }}|{{ xs + xs }}|{{ 'xs' in tools[0] }}",
+        "{% set ys = xs %}{% set _ = ys.append(4) %}{{ xs }}|{% set _ = tools[0].params.pop('z') %}{{ tools }}",
+    }) {
+        EXPECT_EQ(render_with(tmpl, minja::Value(doc)), render_with(tmpl, minja::Value::borrow(doc))) << tmpl;
+    }
+    // Mutations materialize the borrowed values, never touching the document.
+    EXPECT_EQ(3u, doc["xs"].Size());
+    EXPECT_TRUE(doc["tools"][0]["params"].HasMember("z"));
+}
+
+TEST(SyntaxTest, CompactPrimitives) {
+    // Short strings are stored inline, long ones are shared between copies.
+    minja::json short_str(std::string("role"));
+    minja::json long_str(std::string(100, 'x'));
+    auto short_copy = short_str;
+    auto long_copy = long_str;
+    EXPECT_EQ("role", short_copy.str());
+    EXPECT_NE(short_str.str().data(), short_copy.str().data());
+    EXPECT_EQ(long_str.str().data(), long_copy.str().data());
+    EXPECT_TRUE(long_str == long_copy);
+
+    // Borrowed strings point into the caller's memory.
+    std::string content(64, 'c');
+    auto borrowed = minja::json::borrow(content.data(), content.size());
+    EXPECT_EQ(content.data(), borrowed.str().data());
+    EXPECT_EQ(content, std::string(borrowed.str()));
+
+    // Numbers convert between int & float.
+    auto render_empty = [](const std::string & tmpl) {
+        return minja::Parser::parse(tmpl, {})->render(minja::Context::make(minja::Value::object()));
+    };
+    EXPECT_EQ("True|False|x|2|True", render_empty("{{ 1 < 2 }}|{{ 3 >= 10 }}|{{ 0 or 'x' }}|{{ 2 if 1 }}|{{ 2 * 3 > 5.5 }}"));
+}
+
+TEST(SyntaxTest, ResolvedVariables) {
+    // Variables bound by for loops are read from the loop contexts' slots; these check the scoping is unchanged.
+    auto render_with = [](const std::string & tmpl) {
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("y", "Y");
+        return minja::Parser::parse(tmpl, {})->render(context);
+    };
+    EXPECT_EQ("13112312", render_with("{% for x in [1,2] %}{% for y in [3] %}{{ x }}{{ y }}{{ loop.index }}{% endfor %}{{ loop.index }}{% endfor %}"));
+    EXPECT_EQ("o112o", render_with("{% set a = 'o' %}{% for x in [1,2] %}{{ a }}{% set a = x %}{{ a }}{% endfor %}{{ a }}"));
+    EXPECT_EQ("292", render_with("{% for x in [1] %}{% set y = 2 %}{% for z in [3] %}{{ y }}{% set y = 9 %}{{ y }}{% endfor %}{{ y }}{% endfor %}"));
+    EXPECT_EQ("101202", render_with("{% for x in [1,2] %}{% macro m(p) %}{{ p }}{{ x }}{% endmacro %}{{ m(x * 10) }}{% endfor %}"));
+    EXPECT_EQ("5", render_with("{% macro m(p=x) %}{{ p }}{% endmacro %}{% for x in [5] %}{{ m() }}{% endfor %}"));
+    EXPECT_EQ("6", render_with("{% set ns = namespace(c=0) %}{% for x in [1,2,3] %}{% set ns.c = ns.c + x %}{% endfor %}{{ ns.c }}"));
+    EXPECT_EQ("in1False", render_with("{% for x in [1] %}{% set t %}in{{ x }}{% endset %}{{ t }}{% endfor %}{{ t is defined }}"));
+    EXPECT_EQ("22|1", render_with("{% for x in [1] %}{% for x in [2] %}{{ x }}{% endfor %}{{ x }}{% endfor %}|{{ x }}"));
+    EXPECT_EQ("Y2Y", render_with("{% for x in [1] %}{{ y }}{% for y in [2] %}{{ y }}{% endfor %}{% endfor %}{{ y }}"));
+}
+
+TEST(SyntaxTest, SharedBuiltins) {
+    auto builtins = minja::Context::builtins();
+    EXPECT_EQ(builtins.get(), minja::Context::builtins().get());
+    EXPECT_EQ(builtins.get(), minja::Context::make(minja::Value::object())->get_parent().get());
+
+    auto render_with = [](const std::string & tmpl, minja::Value bindings) {
+        return minja::Parser::parse(tmpl, {})->render(minja::Context::make(std::move(bindings)));
+    };
+    // (A name no other test uses, as builtins can't be unregistered.)
+    minja::Context::register_builtin("shared_builtins_shout", minja::Value::callable([](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+        return minja::Value(args.args[0].get<std::string>() + "!");
+    }));
+    EXPECT_EQ("hi!|HI", render_with("{{ shared_builtins_shout('hi') }}|{{ 'hi' | upper }}", minja::Value::object()));
+    // The previous table is left untouched, and only the new builtin was added.
+    EXPECT_FALSE(builtins->contains("shared_builtins_shout"));
+    EXPECT_NE(builtins.get(), minja::Context::builtins().get());
+    auto names = [](const std::shared_ptr<minja::Context> & context) {
+        std::vector<std::string> names;
+        for (const auto & key : context->keys()) names.push_back(key.get<std::string>());
+        std::sort(names.begin(), names.end());
+        return names;
+    };
+    auto expected = names(builtins);
+    expected.insert(std::lower_bound(expected.begin(), expected.end(), "shared_builtins_shout"), "shared_builtins_shout");
+    EXPECT_EQ(expected, names(minja::Context::builtins()));
+    // Bindings still shadow builtins.
+    auto bindings = minja::Value::object();
+    bindings.set("shared_builtins_shout", "quiet");
+    EXPECT_EQ("quiet", render_with("{{ shared_builtins_shout }}", bindings));
+}
+
+TEST(SyntaxTest, ResolvedBuiltins) {
+    auto render_with = [](const std::shared_ptr<minja::TemplateNode> & root, minja::Value bindings) {
+        return root->render(minja::Context::make(std::move(bindings)));
+    };
+    auto filters = minja::Parser::parse("{% for s in ['a ', 'b'] %}{{ s | upper }}{{ s.strip() }}{{ s.startswith('a') }}{% endfor %}", {});
+    EXPECT_EQ("A aTrueBbFalse", render_with(filters, minja::Value::object()));
+    // Names bound by the caller or the template still shadow the builtins.
+    auto bindings = minja::Value::object();
+    bindings.set("upper", minja::Value::callable([](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+        return minja::Value("<" + args.args[0].get<std::string>() + ">");
+    }));
+    EXPECT_EQ("<a >aTrue<b>bFalse", render_with(filters, bindings));
+    EXPECT_EQ("[a]", render_with(minja::Parser::parse("{% macro upper(x) %}[{{ x }}]{% endmacro %}{{ 'a' | upper }}", {}), minja::Value::object()));
+
+    // Builtins registered after parsing are seen by the renders that start afterwards.
+    auto whisper = [](const std::string & suffix) {
+        return minja::Value::callable([suffix](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+            return minja::Value(args.args[0].get<std::string>() + suffix);
+        });
+    };
+    auto early = minja::Parser::parse("{{ 'a' | whisper }}", {});
+    minja::Context::register_builtin("whisper", whisper("..."));
+    auto late = minja::Parser::parse("{{ 'a' | whisper }}|{{ 'b' | whisper() }}", {});
+    EXPECT_EQ("a...", render_with(early, minja::Value::object()));
+    EXPECT_EQ("a...|b...", render_with(late, minja::Value::object()));
+    minja::Context::register_builtin("whisper", whisper("~"));
+    EXPECT_EQ("a~|b~", render_with(late, minja::Value::object()));
+}
+
+TEST(SyntaxTest, RenderSinks) {
+    auto root = minja::Parser::parse("{% for x in xs %}[{{ x }}]{% macro m() %}<{{ x }}>{% endmacro %}{{ m() }}{% endfor %}{% filter upper %}done{% endfilter %}", {});
+    auto context = minja::Context::make(minja::Value::object());
+    context->set("xs", minja::Value::array({"a", "bb", "ccc"}));
+    auto expected = root->render(context);
+    EXPECT_EQ("[a]<a>[bb]<bb>[ccc]<ccc>DONE", expected);
+
+    std::vector<std::string> chunks;
+    minja::CallbackSink callback_sink([&](const char * data, size_t size) { chunks.emplace_back(data, size); }, /* min_chunk= */ 8);
+    root->render(callback_sink, context);
+    callback_sink.flush();
+    std::string streamed;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i + 1 < chunks.size()) {
+            EXPECT_GE(chunks[i].size(), 8u);
+        }
+        streamed += chunks[i];
+    }
+    EXPECT_GT(chunks.size(), 1u);
+    EXPECT_EQ(expected, streamed);
+
+    minja::StringSink string_sink(1024);
+    for (int i = 0; i < 2; ++i) {
+        string_sink.clear();
+        root->render(string_sink, context);
+        EXPECT_EQ(expected, string_sink.str());
+        EXPECT_GE(string_sink.str().capacity(), 1024u);
+    }
+}
+
+TEST(SyntaxTest, LoopObject) {
+    auto render_with = [](const std::string & tmpl) {
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("xs", minja::Value::array({(int64_t) 1, (int64_t) 2, (int64_t) 3}));
+        return minja::Parser::parse(tmpl, {})->render(context);
+    };
+    EXPECT_EQ("1,0,3,2,True,False,3,,2;2,1,2,1,False,False,3,1,3;3,2,1,0,False,True,3,2,;", render_with(
+        "{% for x in xs %}{{ loop.index }},{{ loop.index0 }},{{ loop.revindex }},{{ loop.revindex0 }},{{ loop.first }},{{ loop.last }},"
+        "{{ loop.length }},{{ loop.previtem }},{{ loop.nextitem }};{% endfor %}"));
+    EXPECT_EQ("1/2:2 2/2:3 ", render_with("{% for x in xs if x > 1 %}{{ loop.index }}/{{ loop.length }}:{{ x }} {% endfor %}"));
+    // As in Jinja, cycle() picks the argument at the loop's index, however many times it's called.
+    EXPECT_EQ("aabbaa", render_with("{% for x in xs %}{{ loop.cycle('a', 'b') }}{{ loop.cycle('a', 'b') }}{% endfor %}"));
+    EXPECT_EQ("ac", render_with("{% for x in xs %}{% if x == 2 %}{% continue %}{% endif %}{{ loop.cycle('a', 'b', 'c') }}{% endfor %}"));
+    // The loop object can still be used as a whole, and keeps following the loop once stored.
+    EXPECT_EQ("True3True", render_with("{% for x in xs %}{% if loop.last %}{{ 'index' in loop }}{{ loop.get('index') }}{{ loop['last'] }}{% endif %}{% endfor %}"));
+    EXPECT_EQ("3", render_with("{% set ns = namespace(l=none) %}{% for x in xs %}{% set ns.l = loop %}{% endfor %}{{ ns.l.index }}"));
+    EXPECT_EQ("a1Falseb2True", render_with("{% for k in {'a': 1, 'b': 2} %}{{ k }}{{ loop.index }}{{ loop.last }}{% endfor %}"));
+    EXPECT_EQ("12", render_with("{% for x in xs %}{{ x }}{% if x == 2 %}{% set _ = xs.pop() %}{% endif %}{% endfor %}"));
+}
+
+TEST(SyntaxTest, OptimizedTemplates) {
+    minja::Options plain {}, optimized {};
+    optimized.optimize = true;
+    auto render_with = [](const std::shared_ptr<minja::TemplateNode> & root) {
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("x", (int64_t) 2);
+        context->set("bos", "<s>");
+        return root->render(context);
+    };
+    for (const auto & tmpl : std::vector<std::string> {
+        "a{{ 'b' ~ 'c' }}{% if true %}d{% else %}e{% endif %}{{ 1 + 2 }}{{ not false }}{{ none }}{{ 'x' if false }}",
+        "{{ x ~ 'a' ~ 'b' }}|{{ false or x }}|{{ true and x }}|{{ 0 and x }}|{{ -1 < 2 }}|{{ 'ab' == 'a' ~ 'b' }}",
+        "{% if false %}a{% elif x == 2 %}b{% elif true %}c{% else %}d{% endif %}{% if 0 %}e{% elif '' %}f{% endif %}",
+        "{% for i in [1, 2] %}{{ i }}{% if true %}{% break %}{% endif %}{% endfor %}{% macro m(a='q' ~ 'r') %}{{ a }}{% endmacro %}{{ m() }}",
+        "{% set xs = [1] %}{% for i in range(2) %}{% set _ = xs.append(i) %}{% endfor %}{{ xs }}",
+    }) {
+        EXPECT_EQ(render_with(minja::Parser::parse(tmpl, plain)), render_with(minja::Parser::parse(tmpl, optimized))) << tmpl;
+    }
+
+    auto root = minja::Parser::parse("a{{ 'b' }}{% if false %}x{% endif %}{% if true %}c{{ 'd' ~ 1 }}{% endif %}", optimized);
+    ASSERT_EQ(minja::TemplateNode::Type_Text, root->mType);
+    EXPECT_EQ("abcd1", ((minja::TextNode*)root.get())->get_text());
+
+    // Constants are substituted, except where the template rebinds their name.
+    const std::map<std::string, minja::Value> constants {{"bos", "[BOS]"}, {"flag", true}};
+    EXPECT_EQ("[BOS]yes", render_with(minja::Parser::parse("{{ bos }}{% if flag %}yes{% endif %}", optimized, nullptr, constants)));
+    EXPECT_EQ("<s>", render_with(minja::Parser::parse("{{ bos }}", plain, nullptr, constants)));
+    EXPECT_EQ("b|b", render_with(minja::Parser::parse("{% set bos = 'b' %}{{ bos }}|{{ bos }}", optimized, nullptr, constants)));
+    EXPECT_EQ("12", render_with(minja::Parser::parse("{% for bos in [1, 2] %}{{ bos }}{% endfor %}", optimized, nullptr, constants)));
+}
+
+TEST(SyntaxTest, CompiledTrees) {
+    auto render_with = [](const std::shared_ptr<minja::TemplateNode> & root) {
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("x", (int64_t) -3);
+        context->set("s", "Hello");
+        return root->render(context);
+    };
+    for (const auto & tmpl : std::vector<std::string> {
+        "{{ x }}|{{ -x * 2.5 }}|{{ s[1:3] }}|{{ s | upper }}|{{ s.lower() }}|{{ {'a': [1, none, true]} | tojson }}|{{ 'y' if x < 0 else 'n' }}",
+        "{% for i in range(3) if i != 1 %}{{ loop.index }}{{ i }}{% if i %}{% break %}{% endif %}{% else %}-{% endfor %}",
+        "{% macro m(a, b='q') %}{{ a }}{{ b }}{% endmacro %}{{ m(1) }}{{ m(2, b=x) }}{% filter upper %}f{{ s }}{% endfilter %}",
+        "{% set ns = namespace(n=0) %}{% set ns.n = ns.n + 1 %}{% set a, b = [1, 2] %}{% set t %}T{{ a }}{% endset %}{{ ns.n }}{{ b }}{{ t }}{{ x is defined }}",
+    }) {
+        auto root = minja::Parser::parse(tmpl, {});
+        minja::TemplateWriter writer;
+        ASSERT_TRUE(writer.write_tree(root)) << tmpl;
+        auto bytes = writer.finish();
+        minja::TemplateReader reader(bytes.data(), bytes.size(), std::make_shared<std::string>(tmpl));
+        auto loaded = reader.read_tree();
+        ASSERT_TRUE(loaded) << tmpl;
+        EXPECT_TRUE(reader.at_end());
+        EXPECT_EQ(render_with(root), render_with(loaded)) << tmpl;
+
+        minja::TemplateReader truncated(bytes.data(), bytes.size() - 1, std::make_shared<std::string>(tmpl));
+        EXPECT_FALSE(truncated.read_tree()) << tmpl;
+        EXPECT_FALSE(truncated.ok());
+
+        // Locations must point into the source.
+        minja::TemplateReader misplaced(bytes.data(), bytes.size(), std::make_shared<std::string>(tmpl.substr(0, 2)));
+        EXPECT_FALSE(misplaced.read_tree()) << tmpl;
+        EXPECT_FALSE(misplaced.ok());
+    }
+
+    // Trees nested too deep are rejected rather than read recursively.
+    std::string deep;
+    for (size_t i = 0; i < minja::TemplateReader::max_depth; ++i) deep += "{% if x %}";
+    for (size_t i = 0; i < minja::TemplateReader::max_depth; ++i) deep += "{% endif %}";
+    minja::TemplateWriter writer;
+    ASSERT_TRUE(writer.write_tree(minja::Parser::parse(deep, {})));
+    auto bytes = writer.finish();
+    minja::TemplateReader reader(bytes.data(), bytes.size(), std::make_shared<std::string>(deep));
+    EXPECT_FALSE(reader.read_tree());
+    EXPECT_FALSE(reader.ok());
+}
+
+TEST(SyntaxTest, BytecodePrograms) {
+    auto render_both = [](const std::string & tmpl) {
+        auto root = minja::Parser::parse(tmpl, {});
+        auto make_context = [] {
+            auto context = minja::Context::make(minja::Value::object());
+            context->set("x", (int64_t) 3);
+            context->set("s", "Hello");
+            context->set("xs", minja::Value::array({(int64_t) 1, (int64_t) 2, (int64_t) 3}));
+            auto msg = minja::Value::object();
+            msg.set("role", "user");
+            msg.set("content", "hi");
+            context->set("messages", minja::Value::array({msg, msg}));
+            return context;
+        };
+        auto expected = root->render(make_context());
+        minja::TemplateProgram program(root);
+        EXPECT_FALSE(program.get_code().empty()) << tmpl;
+        return std::make_pair(expected, program.render(make_context()));
+    };
+    for (const auto & tmpl : std::vector<std::string> {
+        "{{ x }}|{{ -x }}|{{ not x }}|{{ s[1] }}|{{ s[1:3] }}|{{ s | upper | lower }}|{{ 'y' if x > 2 else 'n' }}|{{ 'y' if x < 2 }}",
+        "{{ x and s }}|{{ 0 and s }}|{{ x or s }}|{{ '' or x }}|{{ x is defined }}|{{ y is not defined }}|{{ x == 3 }}|{{ x * 2 + 1 }}",
+        "{{ s + '!' + s ~ x ~ 1.5 }}|{{ x + 1 ~ s }}|{{ 'a' ~ none ~ true }}|{{ xs + [4] }}|{{ s.upper() + s }}",
+        "{% for i in xs %}{{ loop.index }}{{ i }}{% if i == 2 %}{% continue %}{% endif %}.{% endfor %}",
+        "{% for i in xs %}{% for j in xs %}{% if j > i %}{% break %}{% endif %}{{ i }}{{ j }}{% endfor %},{% endfor %}{{ i }}",
+        "{% for i in [] %}{{ i }}{% else %}empty{% endfor %}|{% for i in xs if i != 2 %}{{ i }}{% else %}-{% endfor %}",
+        "{% for m in messages %}<|{{ m.role }}|>{{ m['content'] }}{% if loop.last %}${% endif %}{% endfor %}",
+        "{% for i in xs %}{% set _ = xs.append(i) %}{{ i }}{% endfor %}|{{ xs | length }}",
+        "{% set a = x * 2 %}{% set ns = namespace(n=0) %}{% for i in xs %}{% set ns.n = ns.n + i %}{% endfor %}{{ a }}{{ ns.n }}",
+        "{% macro m(a, b='q') %}{{ a }}{{ b }}{% endmacro %}{{ m(1) }}{{ m(2, b=x) }}{% filter upper %}f{{ s }}{% endfilter %}",
+        "{% for node in [{'n': 1, 'c': [{'n': 2}]}] recursive %}{{ node.n }}{% if node.c %}({{ loop(node.c) }}){% endif %}{% endfor %}",
+    }) {
+        auto results = render_both(tmpl);
+        EXPECT_EQ(results.first, results.second) << tmpl;
+    }
+}
+
+TEST(SyntaxTest, FusedFilters) {
+    auto make_context = [](minja::Value bindings) {
+        std::vector<minja::Value> messages;
+        int i = 0;
+        for (auto role : {"system", "user", "tool", "user", "tool", "assistant"}) {
+            auto message = minja::Value::object();
+            message.set("role", role);
+            if (i++ % 3) message.set("content", "c" + std::to_string(i - 1));
+            messages.push_back(message);
+        }
+        bindings.set("messages", minja::Value::array(messages));
+        bindings.set("nums", minja::Value::array({(int64_t) 1, (int64_t) 2, (int64_t) 3, (int64_t) 3, (int64_t) 4}));
+        return minja::Context::make(std::move(bindings));
+    };
+    auto render = [&](const std::string & tmpl, minja::Value bindings = minja::Value::object()) {
+        auto root = minja::Parser::parse(tmpl, {});
+        auto result = root->render(make_context(bindings));
+        EXPECT_EQ(result, minja::TemplateProgram(root).render(make_context(bindings))) << tmpl;
+        return result;
+    };
+    EXPECT_EQ("2", render("{{ messages | selectattr('role', 'equalto', 'tool') | map(attribute='content') | list | length }}"));
+    EXPECT_EQ("c2, c4", render("{{ messages | selectattr('role', 'equalto', 'tool') | map(attribute='content') | join(', ') }}"));
+    EXPECT_EQ("system|user|assistant", render("{{ messages | rejectattr('role', 'equalto', 'tool') | map(attribute='role') | unique | join('|') }}"));
+    EXPECT_EQ("dddddd|assistant|4", render("{{ messages | map(attribute='missing', default='d') | join }}|{{ messages | map(attribute='role') | last }}|{{ messages | map(attribute='role') | unique | list | count }}"));
+    EXPECT_EQ("1-2-3-3-4|2|1+2+3+3+4|[1, 2, 3, 4]", render("{{ nums | reject('odd') | join(d='-') }}|{{ nums | select('==', 3) | list | length }}|{{ nums | map('string') | join('+') }}|{{ nums | map('int') | unique | list }}"));
+    EXPECT_EQ("[1/2:c1][2/2:]", render("{% for c in messages | selectattr('role', 'equalto', 'user') | map(attribute='content') %}[{{ loop.index }}/{{ loop.length }}:{{ c }}]{% endfor %}"));
+    EXPECT_EQ("[]|3", render("{{ none | map(attribute='x') | list }}|{{ 'abc' | list | length }}"));
+
+    // Filters shadowed by the template or the caller are called as they are.
+    EXPECT_EQ("L", render("{% macro length(x) %}L{% endmacro %}{{ nums | list | length }}"));
+    auto bindings = minja::Value::object();
+    bindings.set("unique", minja::Value::callable([](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+        return minja::Value((int64_t) args.args[0].size());
+    }));
+    EXPECT_EQ("5", render("{{ nums | map('int') | unique }}", bindings));
+}
+
+TEST(SyntaxTest, HashedValues) {
+    std::hash<minja::Value> hash;
+    EXPECT_EQ(hash(minja::Value("a long string, stored out of line")), hash(minja::Value(std::string("a long string, stored out of line"))));
+    EXPECT_EQ(hash(minja::Value(0.0)), hash(minja::Value(-0.0)));
+    std::unordered_set<minja::Value> set {minja::Value((int64_t) 1), minja::Value(1.0), minja::Value(true), minja::Value("1"), minja::Value()};
+    EXPECT_EQ(5u, set.size());
+    EXPECT_EQ(1u, set.count(minja::Value((int64_t) 1)));
+    EXPECT_EQ(0u, set.count(minja::Value((int64_t) 2)));
+
+    auto render = [](const std::string & tmpl) {
+        auto context = minja::Context::make(minja::Value::object());
+        auto tool = minja::Value::object();
+        tool.set("name", "search");
+        context->set("tool", tool);
+        auto root = minja::Parser::parse(tmpl, {});
+        auto result = root->render(context);
+        EXPECT_EQ(result, minja::TemplateProgram(root).render(context)) << tmpl;
+        return result;
+    };
+    EXPECT_EQ("TrueFalseTrue", render("{{ tool.name in ['get_weather', 'search'] }}{{ tool.name in ['get_weather'] }}{{ tool.name not in ['get_weather'] }}"));
+    // Membership has the semantics of Value::contains: falsy items and values of another type never match.
+    EXPECT_EQ("FalseFalseFalseFalse", render("{{ 0 in [0, 1] }}{{ 1 in [1.0] }}{{ none in [none] }}{{ [1] in [1] }}"));
+    EXPECT_EQ("3|TrueTrueTrueFalse|1|True|2", render(
+        "{% set xs = [1, 2, 1, 'a', 'a'] | unique | list %}{{ xs | length }}|"
+        "{{ 1 in xs }}{{ 2 in xs }}{{ 'a' in xs }}{{ 'b' in xs }}|{{ xs | select('equalto', 'a') | list | length }}|"
+        "{{ 'b' in {'a': 1, 'b': 2} }}|{{ {'a': 1, 'b': 2}['b'] }}"));
+}
+
+TEST(SyntaxTest, RenderSpans) {
+    auto message = [](const std::string & role, const std::string & content) {
+        auto msg = minja::Value::object();
+        msg.set("role", role);
+        msg.set("content", content);
+        return msg;
+    };
+    auto messages = minja::Value::array({message("user", "hi"), message("assistant", "yo"), message("user", "ok")});
+    using Spans = std::vector<std::tuple<size_t, size_t, size_t>>;
+    auto check = [&](const std::string & tmpl, const std::string & expected, const Spans & message_spans, const Spans & generation_spans) {
+        auto root = minja::Parser::parse(tmpl, {});
+        minja::TemplateProgram program(root);
+        for (auto use_program : {false, true}) {
+            auto context = minja::Context::make(minja::Value::object());
+            context->set("messages", messages);
+            minja::StringSink text;
+            minja::SpanSink out(text);
+            out.set_messages(messages);
+            if (use_program) program.render(out, context);
+            else root->render(out, context);
+            EXPECT_EQ(expected, text.str()) << tmpl;
+            EXPECT_EQ(text.str().size(), out.size());
+            Spans actual;
+            for (const auto & span : out.message_spans()) actual.emplace_back(span.begin, span.end, span.message);
+            EXPECT_EQ(message_spans, actual) << tmpl << (use_program ? " (program)" : "");
+            actual.clear();
+            for (const auto & span : out.generation_spans()) actual.emplace_back(span.begin, span.end, span.message);
+            EXPECT_EQ(generation_spans, actual) << tmpl << (use_program ? " (program)" : "");
+        }
+    };
+    const auto npos = minja::SpanSink::npos;
+    check("<s>{% for m in messages %}{% if m.role == 'assistant' %}{% generation %}[{{ m.content }}]{% endgeneration %}{% else %}({{ m.content }}){% endif %}{% endfor %}{% for m in messages %}{% endfor %}|",
+          "<s>(hi)[yo](ok)|", {{3, 7, 0}, {7, 11, 1}, {11, 15, 2}}, {{7, 11, npos}});
+    // Slices hold the same messages, and nested loops (here, looking ahead) don't split a message's span.
+    check("{% for m in messages[1:] %}{{ m.content }}{% for n in messages %}{% if loop.index > 1 %}{% break %}{% endif %}-{% endfor %}{% endfor %}!",
+          "yo-ok-!", {{0, 3, 1}, {3, 6, 2}}, {});
+    check("{% for m in messages %}{% generation %}{{ m.content }}{% if loop.index == 2 %}{% break %}{% endif %}{% endgeneration %}{% endfor %}",
+          "hiyo", {{0, 2, 0}, {2, 4, 1}}, {{0, 2, npos}, {2, 4, npos}});
+    check("{% for x in [1, 2] %}{{ x }}{% endfor %}{% generation %}{% endgeneration %}", "12", {}, {{2, 2, npos}});
+}
+
+TEST(SyntaxTest, StringAccumulation) {
+    auto check = [](const std::string & expected, const std::string & tmpl) {
+        auto root = minja::Parser::parse(tmpl, {});
+        minja::TemplateProgram program(root);
+        // Twice each, to check that appending in place never changes the template's own strings.
+        for (int i = 0; i < 2; ++i) {
+            EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value::object()))) << tmpl;
+            EXPECT_EQ(expected, program.render(minja::Context::make(minja::Value::object()))) << tmpl;
+        }
+    };
+    std::string numbers;
+    for (int i = 0; i < 100; ++i) numbers += std::to_string(i) + ",";
+    check(numbers, "{% set ns = namespace(out='') %}{% for i in range(100) %}{% set ns.out = ns.out ~ i ~ ',' %}{% endfor %}{{ ns.out }}");
+    check(numbers, "{% for i in range(100) %}{% set s = s + i ~ ',' if s is defined else i ~ ',' %}{% set out = (out or '') + i ~ ',' %}{% if loop.last %}{{ out }}{% endif %}{% endfor %}");
+    check("a long string, quite long|a long string, quite long!",
+          "{% set x = 'a long string, quite long' %}{% set y = x %}{% set x = x ~ '!' %}{{ y }}|{{ x }}");
+    check("abcdefghijklmnopqrstu-abcdefghijklmnopqrstu", "{% set x = 'abcdefghijklmnopqrstu' %}{% set x = x ~ '-' ~ x %}{{ x }}");
+    check("6|[1, 2]|a1|None!", "{% set n = 1 %}{% set n = n + 2 + 3 %}{% set l = [1] %}{% set l = l + [2] %}{% set s = 'a' %}{% set s = s + 1 %}{% set u = u ~ '!' %}{{ n }}|{{ l }}|{{ s }}|{{ u }}");
+    check("ababab||", "{{ 'ab' * 3 }}|{{ 'ab' * 0 }}|{{ 'ab' * -1 }}");
+}
+
+TEST(SyntaxTest, StringScanning) {
+    // Matches at each position of the 16-byte chunks and in the scalar tail, for one byte and for several.
+    for (size_t size = 0; size < 40; ++size) {
+        for (size_t pos = 0; pos <= size; ++pos) {
+            std::string s(size, 'x');
+            if (pos < size) s[pos] = '<';
+            if (pos + 1 < size) s[pos + 1] = '&';
+            auto begin = s.data(), end = begin + size;
+            EXPECT_EQ(pos, (size_t) (minja::find_byte(begin, end, '<') - begin)) << size;
+            EXPECT_EQ(pos, (size_t) (minja::find_first_of_bytes(begin, end, "&<>\"'") - begin)) << size;
+            EXPECT_EQ(pos, (size_t) (minja::find_first_of_bytes(begin, end, "<") - begin)) << size;
+        }
+    }
+
+    auto check = [](const std::string & expected, const std::string & tmpl) {
+        auto root = minja::Parser::parse(tmpl, {});
+        EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value::object()))) << tmpl;
+    };
+    check("0123456789abcde&lt;&amp;&#34;&apos;0123456789abcdef&gt;", "{{ '0123456789abcde<&\"\\'0123456789abcdef>' | escape }}");
+    check("a/b,c//d|/|a|ab/b|x/x/x,", "{{ 'a, b,c, , d'.split(', ') | join('/') }}|{{ ','.split(',') | join('/') }}|{{ 'a'.split(', ') | join('/') }}|"
+                                     "{{ 'ab--b'.split('--') | join('/') }}|{{ 'x,,,x,,,x,'.split(',,,') | join('/') }}");
+    check("a b|a b  |  a b|b|", "{{ '  a b  '.strip() }}|{{ '  a b  '.lstrip() }}|{{ '  a b  '.rstrip() }}|{{ 'xxbx'.strip('x') }}|{{ '   ' | trim }}");
+    check("True|False|True", "{{ 'prefix long enough'.startswith('prefix') }}|{{ 'ab'.endswith('abc') }}|{{ 'abc'.endswith('bc') }}");
+    // Braces that don't open a tag, and comments holding tag ends.
+    check("{ {x} %} #} {{", "{ {x}{# } #} %} #}{{ ' {{' }}");
+}
+
+TEST(SyntaxTest, SharedJsonDumps) {
+    rapidjson::Document doc;
+    doc.Parse(R"({"tools": [{"name": "b", "params": {"z": 1.5, "a": [true, null, "it's"], "z": -2}}, {"name": "a"}], "xs": [1, 2, 3]})");
+    minja::SharedJson shared(doc);
+
+    for (const auto & tmpl : {
+        "{{ tools | tojson }}|{{ tools | tojson(indent=2) }}|{{ tools }}",
+        "{% for t in tools %}{{ t | tojson }}{{ t.params | tojson(indent=1) }}{% endfor %}{{ tools[0] }}",
+        "{% set _ = tools[0].params.pop('a') %}{{ tools | tojson }}|{{ xs + [4] }}|{{ xs | tojson }}",
+    }) {
+        auto root = minja::Parser::parse(tmpl, {});
+        minja::TemplateProgram program(root);
+        auto expected = root->render(minja::Context::make(minja::Value(doc)));
+        // Twice each, the second time from the dumps cached by the first.
+        for (int i = 0; i < 2; ++i) {
+            EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value::borrow(shared)))) << tmpl;
+            EXPECT_EQ(expected, program.render(minja::Context::make(minja::Value::borrow(shared)))) << tmpl;
+        }
+    }
+    // The document is a copy, and never changes.
+    EXPECT_EQ(3u, shared.get()["xs"].Size());
+    EXPECT_TRUE(shared.get()["tools"][0]["params"].HasMember("a"));
+
+    // Dumps are looked up by value and settings.
+    minja::SharedJson cached(doc);
+    cached.add_dump(&cached.get()["xs"], -1, 0, true, "cached");
+    auto render = [&](const std::string & tmpl) {
+        return minja::Parser::parse(tmpl, {})->render(minja::Context::make(minja::Value::borrow(cached)));
+    };
+    EXPECT_EQ("cached|[1, 2, 3]|[1, 2, 3]", render("{{ xs | tojson }}|{{ xs }}|{{ xs + [] }}"));
+}
+
+TEST(SyntaxTest, RenderMemo) {
+    const char * contexts[] = {
+        R"({"tools": [{"name": "f", "params": {"a": 1}}], "messages": [{"role": "user", "content": "hi"}], "x": 1})",
+        R"({"tools": [{"name": "f", "params": {"a": 1}}], "messages": [{"role": "user", "content": "hi"}, {"role": "assistant", "content": "yo"}], "x": 1})",
+        R"({"tools": [{"name": "f", "params": {"a": 1.0}}], "messages": [{"role": "user", "content": "hi"}], "x": 0})",
+        R"({"messages": [{"role": "user", "content": "ok"}]})",
+    };
+    // Each template, and whether some of its blocks can be cached.
+    std::vector<std::pair<std::string, bool>> templates {
+        {"{% macro tool(t) %}[{{ t.name }}: {{ t.params | tojson }}]{% endmacro %}{% if tools %}{% for t in tools %}{{ tool(t) }}{% endfor %}{% endif %}"
+         "{% for m in messages %}<{{ m.role }}>{{ m.content | trim }}{% if loop.last %}!{% endif %}{% endfor %}", true},
+        {"{% for m in messages %}{% if m.role == 'user' %}{% continue %}{% endif %}{{ m.content }}{% endfor %}", true},
+        // Changes that outlive the block are made each time.
+        {"{% set ns = namespace(n=0) %}{% for m in messages %}{% set ns.n = ns.n + 1 %}{% endfor %}{{ ns.n }}", false},
+        {"{% for m in messages %}{% endfor %}{{ m.role }}{% if x %}{% set y = x + 1 %}{% endif %}{{ y }}", false},
+        {"{% set xs = [] %}{% for m in messages %}{% if xs.append(m.role) %}{% endif %}{% endfor %}{{ xs }}", false},
+    };
+    for (const auto & entry : templates) {
+        const auto & tmpl = entry.first;
+        auto root = minja::Parser::parse(tmpl, {});
+        minja::TemplateProgram program(root);
+        minja::RenderMemo memo;
+        for (int i = 0; i < 2; ++i) {
+            for (auto context_json : contexts) {
+                rapidjson::Document doc;
+                doc.Parse(context_json);
+                auto expected = root->render(minja::Context::make(minja::Value(doc)));
+                minja::RenderMemo::Scope scope(memo, root);
+                EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value::borrow(doc)))) << tmpl;
+                EXPECT_EQ(expected, program.render(minja::Context::make(minja::Value(doc)))) << tmpl;
+            }
+        }
+        EXPECT_EQ(entry.second, memo.stats().hits > 0) << tmpl;
+    }
+
+    auto root = minja::Parser::parse("{% for m in messages %}({{ m.content }}){% endfor %}{% if f %}{{ f() }}{% endif %}", {});
+    minja::RenderMemo memo;
+    int64_t calls = 0;
+    auto message = minja::Value::object();
+    message.set("content", "hi");
+    auto messages = minja::Value::array({message});
+    auto render = [&](minja::RenderSink & out) {
+        auto context = minja::Context::make(minja::Value::object());
+        context->set("messages", messages);
+        context->set("f", minja::Value::callable([&](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue &) {
+            return minja::Value(++calls);
+        }));
+        minja::RenderMemo::Scope scope(memo, root);
+        root->render(out, context);
+    };
+    minja::StringSink out;
+    render(out);
+    EXPECT_EQ("(hi)1", out.take());
+    render(out);
+    // The loop comes from the cache, while the block calling f (which isn't a builtin) renders again.
+    EXPECT_EQ("(hi)2", out.take());
+    auto stats = memo.stats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(1u, stats.misses);
+    EXPECT_EQ(1u, stats.entries);
+    EXPECT_EQ(4u, stats.bytes);
+
+    // Sinks that want structure events aren't given cached output.
+    minja::SpanSink spans(out);
+    spans.set_messages(messages);
+    render(spans);
+    EXPECT_EQ("(hi)3", out.take());
+    EXPECT_EQ(1u, spans.message_spans().size());
+    EXPECT_EQ(1u, memo.stats().hits);
+
+    memo.clear();
+    EXPECT_EQ(0u, memo.stats().entries);
+    EXPECT_EQ(0u, memo.stats().bytes);
+}
+
+TEST(SyntaxTest, RenderMemory) {
+    auto root = minja::Parser::parse(
+        "{% macro greet(m) %}{{ m.role | upper }}: {{ m.content ~ ' (and then some more text)' }}{% endmacro %}"
+        "{% set ns = namespace(seen=[]) %}{% for m in messages %}{{ greet(m) }};{% set ns.seen = ns.seen + [loop.index] %}{% endfor %}"
+        "{{ ns.seen | length }} {{ {'a': [1, 2, 3], 'b': 'c'}.a | length }}", {});
+    const char * context_json = R"({"messages": [{"role": "user", "content": "hi"}, {"role": "assistant", "content": "yo"}]})";
+    rapidjson::Document doc;
+    doc.Parse(context_json);
+    auto expected = root->render(minja::Context::make(minja::Value(doc)));
+    EXPECT_EQ("USER: hi (and then some more text);ASSISTANT: yo (and then some more text);2 3", expected);
+
+    // From the heap: everything made during the render is gone by the end of it.
+    auto memory = std::make_shared<minja::RenderMemory>();
+    {
+        minja::RenderMemory::Scope scope(memory);
+        EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value(doc))));
+    }
+    auto stats = memory->stats();
+    EXPECT_GT(stats.allocations, 0u);
+    EXPECT_GT(stats.peak_bytes, 0u);
+    EXPECT_LE(stats.peak_bytes, stats.total_bytes);
+    EXPECT_EQ(0u, stats.live_bytes);
+    memory->reset_stats();
+    EXPECT_EQ(0u, memory->stats().allocations);
+    EXPECT_EQ(0u, memory->stats().peak_bytes);
+
+    // From an arena, which gets all of it.
+    auto arena = std::make_shared<minja::Arena>();
+    auto arena_memory = std::make_shared<minja::RenderMemory>(arena);
+    {
+        minja::RenderMemory::Scope scope(arena_memory);
+        EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value(doc))));
+    }
+    EXPECT_EQ(stats.allocations, arena_memory->stats().allocations);
+    EXPECT_EQ(stats.total_bytes, arena_memory->stats().total_bytes);
+    EXPECT_EQ(stats.total_bytes, arena->bytes_used());
+
+    // Values may outlive their scope (and the memory they came from is kept until they are gone).
+    std::weak_ptr<minja::RenderMemory> weak = arena_memory;
+    minja::Value kept;
+    {
+        minja::RenderMemory::Scope scope(arena_memory);
+        kept = minja::Value::array({minja::Value("a string long enough not to be inlined"), minja::Value::object()});
+        kept.at(1).set("k", minja::Value::array({minja::Value(int64_t(1))}));
+        // A scope of no memory goes back to the heap.
+        minja::RenderMemory::Scope heap(nullptr);
+        auto before = arena_memory->stats().allocations;
+        auto other = minja::Value::array({minja::Value(int64_t(2))});
+        EXPECT_EQ(before, arena_memory->stats().allocations);
+    }
+    arena_memory.reset();
+    arena.reset();
+    EXPECT_FALSE(weak.expired());
+    EXPECT_EQ("a string long enough not to be inlined", kept.at(0).get<std::string>());
+    EXPECT_EQ(1, kept.at(1).at("k").at(0).get<int64_t>());
+    kept = minja::Value();
+    EXPECT_TRUE(weak.expired());
+}
+
+TEST(SyntaxTest, RenderBudget) {
+    struct Case {
+        std::string tmpl;
+        minja::RenderBudget::Limits limits;
+        minja::RenderBudget::Exceeded reason;
+        std::string output;  // What was rendered before the limit was hit
+    };
+    minja::RenderBudget::Limits iterations, depth, output, deadline;
+    iterations.max_iterations = 10;
+    depth.max_depth = 20;
+    output.max_output_bytes = 1000;
+    deadline.timeout = std::chrono::milliseconds(10);
+    std::vector<Case> cases {
+        {"{% for c in letters %}{{ c }}{% endfor %}", iterations, minja::RenderBudget::Exceeded_Iterations, "abcdefghij"},
+        {"a{% for i in range(1000000000) %}{{ i }}{% endfor %}b", iterations, minja::RenderBudget::Exceeded_Items, "a"},
+        {"{% set xs = [1] %}{% for i in range(5) %}{% set xs = xs + xs %}{% endfor %}{{ xs | length }}", iterations, minja::RenderBudget::Exceeded_Items, ""},
+        {"{% for c in 'abcdefghijklmnop' %}{{ c }}{% endfor %}", iterations, minja::RenderBudget::Exceeded_Items, ""},
+        {"{% macro f(n) %}({{ n }}{{ f(n + 1) }}){% endmacro %}{{ f(0) }}", depth, minja::RenderBudget::Exceeded_Depth, ""},
+        {"{% for m in messages recursive %}{{ loop(messages) }}{% endfor %}", depth, minja::RenderBudget::Exceeded_Depth, ""},
+        {"[{{ 'x' * (1000000 * 1000000) }}]", output, minja::RenderBudget::Exceeded_Output, "["},
+        {"{% set s = 'ab' %}{% for i in range(64) %}{% set s = s ~ s %}{% endfor %}{{ s | length }}", output, minja::RenderBudget::Exceeded_Output, ""},
+        {"{% for i in range(20000) %}{{ 'y' }}{% endfor %}", output, minja::RenderBudget::Exceeded_Output, std::string(1000, 'y')},
+        {"{% for i in range(10000) %}{% for j in range(10000) %}{% endfor %}{% endfor %}done", deadline, minja::RenderBudget::Exceeded_Deadline, ""},
+    };
+    rapidjson::Document doc;
+    doc.Parse(R"({"messages": [{"role": "user"}], "letters": ["a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m", "n", "o", "p"]})");
+    for (const auto & c : cases) {
+        auto root = minja::Parser::parse(c.tmpl, {});
+        minja::TemplateProgram program(root);
+        for (int use_program = 0; use_program < 2; ++use_program) {
+            minja::RenderBudget budget(c.limits);
+            std::string rendered;
+            {
+                minja::RenderBudget::Scope scope(budget);
+                auto context = minja::Context::make(minja::Value(doc));
+                rendered = use_program ? program.render(context) : root->render(context);
+            }
+            EXPECT_EQ(c.reason, budget.reason()) << c.tmpl;
+            EXPECT_TRUE(budget.exceeded()) << c.tmpl;
+            EXPECT_NE("", budget.error()) << c.tmpl;
+            EXPECT_EQ(c.output, rendered) << c.tmpl << " (program: " << use_program << ")";
+        }
+    }
+
+    // Sinks are told about the loops & generation blocks left when the limit is hit.
+    doc.Parse(R"({"messages": [{"role": "user", "content": "abcde"}, {"role": "assistant", "content": "fghij"},
+        {"role": "user", "content": "klmno"}, {"role": "assistant", "content": "pqrst"}, {"role": "user", "content": "uvwxy"}]})");
+    output.max_output_bytes = 28;
+    auto spans_root = minja::Parser::parse("{% for m in messages %}{% generation %}<{{ m.role }}>{{ m.content }}{% endgeneration %}{% endfor %}!", {});
+    minja::TemplateProgram spans_program(spans_root);
+    using Spans = std::vector<std::tuple<size_t, size_t, size_t>>;
+    for (int use_program = 0; use_program < 2; ++use_program) {
+        minja::RenderBudget budget(output);
+        minja::RenderBudget::Scope scope(budget);
+        auto context = minja::Context::make(minja::Value(doc));
+        minja::StringSink text;
+        minja::SpanSink out(text);
+        out.set_messages(context->get("messages"));
+        if (use_program) spans_program.render(out, context);
+        else spans_root->render(out, context);
+        EXPECT_EQ(minja::RenderBudget::Exceeded_Output, budget.reason());
+        EXPECT_EQ("<user>abcde<assistant>fghij<", text.str()) << "(program: " << use_program << ")";
+        Spans actual;
+        for (const auto & span : out.message_spans()) actual.emplace_back(span.begin, span.end, span.message);
+        EXPECT_EQ(Spans({{0, 11, 0}, {11, 27, 1}, {27, 28, 2}}), actual) << "(program: " << use_program << ")";
+        actual.clear();
+        for (const auto & span : out.generation_spans()) actual.emplace_back(span.begin, span.end, span.message);
+        EXPECT_EQ(Spans({{0, 11, minja::SpanSink::npos}, {11, 27, minja::SpanSink::npos}, {27, 28, minja::SpanSink::npos}}), actual)
+            << "(program: " << use_program << ")";
+    }
+
+    // Within its limits, a render is unaffected: what macro calls, set & filter blocks render only counts once printed.
+    const std::string expected = "<0><1><2>[<9>]ZZZ";
+    minja::RenderBudget::Limits all;
+    all.max_iterations = 3;
+    all.max_depth = 5;
+    all.max_output_bytes = expected.size();
+    all.timeout = std::chrono::seconds(10);
+    auto root = minja::Parser::parse("{% macro f(x) %}<{{ x }}>{% endmacro %}{% for i in range(3) %}{{ f(i) }}{% endfor %}"
+                                     "{% set t %}[{{ f(9) }}]{% endset %}{{ t }}{% filter upper %}z{{ 'z' * 2 }}{% endfilter %}", {});
+    minja::TemplateProgram program(root);
+    for (int use_program = 0; use_program < 2; ++use_program) {
+        minja::RenderBudget budget(all);
+        {
+            minja::RenderBudget::Scope scope(budget);
+            auto context = minja::Context::make(minja::Value::object());
+            EXPECT_EQ(expected, use_program ? program.render(context) : root->render(context));
+        }
+        EXPECT_FALSE(budget.exceeded()) << budget.error();
+        EXPECT_EQ("", budget.error());
+        EXPECT_EQ(3u, budget.iterations());
+        EXPECT_EQ(3u, budget.items());  // Those of range(3)
+        EXPECT_EQ(expected.size(), budget.output_bytes());
+    }
+    EXPECT_EQ(expected, root->render(minja::Context::make(minja::Value::object())));
+}
+
+TEST(SyntaxTest, ConcurrentRenders) {
+    auto root = minja::Parser::parse(R"(
+        {%- macro item(x, sep=', ') -%}
+            {%- set doubled = x * 2 -%}
+            {{ x }}:{{ doubled }}{{ sep }}
+        {%- endmacro -%}
+        {%- set ns = namespace(total=0) -%}
+        {%- for x in xs -%}
+            {{ item(x) }}{{ loop.cycle('a', 'b') }}
+            {%- set ns.total = ns.total + x -%}
+        {%- endfor -%}
+        |{{ ns.total }}|{{ doubled is defined }}|
+        {%- for node in tree recursive -%}
+            {{ node.name }}{% if node.children %}({{ loop(node.children) }}){% endif %}
+        {%- endfor -%}
+    )", {});
+    auto render_once = [&](int n) {
+        auto context = minja::Context::make(minja::Value::object());
+        std::vector<minja::Value> xs;
+        for (int64_t i = 0; i < n; ++i) xs.emplace_back(i);
+        context->set("xs", minja::Value::array(xs));
+        auto leaf = minja::Value::object();
+        leaf.set("name", "leaf");
+        auto inner = minja::Value::object();
+        inner.set("name", "inner");
+        inner.set("children", minja::Value::array({leaf}));
+        context->set("tree", minja::Value::array({inner, leaf}));
+        return root->render(context);
+    };
+    EXPECT_EQ("0:0, a1:2, b2:4, a|3|False|inner(leaf)leaf", render_once(3));
+
+    const int kThreads = 8;
+    std::vector<std::string> expected;
+    for (int t = 0; t < kThreads; ++t) expected.push_back(render_once(t + 1));
+
+    std::vector<int> mismatches(kThreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 200; ++i) {
+                if (render_once(t + 1) != expected[t]) mismatches[t]++;
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (int t = 0; t < kThreads; ++t) EXPECT_EQ(0, mismatches[t]) << "thread " << t;
+}